@@ -25,7 +25,7 @@ __Abort:
     // ARM32
     asm volatile("mov r0, %0" : : "i" (&&__Abort) : );      /* r0 = $PC */
     asm volatile("b Abort" : : : );                         /* call Abort() */
-#elif defined(__APPLE__)
+#elif defined(__APPLE__) || defined(__linux__)
     void abort(void);
     abort();
 #else
@@ -0,0 +1,647 @@
+#pragma once
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <future>
+#include <functional>
+#include <chrono>
+#include <system_error>
+#include "ReadWrite.h"
+#include "Signal.h"
+#include "FileDescriptor.h"
+
+#if __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace Toastbox {
+
+// AsyncIO:
+//   AsyncIO is an asynchronous read/write engine, so that many outstanding
+//   reads/writes don't require a thread each.
+//
+//   On Linux, AsyncIO is backed by io_uring (via the raw syscalls, so there's
+//   no liburing dependency), and a single completion thread invokes the
+//   completion callbacks. Elsewhere, or if io_uring is unavailable (eg
+//   disabled via the io_uring_disabled sysctl), AsyncIO falls back to a pool
+//   of `threads` threads that perform blocking syscalls.
+//
+//   Operations are batched: read()/write() only queue the operation, and
+//   submit() submits all queued operations with a single syscall.
+//
+//   Each operation has the semantics of a single read()/write() (or
+//   pread()/pwrite() if `off>=0`), so it may transfer fewer than `len` bytes.
+//   If a deadline is specified and the operation hasn't completed by then, it
+//   completes with ETIMEDOUT.
+//
+//   Completion callbacks are invoked on AsyncIO's own thread(s), so they should
+//   be quick and must not throw. The buffers must remain valid until the
+//   operation completes. With io_uring, a callback that queues and submits an
+//   operation while the completion queue is backed up reaps completions
+//   inline, so other callbacks may be invoked from within it.
+//
+//   If the io_uring completion thread fails (ie io_uring_enter() returns an
+//   unexpected error), the error is recorded: outstanding operations complete
+//   with it, and so do operations queued afterwards, immediately. (The
+//   kernel may still be accessing the buffers of operations that were
+//   submitted before the failure, until AsyncIO is destroyed.)
+//
+//   The destructor submits any queued operations and waits for all
+//   operations to complete. With io_uring, outstanding operations are
+//   cancelled first (on kernels that support IORING_ASYNC_CANCEL_ANY);
+//   otherwise the caller must ensure that outstanding operations complete
+//   (eg by specifying deadlines).
+
+class AsyncIO {
+public:
+    using Deadline = std::chrono::steady_clock::time_point;
+    
+    struct Result {
+        size_t len = 0;
+        int error = 0; // errno value, or 0 on success
+    };
+    
+    using Callback = std::function<void(const Result&)>;
+    
+    AsyncIO(size_t entries=256, size_t threads=2) {
+#if __linux__
+        _uring = _uringInit(entries);
+        if (_uring) {
+            _threads.emplace_back([&] { _uringThread(); });
+            return;
+        }
+#endif
+        
+        if (!threads) threads = 1;
+        for (size_t i=0; i<threads; i++) {
+            _threads.emplace_back([&] { _poolThread(); });
+        }
+    }
+    
+    // Copy/move: illegal
+    AsyncIO(const AsyncIO& x) = delete;
+    AsyncIO& operator=(const AsyncIO& x) = delete;
+    
+    ~AsyncIO() {
+#if __linux__
+        if (_uring) {
+            {
+                auto lock = std::unique_lock(_lock);
+                _stopping = true;
+                // Cancel outstanding operations, and wake the completion thread
+                // via a NOP, since it only checks _stopping after reaping a CQE.
+                // If the completion thread failed, it has already exited.
+                if (!_uringError) {
+                    io_uring_sqe* sqe = _sqeAlloc(lock, 2);
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->fd = -1;
+                    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+                    sqe = _sqeAlloc(lock, 1);
+                    sqe->opcode = IORING_OP_NOP;
+                    _submit(lock);
+                }
+            }
+            for (std::thread& t : _threads) t.join();
+            _uringDeinit();
+            return;
+        }
+#endif
+        
+        submit();
+        {
+            auto lock = _signal.lock();
+            _stopping = true;
+        }
+        _signal.signalAll();
+        for (std::thread& t : _threads) t.join();
+    }
+    
+    // uring(): whether AsyncIO is backed by io_uring (or by the thread pool)
+    bool uring() const { return _uring; }
+    
+    // read()/write(): queue an operation, which invokes `cb` upon completion.
+    // The operation isn't started until submit() is called.
+    void read(int fd, void* buf, size_t len, off_t off, Callback cb, Deadline deadline=Deadline()) {
+        _queue({ .cb=std::move(cb), .fd=fd, .buf=buf, .len=len, .off=off, .deadline=deadline });
+    }
+    
+    void write(int fd, const void* buf, size_t len, off_t off, Callback cb, Deadline deadline=Deadline()) {
+        _queue({ .cb=std::move(cb), .write=true, .fd=fd, .buf=(void*)buf, .len=len, .off=off, .deadline=deadline });
+    }
+    
+    // readFixed()/writeFixed(): same as read()/write(), but `buf` must lie within
+    // the registered buffer `bufIdx` (see registerBuffers()), which saves the
+    // kernel from mapping the buffer for every operation
+    void readFixed(int fd, size_t bufIdx, void* buf, size_t len, off_t off, Callback cb, Deadline deadline=Deadline()) {
+        _queue({ .cb=std::move(cb), .fd=fd, .buf=buf, .len=len, .off=off, .bufIdx=(int)bufIdx, .deadline=deadline });
+    }
+    
+    void writeFixed(int fd, size_t bufIdx, const void* buf, size_t len, off_t off, Callback cb, Deadline deadline=Deadline()) {
+        _queue({ .cb=std::move(cb), .write=true, .fd=fd, .buf=(void*)buf, .len=len, .off=off, .bufIdx=(int)bufIdx, .deadline=deadline });
+    }
+    
+    // read()/write(): future variants, where the future throws
+    // ReadWriteTimeout upon timeout, or std::system_error upon error
+    std::future<size_t> read(int fd, void* buf, size_t len, off_t off, Deadline deadline=Deadline()) {
+        auto p = std::make_shared<std::promise<size_t>>();
+        std::future<size_t> r = p->get_future();
+        read(fd, buf, len, off, [=] (const Result& x) { _Fulfill(*p, x); }, deadline);
+        return r;
+    }
+    
+    std::future<size_t> write(int fd, const void* buf, size_t len, off_t off, Deadline deadline=Deadline()) {
+        auto p = std::make_shared<std::promise<size_t>>();
+        std::future<size_t> r = p->get_future();
+        write(fd, buf, len, off, [=] (const Result& x) { _Fulfill(*p, x); }, deadline);
+        return r;
+    }
+    
+    // registerBuffers(): registers buffers for use with readFixed()/writeFixed(),
+    // replacing any previously-registered buffers. No-op for the thread pool.
+    void registerBuffers(const struct iovec* iov, size_t iovLen) {
+#if __linux__
+        if (!_uring) return;
+        auto lock = std::unique_lock(_lock);
+        if (_buffersRegistered) {
+            _register(IORING_UNREGISTER_BUFFERS, nullptr, 0);
+            _buffersRegistered = false;
+        }
+        if (iovLen) {
+            _register(IORING_REGISTER_BUFFERS, iov, (unsigned)iovLen);
+            _buffersRegistered = true;
+        }
+#endif
+    }
+    
+    // submit(): start all queued operations. Returns the number of operations submitted.
+    size_t submit() {
+#if __linux__
+        if (_uring) {
+            auto lock = std::unique_lock(_lock);
+            // Reset _queuedOps first, since _submit() may release _lock
+            const size_t r = _queuedOps;
+            _queuedOps = 0;
+            _submit(lock);
+            return r;
+        }
+#endif
+        
+        std::vector<_Op*> ops;
+        {
+            auto lock = std::unique_lock(_lock);
+            ops.swap(_poolQueued);
+        }
+        if (ops.empty()) return 0;
+        {
+            auto lock = _signal.lock();
+            _poolOps.insert(_poolOps.end(), ops.begin(), ops.end());
+        }
+        if (ops.size() == 1) _signal.signalOne();
+        else                 _signal.signalAll();
+        return ops.size();
+    }
+    
+private:
+    struct _Op {
+        Callback cb;
+        bool write = false;
+        int fd = -1;
+        void* buf = nullptr;
+        size_t len = 0;
+        off_t off = -1;
+        int bufIdx = -1;
+        Deadline deadline;
+#if __linux__
+        // ts: the deadline as an absolute CLOCK_MONOTONIC time (which is what
+        // steady_clock is based on), referenced by the linked timeout SQE
+        __kernel_timespec ts = {};
+        // prev/next: links in _uringOps
+        _Op* prev = nullptr;
+        _Op* next = nullptr;
+#endif
+    };
+    
+    static void _Fulfill(std::promise<size_t>& p, const Result& x) {
+        if (!x.error) {
+            p.set_value(x.len);
+        } else if (x.error == ETIMEDOUT) {
+            p.set_exception(std::make_exception_ptr(ReadWriteTimeout()));
+        } else {
+            p.set_exception(std::make_exception_ptr(std::system_error(x.error, std::generic_category())));
+        }
+    }
+    
+    void _queue(_Op&& x) {
+        auto op = std::make_unique<_Op>(std::move(x));
+        assert(op->cb);
+        
+#if __linux__
+        if (_uring) {
+            auto lock = std::unique_lock(_lock);
+            if (_uringError) {
+                const int error = _uringError;
+                lock.unlock();
+                _outstanding.fetch_add(1, std::memory_order_relaxed);
+                _complete(op.release(), { .error = error });
+                return;
+            }
+            
+            const bool timeout = op->deadline.time_since_epoch().count();
+            io_uring_sqe* sqe = _sqeAlloc(lock, timeout ? 2 : 1);
+            if (op->bufIdx < 0) sqe->opcode = (op->write ? IORING_OP_WRITE : IORING_OP_READ);
+            else                sqe->opcode = (op->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED);
+            sqe->fd = op->fd;
+            sqe->addr = (uint64_t)op->buf;
+            sqe->len = (uint32_t)op->len;
+            // An offset of -1 means the fd's current file offset
+            sqe->off = (uint64_t)op->off;
+            sqe->buf_index = (op->bufIdx<0 ? 0 : (uint16_t)op->bufIdx);
+            sqe->user_data = (uint64_t)op.get();
+            
+            if (timeout) {
+                using namespace std::chrono;
+                const auto t = op->deadline.time_since_epoch();
+                const auto sec = duration_cast<seconds>(t);
+                op->ts = {
+                    .tv_sec = (int64_t)sec.count(),
+                    .tv_nsec = (long long)duration_cast<nanoseconds>(t-sec).count(),
+                };
+                sqe->flags |= IOSQE_IO_LINK;
+                
+                io_uring_sqe* tsqe = _sqeAlloc(lock, 1);
+                tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+                tsqe->fd = -1;
+                tsqe->addr = (uint64_t)&op->ts;
+                tsqe->len = 1;
+                tsqe->timeout_flags = IORING_TIMEOUT_ABS;
+            }
+            
+            _queuedOps++;
+            _outstanding.fetch_add(1, std::memory_order_relaxed);
+            _uringLink(op.release());
+            return;
+        }
+#endif
+        
+        auto lock = std::unique_lock(_lock);
+        _outstanding.fetch_add(1, std::memory_order_relaxed);
+        _poolQueued.push_back(op.release());
+    }
+    
+    void _complete(_Op* op, const Result& r) {
+        op->cb(r);
+        delete op;
+        _outstanding.fetch_sub(1, std::memory_order_release);
+    }
+    
+    // MARK: - Thread Pool
+    
+    void _poolThread() {
+        for (;;) {
+            _Op* op = nullptr;
+            {
+                auto lock = _signal.wait([&] { return !_poolOps.empty() || _stopping; });
+                if (_poolOps.empty()) return; // Stopping
+                op = _poolOps.front();
+                _poolOps.pop_front();
+            }
+            _complete(op, (op->write ? _poolExec<true>(*op) : _poolExec<false>(*op)));
+        }
+    }
+    
+    template<bool T_Write>
+    static Result _poolExec(const _Op& op) {
+        // pread()/pwrite() on regular files don't block indefinitely, so we only
+        // need to wait for readiness for streams (off<0)
+        const bool stream = op.off < 0;
+        const bool hasDeadline = op.deadline.time_since_epoch().count();
+        try {
+            const bool nonBlocking = stream && hasDeadline && _NonBlocking(op.fd);
+            for (;;) {
+                if (stream && hasDeadline && !nonBlocking) {
+                    if (!_Wait<T_Write>(op.fd, op.deadline)) return { .error = ETIMEDOUT };
+                }
+                
+                ssize_t sr = 0;
+                if constexpr (!T_Write) {
+                    do sr = (stream ? ::read(op.fd, op.buf, op.len) : ::pread(op.fd, op.buf, op.len, op.off));
+                    while (sr==-1 && errno==EINTR);
+                } else {
+                    do sr = (stream ? ::write(op.fd, op.buf, op.len) : ::pwrite(op.fd, op.buf, op.len, op.off));
+                    while (sr==-1 && errno==EINTR);
+                }
+                
+                if (sr<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+                    if (!_Wait<T_Write>(op.fd, op.deadline)) return { .error = ETIMEDOUT };
+                    continue;
+                }
+                
+                if (sr < 0) return { .error = errno };
+                return { .len = (size_t)sr };
+            }
+        
+        // _NonBlocking()/_Wait() failed
+        } catch (const std::system_error& e) {
+            return { .error = e.code().value() };
+        }
+    }
+    
+#if __linux__
+    // MARK: - io_uring
+    
+    struct _Map {
+        void* addr = nullptr;
+        size_t len = 0;
+    };
+    
+    static _Map _Mmap(int fd, size_t len, off_t off) {
+        void* addr = mmap(nullptr, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, off);
+        if (addr == MAP_FAILED) throw std::system_error(errno, std::generic_category());
+        return { addr, len };
+    }
+    
+    template<typename T>
+    static T* _Ptr(const _Map& m, uint32_t off) {
+        return (T*)((uint8_t*)m.addr + off);
+    }
+    
+    bool _uringInit(size_t entries) {
+        io_uring_params p = {};
+        // Make the CQ larger than the SQ, since operations can be submitted
+        // faster than they complete
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+        p.cq_entries = (uint32_t)entries*4;
+        int fd = (int)syscall(SYS_io_uring_setup, (unsigned)entries, &p);
+        if (fd<0 && (errno==ENOSYS || errno==EPERM || errno==EACCES)) return false;
+        if (fd < 0) throw std::system_error(errno, std::generic_category());
+        _ring = fd;
+        
+        const size_t sqLen = p.sq_off.array + p.sq_entries*sizeof(uint32_t);
+        const size_t cqLen = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+        try {
+            if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                _sqMap = _Mmap(_ring, std::max(sqLen, cqLen), IORING_OFF_SQ_RING);
+                _cqMap = _sqMap;
+            } else {
+                _sqMap = _Mmap(_ring, sqLen, IORING_OFF_SQ_RING);
+                _cqMap = _Mmap(_ring, cqLen, IORING_OFF_CQ_RING);
+            }
+            _sqesMap = _Mmap(_ring, p.sq_entries*sizeof(io_uring_sqe), IORING_OFF_SQES);
+        } catch (...) {
+            // Unmap whatever was mapped before the failure
+            _uringDeinit();
+            throw;
+        }
+        
+        _sq = {
+            .head = _Ptr<uint32_t>(_sqMap, p.sq_off.head),
+            .tail = _Ptr<uint32_t>(_sqMap, p.sq_off.tail),
+            .mask = *_Ptr<uint32_t>(_sqMap, p.sq_off.ring_mask),
+            .entries = p.sq_entries,
+            .array = _Ptr<uint32_t>(_sqMap, p.sq_off.array),
+            .sqes = (io_uring_sqe*)_sqesMap.addr,
+        };
+        
+        _cq = {
+            .head = _Ptr<uint32_t>(_cqMap, p.cq_off.head),
+            .tail = _Ptr<uint32_t>(_cqMap, p.cq_off.tail),
+            .mask = *_Ptr<uint32_t>(_cqMap, p.cq_off.ring_mask),
+            .cqes = _Ptr<io_uring_cqe>(_cqMap, p.cq_off.cqes),
+        };
+        return true;
+    }
+    
+    // _uringDeinit(): unmaps the rings and closes the io_uring fd. Handles
+    // partially-initialized state, for _uringInit() failures.
+    void _uringDeinit() {
+        if (_sqesMap.addr) munmap(_sqesMap.addr, _sqesMap.len);
+        if (_cqMap.addr && _cqMap.addr!=_sqMap.addr) munmap(_cqMap.addr, _cqMap.len);
+        if (_sqMap.addr) munmap(_sqMap.addr, _sqMap.len);
+        _sqesMap = {};
+        _cqMap = {};
+        _sqMap = {};
+        _ring.reset();
+    }
+    
+    int _enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return (int)syscall(SYS_io_uring_enter, (int)_ring, toSubmit, minComplete, flags, nullptr, 0);
+    }
+    
+    void _register(unsigned op, const void* arg, unsigned argLen) {
+        int ir = (int)syscall(SYS_io_uring_register, (int)_ring, op, arg, argLen);
+        if (ir < 0) throw std::system_error(errno, std::generic_category());
+    }
+    
+    // _sqeAlloc(): returns a zeroed SQE, after ensuring that at least `count`
+    // SQEs are available (so that linked SQEs are submitted together).
+    // `lock` must hold _lock; it may be released while waiting for room (see
+    // _submit()), but only before an SQE is allocated, so callers must
+    // reserve every SQE of a linked group with the first call.
+    io_uring_sqe* _sqeAlloc(std::unique_lock<std::mutex>& lock, uint32_t count) {
+        for (;;) {
+            const uint32_t head = std::atomic_ref<uint32_t>(*_sq.head).load(std::memory_order_acquire);
+            if (_sq.entries-(_sqTail-head) >= count) break;
+            // SQ is full: submit what's queued to make room. The SQ never
+            // drains if the completion thread failed.
+            if (_uringError) throw std::system_error(_uringError, std::generic_category());
+            _submit(lock);
+        }
+        
+        const uint32_t idx = _sqTail & _sq.mask;
+        io_uring_sqe* sqe = &_sq.sqes[idx];
+        *sqe = {};
+        _sq.array[idx] = idx;
+        _sqTail++;
+        std::atomic_ref<uint32_t>(*_sq.tail).store(_sqTail, std::memory_order_release);
+        _sqPending++;
+        return sqe;
+    }
+    
+    // _submit(): submits all allocated SQEs. `lock` must hold _lock.
+    // No-op if the completion thread failed, since the SQEs' ops have been
+    // completed (and freed) by then.
+    //
+    // If the CQ is backed up (EBUSY/EAGAIN), `lock` is released while we wait,
+    // since the completion thread needs _lock to reap. (If we are the
+    // completion thread, we reap inline instead, so callbacks can be invoked
+    // re-entrantly from an op queued by a callback.) SQEs are fully written
+    // before their allocator releases _lock, so whichever thread submits next
+    // can submit everything that's pending.
+    void _submit(std::unique_lock<std::mutex>& lock) {
+        assert(lock.owns_lock());
+        while (_sqPending) {
+            if (_uringError) {
+                _sqPending = 0;
+                return;
+            }
+            const int ir = _enter(_sqPending, 0, 0);
+            if (ir < 0) {
+                if (errno==EINTR) continue;
+                if (errno==EBUSY || errno==EAGAIN) {
+                    lock.unlock();
+                    // On the completion thread (ie a callback queued an op),
+                    // nobody else will reap, so reap inline
+                    if (std::this_thread::get_id() == _threads.front().get_id()) _uringReap();
+                    else std::this_thread::yield();
+                    lock.lock();
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category());
+            }
+            _sqPending -= (uint32_t)ir;
+        }
+    }
+    
+    // _uringLink()/_uringUnlink(): track in-flight ops in _uringOps, so that
+    // they can be failed if the completion thread fails. Require _lock.
+    void _uringLink(_Op* op) {
+        op->prev = nullptr;
+        op->next = _uringOps;
+        if (_uringOps) _uringOps->prev = op;
+        _uringOps = op;
+    }
+    
+    void _uringUnlink(_Op* op) {
+        // Already unlinked (by an outer _uringReap(), for inline reaping)
+        if (!op->prev && _uringOps!=op) return;
+        if (op->prev) op->prev->next = op->next;
+        else          _uringOps = op->next;
+        if (op->next) op->next->prev = op->prev;
+        op->prev = op->next = nullptr;
+    }
+    
+    // _uringFail(): records `error` and completes all in-flight ops with it.
+    // Called by the completion thread when io_uring_enter() fails, rather than
+    // throwing (which would terminate the process, since it's not our
+    // caller's thread).
+    void _uringFail(int error) {
+        _Op* ops = nullptr;
+        {
+            auto lock = std::unique_lock(_lock);
+            _uringError = error;
+            ops = _uringOps;
+            _uringOps = nullptr;
+        }
+        
+        while (ops) {
+            _Op*const op = ops;
+            ops = op->next;
+            _complete(op, { .error = error });
+        }
+    }
+    
+    void _uringThread() {
+        for (;;) {
+            const int ir = _enter(0, 1, IORING_ENTER_GETEVENTS);
+            if (ir<0 && errno!=EINTR && errno!=EAGAIN && errno!=EBUSY) {
+                _uringFail(errno);
+                return;
+            }
+            
+            _uringReap();
+            if (_stopping.load() && !_outstanding.load(std::memory_order_acquire)) return;
+        }
+    }
+    
+    // _uringReap(): completes the ops whose CQEs are available. Only called on
+    // the completion thread, but may be re-entered (via _submit()) by a
+    // callback that queues an op while the CQ is backed up, so the CQ head is
+    // reloaded after every completion.
+    void _uringReap() {
+        // We're the only CQ consumer, so the head only needs to be loaded
+        // relaxed, but it needs to be stored with release semantics so the
+        // kernel doesn't overwrite a CQE that we're still reading
+        const uint32_t tail = std::atomic_ref<uint32_t>(*_cq.tail).load(std::memory_order_acquire);
+        
+        // Unlink the batch's ops from _uringOps under a single lock, before
+        // invoking their callbacks (which may queue more ops) without it
+        {
+            auto lock = std::unique_lock(_lock);
+            const uint32_t head = std::atomic_ref<uint32_t>(*_cq.head).load(std::memory_order_relaxed);
+            for (uint32_t i=head; i!=tail; i++) {
+                _Op*const op = (_Op*)_cq.cqes[i & _cq.mask].user_data;
+                if (op) _uringUnlink(op);
+            }
+        }
+        
+        for (;;) {
+            const uint32_t head = std::atomic_ref<uint32_t>(*_cq.head).load(std::memory_order_relaxed);
+            // A re-entrant reap may have consumed past our `tail`
+            if ((int32_t)(tail-head) <= 0) break;
+            const io_uring_cqe& cqe = _cq.cqes[head & _cq.mask];
+            _Op*const op = (_Op*)cqe.user_data;
+            const int32_t res = cqe.res;
+            std::atomic_ref<uint32_t>(*_cq.head).store(head+1, std::memory_order_release);
+            
+            // Internal SQEs (timeouts, cancellation, wakeup) have no op
+            if (!op) continue;
+            
+            Result r;
+            if (res >= 0) {
+                r.len = (size_t)res;
+            } else {
+                r.error = -res;
+                // An operation cancelled by its linked timeout completes with ECANCELED
+                if (r.error==ECANCELED && op->deadline.time_since_epoch().count() && !_stopping.load()) {
+                    r.error = ETIMEDOUT;
+                }
+            }
+            _complete(op, r);
+        }
+    }
+    
+    struct {
+        uint32_t* head = nullptr;
+        uint32_t* tail = nullptr;
+        uint32_t mask = 0;
+        uint32_t entries = 0;
+        uint32_t* array = nullptr;
+        io_uring_sqe* sqes = nullptr;
+    } _sq;
+    
+    struct {
+        uint32_t* head = nullptr;
+        uint32_t* tail = nullptr;
+        uint32_t mask = 0;
+        io_uring_cqe* cqes = nullptr;
+    } _cq;
+    
+    FileDescriptor _ring;
+    _Map _sqMap;
+    _Map _cqMap;
+    _Map _sqesMap;
+    uint32_t _sqTail = 0;
+    uint32_t _sqPending = 0;
+    size_t _queuedOps = 0;
+    bool _buffersRegistered = false;
+    // _uringOps: in-flight ops (queued or submitted, but not yet completed);
+    // protected by _lock
+    _Op* _uringOps = nullptr;
+    // _uringError: the completion thread's error, if it failed; protected by _lock
+    int _uringError = 0;
+#endif
+    
+    bool _uring = false;
+    std::mutex _lock;
+    std::atomic<bool> _stopping = false;
+    std::atomic<size_t> _outstanding = 0;
+    std::vector<std::thread> _threads;
+    // _poolQueued: ops queued by read()/write() but not yet submitted; protected by _lock
+    std::vector<_Op*> _poolQueued;
+    // _poolOps: ops submitted to the pool; protected by _signal
+    Signal _signal;
+    std::deque<_Op*> _poolOps;
+};
+
+} // namespace Toastbox
@@ -0,0 +1,149 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <initializer_list>
+#include <type_traits>
+#include "../Trace.h"
+
+// Bench: a minimal benchmark harness for Toastbox's primitives
+//
+// Each benchmark is a function `void(uint64_t n)` that performs `n`
+// operations (or `uint64_t(uint64_t n)`, returning the number of operations
+// it actually performed, if it can't perform exactly `n`). Runner::measure()
+// calibrates `n` so that a batch takes at least Runner::BatchMin, runs
+// Runner::Samples batches, and reports the median (and fastest) time per
+// operation, operations/sec, and MB/s if the operations process a known
+// number of bytes.
+//
+// Throughput alone hides tail latency, so benchmarks that can time individual
+// operations (eg an item's time in a queue) report their distribution via
+// Runner::latency().
+//
+// Every batch is also recorded as a Toastbox::Trace event, so the run can be
+// inspected as a Chrome trace (see `--trace`).
+namespace Bench {
+
+// Use(): prevents the compiler from optimizing away the computation of `x`
+template<typename T>
+inline void Use(const T& x) {
+    asm volatile("" : : "r,m"(x) : "memory");
+}
+
+class Runner {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::chrono::milliseconds BatchMin = std::chrono::milliseconds(20);
+    static constexpr size_t Samples = 5;
+    
+    Runner(std::string_view filter) : _filter(filter) {}
+    
+    bool enabled(std::string_view name) const {
+        return _filter.empty() || name.find(_filter) != std::string_view::npos;
+    }
+    
+    // enabled(names): whether any of `names` are enabled, so benchmarks can
+    // skip expensive setup
+    bool enabled(std::initializer_list<std::string_view> names) const {
+        return std::any_of(names.begin(), names.end(), [&] (std::string_view x) { return enabled(x); });
+    }
+    
+    // measure(): benchmarks `fn`, where each operation processes `bytesPerOp`
+    // bytes (if non-zero, MB/s is also reported)
+    template<typename T_Fn>
+    void measure(std::string_view name, T_Fn fn, uint64_t bytesPerOp=0) {
+        if (!enabled(name)) return;
+        // Trace event names must outlive the trace
+        const char* traceName = _names.emplace_back(name).c_str();
+        
+        // Calibrate: double `n` until a batch takes at least BatchMin
+        uint64_t n = 1;
+        for (;;) {
+            const auto [ns, ops] = _batch(traceName, fn, n);
+            if (ns >= std::chrono::nanoseconds(BatchMin).count()) break;
+            // Jump straight to the estimated `n` once the timing is meaningful
+            if (ns > 1e6) n = std::max(n*2, (uint64_t)std::ceil(n * (std::chrono::nanoseconds(BatchMin).count()/ns)));
+            else n *= 2;
+        }
+        
+        std::vector<double> nsPerOp;
+        for (size_t i=0; i<Samples; i++) {
+            const auto [ns, ops] = _batch(traceName, fn, n);
+            nsPerOp.push_back(ns / ops);
+        }
+        std::sort(nsPerOp.begin(), nsPerOp.end());
+        const double median = nsPerOp[nsPerOp.size()/2];
+        const double min = nsPerOp.front();
+        
+        char mbps[32] = "";
+        if (bytesPerOp) snprintf(mbps, sizeof(mbps), "%10.1f MB/s", (bytesPerOp/median)*1e3);
+        printf("%-56s %12s/op (min %10s) %14.1f ops/s %s\n", std::string(name).c_str(),
+            _DurationStr(median).c_str(), _DurationStr(min).c_str(), 1e9/median, mbps);
+        fflush(stdout);
+    }
+    
+    // latency(): reports the distribution of per-operation latencies `ns`,
+    // which the caller measured itself
+    void latency(std::string_view name, std::vector<double> ns) {
+        if (!enabled(name) || ns.empty()) return;
+        std::sort(ns.begin(), ns.end());
+        const auto pct = [&] (double p) {
+            return _DurationStr(ns[std::min(ns.size()-1, (size_t)(p*ns.size()))]);
+        };
+        printf("%-56s p50 %10s   p90 %10s   p99 %10s   p99.9 %10s   max %10s\n", std::string(name).c_str(),
+            pct(.5).c_str(), pct(.9).c_str(), pct(.99).c_str(), pct(.999).c_str(), _DurationStr(ns.back()).c_str());
+        fflush(stdout);
+    }
+    
+    // Now(): a timestamp for latency measurements, in nanoseconds
+    static uint64_t Now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+    
+private:
+    static std::string _DurationStr(double ns) {
+        char buf[32];
+        if (ns < 1e3)       snprintf(buf, sizeof(buf), "%.1f ns", ns);
+        else if (ns < 1e6)  snprintf(buf, sizeof(buf), "%.2f us", ns/1e3);
+        else if (ns < 1e9)  snprintf(buf, sizeof(buf), "%.2f ms", ns/1e6);
+        else                snprintf(buf, sizeof(buf), "%.2f s", ns/1e9);
+        return buf;
+    }
+    
+    struct _Batch {
+        double ns = 0;
+        uint64_t ops = 0;
+    };
+    
+    template<typename T_Fn>
+    static _Batch _batch(const char* traceName, T_Fn& fn, uint64_t n) {
+        Toastbox::Trace::Scope trace(traceName);
+        const auto start = Clock::now();
+        uint64_t ops = n;
+        if constexpr (std::is_void_v<decltype(fn(n))>) fn(n);
+        else ops = fn(n);
+        return {
+            .ns = std::chrono::duration<double,std::nano>(Clock::now()-start).count(),
+            .ops = std::max(ops, (uint64_t)1),
+        };
+    }
+    
+    std::string _filter;
+    std::deque<std::string> _names; // Stable storage for trace event names
+};
+
+void Queue(Runner& r);
+void LRU(Runner& r);
+void Mmap(Runner& r);
+void TIFF(Runner& r);
+void ReadWrite(Runner& r);
+void Mat(Runner& r);
+void Renderer(Runner& r);
+
+} // namespace Bench
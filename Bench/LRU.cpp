@@ -0,0 +1,123 @@
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include <string>
+#include "Bench.h"
+#include "../LRU.h"
+#include "../ShardedLRU.h"
+
+namespace Bench {
+
+// _Keys(): `count` distinct keys in random order, so that lookups don't
+// benefit from sequential access patterns
+static std::vector<uint64_t> _Keys(size_t count, uint64_t base=0) {
+    std::vector<uint64_t> keys(count);
+    for (size_t i=0; i<count; i++) keys[i] = base + i*0x9E3779B97F4A7C15;
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(count));
+    return keys;
+}
+
+// _LRU(): hit/miss/churn costs of `T_LRU`, which holds `T_Cap` entries. The
+// cache is filled to 75% (below the eviction threshold), so hits and misses
+// don't evict.
+template<typename T_LRU, size_t T_Cap>
+static void _LRU(Runner& r, std::string_view type) {
+    const std::string name = "LRU/" + std::string(type) + "/" + std::to_string(T_Cap);
+    const size_t fill = (T_Cap*3)/4;
+    const std::vector<uint64_t> hits = _Keys(fill);
+    const std::vector<uint64_t> misses = _Keys(fill, 1);
+    // LRUFlat stores its entries inline, so allocate it on the heap
+    const auto lru = std::make_unique<T_LRU>();
+    for (uint64_t k : hits) (*lru)[k] = k;
+    
+    r.measure(name+"/Hit", [&] (uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i=0; i<n; i++) sum += lru->find(hits[i % fill])->val;
+        Use(sum);
+    });
+    
+    r.measure(name+"/Miss", [&] (uint64_t n) {
+        size_t found = 0;
+        for (uint64_t i=0; i<n; i++) found += (lru->find(misses[i % fill]) != lru->end());
+        Use(found);
+    });
+    
+    // Insert new keys, so that every insertion eventually evicts
+    uint64_t next = 0;
+    r.measure(name+"/Insert", [&] (uint64_t n) {
+        for (uint64_t i=0; i<n; i++, next++) (*lru)[misses[next % fill] + next] = i;
+    });
+}
+
+template<size_t T_Cap>
+static void _LRUCost(Runner& r) {
+    const std::string name = "LRU/LRUCost/" + std::to_string(T_Cap);
+    const size_t fill = (T_Cap*3)/4;
+    const std::vector<uint64_t> hits = _Keys(fill);
+    const std::vector<uint64_t> misses = _Keys(fill, 1);
+    Toastbox::LRUCost<uint64_t,uint64_t> lru(T_Cap);
+    for (uint64_t k : hits) lru.set(k, k, 1);
+    
+    r.measure(name+"/Hit", [&] (uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i=0; i<n; i++) sum += lru.find(hits[i % fill])->val;
+        Use(sum);
+    });
+    
+    r.measure(name+"/Miss", [&] (uint64_t n) {
+        size_t found = 0;
+        for (uint64_t i=0; i<n; i++) found += (lru.find(misses[i % fill]) != lru.end());
+        Use(found);
+    });
+    
+    uint64_t next = 0;
+    r.measure(name+"/Insert", [&] (uint64_t n) {
+        for (uint64_t i=0; i<n; i++, next++) lru.set(misses[next % fill] + next, i, 1);
+    });
+}
+
+// _ShardedLRU(): hit cost with `threads` threads looking up concurrently.
+// Each operation is one lookup by one thread.
+template<size_t T_Cap, bool T_Approx>
+static void _ShardedLRU(Runner& r, size_t threadsMax) {
+    using T_LRU = Toastbox::ShardedLRU<uint64_t,uint64_t,T_Cap,16,T_Approx>;
+    const size_t fill = (T_Cap*3)/4;
+    const std::vector<uint64_t> hits = _Keys(fill);
+    T_LRU lru;
+    for (uint64_t k : hits) lru.set(k, k);
+    
+    for (size_t threads=1; threads<=threadsMax; threads*=2) {
+        const std::string name = std::string("LRU/ShardedLRU") + (T_Approx ? "Approx/" : "/") +
+            std::to_string(T_Cap) + "/Hit/" + std::to_string(threads) + "t";
+        r.measure(name, [&] (uint64_t n) {
+            std::vector<std::thread> ts;
+            for (size_t t=0; t<threads; t++) {
+                ts.emplace_back([&, t] {
+                    uint64_t sum = 0;
+                    for (uint64_t i=t; i<n; i+=threads) sum += *lru.find(hits[i % fill]);
+                    Use(sum);
+                });
+            }
+            for (std::thread& t : ts) t.join();
+        });
+    }
+}
+
+template<size_t... T_Caps>
+static void _LRUs(Runner& r) {
+    (_LRU<Toastbox::LRU<uint64_t,uint64_t,T_Caps>,T_Caps>(r, "LRU"), ...);
+    (_LRU<Toastbox::LRUHashed<uint64_t,uint64_t,T_Caps>,T_Caps>(r, "LRUHashed"), ...);
+    (_LRU<Toastbox::LRUFlat<uint64_t,uint64_t,T_Caps>,T_Caps>(r, "LRUFlat"), ...);
+    (_LRUCost<T_Caps>(r), ...);
+}
+
+void LRU(Runner& r) {
+    _LRUs<64, 1024, 16384, 262144>(r);
+    
+    const size_t threadsMax = std::max(1u, std::thread::hardware_concurrency());
+    _ShardedLRU<16384,false>(r, threadsMax);
+    _ShardedLRU<16384,true>(r, threadsMax);
+}
+
+} // namespace Bench
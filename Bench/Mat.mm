@@ -0,0 +1,79 @@
+#import <memory>
+#import <cassert>
+#import <string>
+#import "Bench.h"
+#import "../Mac/Mat.h"
+#import "../Mac/DynMat.h"
+
+namespace Bench {
+
+template<typename T>
+static void _Fill(T* begin, T* end) {
+    uint32_t seed = 1;
+    for (T* it=begin; it!=end; it++) {
+        seed = seed*1664525 + 1013904223;
+        *it = (T)(seed>>8) / (T)(1<<24);
+    }
+}
+
+// _Gemm(): Mat<float,N,N> multiply. N=3/4 exercise Mat's small-matrix path;
+// larger sizes go through BLAS.
+template<size_t N>
+static void _Gemm(Runner& r) {
+    using T_Mat = Toastbox::Mat<float,N,N>;
+    // Large Mats don't fit comfortably on the stack
+    const auto a = std::make_unique<T_Mat>();
+    const auto b = std::make_unique<T_Mat>();
+    const auto c = std::make_unique<T_Mat>();
+    _Fill(a->begin(), a->end());
+    _Fill(b->begin(), b->end());
+    r.measure("Mat/Gemm/" + std::to_string(N), [&] (uint64_t n) {
+        for (uint64_t i=0; i<n; i++) {
+            c->gemm(*a, *b);
+            Use(*c->begin());
+        }
+    });
+}
+
+// _DynGemm(): DynMat<float> multiply, for sizes too large for Mat
+static void _DynGemm(Runner& r, size_t n) {
+    Toastbox::DynMat<float> a(n, n), b(n, n), c(n, n);
+    _Fill(a.begin(), a.end());
+    _Fill(b.begin(), b.end());
+    r.measure("Mat/DynGemm/" + std::to_string(n), [&] (uint64_t count) {
+        for (uint64_t i=0; i<count; i++) {
+            c.gemm(a, b);
+            Use(*c.begin());
+        }
+    });
+}
+
+// _FFT(): 2D FFT of a real NxN Mat. The result is returned on the stack, so
+// N is limited to sizes whose complex result fits there.
+template<size_t N>
+static void _FFT(Runner& r) {
+    using T_Mat = Toastbox::Mat<float,N,N>;
+    const auto a = std::make_unique<T_Mat>();
+    _Fill(a->begin(), a->end());
+    r.measure("Mat/FFT/" + std::to_string(N), [&] (uint64_t n) {
+        for (uint64_t i=0; i<n; i++) {
+            const auto f = a->fft();
+            Use(*f.begin());
+        }
+    }, N*N*sizeof(float));
+}
+
+void Mat(Runner& r) {
+    _Gemm<3>(r);
+    _Gemm<4>(r);
+    _Gemm<16>(r);
+    _Gemm<64>(r);
+    _Gemm<256>(r);
+    for (size_t n : {512, 1024, 2048}) _DynGemm(r, n);
+    
+    _FFT<16>(r);
+    _FFT<64>(r);
+    _FFT<256>(r);
+}
+
+} // namespace Bench
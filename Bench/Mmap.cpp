@@ -0,0 +1,70 @@
+#include <random>
+#include <vector>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Bench.h"
+#include "../Mmap.h"
+
+namespace Bench {
+
+static constexpr size_t _MmapLen = 256<<20;
+
+// _MmapFile(): creates a `len`-byte scratch file, removed on destruction
+struct _MmapFile {
+    _MmapFile(size_t len) : path(std::filesystem::temp_directory_path() / "ToastboxBench-Mmap") {
+        Toastbox::Mmap map(path, len, O_RDWR|O_CREAT|O_TRUNC, 0644);
+        map.len(len);
+        uint64_t* words = (uint64_t*)map.data();
+        for (size_t i=0; i<len/sizeof(uint64_t); i++) words[i] = i;
+    }
+    
+    ~_MmapFile() {
+        std::filesystem::remove(path);
+    }
+    
+    std::filesystem::path path;
+};
+
+void Mmap(Runner& r) {
+    if (!r.enabled({"Mmap/Sequential", "Mmap/Sequential/Populate", "Mmap/RandomPage", "Mmap/RandomPage/HugePages"})) return;
+    const _MmapFile file(_MmapLen);
+    const size_t pageSize = Toastbox::Mmap::PageSize();
+    const size_t pageCount = _MmapLen/pageSize;
+    
+    // Sequential scan of the whole file (warm page cache). Each operation is
+    // one full pass.
+    for (bool populate : {false, true}) {
+        const Toastbox::Mmap map(file.path, std::nullopt, O_RDONLY, { .populate = populate });
+        map.advise(0, map.len(), Toastbox::Mmap::Advice::Sequential);
+        r.measure(std::string("Mmap/Sequential") + (populate ? "/Populate" : ""), [&] (uint64_t n) {
+            const uint64_t* words = (const uint64_t*)map.data();
+            const size_t count = map.len()/sizeof(uint64_t);
+            for (uint64_t i=0; i<n; i++) {
+                uint64_t sum = 0;
+                for (size_t j=0; j<count; j++) sum += words[j];
+                Use(sum);
+            }
+        }, _MmapLen);
+    }
+    
+    // Random page reads (warm page cache). Each operation reads one word from
+    // a random page, so this measures the TLB/page-fault cost of random
+    // access rather than memory bandwidth.
+    std::vector<uint32_t> pages(pageCount);
+    for (size_t i=0; i<pageCount; i++) pages[i] = (uint32_t)i;
+    std::shuffle(pages.begin(), pages.end(), std::mt19937(pageCount));
+    
+    for (bool hugePages : {false, true}) {
+        const Toastbox::Mmap map(file.path, std::nullopt, O_RDONLY, { .hugePages = hugePages });
+        map.advise(0, map.len(), Toastbox::Mmap::Advice::Random);
+        r.measure(std::string("Mmap/RandomPage") + (hugePages ? "/HugePages" : ""), [&] (uint64_t n) {
+            const uint8_t* data = map.data();
+            uint64_t sum = 0;
+            for (uint64_t i=0; i<n; i++) sum += *(const uint64_t*)(data + (size_t)pages[i % pageCount]*pageSize);
+            Use(sum);
+        });
+    }
+}
+
+} // namespace Bench
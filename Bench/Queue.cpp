@@ -0,0 +1,195 @@
+#include <thread>
+#include <vector>
+#include "Bench.h"
+#include "../RingBuffer.h"
+#include "../SignalQueue.h"
+#include "../SignalQueueMPMC.h"
+
+namespace Bench {
+
+static constexpr size_t _QueueCap = 1024;
+
+// _Transfer(): moves about `n` items through `q`, split evenly across
+// `threads` producers and `threads` consumers. Each operation is one item
+// pushed and popped. Returns the number of items actually moved.
+template<typename T_Queue>
+static uint64_t _Transfer(T_Queue& q, size_t threads, uint64_t n) {
+    const uint64_t perThread = std::max((uint64_t)1, n/threads);
+    std::vector<std::thread> ts;
+    for (size_t i=0; i<threads; i++) {
+        ts.emplace_back([&] {
+            for (uint64_t j=0; j<perThread; j++) q.push((uint64_t)j);
+        });
+        ts.emplace_back([&] {
+            uint64_t sum = 0;
+            for (uint64_t j=0; j<perThread; j++) sum += q.pop();
+            Use(sum);
+        });
+    }
+    for (std::thread& t : ts) t.join();
+    return perThread*threads;
+}
+
+static constexpr uint64_t _LatencyItems = 20000; // Per producer
+static constexpr uint64_t _LatencyInterval = 5000; // Nanoseconds
+
+// _Latency(): measures each item's time in the queue (from push to pop),
+// with `threads` producers and `threads` consumers. Producers are paced (one
+// item per `_LatencyInterval` each) so that the queue doesn't stay full, and
+// the result reflects handoff latency rather than queueing delay. Items are
+// their push timestamps.
+template<typename T_Push, typename T_Pop>
+static std::vector<double> _Latency(size_t threads, T_Push push, T_Pop pop) {
+    std::vector<std::vector<double>> lat(threads);
+    std::vector<std::thread> ts;
+    for (size_t i=0; i<threads; i++) {
+        ts.emplace_back([&] {
+            uint64_t next = Runner::Now();
+            for (uint64_t j=0; j<_LatencyItems; j++) {
+                // Yield rather than spin, in case we share a core with a consumer
+                while (Runner::Now() < next) std::this_thread::yield();
+                push(Runner::Now());
+                next += _LatencyInterval;
+            }
+        });
+        ts.emplace_back([&, i] {
+            lat[i].reserve(_LatencyItems);
+            for (uint64_t j=0; j<_LatencyItems; j++) {
+                const uint64_t t = pop();
+                lat[i].push_back((double)(Runner::Now()-t));
+            }
+        });
+    }
+    for (std::thread& t : ts) t.join();
+    
+    std::vector<double> r;
+    for (const std::vector<double>& x : lat) r.insert(r.end(), x.begin(), x.end());
+    return r;
+}
+
+// _TransferSPSC(): moves `n` items from a producer thread to a consumer
+// thread through the lock-free RingBufferSPSC, spinning (and yielding, in
+// case the threads share a core) when it's full/empty.
+// If `T_Batch`, items are transferred in bulk via the reserve/peek API.
+template<bool T_Batch>
+static void _TransferSPSC(Toastbox::RingBufferSPSC<uint64_t,_QueueCap>& q, uint64_t n) {
+    std::thread producer([&] {
+        for (uint64_t i=0; i<n;) {
+            if constexpr (T_Batch) {
+                const auto s = q.writeReserve(n-i);
+                for (uint64_t& x : s.a) x = i++;
+                for (uint64_t& x : s.b) x = i++;
+                q.writeCommit(s.len());
+                if (!s.len()) std::this_thread::yield();
+            } else {
+                if (!q.space()) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                q.write(i++);
+            }
+        }
+    });
+    
+    uint64_t sum = 0;
+    for (uint64_t i=0; i<n;) {
+        if constexpr (T_Batch) {
+            const auto s = q.readPeek();
+            for (uint64_t x : s.a) sum += x;
+            for (uint64_t x : s.b) sum += x;
+            q.readConsume(s.len());
+            i += s.len();
+            if (!s.len()) std::this_thread::yield();
+        } else {
+            if (!q.len()) {
+                std::this_thread::yield();
+                continue;
+            }
+            sum += q.read();
+            i++;
+        }
+    }
+    Use(sum);
+    producer.join();
+}
+
+void Queue(Runner& r) {
+    const size_t threadsMax = std::max(1u, std::thread::hardware_concurrency()/2);
+    
+    // Single-threaded push/pop pairs, to isolate the per-operation cost from
+    // cross-thread handoff
+    {
+        Toastbox::SignalQueue<uint64_t,_QueueCap> q;
+        r.measure("Queue/SignalQueue/PushPop", [&] (uint64_t n) {
+            uint64_t sum = 0;
+            for (uint64_t i=0; i<n; i++) {
+                q.push((uint64_t)i);
+                sum += q.pop();
+            }
+            Use(sum);
+        });
+    }
+    
+    {
+        Toastbox::SignalQueueMPMC<uint64_t,_QueueCap> q;
+        r.measure("Queue/SignalQueueMPMC/PushPop", [&] (uint64_t n) {
+            uint64_t sum = 0;
+            for (uint64_t i=0; i<n; i++) {
+                q.push((uint64_t)i);
+                sum += q.pop();
+            }
+            Use(sum);
+        });
+    }
+    
+    // Cross-thread transfer: 1 producer/1 consumer (SPSC), then N/N (MPMC)
+    {
+        Toastbox::RingBufferSPSC<uint64_t,_QueueCap> q;
+        r.measure("Queue/RingBufferSPSC/Transfer/1p1c", [&] (uint64_t n) { _TransferSPSC<false>(q, n); });
+        r.measure("Queue/RingBufferSPSC/TransferBatch/1p1c", [&] (uint64_t n) { _TransferSPSC<true>(q, n); });
+    }
+    
+    for (size_t threads=1; threads<=threadsMax; threads*=2) {
+        const std::string suffix = "/" + std::to_string(threads) + "p" + std::to_string(threads) + "c";
+        {
+            Toastbox::SignalQueue<uint64_t,_QueueCap> q;
+            r.measure("Queue/SignalQueue/Transfer"+suffix, [&] (uint64_t n) { return _Transfer(q, threads, n); });
+        }
+        {
+            Toastbox::SignalQueueMPMC<uint64_t,_QueueCap> q;
+            r.measure("Queue/SignalQueueMPMC/Transfer"+suffix, [&] (uint64_t n) { return _Transfer(q, threads, n); });
+        }
+    }
+    
+    // Latency distributions of the same configurations
+    {
+        const std::string name = "Queue/RingBufferSPSC/Latency/1p1c";
+        if (r.enabled(name)) {
+            Toastbox::RingBufferSPSC<uint64_t,_QueueCap> q;
+            r.latency(name, _Latency(1,
+                [&] (uint64_t t) { while (!q.space()) std::this_thread::yield(); q.write(t); },
+                [&] { while (!q.len()) std::this_thread::yield(); return q.read(); }
+            ));
+        }
+    }
+    
+    for (size_t threads=1; threads<=threadsMax; threads*=2) {
+        const std::string suffix = "/" + std::to_string(threads) + "p" + std::to_string(threads) + "c";
+        {
+            const std::string name = "Queue/SignalQueue/Latency"+suffix;
+            if (r.enabled(name)) {
+                Toastbox::SignalQueue<uint64_t,_QueueCap> q;
+                r.latency(name, _Latency(threads, [&] (uint64_t t) { q.push(std::move(t)); }, [&] { return q.pop(); }));
+            }
+        }
+        {
+            const std::string name = "Queue/SignalQueueMPMC/Latency"+suffix;
+            if (r.enabled(name)) {
+                Toastbox::SignalQueueMPMC<uint64_t,_QueueCap> q;
+                r.latency(name, _Latency(threads, [&] (uint64_t t) { q.push(std::move(t)); }, [&] { return q.pop(); }));
+            }
+        }
+    }
+}
+
+} // namespace Bench
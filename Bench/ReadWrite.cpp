@@ -0,0 +1,156 @@
+#include <thread>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "Bench.h"
+#include "../ReadWrite.h"
+#include "../FileDescriptor.h"
+
+namespace Bench {
+
+static constexpr size_t _ReadWriteChunk = 64<<10;
+static constexpr size_t _ReadWriteIovs = 4;
+static constexpr uint64_t _PingPongLatencyCount = 20000;
+
+// _Channel: a bidirectional channel between side A and side B, as either two
+// pipes or a socketpair
+struct _Channel {
+    _Channel(bool socket, bool nonBlocking) {
+        if (socket) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) throw std::system_error(errno, std::generic_category());
+            a = Toastbox::FileDescriptor(fds[0]);
+            b = Toastbox::FileDescriptor(fds[1]);
+            aw = ar = fds[0];
+            bw = br = fds[1];
+        } else {
+            int ab[2], ba[2];
+            if (pipe(ab) || pipe(ba)) throw std::system_error(errno, std::generic_category());
+            a = Toastbox::FileDescriptor(ab[1]);
+            b = Toastbox::FileDescriptor(ab[0]);
+            c = Toastbox::FileDescriptor(ba[1]);
+            d = Toastbox::FileDescriptor(ba[0]);
+            aw = ab[1]; br = ab[0];
+            bw = ba[1]; ar = ba[0];
+        }
+        
+        if (nonBlocking) {
+            for (int fd : {aw, ar, bw, br}) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+    
+    Toastbox::FileDescriptor a, b, c, d;
+    int aw = -1, ar = -1; // Side A's write/read fds
+    int bw = -1, br = -1; // Side B's write/read fds
+};
+
+struct _ReadWriteConfig {
+    const char* name;
+    bool socket = false;
+    bool nonBlocking = false;
+    bool deadline = false;
+    bool modeUnknown = false; // Pass FdMode::Unknown instead of the fds' mode
+    
+    Toastbox::FdMode mode() const {
+        if (modeUnknown) return Toastbox::FdMode::Unknown;
+        return (nonBlocking ? Toastbox::FdMode::NonBlocking : Toastbox::FdMode::Blocking);
+    }
+};
+
+static std::chrono::steady_clock::time_point _Deadline(bool deadline) {
+    if (!deadline) return {};
+    return std::chrono::steady_clock::now() + std::chrono::seconds(10);
+}
+
+// _Stream(): streams `n` chunks from side A to side B, via Write()/Read() or
+// WriteV()/ReadV() (into `_ReadWriteIovs` pieces per chunk)
+template<bool T_Vectored>
+static void _Stream(const _ReadWriteConfig& c, _Channel& ch, uint64_t n) {
+    const auto xfer = [&] (int fd, bool write) {
+        std::vector<uint8_t> buf(_ReadWriteChunk);
+        struct iovec iov[_ReadWriteIovs];
+        for (size_t i=0; i<_ReadWriteIovs; i++) {
+            iov[i] = {
+                .iov_base = buf.data() + i*(_ReadWriteChunk/_ReadWriteIovs),
+                .iov_len = _ReadWriteChunk/_ReadWriteIovs,
+            };
+        }
+        
+        for (uint64_t i=0; i<n; i++) {
+            const auto deadline = _Deadline(c.deadline);
+            size_t len = 0;
+            if constexpr (T_Vectored) {
+                if (write)  len = Toastbox::WriteV(fd, iov, _ReadWriteIovs, deadline, c.mode());
+                else        len = Toastbox::ReadV(fd, iov, _ReadWriteIovs, deadline, c.mode());
+            } else {
+                if (write)  len = Toastbox::Write(fd, buf.data(), buf.size(), deadline, c.mode());
+                else        len = Toastbox::Read(fd, buf.data(), buf.size(), deadline, c.mode());
+            }
+            if (len != _ReadWriteChunk) throw Toastbox::RuntimeError("short transfer: %zu", len);
+        }
+    };
+    
+    std::thread writer([&] { xfer(ch.aw, true); });
+    xfer(ch.br, false);
+    writer.join();
+}
+
+// _PingPong(): `n` 1-byte round trips between side A and side B. If `lat` is
+// non-null, it's filled with each round trip's latency.
+static void _PingPong(const _ReadWriteConfig& c, _Channel& ch, uint64_t n, std::vector<double>* lat=nullptr) {
+    std::thread echo([&] {
+        uint8_t x = 0;
+        for (uint64_t i=0; i<n; i++) {
+            Toastbox::Read(ch.br, &x, 1, _Deadline(c.deadline), c.mode());
+            Toastbox::Write(ch.bw, &x, 1, _Deadline(c.deadline), c.mode());
+        }
+    });
+    
+    uint8_t x = 0;
+    for (uint64_t i=0; i<n; i++) {
+        const uint64_t start = (lat ? Runner::Now() : 0);
+        Toastbox::Write(ch.aw, &x, 1, _Deadline(c.deadline), c.mode());
+        Toastbox::Read(ch.ar, &x, 1, _Deadline(c.deadline), c.mode());
+        if (lat) lat->push_back((double)(Runner::Now()-start));
+    }
+    echo.join();
+}
+
+void ReadWrite(Runner& r) {
+    // Non-blocking fds require a deadline (otherwise Read()/Write() throw on
+    // EAGAIN). The ModeUnknown variants show the cost of FdMode::Unknown's
+    // fcntl() per call.
+    const _ReadWriteConfig configs[] = {
+        { .name = "ReadWrite/Pipe/Blocking",                .socket = false, .nonBlocking = false, .deadline = false },
+        { .name = "ReadWrite/Pipe/Blocking/Deadline",       .socket = false, .nonBlocking = false, .deadline = true  },
+        { .name = "ReadWrite/Pipe/NonBlocking/Deadline",    .socket = false, .nonBlocking = true,  .deadline = true  },
+        { .name = "ReadWrite/Pipe/NonBlocking/Deadline/ModeUnknown", .socket = false, .nonBlocking = true, .deadline = true, .modeUnknown = true },
+        { .name = "ReadWrite/Socket/Blocking",              .socket = true,  .nonBlocking = false, .deadline = false },
+        { .name = "ReadWrite/Socket/Blocking/Deadline",     .socket = true,  .nonBlocking = false, .deadline = true  },
+        { .name = "ReadWrite/Socket/NonBlocking/Deadline",  .socket = true,  .nonBlocking = true,  .deadline = true  },
+    };
+    
+    for (const _ReadWriteConfig& c : configs) {
+        _Channel ch(c.socket, c.nonBlocking);
+        const std::string name = c.name;
+        
+        // Each operation is one 64 KB chunk
+        r.measure(name+"/Stream", [&] (uint64_t n) { _Stream<false>(c, ch, n); }, _ReadWriteChunk);
+        r.measure(name+"/StreamV", [&] (uint64_t n) { _Stream<true>(c, ch, n); }, _ReadWriteChunk);
+        
+        // Each operation is one round trip
+        r.measure(name+"/PingPong", [&] (uint64_t n) { _PingPong(c, ch, n); });
+        if (r.enabled(name+"/PingPong/Latency")) {
+            std::vector<double> lat;
+            lat.reserve(_PingPongLatencyCount);
+            _PingPong(c, ch, _PingPongLatencyCount, &lat);
+            r.latency(name+"/PingPong/Latency", lat);
+        }
+    }
+}
+
+} // namespace Bench
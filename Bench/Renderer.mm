@@ -0,0 +1,48 @@
+#import <string>
+#import <string_view>
+#import "Bench.h"
+#import "../Mac/Renderer.h"
+
+namespace Bench {
+
+void Renderer(Runner& r) {
+    Toastbox::Renderer renderer;
+    
+    // Buffer pool: each operation creates a buffer and drops it, which
+    // recycles it into the pool. With the pool disabled (cap=0), every
+    // operation allocates a new MTLBuffer instead.
+    for (size_t len : {256, 64<<10, 4<<20}) {
+        for (bool pool : {true, false}) {
+            renderer.bufferPoolSetCap(pool ? (64<<20) : 0);
+            renderer.bufferPoolTrim();
+            r.measure("Renderer/Buffer/" + std::string(pool ? "Pool/" : "NoPool/") + std::to_string(len), [&] (uint64_t n) {
+                for (uint64_t i=0; i<n; i++) {
+                    const Toastbox::Renderer::Buf buf = renderer.bufferCreate(len);
+                    Use((__bridge const void*)(id<MTLBuffer>)buf);
+                }
+            });
+        }
+    }
+    renderer.bufferPoolSetCap(64<<20);
+    
+    // Pipeline lookup: each operation looks up an already-compiled pipeline
+    // via pipelinesPrecompile(), which is the same name->id->pipeline lookup
+    // that render()/compute() perform, plus a (no-op) dispatch group wait
+    const Toastbox::Renderer::RenderPipeline renders[] = {
+        { .fmt = MTLPixelFormatBGRA8Unorm },
+    };
+    const std::string_view computes[] = {
+        "Toastbox::RendererShader::LoadFromU8Kernel",
+    };
+    renderer.pipelinesPrecompile(renders, computes);
+    
+    r.measure("Renderer/PipelineLookup/Render", [&] (uint64_t n) {
+        for (uint64_t i=0; i<n; i++) renderer.pipelinesPrecompile(renders);
+    });
+    
+    r.measure("Renderer/PipelineLookup/Compute", [&] (uint64_t n) {
+        for (uint64_t i=0; i<n; i++) renderer.pipelinesPrecompile({}, computes);
+    });
+}
+
+} // namespace Bench
@@ -0,0 +1,58 @@
+#include <vector>
+#include <filesystem>
+#include "Bench.h"
+#define ToastboxTIFFDeflate 1
+#include "../TIFF.h"
+
+namespace Bench {
+
+static constexpr uint32_t _TIFFWidth = 4096;
+static constexpr uint32_t _TIFFHeight = 3072;
+
+void TIFF(Runner& r) {
+    using Compression = Toastbox::TIFF::Compression;
+    const std::filesystem::path path = std::filesystem::temp_directory_path() / "ToastboxBench.tiff";
+    
+    struct Config {
+        const char* name;
+        Toastbox::TIFF::ImageOptions opts;
+    };
+    
+    const Config configs[] = {
+        { "TIFF/Strips/None",               { .compression = Compression::None } },
+        { "TIFF/Tiles/None",                { .tileWidth = 256, .tileLength = 256, .compression = Compression::None } },
+        { "TIFF/Strips/Deflate1",           { .compression = Compression::Deflate, .level = 1 } },
+        { "TIFF/Strips/Deflate1/Predictor", { .compression = Compression::Deflate, .predictor = true, .level = 1 } },
+        { "TIFF/Strips/Deflate1/1Thread",   { .compression = Compression::Deflate, .level = 1, .threads = 1 } },
+        { "TIFF/Strips/Deflate6/Predictor", { .compression = Compression::Deflate, .predictor = true, .level = 6 } },
+    };
+    if (std::none_of(std::begin(configs), std::end(configs), [&] (const Config& c) { return r.enabled(c.name); })) return;
+    
+    // A smooth gradient plus noise, so Deflate has something realistic (but
+    // not trivial) to compress
+    std::vector<uint16_t> pixels((size_t)_TIFFWidth*_TIFFHeight);
+    uint32_t seed = 1;
+    for (uint32_t y=0; y<_TIFFHeight; y++) {
+        for (uint32_t x=0; x<_TIFFWidth; x++) {
+            seed = seed*1664525 + 1013904223;
+            pixels[(size_t)y*_TIFFWidth+x] = (uint16_t)((x+y)*8 + (seed>>28));
+        }
+    }
+    const size_t len = pixels.size()*sizeof(uint16_t);
+    
+    // Each operation streams one image to a file. MB/s is in terms of the
+    // uncompressed pixel data.
+    for (const Config& c : configs) {
+        r.measure(c.name, [&] (uint64_t n) {
+            for (uint64_t i=0; i<n; i++) {
+                Toastbox::TIFF tiff(path);
+                tiff.pushImage(pixels.data(), _TIFFWidth, _TIFFHeight, 1, _TIFFWidth, c.opts);
+                tiff.write();
+            }
+        }, len);
+    }
+    
+    std::filesystem::remove(path);
+}
+
+} // namespace Bench
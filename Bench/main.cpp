@@ -0,0 +1,41 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <exception>
+#include "Bench.h"
+
+// Usage: ToastboxBench [filter] [--trace out.json]
+//   filter: only run benchmarks whose name contains `filter`
+//   --trace: record every batch, and write a Chrome trace to `out.json`
+int main(int argc, const char* argv[]) {
+    std::string_view filter;
+    const char* tracePath = nullptr;
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "--trace") && i+1<argc) tracePath = argv[++i];
+        else filter = argv[i];
+    }
+    
+    try {
+        Toastbox::Trace::Enable(tracePath);
+        Bench::Runner r(filter);
+        Bench::Queue(r);
+        Bench::LRU(r);
+        Bench::Mmap(r);
+        Bench::TIFF(r);
+        Bench::ReadWrite(r);
+#if __APPLE__
+        Bench::Mat(r);
+        Bench::Renderer(r);
+#endif
+        
+        if (tracePath) {
+            std::ofstream f(tracePath);
+            Toastbox::Trace::WriteChromeJSON(f);
+            printf("Wrote trace: %s\n", tracePath);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
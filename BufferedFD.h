@@ -0,0 +1,378 @@
+#pragma once
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <utility>
+#include <algorithm>
+#include <memory>
+#include <span>
+#include <streambuf>
+#include <istream>
+#include <system_error>
+#include "FileDescriptor.h"
+#include "ReadWrite.h"
+
+namespace Toastbox {
+
+// BufferedReader/BufferedWriter:
+//   Lightweight buffered I/O over a FileDescriptor, with a configurable buffer
+//   size and bulk read()/write(), without iostream's per-character virtual
+//   dispatch or locale machinery.
+//
+//   Transfers at least as large as the buffer bypass it, so large reads/writes
+//   cost one syscall and no copy.
+//
+//   BufferedStreambuf adapts the same strategy to std::streambuf, for code that
+//   needs an iostream (see BufferedFDStream, a replacement for FDStreamInOut).
+
+// _ReadSome(): a single read() that handles EINTR. Returns 0 on EOF.
+inline size_t _ReadSome(int fd, void* data, size_t len) {
+    ssize_t sr = 0;
+    do sr = read(fd, data, len);
+    while (sr==-1 && errno==EINTR);
+    if (sr < 0) throw std::system_error(errno, std::generic_category());
+    return (size_t)sr;
+}
+
+class BufferedReader {
+public:
+    static constexpr size_t DefaultCap = 1<<20;
+    
+    BufferedReader() {}
+    BufferedReader(FileDescriptor&& fd, size_t cap=DefaultCap) :
+    _fd(std::move(fd)), _buf(std::make_unique<uint8_t[]>(cap)), _cap(cap) {}
+    
+    // Copy: illegal
+    BufferedReader(const BufferedReader& x) = delete;
+    BufferedReader& operator=(const BufferedReader& x) = delete;
+    // Move: allowed
+    BufferedReader(BufferedReader&& x) = default;
+    BufferedReader& operator=(BufferedReader&& x) = default;
+    
+    // read(): reads `len` bytes, or fewer if EOF is reached
+    size_t read(void* data, size_t len) {
+        uint8_t* d = (uint8_t*)data;
+        size_t off = _take(d, len);
+        while (off < len) {
+            const size_t rem = len-off;
+            // Large reads bypass the buffer
+            if (rem >= _cap) {
+                const size_t sr = _ReadSome(_fd, d+off, rem);
+                if (!sr) break; // EOF
+                off += sr;
+            } else {
+                if (!_fill()) break; // EOF
+                off += _take(d+off, rem);
+            }
+        }
+        return off;
+    }
+    
+    size_t read(std::span<uint8_t> x) {
+        return read(x.data(), x.size());
+    }
+    
+    // peek(): returns the buffered data, filling the buffer first if it's empty.
+    // Returns an empty span on EOF. Use consume() to skip past the returned data.
+    std::span<const uint8_t> peek() {
+        if (_off == _len) _fill();
+        return { _buf.get()+_off, _len-_off };
+    }
+    
+    void consume(size_t len) {
+        assert(len <= _len-_off);
+        _off += len;
+    }
+    
+    FileDescriptor& fd() { return _fd; }
+    
+private:
+    size_t _take(uint8_t* d, size_t len) {
+        const size_t l = std::min(len, _len-_off);
+        memcpy(d, _buf.get()+_off, l);
+        _off += l;
+        return l;
+    }
+    
+    // _fill(): refill the (empty) buffer with a single read(). Returns false on EOF.
+    bool _fill() {
+        assert(_off == _len);
+        _off = 0;
+        _len = _ReadSome(_fd, _buf.get(), _cap);
+        return _len;
+    }
+    
+    FileDescriptor _fd;
+    std::unique_ptr<uint8_t[]> _buf;
+    size_t _cap = 0;
+    size_t _off = 0;
+    size_t _len = 0;
+};
+
+class BufferedWriter {
+public:
+    static constexpr size_t DefaultCap = 1<<20;
+    
+    BufferedWriter() {}
+    BufferedWriter(FileDescriptor&& fd, size_t cap=DefaultCap) :
+    _fd(std::move(fd)), _buf(std::make_unique<uint8_t[]>(cap)), _cap(cap) {}
+    
+    // Copy: illegal
+    BufferedWriter(const BufferedWriter& x) = delete;
+    BufferedWriter& operator=(const BufferedWriter& x) = delete;
+    // Move: allowed
+    BufferedWriter(BufferedWriter&& x) = default;
+    BufferedWriter& operator=(BufferedWriter&& x) {
+        _flushNoThrow();
+        _fd = std::move(x._fd);
+        _buf = std::move(x._buf);
+        _cap = std::exchange(x._cap, 0);
+        _len = std::exchange(x._len, 0);
+        return *this;
+    }
+    
+    // Destructor: flushes, but errors are ignored since destructors can't throw.
+    // Call flush() explicitly to observe errors.
+    ~BufferedWriter() {
+        _flushNoThrow();
+    }
+    
+    void write(const void* data, size_t len) {
+        const uint8_t* d = (const uint8_t*)data;
+        // Common case: the data fits in the buffer
+        if (len <= _cap-_len) {
+            memcpy(_buf.get()+_len, d, len);
+            _len += len;
+            return;
+        }
+        
+        // Large writes bypass the buffer, and are written along with the
+        // buffered data in a single writev()
+        if (len >= _cap) {
+            const struct iovec iov[] = {
+                { .iov_base = _buf.get(), .iov_len = _len },
+                { .iov_base = (void*)d, .iov_len = len },
+            };
+            WriteV(_fd, iov, std::size(iov));
+            _len = 0;
+            return;
+        }
+        
+        // Top off the buffer, flush it, and buffer the remainder
+        const size_t l = _cap-_len;
+        memcpy(_buf.get()+_len, d, l);
+        _len = _cap;
+        flush();
+        memcpy(_buf.get(), d+l, len-l);
+        _len = len-l;
+    }
+    
+    void write(std::span<const uint8_t> x) {
+        write(x.data(), x.size());
+    }
+    
+    void flush() {
+        if (!_len) return;
+        Write(_fd, _buf.get(), _len);
+        _len = 0;
+    }
+    
+    FileDescriptor& fd() { return _fd; }
+    
+private:
+    void _flushNoThrow() {
+        if (!_fd.hasValue()) return;
+        try {
+            flush();
+        } catch (...) {}
+    }
+    
+    FileDescriptor _fd;
+    std::unique_ptr<uint8_t[]> _buf;
+    size_t _cap = 0;
+    size_t _len = 0;
+};
+
+// BufferedStreambuf: a std::streambuf over a FileDescriptor, with separate
+// read/write buffers of a configurable size. Bulk reads/writes (xsgetn/xsputn)
+// at least as large as the buffer bypass it.
+//
+// Intended for sequential streams (pipes, sockets, files opened for only reading
+// or only writing), since seeking isn't supported, and read-ahead data isn't
+// discarded when writing.
+class BufferedStreambuf : public std::streambuf {
+public:
+    static constexpr size_t DefaultCap = 1<<20;
+    
+    BufferedStreambuf() {}
+    BufferedStreambuf(FileDescriptor&& fd, size_t cap=DefaultCap) :
+    _fd(std::move(fd)), _rbuf(std::make_unique<char[]>(cap)), _wbuf(std::make_unique<char[]>(cap)), _cap(cap) {
+        setg(_rbuf.get(), _rbuf.get(), _rbuf.get());
+        setp(_wbuf.get(), _wbuf.get()+_cap);
+    }
+    
+    // Copy/move: illegal, since the iostream references us
+    BufferedStreambuf(const BufferedStreambuf& x) = delete;
+    BufferedStreambuf& operator=(const BufferedStreambuf& x) = delete;
+    
+    ~BufferedStreambuf() {
+        if (!_fd.hasValue()) return;
+        try {
+            _flush();
+        } catch (...) {}
+    }
+    
+    FileDescriptor& fd() { return _fd; }
+    
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        if (!_fd.hasValue()) return traits_type::eof();
+        try {
+            const size_t len = _ReadSome(_fd, _rbuf.get(), _cap);
+            setg(_rbuf.get(), _rbuf.get(), _rbuf.get()+len);
+            if (!len) return traits_type::eof();
+            return traits_type::to_int_type(*gptr());
+        } catch (...) {
+            return traits_type::eof();
+        }
+    }
+    
+    std::streamsize xsgetn(char* d, std::streamsize n) override {
+        std::streamsize off = 0;
+        while (off < n) {
+            // Drain the buffer first
+            const std::streamsize avail = egptr()-gptr();
+            if (avail) {
+                const std::streamsize l = std::min(avail, n-off);
+                memcpy(d+off, gptr(), l);
+                gbump((int)l);
+                off += l;
+                continue;
+            }
+            
+            // Large reads bypass the buffer
+            if ((size_t)(n-off) >= _cap) {
+                if (!_fd.hasValue()) break;
+                try {
+                    const size_t sr = _ReadSome(_fd, d+off, n-off);
+                    if (!sr) break; // EOF
+                    off += sr;
+                } catch (...) {
+                    break;
+                }
+                continue;
+            }
+            
+            if (underflow() == traits_type::eof()) break;
+        }
+        return off;
+    }
+    
+    int_type overflow(int_type c) override {
+        if (!_fd.hasValue()) return traits_type::eof();
+        try {
+            _flush();
+        } catch (...) {
+            return traits_type::eof();
+        }
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+        return c;
+    }
+    
+    std::streamsize xsputn(const char* d, std::streamsize n) override {
+        // Small writes go to the buffer
+        if ((size_t)n < _cap) {
+            std::streamsize off = 0;
+            while (off < n) {
+                const std::streamsize space = epptr()-pptr();
+                if (!space) {
+                    if (overflow(traits_type::eof()) == traits_type::eof()) break;
+                    continue;
+                }
+                const std::streamsize l = std::min(space, n-off);
+                memcpy(pptr(), d+off, l);
+                pbump((int)l);
+                off += l;
+            }
+            return off;
+        }
+        
+        // Large writes bypass the buffer, and are written along with the
+        // buffered data in a single writev()
+        if (!_fd.hasValue()) return 0;
+        try {
+            const struct iovec iov[] = {
+                { .iov_base = pbase(), .iov_len = (size_t)(pptr()-pbase()) },
+                { .iov_base = (void*)d, .iov_len = (size_t)n },
+            };
+            WriteV(_fd, iov, std::size(iov));
+            setp(_wbuf.get(), _wbuf.get()+_cap);
+        } catch (...) {
+            return 0;
+        }
+        return n;
+    }
+    
+    int sync() override {
+        if (!_fd.hasValue()) return 0;
+        try {
+            _flush();
+        } catch (...) {
+            return -1;
+        }
+        return 0;
+    }
+    
+private:
+    void _flush() {
+        const size_t len = pptr()-pbase();
+        if (len) Write(_fd, pbase(), len);
+        setp(_wbuf.get(), _wbuf.get()+_cap);
+    }
+    
+    FileDescriptor _fd;
+    std::unique_ptr<char[]> _rbuf;
+    std::unique_ptr<char[]> _wbuf;
+    size_t _cap = 0;
+};
+
+// BufferedFDStream: an iostream over a BufferedStreambuf, which can replace
+// FDStreamInOut. Takes ownership of the file descriptor.
+class BufferedFDStream : public std::iostream {
+public:
+    BufferedFDStream() : std::iostream(nullptr) {}
+    BufferedFDStream(FileDescriptor&& fd, size_t cap=BufferedStreambuf::DefaultCap) :
+    std::iostream(nullptr), _buf(std::make_unique<BufferedStreambuf>(std::move(fd), cap)) {
+        rdbuf(_buf.get());
+    }
+    
+    BufferedFDStream(BufferedFDStream&& x) : BufferedFDStream() {
+        swap(x);
+    }
+    
+    // Move assignment operator
+    BufferedFDStream& operator=(BufferedFDStream&& x) {
+        swap(x);
+        return *this;
+    }
+    
+    void swap(BufferedFDStream& x) {
+        std::swap(_buf, x._buf);
+        std::iostream::swap(x);
+        rdbuf(_buf.get());
+        x.rdbuf(x._buf.get());
+    }
+    
+private:
+    // _buf needs to be a unique_ptr so that the pointer given to rdbuf() stays
+    // valid across swap(), like FDStream::_filebuf
+    std::unique_ptr<BufferedStreambuf> _buf;
+};
+
+} // namespace Toastbox
@@ -1,4 +1,17 @@
 #pragma once
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <bit>
+#include <span>
+#include <ranges>
+#include <type_traits>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
 
 namespace Toastbox::Endian {
 
@@ -26,6 +39,22 @@ constexpr uint32_t Swap(uint32_t x) {
             (x&0x000000FF)<<24  ;
 }
 
+constexpr uint64_t Swap(uint64_t x) {
+    return __builtin_bswap64(x);
+}
+
+constexpr int64_t Swap(int64_t x) {
+    return (int64_t)__builtin_bswap64((uint64_t)x);
+}
+
+constexpr float Swap(float x) {
+    return std::bit_cast<float>(Swap(std::bit_cast<uint32_t>(x)));
+}
+
+constexpr double Swap(double x) {
+    return std::bit_cast<double>(Swap(std::bit_cast<uint64_t>(x)));
+}
+
 constexpr bool LittleEndian() {
     return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
 }
@@ -44,6 +73,14 @@ constexpr uint32_t  LFH(uint32_t x)     { if (LittleEndian()) return x; else ret
 constexpr int32_t   LFH(int32_t x)      { if (LittleEndian()) return x; else return Swap(x); }
 constexpr uint32_t  HFL(uint32_t x)     { if (LittleEndian()) return x; else return Swap(x); }
 constexpr int32_t   HFL(int32_t x)      { if (LittleEndian()) return x; else return Swap(x); }
+constexpr uint64_t  LFH(uint64_t x)     { if (LittleEndian()) return x; else return Swap(x); }
+constexpr int64_t   LFH(int64_t x)      { if (LittleEndian()) return x; else return Swap(x); }
+constexpr uint64_t  HFL(uint64_t x)     { if (LittleEndian()) return x; else return Swap(x); }
+constexpr int64_t   HFL(int64_t x)      { if (LittleEndian()) return x; else return Swap(x); }
+constexpr float     LFH(float x)        { if (LittleEndian()) return x; else return Swap(x); }
+constexpr float     HFL(float x)        { if (LittleEndian()) return x; else return Swap(x); }
+constexpr double    LFH(double x)       { if (LittleEndian()) return x; else return Swap(x); }
+constexpr double    HFL(double x)       { if (LittleEndian()) return x; else return Swap(x); }
 
 constexpr uint8_t   LFH_U8(uint8_t x)   { return LFH(x); }
 constexpr int8_t    LFH_S8(int8_t x)    { return LFH(x); }
@@ -57,6 +94,10 @@ constexpr uint32_t  LFH_U32(uint32_t x) { return LFH(x); }
 constexpr int32_t   LFH_S32(int32_t x)  { return LFH(x); }
 constexpr uint32_t  HFL_U32(uint32_t x) { return HFL(x); }
 constexpr int32_t   HFL_S32(int32_t x)  { return HFL(x); }
+constexpr uint64_t  LFH_U64(uint64_t x) { return LFH(x); }
+constexpr int64_t   LFH_S64(int64_t x)  { return LFH(x); }
+constexpr uint64_t  HFL_U64(uint64_t x) { return HFL(x); }
+constexpr int64_t   HFL_S64(int64_t x)  { return HFL(x); }
 
 // Big <-> Host
 
@@ -72,6 +113,14 @@ constexpr uint32_t  BFH(uint32_t x)     { if (!LittleEndian()) return x; else re
 constexpr int32_t   BFH(int32_t x)      { if (!LittleEndian()) return x; else return Swap(x); }
 constexpr uint32_t  HFB(uint32_t x)     { if (!LittleEndian()) return x; else return Swap(x); }
 constexpr int32_t   HFB(int32_t x)      { if (!LittleEndian()) return x; else return Swap(x); }
+constexpr uint64_t  BFH(uint64_t x)     { if (!LittleEndian()) return x; else return Swap(x); }
+constexpr int64_t   BFH(int64_t x)      { if (!LittleEndian()) return x; else return Swap(x); }
+constexpr uint64_t  HFB(uint64_t x)     { if (!LittleEndian()) return x; else return Swap(x); }
+constexpr int64_t   HFB(int64_t x)      { if (!LittleEndian()) return x; else return Swap(x); }
+constexpr float     BFH(float x)        { if (!LittleEndian()) return x; else return Swap(x); }
+constexpr float     HFB(float x)        { if (!LittleEndian()) return x; else return Swap(x); }
+constexpr double    BFH(double x)       { if (!LittleEndian()) return x; else return Swap(x); }
+constexpr double    HFB(double x)       { if (!LittleEndian()) return x; else return Swap(x); }
 
 constexpr uint8_t   BFH_U8(uint8_t x)   { return BFH(x); }
 constexpr int8_t    BFH_S8(int8_t x)    { return BFH(x); }
@@ -85,5 +134,111 @@ constexpr uint32_t  BFH_U32(uint32_t x) { return BFH(x); }
 constexpr int32_t   BFH_S32(int32_t x)  { return BFH(x); }
 constexpr uint32_t  HFB_U32(uint32_t x) { return HFB(x); }
 constexpr int32_t   HFB_S32(int32_t x)  { return HFB(x); }
+constexpr uint64_t  BFH_U64(uint64_t x) { return BFH(x); }
+constexpr int64_t   BFH_S64(int64_t x)  { return BFH(x); }
+constexpr uint64_t  HFB_U64(uint64_t x) { return HFB(x); }
+constexpr int64_t   HFB_S64(int64_t x)  { return HFB(x); }
+
+// Bulk conversion
+//
+// SwapN() byte-swaps `count` elements from `src` into `dst` (which may be equal
+// to `src`, for in-place conversion), using NEON/AVX2/SSSE3 byte shuffles where
+// available, and __builtin_bswap for the remainder.
+//
+// The range variants of LFH/HFL/BFH/HFB (which accept any contiguous range,
+// eg std::span, std::vector or std::array) convert in place, or from `src`
+// into `dst`. When the host byte order already matches, they're resolved at
+// compile time to a no-op (in place) or a memcpy.
+
+template<typename T>
+concept _Swappable = (std::is_arithmetic_v<T> && (sizeof(T)==2 || sizeof(T)==4 || sizeof(T)==8));
+
+template<size_t T_Size>
+constexpr uint64_t _SwapScalar(uint64_t x) {
+    if constexpr (T_Size == 2) return __builtin_bswap16((uint16_t)x);
+    else if constexpr (T_Size == 4) return __builtin_bswap32((uint32_t)x);
+    else return __builtin_bswap64(x);
+}
+
+template<size_t T_Size>
+inline void _SwapBytes(uint8_t* dst, const uint8_t* src, size_t count) {
+    using U = std::conditional_t<T_Size==2, uint16_t, std::conditional_t<T_Size==4, uint32_t, uint64_t>>;
+    size_t len = count*T_Size;
+    
+#if defined(__ARM_NEON)
+    for (; len>=16; len-=16, src+=16, dst+=16) {
+        const uint8x16_t v = vld1q_u8(src);
+        if constexpr (T_Size == 2)      vst1q_u8(dst, vrev16q_u8(v));
+        else if constexpr (T_Size == 4) vst1q_u8(dst, vrev32q_u8(v));
+        else                            vst1q_u8(dst, vrev64q_u8(v));
+    }
+#elif defined(__AVX2__) || defined(__SSSE3__)
+    // _mm_shuffle_epi8 mask that reverses each T_Size-byte element
+    alignas(16) uint8_t maskBytes[16];
+    for (size_t i=0; i<16; i++) maskBytes[i] = (uint8_t)((i/T_Size)*T_Size + (T_Size-1-(i%T_Size)));
+    const __m128i mask = _mm_load_si128((const __m128i*)maskBytes);
+#if defined(__AVX2__)
+    const __m256i mask256 = _mm256_broadcastsi128_si256(mask);
+    for (; len>=32; len-=32, src+=32, dst+=32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)src);
+        _mm256_storeu_si256((__m256i*)dst, _mm256_shuffle_epi8(v, mask256));
+    }
+#endif
+    for (; len>=16; len-=16, src+=16, dst+=16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)src);
+        _mm_storeu_si128((__m128i*)dst, _mm_shuffle_epi8(v, mask));
+    }
+#endif
+    
+    for (; len; len-=T_Size, src+=T_Size, dst+=T_Size) {
+        U x;
+        memcpy(&x, src, sizeof(x));
+        x = (U)_SwapScalar<T_Size>(x);
+        memcpy(dst, &x, sizeof(x));
+    }
+}
+
+template<_Swappable T>
+inline void SwapN(T* dst, const T* src, size_t count) {
+    _SwapBytes<sizeof(T)>((uint8_t*)dst, (const uint8_t*)src, count);
+}
+
+template<_Swappable T>
+inline void SwapN(T* x, size_t count) {
+    SwapN(x, x, count);
+}
+
+// _Convert(): swaps if `T_Swap`, otherwise copies (or does nothing, in place)
+template<bool T_Swap, typename T>
+inline void _Convert(std::span<T> dst, std::span<const T> src) {
+    assert(dst.size() == src.size());
+    if constexpr (T_Swap) {
+        SwapN(dst.data(), src.data(), dst.size());
+    } else {
+        if (dst.data() != src.data()) memcpy(dst.data(), src.data(), dst.size_bytes());
+    }
+}
+
+// _SwappableRange: a contiguous range of _Swappable elements (eg std::span,
+// std::vector, std::array, or a C array), for the bulk LFH/HFL/BFH/HFB
+template<typename T>
+concept _SwappableRange = std::ranges::contiguous_range<T> && std::ranges::sized_range<T> &&
+    _Swappable<std::ranges::range_value_t<T>>;
+
+template<bool T_Swap, typename T_Dst, typename T_Src>
+inline void _ConvertRange(T_Dst&& dst, T_Src&& src) {
+    using T = std::ranges::range_value_t<T_Dst>;
+    static_assert(std::is_same_v<T, std::ranges::range_value_t<T_Src>>, "dst and src element types must match");
+    _Convert<T_Swap,T>(std::span<T>(dst), std::span<const T>(src));
+}
+
+template<_SwappableRange T> inline void LFH(T&& x)                             { _ConvertRange<!LittleEndian()>(x, x); }
+template<_SwappableRange T> inline void HFL(T&& x)                             { _ConvertRange<!LittleEndian()>(x, x); }
+template<_SwappableRange T> inline void BFH(T&& x)                             { _ConvertRange<LittleEndian()>(x, x); }
+template<_SwappableRange T> inline void HFB(T&& x)                             { _ConvertRange<LittleEndian()>(x, x); }
+template<_SwappableRange T_Dst, _SwappableRange T_Src> inline void LFH(T_Dst&& dst, T_Src&& src) { _ConvertRange<!LittleEndian()>(dst, src); }
+template<_SwappableRange T_Dst, _SwappableRange T_Src> inline void HFL(T_Dst&& dst, T_Src&& src) { _ConvertRange<!LittleEndian()>(dst, src); }
+template<_SwappableRange T_Dst, _SwappableRange T_Src> inline void BFH(T_Dst&& dst, T_Src&& src) { _ConvertRange<LittleEndian()>(dst, src); }
+template<_SwappableRange T_Dst, _SwappableRange T_Src> inline void HFB(T_Dst&& dst, T_Src&& src) { _ConvertRange<LittleEndian()>(dst, src); }
 
 } // namespace Toastbox::Endian
@@ -1,4 +1,14 @@
 #include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <vector>
+#include <span>
+#include <string_view>
+#include <algorithm>
+#include <sys/uio.h>
+#include "Mmap.h"
+#include "ReadWrite.h"
+#include "RuntimeError.h"
 
 namespace Toastbox {
 namespace FAT12 {
@@ -82,6 +92,391 @@ struct [[gnu::packed]] DirTable {
 };
 static_assert(sizeof(DirTable<8192>) == 8192);
 
+// Cluster values in the FAT
+static constexpr std::uint16_t ClusterFree  = 0x000;
+static constexpr std::uint16_t ClusterFirst = 0x002; // First data cluster
+static constexpr std::uint16_t ClusterBad   = 0xFF7;
+static constexpr std::uint16_t ClusterEnd   = 0xFFF; // End-of-chain marker written by us
+static constexpr std::uint16_t ClusterEndMin = 0xFF8; // Values >= this mark the end of a chain
+
+// FATDecode(): decodes `count` 12-bit entries from the packed FAT `src` into `dst`.
+// Entries are packed in pairs (FATEntry), so each 3 bytes produce 2 entries.
+inline void FATDecode(std::uint16_t* dst, const std::uint8_t* src, size_t count) {
+    size_t i = 0;
+    for (; i+1<count; i+=2, src+=3) {
+        dst[i]   = (std::uint16_t)(src[0] | ((src[1]&0x0F)<<8));
+        dst[i+1] = (std::uint16_t)((src[1]>>4) | (src[2]<<4));
+    }
+    if (i < count) dst[i] = (std::uint16_t)(src[0] | ((src[1]&0x0F)<<8));
+}
+
+// FATEncode(): the inverse of FATDecode()
+inline void FATEncode(std::uint8_t* dst, const std::uint16_t* src, size_t count) {
+    size_t i = 0;
+    for (; i+1<count; i+=2, dst+=3) {
+        dst[0] = (std::uint8_t)src[i];
+        dst[1] = (std::uint8_t)(((src[i]>>8)&0x0F) | ((src[i+1]&0x0F)<<4));
+        dst[2] = (std::uint8_t)(src[i+1]>>4);
+    }
+    if (i < count) {
+        dst[0] = (std::uint8_t)src[i];
+        dst[1] = (std::uint8_t)((dst[1]&0xF0) | ((src[i]>>8)&0x0F));
+    }
+}
+
+// Name(): formats an 8.3 name (eg "DATA.BIN") into DirEntry's space-padded name/ext
+inline void Name(DirEntry& e, std::string_view name) {
+    const size_t dot = name.rfind('.');
+    const std::string_view base = name.substr(0, dot);
+    const std::string_view ext = (dot==std::string_view::npos ? std::string_view() : name.substr(dot+1));
+    if (base.empty() || base.size()>sizeof(e.name) || ext.size()>sizeof(e.ext)) {
+        throw RuntimeError("invalid 8.3 name: %.*s", (int)name.size(), name.data());
+    }
+    memset(e.name, ' ', sizeof(e.name));
+    memset(e.ext, ' ', sizeof(e.ext));
+    std::transform(base.begin(), base.end(), e.name, [] (char c) { return (std::uint8_t)toupper(c); });
+    std::transform(ext.begin(), ext.end(), e.ext, [] (char c) { return (std::uint8_t)toupper(c); });
+}
+
+// Volume: a FAT12 filesystem image, accessed via Mmap
+//
+// The FAT is decoded once (in bulk) into a uint16_t-per-cluster cache, so
+// resolving a cluster chain doesn't decode 12-bit entries. Files are
+// accessed as runs of contiguous clusters, so reading/writing a file costs
+// one memcpy (or one iovec) per run rather than per cluster.
+//
+// The Mmap must be opened with O_RDWR to use writeFile().
+template<size_t T_SectorSize>
+class Volume {
+public:
+    // Run: a run of `count` contiguous clusters starting at `cluster`
+    struct Run {
+        std::uint16_t cluster = 0;
+        std::uint16_t count = 0;
+    };
+    
+    Volume(Mmap&& mmap) : _mmap(std::move(mmap)) {
+        const auto& br = *(const BootRecord<T_SectorSize>*)_mmap.data(0, sizeof(BootRecord<T_SectorSize>));
+        if (br.sectorSize != T_SectorSize) {
+            throw RuntimeError("sector size mismatch (expected %ju, got %ju)", (uintmax_t)T_SectorSize, (uintmax_t)br.sectorSize);
+        }
+        if (!br.clusterSize || !br.fatCount || !br.fatSize) throw RuntimeError("invalid boot record");
+        
+        const size_t totalSectors = (br.totalSize ? br.totalSize : br.largeSectorCount);
+        _fatOff = (size_t)br.reservedSize * T_SectorSize;
+        _fatLen = (size_t)br.fatSize * T_SectorSize;
+        _fatCount = br.fatCount;
+        _rootOff = _fatOff + _fatLen*_fatCount;
+        _rootCount = br.rootEntryCount;
+        _dataOff = _rootOff + _SectorCeil(_rootCount*sizeof(DirEntry));
+        _clusterLen = (size_t)br.clusterSize * T_SectorSize;
+        
+        const size_t dataSectors = totalSectors - std::min(totalSectors, _dataOff/T_SectorSize);
+        const size_t clusterCount = std::min(dataSectors/br.clusterSize + ClusterFirst, (_fatLen*2)/3);
+        // Validate that the whole layout is mapped
+        _mmap.data(0, _dataOff + (clusterCount-ClusterFirst)*_clusterLen);
+        
+        _fat.resize(clusterCount);
+        FATDecode(_fat.data(), _mmap.data(_fatOff, _fatLen), _fat.size());
+    }
+    
+    std::span<DirEntry> root() {
+        return { (DirEntry*)_mmap.data(_rootOff, _rootCount*sizeof(DirEntry)), _rootCount };
+    }
+    
+    std::span<const DirEntry> root() const {
+        return { (const DirEntry*)_mmap.data(_rootOff, _rootCount*sizeof(DirEntry)), _rootCount };
+    }
+    
+    // find(): returns the root directory entry with the 8.3 name `name`, or nullptr
+    DirEntry* find(std::string_view name) {
+        DirEntry n;
+        Name(n, name);
+        for (DirEntry& e : root()) {
+            if (!e.name[0]) break; // End of directory
+            if (e.name[0] == 0xE5) continue; // Deleted
+            if (!memcmp(e.name, n.name, sizeof(n.name)) && !memcmp(e.ext, n.ext, sizeof(n.ext))) return &e;
+        }
+        return nullptr;
+    }
+    
+    // runs(): resolves the cluster chain starting at `cluster` into runs of
+    // contiguous clusters
+    std::vector<Run> runs(std::uint16_t cluster) const {
+        std::vector<Run> r;
+        // Bound the walk by the cluster count, so a corrupt (cyclic) chain can't loop forever
+        for (size_t i=0; cluster<ClusterEndMin; i++) {
+            if (cluster<ClusterFirst || cluster>=_fat.size() || i>=_fat.size()) {
+                throw RuntimeError("invalid cluster chain (cluster 0x%x)", cluster);
+            }
+            if (!r.empty() && r.back().cluster+r.back().count==cluster && r.back().count<UINT16_MAX) {
+                r.back().count++;
+            } else {
+                r.push_back({ cluster, 1 });
+            }
+            cluster = _fat[cluster];
+        }
+        return r;
+    }
+    
+    // readFile(): copies up to `len` bytes of the file into `dst`. Returns the
+    // number of bytes copied.
+    size_t readFile(const DirEntry& e, void* dst, size_t len) const {
+        std::uint8_t* d = (std::uint8_t*)dst;
+        size_t off = 0;
+        _forEachRun(e, [&] (const std::uint8_t* data, size_t l) {
+            l = std::min(l, len-off);
+            memcpy(d+off, data, l);
+            off += l;
+            return off < len;
+        });
+        return off;
+    }
+    
+    // sendFile(): writes the file to `fd`, directly from the mapping, via a
+    // single WriteV() of its runs
+    void sendFile(int fd, const DirEntry& e, std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point()) const {
+        std::vector<struct iovec> iov;
+        _forEachRun(e, [&] (const std::uint8_t* data, size_t l) {
+            iov.push_back({ .iov_base = (void*)data, .iov_len = l });
+            return true;
+        });
+        const size_t len = WriteV(fd, iov.data(), iov.size(), deadline);
+        if (len != e.fileSize) throw ReadWriteTimeout();
+    }
+    
+    // writeFile(): replaces the contents of the file with `data`. Frees the
+    // file's existing clusters, and allocates new ones, preferring a single
+    // contiguous run. Updates every copy of the FAT. If there isn't enough
+    // space (even counting the file's own clusters), throws and leaves the
+    // file and the FAT unchanged.
+    void writeFile(DirEntry& e, const void* data, size_t len) {
+        if (len > UINT32_MAX) throw RuntimeError("file too large");
+        const size_t clusterCount = (len+_clusterLen-1) / _clusterLen;
+        
+        // Free the existing chain, so that _alloc() can reuse its clusters, but
+        // keep its FAT entries so that they can be restored if _alloc() fails
+        const std::vector<Run> old = (e.fatIndex>=ClusterFirst ? runs(e.fatIndex) : std::vector<Run>{});
+        std::vector<std::uint16_t> oldFat;
+        for (const Run& run : old) {
+            oldFat.insert(oldFat.end(), _fat.begin()+run.cluster, _fat.begin()+run.cluster+run.count);
+            std::fill_n(_fat.begin()+run.cluster, run.count, ClusterFree);
+            _fatDirty(run.cluster, run.count);
+        }
+        
+        std::vector<Run> rs;
+        try {
+            rs = _alloc(clusterCount);
+        } catch (...) {
+            auto it = oldFat.begin();
+            for (const Run& run : old) {
+                std::copy_n(it, run.count, _fat.begin()+run.cluster);
+                it += run.count;
+            }
+            throw;
+        }
+        
+        // Link the runs into a chain, and copy the data
+        const std::uint8_t* d = (const std::uint8_t*)data;
+        size_t off = 0;
+        for (size_t i=0; i<rs.size(); i++) {
+            const Run& run = rs[i];
+            for (std::uint16_t c=run.cluster; c<run.cluster+run.count-1; c++) _fat[c] = c+1;
+            _fat[run.cluster+run.count-1] = (i+1<rs.size() ? rs[i+1].cluster : ClusterEnd);
+            _fatDirty(run.cluster, run.count);
+            
+            const size_t l = std::min(len-off, (size_t)run.count*_clusterLen);
+            const size_t coff = _clusterOff(run.cluster);
+            memcpy(_mmap.data(coff, l), d+off, l);
+            _mmap.markDirty(coff, l);
+            off += l;
+        }
+        
+        e.fatIndex = (rs.empty() ? 0 : rs.front().cluster);
+        e.fileSize = (std::uint32_t)len;
+        _mmap.markDirty((std::uint8_t*)&e-_mmap.data(), sizeof(e));
+        _fatFlush();
+    }
+    
+    size_t clusterLen() const { return _clusterLen; }
+    const std::vector<std::uint16_t>& fat() const { return _fat; }
+    Mmap& mmap() { return _mmap; }
+    
+private:
+    static constexpr size_t _SectorCeil(size_t x) {
+        return ((x+T_SectorSize-1)/T_SectorSize)*T_SectorSize;
+    }
+    
+    size_t _clusterOff(std::uint16_t cluster) const {
+        return _dataOff + (size_t)(cluster-ClusterFirst)*_clusterLen;
+    }
+    
+    // _forEachRun(): calls `fn(data,len)` for each run of the file, clipped to
+    // the file's size, until `fn` returns false
+    template<typename T_Fn>
+    void _forEachRun(const DirEntry& e, T_Fn fn) const {
+        size_t rem = e.fileSize;
+        if (!rem) return;
+        for (const Run& run : runs(e.fatIndex)) {
+            const size_t l = std::min(rem, (size_t)run.count*_clusterLen);
+            if (!fn(_mmap.data(_clusterOff(run.cluster), l), l)) return;
+            rem -= l;
+            if (!rem) return;
+        }
+        throw RuntimeError("cluster chain shorter than file size");
+    }
+    
+    // _alloc(): allocates `count` clusters, preferring a single contiguous run
+    // (the first free run that's large enough), and otherwise taking free runs
+    // in order
+    std::vector<Run> _alloc(size_t count) {
+        std::vector<Run> free;
+        for (size_t c=ClusterFirst; c<_fat.size();) {
+            if (_fat[c] != ClusterFree) {
+                c++;
+                continue;
+            }
+            const size_t begin = c;
+            while (c<_fat.size() && _fat[c]==ClusterFree && c-begin<UINT16_MAX) c++;
+            free.push_back({ (std::uint16_t)begin, (std::uint16_t)(c-begin) });
+        }
+        
+        for (const Run& run : free) {
+            if (run.count >= count) {
+                if (!count) return {};
+                return { Run{ run.cluster, (std::uint16_t)count } };
+            }
+        }
+        
+        std::vector<Run> r;
+        size_t rem = count;
+        for (const Run& run : free) {
+            if (!rem) break;
+            const size_t l = std::min(rem, (size_t)run.count);
+            r.push_back({ run.cluster, (std::uint16_t)l });
+            rem -= l;
+        }
+        if (rem) throw RuntimeError("filesystem full");
+        return r;
+    }
+    
+    void _fatDirty(size_t cluster, size_t count) {
+        if (_fatDirtyBegin == _fatDirtyEnd) {
+            _fatDirtyBegin = cluster;
+            _fatDirtyEnd = cluster+count;
+        } else {
+            _fatDirtyBegin = std::min(_fatDirtyBegin, cluster);
+            _fatDirtyEnd = std::max(_fatDirtyEnd, cluster+count);
+        }
+    }
+    
+    // _fatFlush(): re-encodes the dirty range of the FAT cache into every copy of the FAT
+    void _fatFlush() {
+        if (_fatDirtyBegin == _fatDirtyEnd) return;
+        // Align to entry pairs, so the range is a whole number of FATEntry's
+        const size_t begin = _fatDirtyBegin & ~(size_t)1;
+        const size_t end = std::min(_fat.size(), (_fatDirtyEnd+1) & ~(size_t)1);
+        const size_t byteOff = (begin/2)*sizeof(FATEntry);
+        const size_t byteLen = ((end-begin+1)/2)*sizeof(FATEntry);
+        for (size_t i=0; i<_fatCount; i++) {
+            const size_t off = _fatOff + i*_fatLen + byteOff;
+            FATEncode(_mmap.data(off, byteLen), _fat.data()+begin, end-begin);
+            _mmap.markDirty(off, byteLen);
+        }
+        _fatDirtyBegin = 0;
+        _fatDirtyEnd = 0;
+    }
+    
+    Mmap _mmap;
+    size_t _fatOff = 0;
+    size_t _fatLen = 0;
+    size_t _fatCount = 0;
+    size_t _rootOff = 0;
+    size_t _rootCount = 0;
+    size_t _dataOff = 0;
+    size_t _clusterLen = 0;
+    std::vector<std::uint16_t> _fat;
+    size_t _fatDirtyBegin = 0;
+    size_t _fatDirtyEnd = 0;
+};
+
+// File: a file for Build()
+struct File {
+    DirEntry entry = {}; // name/ext/attr/times; fatIndex/fileSize are filled in by Build()
+    std::span<const std::uint8_t> data;
+};
+
+// Build(): writes a FAT12 image to `fd` in a single sequential pass, with
+// each file stored as a single contiguous run of clusters. `br` supplies the
+// geometry; the FAT and root directory are generated, and the file data is
+// written directly from the callers' buffers via WriteV().
+template<size_t T_SectorSize>
+inline void Build(int fd, const BootRecord<T_SectorSize>& br, std::span<File> files) {
+    if (br.sectorSize!=T_SectorSize || !br.clusterSize || !br.fatCount || !br.fatSize) {
+        throw RuntimeError("invalid boot record");
+    }
+    if (files.size() > br.rootEntryCount) throw RuntimeError("too many files for root directory");
+    
+    const auto sectorCeil = [] (size_t x) { return ((x+T_SectorSize-1)/T_SectorSize)*T_SectorSize; };
+    const size_t totalLen = (size_t)(br.totalSize ? br.totalSize : br.largeSectorCount) * T_SectorSize;
+    const size_t fatLen = (size_t)br.fatSize * T_SectorSize;
+    const size_t rootLen = sectorCeil(br.rootEntryCount*sizeof(DirEntry));
+    const size_t clusterLen = (size_t)br.clusterSize * T_SectorSize;
+    const size_t dataOff = (size_t)br.reservedSize*T_SectorSize + fatLen*br.fatCount + rootLen;
+    if (dataOff > totalLen) throw RuntimeError("invalid boot record");
+    const size_t clusterCount = std::min((totalLen-dataOff)/clusterLen + ClusterFirst, (fatLen*2)/3);
+    
+    // Allocate each file contiguously, and generate the FAT and root directory
+    std::vector<std::uint16_t> fat(clusterCount, ClusterFree);
+    fat[0] = 0xF00 | br.mediaDescriptor;
+    fat[1] = ClusterEnd;
+    std::vector<std::uint8_t> root(rootLen);
+    size_t cluster = ClusterFirst;
+    for (size_t i=0; i<files.size(); i++) {
+        File& f = files[i];
+        const size_t count = (f.data.size()+clusterLen-1) / clusterLen;
+        if (cluster+count > clusterCount) throw RuntimeError("filesystem full");
+        for (size_t c=cluster; c<cluster+count; c++) fat[c] = (std::uint16_t)(c+1);
+        if (count) fat[cluster+count-1] = ClusterEnd;
+        f.entry.fatIndex = (std::uint16_t)(count ? cluster : 0);
+        f.entry.fileSize = (std::uint32_t)f.data.size();
+        memcpy(root.data()+i*sizeof(DirEntry), &f.entry, sizeof(DirEntry));
+        cluster += count;
+    }
+    
+    std::vector<std::uint8_t> fatBuf(fatLen);
+    FATEncode(fatBuf.data(), fat.data(), fat.size());
+    
+    // Boot record + reserved sectors
+    std::vector<std::uint8_t> zeros(std::max(clusterLen, (size_t)br.reservedSize*T_SectorSize));
+    memcpy(zeros.data(), &br, sizeof(br));
+    Write(fd, zeros.data(), (size_t)br.reservedSize*T_SectorSize);
+    memset(zeros.data(), 0, sizeof(br));
+    
+    // FATs + root directory
+    for (size_t i=0; i<br.fatCount; i++) Write(fd, fatBuf.data(), fatBuf.size());
+    Write(fd, root.data(), root.size());
+    
+    // File data, padded to cluster boundaries
+    size_t off = dataOff;
+    for (const File& f : files) {
+        const size_t pad = (clusterLen - f.data.size()%clusterLen) % clusterLen;
+        const struct iovec iov[] = {
+            { .iov_base = (void*)f.data.data(), .iov_len = f.data.size() },
+            { .iov_base = zeros.data(), .iov_len = pad },
+        };
+        WriteV(fd, iov, std::size(iov));
+        off += f.data.size()+pad;
+    }
+    
+    // Pad to the total size
+    while (off < totalLen) {
+        const size_t l = std::min(totalLen-off, zeros.size());
+        Write(fd, zeros.data(), l);
+        off += l;
+    }
+}
+
 } // namespace FAT12
 
 } // namespace Toastbox
@@ -0,0 +1,234 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <memory>
+#include <utility>
+#include <iterator>
+#include <functional>
+#include <type_traits>
+#include "HashInts.h"
+
+namespace Toastbox {
+
+// FlatMap:
+//   Open-addressing (linear probing) hash map, with the subset of
+//   std::unordered_map's interface that we use. Entries are stored inline in
+//   a single power-of-2 array, so lookups don't chase pointers, and erasure
+//   shifts subsequent entries in the same probe run backwards (like
+//   LRUFlat's hash index), so there are no tombstones.
+//
+//   Unlike std::unordered_map:
+//     - T_Key and T_Val must be default-constructible and move-assignable
+//     - Insertion can invalidate every iterator/reference (if the table
+//       grows), and so can erasure (since it shifts entries)
+//     - value_type is std::pair<T_Key,T_Val>, whose key must not be modified
+template<typename T_Key, typename T_Val, typename T_Hash=Hash<T_Key>, typename T_Eq=std::equal_to<T_Key>>
+class FlatMap {
+public:
+    using key_type = T_Key;
+    using mapped_type = T_Val;
+    using value_type = std::pair<T_Key,T_Val>;
+    
+    template<bool T_Const>
+    struct _Iter {
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type   = std::ptrdiff_t;
+        using value_type        = FlatMap::value_type;
+        using pointer           = std::conditional_t<T_Const, const value_type*, value_type*>;
+        using reference         = std::conditional_t<T_Const, const value_type&, value_type&>;
+        using _Map              = std::conditional_t<T_Const, const FlatMap, FlatMap>;
+        
+        _Iter() {}
+        _Iter(_Map* map, size_t idx) : _map(map), _idx(idx) { _skipEmpty(); }
+        // Allow conversion from non-const -> const iterator
+        template<bool C=T_Const, typename=std::enable_if_t<C>>
+        _Iter(const _Iter<false>& x) : _map(x._map), _idx(x._idx) {}
+        
+        reference operator*() const { return _map->_slots[_idx].kv; }
+        pointer operator->() const { return &_map->_slots[_idx].kv; }
+        
+        _Iter& operator++() {
+            _idx++;
+            _skipEmpty();
+            return *this;
+        }
+        
+        _Iter operator++(int) { _Iter x(*this); ++*this; return x; }
+        
+        bool operator==(const _Iter& x) const { return _idx == x._idx; }
+        bool operator!=(const _Iter& x) const { return _idx != x._idx; }
+        
+        void _skipEmpty() {
+            while (_idx<_map->_cap && !_map->_slots[_idx].full) _idx++;
+        }
+        
+        _Map* _map = nullptr;
+        size_t _idx = 0;
+    };
+    
+    using iterator = _Iter<false>;
+    using const_iterator = _Iter<true>;
+    
+    FlatMap() {}
+    
+    // Copy: allowed
+    FlatMap(const FlatMap& x) { *this = x; }
+    FlatMap& operator=(const FlatMap& x) {
+        if (this == &x) return *this;
+        clear();
+        reserve(x._size);
+        for (const value_type& kv : x) try_emplace(kv.first, kv.second);
+        return *this;
+    }
+    
+    // Move: allowed
+    FlatMap(FlatMap&& x) { swap(x); }
+    FlatMap& operator=(FlatMap&& x) { swap(x); return *this; }
+    
+    void swap(FlatMap& x) {
+        std::swap(_slots, x._slots);
+        std::swap(_cap, x._cap);
+        std::swap(_size, x._size);
+    }
+    
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, _cap); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, _cap); }
+    
+    size_t size() const { return _size; }
+    bool empty() const { return !_size; }
+    
+    iterator find(const T_Key& key) {
+        if (!_size) return end();
+        const size_t i = _find(key);
+        return (_slots[i].full ? iterator(this, i) : end());
+    }
+    
+    const_iterator find(const T_Key& key) const {
+        if (!_size) return end();
+        const size_t i = _find(key);
+        return (_slots[i].full ? const_iterator(this, i) : end());
+    }
+    
+    bool contains(const T_Key& key) const { return find(key) != end(); }
+    
+    template<typename... T_Args>
+    std::pair<iterator,bool> try_emplace(const T_Key& key, T_Args&&... args) {
+        _reserveForInsert();
+        const size_t i = _find(key);
+        _Slot& slot = _slots[i];
+        if (slot.full) return { iterator(this, i), false };
+        slot.kv.first = key;
+        slot.kv.second = T_Val(std::forward<T_Args>(args)...);
+        slot.full = true;
+        _size++;
+        return { iterator(this, i), true };
+    }
+    
+    template<typename... T_Args>
+    std::pair<iterator,bool> emplace(const T_Key& key, T_Args&&... args) {
+        return try_emplace(key, std::forward<T_Args>(args)...);
+    }
+    
+    std::pair<iterator,bool> insert(const value_type& kv) {
+        return try_emplace(kv.first, kv.second);
+    }
+    
+    T_Val& operator[](const T_Key& key) {
+        return try_emplace(key).first->second;
+    }
+    
+    size_t erase(const T_Key& key) {
+        if (!_size) return 0;
+        const size_t i = _find(key);
+        if (!_slots[i].full) return 0;
+        _erase(i);
+        return 1;
+    }
+    
+    void erase(const_iterator it) {
+        assert(it._idx < _cap);
+        _erase(it._idx);
+    }
+    
+    void clear() {
+        for (size_t i=0; i<_cap; i++) {
+            if (_slots[i].full) _slots[i] = {};
+        }
+        _size = 0;
+    }
+    
+    // reserve(): ensures that `n` entries fit without growing
+    void reserve(size_t n) {
+        size_t cap = (_cap ? _cap : _CapMin);
+        while (n > _LoadMax(cap)) cap *= 2;
+        if (cap != _cap) _rehash(cap);
+    }
+    
+private:
+    struct _Slot {
+        value_type kv = {};
+        bool full = false;
+    };
+    
+    static constexpr size_t _CapMin = 16;
+    // Grow when more than 1/2 full, to keep probe runs short
+    static constexpr size_t _LoadMax(size_t cap) { return cap/2; }
+    
+    size_t _home(const T_Key& key) const {
+        return T_Hash{}(key) & (_cap-1);
+    }
+    
+    // _find(): returns the index of the slot that holds `key`, or the empty
+    // slot where `key` would be inserted. Requires _cap>0.
+    size_t _find(const T_Key& key) const {
+        const size_t mask = _cap-1;
+        size_t i = _home(key);
+        while (_slots[i].full && !T_Eq{}(_slots[i].kv.first, key)) {
+            i = (i+1) & mask;
+        }
+        return i;
+    }
+    
+    // _erase(): empties slot `i`, and shifts subsequent entries in the same
+    // probe run backwards so that lookups don't need tombstones
+    void _erase(size_t i) {
+        const size_t mask = _cap-1;
+        size_t hole = i;
+        for (size_t j=(i+1)&mask; _slots[j].full; j=(j+1)&mask) {
+            const size_t home = _home(_slots[j].kv.first);
+            // Move the entry at `j` into the hole if its home slot doesn't
+            // lie cyclically within (hole,j]
+            if (((j-home) & mask) >= ((j-hole) & mask)) {
+                _slots[hole] = std::move(_slots[j]);
+                hole = j;
+            }
+        }
+        _slots[hole] = {};
+        _size--;
+    }
+    
+    void _reserveForInsert() {
+        if (_size+1 > _LoadMax(_cap)) reserve(_size+1);
+    }
+    
+    void _rehash(size_t cap) {
+        std::unique_ptr<_Slot[]> slots = std::make_unique<_Slot[]>(cap);
+        std::swap(_slots, slots);
+        const size_t capPrev = _cap;
+        _cap = cap;
+        for (size_t i=0; i<capPrev; i++) {
+            _Slot& slot = slots[i];
+            if (!slot.full) continue;
+            _slots[_find(slot.kv.first)] = std::move(slot);
+        }
+    }
+    
+    std::unique_ptr<_Slot[]> _slots;
+    size_t _cap = 0;
+    size_t _size = 0;
+};
+
+} // namespace Toastbox
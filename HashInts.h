@@ -1,20 +1,107 @@
 #pragma once
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <functional>
+#include <type_traits>
 
 namespace Toastbox {
 
+// _HashMix(): wyhash-style multiply-mix: the 128-bit product of `a` and `b`,
+// folded to 64 bits
+inline uint64_t _HashMix(uint64_t a, uint64_t b) {
+    const __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static constexpr uint64_t _HashP0 = 0xa0761d6478bd642f;
+static constexpr uint64_t _HashP1 = 0xe7037ed1a0b428db;
+static constexpr uint64_t _HashP2 = 0x8ebc6af09c88c6e3;
+
+// HashInts(): hashes integers (or enums/pointers), one multiply-mix per
+// value rather than one round per byte. The result's bits are all well
+// mixed, so callers can use any subset of them (eg the low bits for a
+// power-of-2 table, and the high bits for sharding).
 template<typename... Ts>
 size_t HashInts(Ts... ts) {
-    // FNV-1 hash
-    const uintmax_t v[] = {(uintmax_t)ts...};
-    const uint8_t* b = (uint8_t*)&v;
-    size_t hash = (size_t)0xcbf29ce484222325;
-    for (size_t i=0; i<sizeof(v); i++) {
-        hash *= 0x100000001b3;
-        hash ^= b[i];
+    uint64_t h = _HashP0 ^ (sizeof...(ts) * _HashP1);
+    ((h = _HashMix(h ^ (uint64_t)ts, _HashP1)), ...);
+    return (size_t)_HashMix(h, _HashP2);
+}
+
+// HashBytes(): hashes `len` bytes, 8 at a time
+inline size_t HashBytes(const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t h = _HashP0 ^ (len * _HashP1);
+    for (; len>=8; p+=8, len-=8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        h = _HashMix(h ^ w, _HashP1);
+    }
+    if (len) {
+        uint64_t w = 0;
+        memcpy(&w, p, len);
+        h = _HashMix(h ^ w, _HashP2);
     }
-    return hash;
+    return (size_t)_HashMix(h, _HashP2);
 }
 
+// Hash: hash functor (eg for std::unordered_map or FlatMap) for integers,
+// enums, pointers, strings, std::pair/std::tuple of hashable types, and types
+// with a `size_t hash() const` member. Other types use std::hash.
+//   `Hash<T>{}(x)` hashes a single value (the unordered_map use case), and
+//   `Hash<A,B,...>{}(a,b,...)` hashes several values together.
+template<typename... Ts>
+struct Hash {
+    size_t operator()(const Ts&... xs) const {
+        if constexpr (sizeof...(Ts) == 1) return _Hash(xs...);
+        else return HashInts(_Word(xs)...);
+    }
+    
+    template<typename T>
+    static constexpr bool _IsWord = std::is_integral_v<T> || std::is_enum_v<T> || std::is_pointer_v<T>;
+    
+    template<typename T, typename = void>
+    struct _HasHashMember : std::false_type {};
+    
+    template<typename T>
+    struct _HasHashMember<T, std::void_t<decltype(std::declval<const T&>().hash())>> : std::true_type {};
+    
+    template<typename T>
+    struct _IsTuple : std::false_type {};
+    
+    template<typename... Us>
+    struct _IsTuple<std::tuple<Us...>> : std::true_type {};
+    
+    template<typename A, typename B>
+    struct _IsTuple<std::pair<A,B>> : std::true_type {};
+    
+    // _Word(): the value to mix in for `x`; words themselves, or the hash of
+    // anything else
+    template<typename T>
+    static uint64_t _Word(const T& x) {
+        if constexpr (_IsWord<T>) return (uint64_t)x;
+        else return _Hash(x);
+    }
+    
+    template<typename T>
+    static size_t _Hash(const T& x) {
+        if constexpr (_IsWord<T>) {
+            return HashInts(x);
+        } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+            const std::string_view s = x;
+            return HashBytes(s.data(), s.size());
+        } else if constexpr (_IsTuple<T>::value) {
+            return std::apply([] (const auto&... ys) { return HashInts(_Word(ys)...); }, x);
+        } else if constexpr (_HasHashMember<T>::value) {
+            return x.hash();
+        } else {
+            return std::hash<T>{}(x);
+        }
+    }
+};
+
 } // namespace Toastbox
@@ -1,22 +1,43 @@
 #pragma once
 #import <map>
 #import <list>
+#import <utility>
+#import <bit>
+#import <iterator>
+#import <type_traits>
+#import <functional>
+#import <cstdint>
+#import <cassert>
+#import "HashInts.h"
+#import "FlatMap.h"
 
 namespace Toastbox {
 
-template<typename T_Key, typename T_Val, size_t T_Cap>
+// LRUHash: default hash for the LRUs (see Hash in HashInts.h)
+template<typename T_Key>
+using LRUHash = Hash<T_Key>;
+
+template<typename T_Key, typename T_Val>
+struct _LRUListVal {
+    T_Key key;
+    T_Val val;
+};
+
+template<typename T_Key, typename T_Val>
+using _LRUListIter = typename std::list<_LRUListVal<T_Key,T_Val>>::iterator;
+
+// LRU:
+//   `T_Map` maps keys to their entries in the recency list. It defaults to
+//   std::map, so keys only need to be ordered; see LRUHashed for a
+//   FlatMap-backed LRU, for hashable keys.
+template<typename T_Key, typename T_Val, size_t T_Cap,
+typename T_Map=std::map<T_Key,_LRUListIter<T_Key,T_Val>>>
 struct LRU {
-    struct ListVal;
-    
+    using ListVal = _LRUListVal<T_Key,T_Val>;
     using _List = std::list<ListVal>;
     using _ListIter = typename _List::iterator;
     using _ListConstIter = typename _List::const_iterator;
-    using _Map = std::map<T_Key,_ListIter>;
-    
-    struct ListVal {
-        T_Key key;
-        T_Val val;
-    };
+    using _Map = T_Map;
     
     void erase(_ListConstIter it) {
         const bool ok = _map.erase(it->key);
@@ -33,10 +54,11 @@ struct LRU {
             it->second = _list.begin();
         
         // If the entry didn't already exist, evict entries if needed
+        // (which invalidates `it`, but never evicts the new entry)
         } else {
             _evictIfNeeded();
         }
-        return it->second->val;
+        return _list.front().val;
     }
     
     _ListIter find(const T_Key& key) {
@@ -92,4 +114,376 @@ struct LRU {
     _List _list;
 };
 
+// LRUHashed: LRU with a FlatMap index instead of std::map, so lookups are
+// O(1) rather than O(log n), but keys must be hashable (via `T_Hash`)
+template<typename T_Key, typename T_Val, size_t T_Cap, typename T_Hash=LRUHash<T_Key>>
+using LRUHashed = LRU<T_Key,T_Val,T_Cap,FlatMap<T_Key,_LRUListIter<T_Key,T_Val>,T_Hash>>;
+
+// LRUFlat:
+//   LRUFlat has the same interface as LRU, but never allocates memory.
+//   
+//   Entries are stored in a fixed array of `T_Cap` slots, which are linked
+//   into the recency list via intrusive prev/next indexes, and are found via
+//   an open-addressing (linear probing) hash index. So operator[]/find()/
+//   erase() are all O(1).
+template<typename T_Key, typename T_Val, size_t T_Cap, typename T_Hash=LRUHash<T_Key>>
+struct LRUFlat {
+    static_assert(T_Cap > 0 && T_Cap < UINT32_MAX);
+    
+    struct ListVal {
+        T_Key key;
+        T_Val val;
+    };
+    
+    using _Idx = uint32_t;
+    static constexpr _Idx _Nil = UINT32_MAX;
+    
+    template<bool T_Const>
+    struct _Iter {
+        using iterator_category = std::bidirectional_iterator_tag;
+        using difference_type   = std::ptrdiff_t;
+        using value_type        = ListVal;
+        using pointer           = std::conditional_t<T_Const, const ListVal*, ListVal*>;
+        using reference         = std::conditional_t<T_Const, const ListVal&, ListVal&>;
+        using _LRU              = std::conditional_t<T_Const, const LRUFlat, LRUFlat>;
+        
+        _Iter() {}
+        _Iter(_LRU* lru, _Idx idx) : _lru(lru), _idx(idx) {}
+        // Allow conversion from non-const -> const iterator
+        template<bool C=T_Const, typename=std::enable_if_t<C>>
+        _Iter(const _Iter<false>& x) : _lru(x._lru), _idx(x._idx) {}
+        
+        reference operator*() const { return _lru->_slots[_idx].lv; }
+        pointer operator->() const { return &_lru->_slots[_idx].lv; }
+        
+        _Iter& operator++() {
+            _idx = _lru->_slots[_idx].next;
+            return *this;
+        }
+        
+        _Iter& operator--() {
+            _idx = (_idx==_Nil ? _lru->_tail : _lru->_slots[_idx].prev);
+            return *this;
+        }
+        
+        _Iter operator++(int) { _Iter x(*this); ++*this; return x; }
+        _Iter operator--(int) { _Iter x(*this); --*this; return x; }
+        
+        bool operator==(const _Iter& x) const { return _idx == x._idx; }
+        bool operator!=(const _Iter& x) const { return _idx != x._idx; }
+        
+        _LRU* _lru = nullptr;
+        _Idx _idx = _Nil;
+    };
+    
+    using _ListIter = _Iter<false>;
+    using _ListConstIter = _Iter<true>;
+    
+    LRUFlat() { clear(); }
+    
+    // Copy/move: illegal (iterators reference `this`)
+    LRUFlat(const LRUFlat& x) = delete;
+    LRUFlat& operator=(const LRUFlat& x) = delete;
+    
+    void erase(_ListConstIter it) {
+        assert(it._idx != _Nil);
+        _erase(it._idx);
+    }
+    
+    T_Val& operator[] (const T_Key& key) {
+        const size_t t = _tableFind(key);
+        // If the entry already exists, move it to the front of the list
+        if (_table[t] != _Nil) {
+            const _Idx idx = _table[t];
+            _listRemove(idx);
+            _listPushFront(idx);
+            return _slots[idx].lv.val;
+        }
+        
+        // Otherwise, create a new entry and evict entries if needed
+        const _Idx idx = _free;
+        assert(idx != _Nil);
+        _free = _slots[idx].next;
+        _slots[idx].lv.key = key;
+        _table[t] = idx;
+        _listPushFront(idx);
+        _size++;
+        _evictIfNeeded();
+        return _slots[idx].lv.val;
+    }
+    
+    _ListIter find(const T_Key& key) {
+        // Find entry
+        const _Idx idx = _table[_tableFind(key)];
+        if (idx == _Nil) return end();
+        // Move entry to front of list
+        _listRemove(idx);
+        _listPushFront(idx);
+        return _ListIter(this, idx);
+    }
+    
+    // peek(): like find(), but doesn't affect the recency order
+    _ListConstIter peek(const T_Key& key) const {
+        return _ListConstIter(this, _table[_tableFind(key)]);
+    }
+    
+    _ListIter begin() { return _ListIter(this, _head); }
+    _ListIter end() { return _ListIter(this, _Nil); }
+    _ListConstIter begin() const { return _ListConstIter(this, _head); }
+    _ListConstIter end() const { return _ListConstIter(this, _Nil); }
+    
+    const ListVal& front() const {
+        assert(_size);
+        return _slots[_head].lv;
+    }
+    
+    const ListVal& back() const {
+        assert(_size);
+        return _slots[_tail].lv;
+    }
+    
+    void evict() {
+        constexpr size_t LowWater = (T_Cap*4)/5;
+        static_assert(LowWater > 0);
+        // Evict until we get to our low-water mark (20% below our capacity)
+        while (_size > LowWater) {
+            _erase(_tail);
+        }
+    }
+    
+    void clear() {
+        while (_size) _erase(_tail);
+        std::fill(std::begin(_table), std::end(_table), _Nil);
+        // Thread every slot onto the free list
+        for (size_t i=0; i<T_Cap; i++) {
+            _slots[i].next = (i+1<T_Cap ? (_Idx)(i+1) : _Nil);
+        }
+        _free = 0;
+        _head = _Nil;
+        _tail = _Nil;
+    }
+    
+    size_t size() const {
+        return _size;
+    }
+    
+    void _evictIfNeeded() {
+        // Evict if we're above our capacity (T_Cap)
+        if (_size >= T_Cap) {
+            evict();
+        }
+    }
+    
+    // _tableFind(): returns the index of the hash table bucket that holds `key`,
+    // or the empty bucket where `key` would be inserted
+    size_t _tableFind(const T_Key& key) const {
+        size_t t = T_Hash{}(key) & _TableMask;
+        while (_table[t]!=_Nil && !(_slots[_table[t]].lv.key==key)) {
+            t = (t+1) & _TableMask;
+        }
+        return t;
+    }
+    
+    // _tableErase(): empties bucket `t`, and shifts subsequent entries in
+    // the same probe run backwards so that lookups don't need tombstones
+    void _tableErase(size_t t) {
+        size_t i = t;
+        for (;;) {
+            i = (i+1) & _TableMask;
+            if (_table[i] == _Nil) break;
+            const size_t home = T_Hash{}(_slots[_table[i]].lv.key) & _TableMask;
+            // Move the entry at `i` into the hole at `t` if its home bucket
+            // doesn't lie cyclically within (t,i]
+            if (((i-home) & _TableMask) >= ((i-t) & _TableMask)) {
+                _table[t] = _table[i];
+                t = i;
+            }
+        }
+        _table[t] = _Nil;
+    }
+    
+    void _erase(_Idx idx) {
+        _Slot& slot = _slots[idx];
+        _tableErase(_tableFind(slot.lv.key));
+        _listRemove(idx);
+        // Release the value's resources now, rather than when the slot is reused
+        slot.lv.val = {};
+        slot.next = _free;
+        _free = idx;
+        _size--;
+    }
+    
+    void _listRemove(_Idx idx) {
+        _Slot& slot = _slots[idx];
+        if (slot.prev != _Nil) _slots[slot.prev].next = slot.next;
+        else                   _head = slot.next;
+        if (slot.next != _Nil) _slots[slot.next].prev = slot.prev;
+        else                   _tail = slot.prev;
+    }
+    
+    void _listPushFront(_Idx idx) {
+        _Slot& slot = _slots[idx];
+        slot.prev = _Nil;
+        slot.next = _head;
+        if (_head != _Nil) _slots[_head].prev = idx;
+        else               _tail = idx;
+        _head = idx;
+    }
+    
+    struct _Slot {
+        ListVal lv = {};
+        _Idx prev = _Nil;
+        _Idx next = _Nil;
+    };
+    
+    // Hash table has at least 2x as many buckets as slots, to keep probe runs short
+    static constexpr size_t _TableCap = std::bit_ceil(2*T_Cap);
+    static constexpr size_t _TableMask = _TableCap-1;
+    
+    _Slot _slots[T_Cap];
+    _Idx _table[_TableCap];
+    _Idx _head = _Nil;
+    _Idx _tail = _Nil;
+    _Idx _free = _Nil;
+    size_t _size = 0;
+};
+
+// LRUCost:
+//   LRUCost is an LRU whose capacity is a runtime budget of 'cost' (eg bytes),
+//   rather than a compile-time entry count. Every entry has a cost, supplied
+//   either explicitly to set(), or computed by `T_CostFn` (a functor that
+//   returns the cost of a T_Val).
+//   
+//   When the total cost exceeds the budget, entries are evicted from the
+//   tail until the total is at or below the low-water mark (20% below the
+//   budget). The most-recently set entry is never evicted by its own
+//   insertion, even if its cost alone exceeds the budget.
+//   
+//   LRUCost also keeps hit/miss/eviction counters, to help size the budget.
+template<typename T_Key, typename T_Val, typename T_CostFn=void, typename T_Hash=LRUHash<T_Key>>
+struct LRUCost {
+    struct ListVal;
+    
+    using _List = std::list<ListVal>;
+    using _ListIter = typename _List::iterator;
+    using _ListConstIter = typename _List::const_iterator;
+    using _Map = FlatMap<T_Key,_ListIter,T_Hash>;
+    
+    struct ListVal {
+        T_Key key;
+        T_Val val;
+        size_t cost = 0;
+    };
+    
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t evictionsCost = 0;
+    };
+    
+    LRUCost(size_t budget) : _budget(budget) {}
+    
+    void erase(_ListConstIter it) {
+        const bool ok = _map.erase(it->key);
+        assert(ok);
+        _cost -= it->cost;
+        _list.erase(it);
+    }
+    
+    T_Val& set(const T_Key& key, T_Val val, size_t cost) {
+        const auto [it, init] = _map.try_emplace(key);
+        // If the entry already existed, move it to the front and update it
+        if (!init) {
+            _list.splice(_list.begin(), _list, it->second);
+            _cost -= it->second->cost;
+            it->second->val = std::move(val);
+            it->second->cost = cost;
+        
+        // Otherwise, create a new entry
+        } else {
+            _list.push_front({.key=key, .val=std::move(val), .cost=cost});
+            it->second = _list.begin();
+        }
+        _cost += cost;
+        _evictIfNeeded();
+        return _list.front().val;
+    }
+    
+    template<typename T_Fn=T_CostFn, typename=std::enable_if_t<!std::is_void_v<T_Fn>>>
+    T_Val& set(const T_Key& key, T_Val val) {
+        const size_t cost = T_Fn{}(std::as_const(val));
+        return set(key, std::move(val), cost);
+    }
+    
+    _ListIter find(const T_Key& key) {
+        // Find entry
+        auto it = _map.find(key);
+        if (it == _map.end()) {
+            _stats.misses++;
+            return _list.end();
+        }
+        _stats.hits++;
+        // Move entry to front of list
+        _list.splice(_list.begin(), _list, it->second);
+        return _list.begin();
+    }
+    
+    _ListConstIter begin() const { return _list.begin(); }
+    _ListConstIter end() const { return _list.end(); }
+    
+    const ListVal& front() const {
+        assert(!_list.empty());
+        return _list.front();
+    }
+    
+    const ListVal& back() const {
+        assert(!_list.empty());
+        return _list.back();
+    }
+    
+    void evict() {
+        const size_t lowWater = (_budget/5)*4;
+        // Evict until we get to our low-water mark (20% below our budget),
+        // but never evict the front entry (the one most recently set)
+        while (_cost>lowWater && _list.size()>1) {
+            const ListVal& lv = _list.back();
+            _stats.evictions++;
+            _stats.evictionsCost += lv.cost;
+            erase(std::prev(_list.end()));
+        }
+    }
+    
+    void clear() {
+        _map.clear();
+        _list.clear();
+        _cost = 0;
+    }
+    
+    size_t size() const { return _list.size(); }
+    size_t cost() const { return _cost; }
+    
+    size_t budget() const { return _budget; }
+    void budget(size_t x) {
+        _budget = x;
+        _evictIfNeeded();
+    }
+    
+    const Stats& stats() const { return _stats; }
+    void statsReset() { _stats = {}; }
+    
+    void _evictIfNeeded() {
+        // Evict if we're above our budget
+        if (_cost > _budget) {
+            evict();
+        }
+    }
+    
+    _Map _map;
+    _List _list;
+    size_t _budget = 0;
+    size_t _cost = 0;
+    Stats _stats;
+};
+
 } // namespace Toastbox
@@ -1,4 +1,6 @@
 #pragma once
+#import <algorithm>
+#import <type_traits>
 #import "Mat.h"
 
 namespace Toastbox {
@@ -24,8 +26,14 @@ namespace White {
 }
 
 namespace ColorSpace {
+    // Gamma: the transfer function applied to a colorspace's (linear) values
+    enum class Gamma : uint8_t {
+        None,
+        SRGB,
+    };
+    
     template<typename Space>
-    Mat<double,3,3> XYZFromRGBMatrix() {
+    Mat<double,3,3> _XYZFromRGBMatrix() {
         const double xr = Space::R[0];
         const double yr = Space::R[1];
         
@@ -62,9 +70,50 @@ namespace ColorSpace {
         return M;
     }
     
+    // XYZFromRGBMatrix() / RGBFromXYZMatrix(): computed once per colorspace,
+    // since they require a solve() / inv()
+    template<typename Space>
+    const Mat<double,3,3>& XYZFromRGBMatrix() {
+        static const Mat<double,3,3> M = _XYZFromRGBMatrix<Space>();
+        return M;
+    }
+    
     template<typename Space>
-    Mat<double,3,3> RGBFromXYZMatrix() {
-        return XYZFromRGBMatrix<Space>().inv();
+    const Mat<double,3,3>& RGBFromXYZMatrix() {
+        static const Mat<double,3,3> M = XYZFromRGBMatrix<Space>().inv();
+        return M;
+    }
+    
+    // ChromaticAdaptationMatrix(): Bradford chromatic adaptation from
+    // WhiteSrc to WhiteDst, computed once per white point pair
+    template<typename WhiteSrc, typename WhiteDst>
+    const Mat<double,3,3>& ChromaticAdaptationMatrix() {
+        static const Mat<double,3,3> M = [] {
+            // From http://www.brucelindbloom.com/index.html?Eqn_XYZ_to_xyY.html
+            const Mat<double,3,3> BradfordForward(
+                0.8951000,  0.2664000,  -0.1614000,
+                -0.7502000, 1.7135000,  0.0367000,
+                 0.0389000, -0.0685000, 1.0296000
+            );
+            
+            const Mat<double,3,3> BradfordReverse(
+                0.9869929,  -0.1470543, 0.1599627,
+                 0.4323053, 0.5183603,  0.0492912,
+                -0.0085287, 0.0400428,  0.9684867
+            );
+            
+            const Float3 S = BradfordForward*WhiteSrc::XYZ;
+            const Float3 D = BradfordForward*WhiteDst::XYZ;
+            
+            const Mat<double,3,3> K(
+                D[0]/S[0],  0.,         0.,
+                0.,         D[1]/S[1],  0.,
+                0.,         0.,         D[2]/S[2]
+            );
+            
+            return BradfordReverse*(K*BradfordForward);
+        }();
+        return M;
     }
     
     template<typename W>
@@ -94,6 +143,10 @@ namespace ColorSpace {
         static constexpr double B[] = {0.1500, 0.0600};
         using White = White::D65;
         
+        // The linear colorspace that we apply our gamma to
+        using Linear = LSRGB;
+        static constexpr ColorSpace::Gamma Gamma = ColorSpace::Gamma::SRGB;
+        
         static double GammaForward(double x) {
             // From http://www.brucelindbloom.com/index.html?Eqn_RGB_XYZ_Matrix.html
             if (x <= 0.0031308) return 12.92*x;
@@ -132,30 +185,7 @@ namespace ColorSpace {
     // Only enable if WhiteSrc!=WhiteDst, otherwise this will be ambiguous with Convert(X,X)
     typename std::enable_if<!std::is_same<WhiteSrc,WhiteDst>::value, bool>::type = false>
     Float3 Convert(XYZ<WhiteSrc>, XYZ<WhiteDst>, const Float3& c) {
-        // From http://www.brucelindbloom.com/index.html?Eqn_XYZ_to_xyY.html
-        const Mat<double,3,3> BradfordForward(
-            0.8951000,  0.2664000,  -0.1614000,
-            -0.7502000, 1.7135000,  0.0367000,
-             0.0389000, -0.0685000, 1.0296000
-        );
-        
-        const Mat<double,3,3> BradfordReverse(
-            0.9869929,  -0.1470543, 0.1599627,
-             0.4323053, 0.5183603,  0.0492912,
-            -0.0085287, 0.0400428,  0.9684867
-        );
-        
-        const Float3 S = BradfordForward*WhiteSrc::XYZ;
-        const Float3 D = BradfordForward*WhiteDst::XYZ;
-        
-        const Mat<double,3,3> K(
-            D[0]/S[0],  0.,         0.,
-            0.,         D[1]/S[1],  0.,
-            0.,         0.,         D[2]/S[2]
-        );
-        
-        const Mat<double,3,3> M = BradfordReverse*(K*BradfordForward);
-        return M*c;
+        return ChromaticAdaptationMatrix<WhiteSrc,WhiteDst>()*c;
     }
     
     // LSRGB<->XYZ
@@ -196,7 +226,7 @@ namespace ColorSpace {
     
     template<typename Src, typename Dst, typename = void>
     struct CanConvert : std::false_type {};
-
+    
     template<typename Src, typename Dst>
     struct CanConvert<Src, Dst, std::void_t<decltype(Convert(Src{}, Dst{}, {}))>> : std::true_type {};
 }
@@ -260,4 +290,150 @@ public:
     Float3 m;
 };
 
+namespace ColorSpace {
+    // Pixels: the channels of `count` pixels (see Transform::apply()), either
+    // planar (one buffer per channel) or interleaved (eg RGB or RGBA)
+    template<typename T>
+    struct Pixels {
+        T* ch[3] = {};
+        size_t stride = 1; // Distance between a channel's consecutive samples
+        
+        static Pixels Planar(T* c0, T* c1, T* c2) {
+            return { .ch = {c0, c1, c2}, .stride = 1 };
+        }
+        
+        static Pixels Interleaved(T* p, size_t samplesPerPixel=3) {
+            return { .ch = {p, p+1, p+2}, .stride = samplesPerPixel };
+        }
+    };
+    
+    // Transform: a colorspace conversion reduced to the form
+    //   gammaOut(m * gammaIn^-1(c))
+    // so that it can be applied to whole images in a single pass, either via
+    // apply() on the CPU, or Renderer::colorTransform() on the GPU.
+    struct Transform {
+        Gamma gammaIn = Gamma::None; // Removed from the source values first
+        Mat<double,3,3> m = Mat<double,3,3>(
+            1., 0., 0.,
+            0., 1., 0.,
+            0., 0., 1.
+        );
+        Gamma gammaOut = Gamma::None; // Applied to the destination values last
+        
+        // Make(): the Transform for Src->Dst, computed once per pair
+        template<typename Src, typename Dst>
+        static const Transform& Make() {
+            static const Transform T = [] {
+                using LinSrc = _Linear<Src>;
+                using LinDst = _Linear<Dst>;
+                // The conversion between the linear spaces is linear, so its
+                // matrix is the conversion of each basis vector
+                Transform t = {
+                    .gammaIn = _GammaFor<Src>(),
+                    .gammaOut = _GammaFor<Dst>(),
+                };
+                for (size_t x=0; x<3; x++) {
+                    Float3 e;
+                    e[x] = 1;
+                    const Color<LinDst> c = Color<LinSrc>(e);
+                    for (size_t y=0; y<3; y++) t.m.at(y,x) = c[y];
+                }
+                return t;
+            }();
+            return T;
+        }
+        
+        // Make(): the Transform for Raw->Dst, where `XYZFromRaw` (eg a
+        // camera's color matrix) converts Raw to XYZ<W>
+        template<typename W, typename Dst>
+        static Transform Make(const Mat<double,3,3>& XYZFromRaw) {
+            Transform t = Make<XYZ<W>,Dst>();
+            t.m = t.m*XYZFromRaw;
+            return t;
+        }
+        
+        // apply(): converts `count` pixels from `src` to `dst`, which may be
+        // the same buffers
+        template<typename T_Src>
+        void apply(Pixels<T_Src> src, Pixels<float> dst, size_t count) const {
+            static_assert(std::is_same_v<std::remove_const_t<T_Src>, float>);
+            // Process in blocks that fit in L1, so that each stage's output
+            // is still cached for the next stage
+            constexpr size_t BlockLen = 1024;
+            float c[3][BlockLen];
+            float r[3][BlockLen];
+            float tmp[BlockLen];
+            
+            float mf[3][3];
+            bool identity = true;
+            for (size_t y=0; y<3; y++) {
+                for (size_t x=0; x<3; x++) {
+                    mf[y][x] = (float)m.at(y,x);
+                    identity &= (mf[y][x] == (x==y ? 1.f : 0.f));
+                }
+            }
+            
+            for (size_t off=0; off<count; off+=BlockLen) {
+                const size_t n = std::min(BlockLen, count-off);
+                
+                for (size_t i=0; i<3; i++) {
+                    cblas_scopy((int)n, src.ch[i]+off*src.stride, (int)src.stride, c[i], 1);
+                    if (gammaIn == Gamma::SRGB) _SRGBGammaReverse(c[i], tmp, n);
+                }
+                
+                for (size_t i=0; i<3; i++) {
+                    float* ri = (identity ? c[i] : r[i]);
+                    if (!identity) {
+                        vDSP_vsmul(c[0], 1, &mf[i][0], ri, 1, n);
+                        vDSP_vsma(c[1], 1, &mf[i][1], ri, 1, ri, 1, n);
+                        vDSP_vsma(c[2], 1, &mf[i][2], ri, 1, ri, 1, n);
+                    }
+                    if (gammaOut == Gamma::SRGB) _SRGBGammaForward(ri, tmp, n);
+                    cblas_scopy((int)n, ri, 1, dst.ch[i]+off*dst.stride, (int)dst.stride);
+                }
+            }
+        }
+        
+    private:
+        template<typename Space, typename = void>
+        struct _LinearT { using Type = Space; };
+        
+        template<typename Space>
+        struct _LinearT<Space, std::void_t<typename Space::Linear>> { using Type = typename Space::Linear; };
+        
+        template<typename Space>
+        using _Linear = typename _LinearT<Space>::Type;
+        
+        template<typename Space>
+        static constexpr Gamma _GammaFor() {
+            if constexpr (std::is_same_v<_Linear<Space>, Space>) return Gamma::None;
+            else return Space::Gamma;
+        }
+        
+        // _SRGBGammaForward() / _SRGBGammaReverse(): vectorized equivalents of
+        // SRGB::GammaForward() / SRGB::GammaReverse(). Both branches are
+        // computed for every value, and the results selected.
+        static void _SRGBGammaForward(float* x, float* tmp, size_t n) {
+            const float e = 1/2.4;
+            const int ni = (int)n;
+            vvpowsf(tmp, &e, x, &ni);
+            for (size_t i=0; i<n; i++) {
+                x[i] = (x[i] <= 0.0031308f ? 12.92f*x[i] : 1.055f*tmp[i]-.055f);
+            }
+        }
+        
+        static void _SRGBGammaReverse(float* x, float* tmp, size_t n) {
+            const float a = 1/1.055;
+            const float b = .055/1.055;
+            const float e = 2.4;
+            const int ni = (int)n;
+            vDSP_vsmsa(x, 1, &a, &b, tmp, 1, n);
+            vvpowsf(tmp, &e, tmp, &ni);
+            for (size_t i=0; i<n; i++) {
+                x[i] = (x[i] <= 0.04045f ? x[i]/12.92f : tmp[i]);
+            }
+        }
+    };
+}
+
 } // namespace Toastbox
@@ -0,0 +1,339 @@
+#pragma once
+#import <new>
+#import <memory>
+#import <algorithm>
+#import <stdexcept>
+#import <cassert>
+#import "Mat.h"
+
+namespace Toastbox {
+
+// MatArena: bump allocator for per-frame DynMat temporaries
+//
+// Allocations are 64-byte aligned and are never freed individually; instead
+// reset() reclaims everything at once (eg at the end of a frame). Every DynMat
+// allocated from the arena must be destroyed (or not used again) before
+// reset(). When the arena is full, DynMat falls back to the heap.
+class MatArena {
+public:
+    static constexpr size_t Align = 64;
+    
+    MatArena(size_t cap) : _cap(_Ceil(cap)) {
+        _mem = (uint8_t*)::operator new(_cap, std::align_val_t(Align));
+    }
+    
+    // Copy/move: deleted, since DynMats reference us
+    MatArena(const MatArena& x) = delete;
+    MatArena& operator=(const MatArena& x) = delete;
+    
+    ~MatArena() {
+        ::operator delete(_mem, std::align_val_t(Align));
+    }
+    
+    // alloc(): returns nullptr if the arena doesn't have `len` bytes available
+    void* alloc(size_t len) {
+        len = _Ceil(len);
+        if (len > _cap-_off) return nullptr;
+        void* r = _mem+_off;
+        _off += len;
+        return r;
+    }
+    
+    void reset() { _off = 0; }
+    size_t used() const { return _off; }
+    size_t cap() const { return _cap; }
+    
+private:
+    static size_t _Ceil(size_t x) { return (x+Align-1) & ~(Align-1); }
+    
+    uint8_t* _mem = nullptr;
+    size_t _cap = 0;
+    size_t _off = 0;
+};
+
+// DynMat: runtime-sized, heap-backed (or arena-backed) counterpart to Mat,
+// for matrices too large for Mat's compile-time sizing (eg full sensor
+// frames). Values are column-major, like Mat, and share Mat's BLAS/vDSP
+// kernels (MatKernel).
+//
+// Moves are O(1), and storage is 64-byte aligned.
+//
+// Storage comes from an arena only when one is passed explicitly, or for the
+// results of arithmetic on an arena-backed DynMat (which are temporaries by
+// nature). Copies always go to the heap unless given an arena, so that
+// `DynMat keep = frameTemp;` survives MatArena::reset().
+template<typename T>
+class DynMat {
+public:
+    static_assert(std::is_trivially_destructible_v<T>);
+    static constexpr size_t Align = MatArena::Align;
+    
+    DynMat() {}
+    
+    // Zero-initialized h x w matrix, allocated from `arena` if supplied and
+    // non-full, otherwise from the heap
+    DynMat(size_t h, size_t w, MatArena* arena=nullptr) : DynMat(_Uninit{}, h, w, arena) {
+        std::uninitialized_fill_n(_vals, count(), T{});
+    }
+    
+    // Disambiguates DynMat(h, w, nullptr) between the `arena` and `v` overloads
+    DynMat(size_t h, size_t w, std::nullptr_t) : DynMat(h, w, (MatArena*)nullptr) {}
+    
+    // Load from column-major array
+    DynMat(size_t h, size_t w, const T v[], MatArena* arena=nullptr) : DynMat(_Uninit{}, h, w, arena) {
+        std::uninitialized_copy_n(v, count(), _vals);
+    }
+    
+    // Load from Mat
+    template<size_t H, size_t W>
+    DynMat(const Mat<T,H,W>& x, MatArena* arena=nullptr) : DynMat(H, W, x.begin(), arena) {}
+    
+    // Copy constructor: allocates from the heap, not the source's arena, so
+    // the copy outlives the arena's reset()
+    DynMat(const DynMat& x) : DynMat(x, nullptr) {}
+    // Copy into `arena` (or the heap, if null)
+    DynMat(const DynMat& x, MatArena* arena) : DynMat(x._h, x._w, x._vals, arena) {}
+    // Copy assignment operator: reuses our storage if the dimensions match
+    DynMat& operator=(const DynMat& x) {
+        if (this == &x) return *this;
+        if (_h==x._h && _w==x._w) std::copy(x.begin(), x.end(), begin());
+        else *this = DynMat(x);
+        return *this;
+    }
+    
+    // Move: O(1), and the source is left empty (0x0)
+    DynMat(DynMat&& x) { _swap(x); }
+    DynMat& operator=(DynMat&& x) {
+        // Move via a temporary, so that our previous storage is released
+        // rather than handed to `x`
+        DynMat tmp(std::move(x));
+        _swap(tmp);
+        return *this;
+    }
+    
+    ~DynMat() {
+        if (_heap) ::operator delete(_vals, std::align_val_t(Align));
+    }
+    
+    size_t h() const { return _h; }
+    size_t w() const { return _w; }
+    size_t count() const { return _h*_w; }
+    
+    // Convert to Mat
+    template<size_t H, size_t W>
+    Mat<T,H,W> mat() const {
+        _CheckDims(H, W, _h, _w);
+        Mat<T,H,W> r;
+        std::copy(begin(), end(), r.begin());
+        return r;
+    }
+    
+    // Transpose
+    DynMat trans() const {
+        DynMat r(_Uninit{}, _w, _h, _arena);
+        for (size_t y=0; y<_h; y++) {
+            for (size_t x=0; x<_w; x++) {
+                r.at(x,y) = at(y,x);
+            }
+        }
+        return r;
+    }
+    
+    // Multiply
+    DynMat operator*(const DynMat& x) const {
+        DynMat r(_Uninit{}, _h, x._w, _arena);
+        r.gemm(*this, x);
+        return r;
+    }
+    
+    // gemm(): fused matrix multiply-add, evaluated in place:
+    //   *this = alpha*(a*b) + beta*(*this)
+    // Like BLAS, if beta==0, our existing contents are ignored.
+    DynMat& gemm(const DynMat& a, const DynMat& b, T alpha=1, T beta=0) {
+        assert(this!=&a && this!=&b);
+        _CheckDims(_h, _w, a._h, b._w);
+        if (a._w != b._h) throw std::runtime_error("matrix dimensions mismatch");
+        MatKernel<T>::Gemm(_h, _w, a._w, alpha, a._vals, b._vals, beta, _vals);
+        return *this;
+    }
+    
+    // axpby(): fused scale-add, evaluated in place:
+    //   *this = a*x + b*(*this)
+    DynMat& axpby(T a, const DynMat& x, T b) {
+        _CheckDims(_h, _w, x._h, x._w);
+        MatKernel<T>::Axpby(count(), a, x._vals, b, _vals);
+        return *this;
+    }
+    
+    // Element-wise multiply
+    DynMat elmMul(const DynMat& x) const& {
+        DynMat r(*this, _arena);
+        r.elmMulEq(x);
+        return r;
+    }
+    
+    // Rvalue overloads operate in place on the temporary, like Mat's
+    DynMat elmMul(const DynMat& x) && {
+        elmMulEq(x);
+        return std::move(*this);
+    }
+    
+    // Element-wise multiply-assign
+    DynMat& elmMulEq(const DynMat& x) {
+        _CheckDims(_h, _w, x._h, x._w);
+        MatKernel<T>::ElmMul(count(), x._vals, _vals);
+        return *this;
+    }
+    
+    // Scalar multiply
+    DynMat operator*(const T& x) const& { DynMat r(*this, _arena); r *= x; return r; }
+    DynMat operator*(const T& x) && { *this *= x; return std::move(*this); }
+    DynMat& operator*=(const T& x) {
+        MatKernel<T>::Scale(count(), x, _vals);
+        return *this;
+    }
+    
+    // Element-wise divide
+    DynMat operator/(const DynMat& x) const& { DynMat r(*this, _arena); r /= x; return r; }
+    DynMat operator/(const DynMat& x) && { *this /= x; return std::move(*this); }
+    DynMat& operator/=(const DynMat& x) {
+        _CheckDims(_h, _w, x._h, x._w);
+        MatKernel<T>::ElmDiv(count(), x._vals, _vals);
+        return *this;
+    }
+    
+    // Scalar divide
+    DynMat operator/(const T& x) const& { DynMat r(*this, _arena); r /= x; return r; }
+    DynMat operator/(const T& x) && { *this /= x; return std::move(*this); }
+    DynMat& operator/=(const T& x) {
+        MatKernel<T>::Scale(count(), T(1)/x, _vals);
+        return *this;
+    }
+    
+    // Element-wise add
+    DynMat operator+(const DynMat& x) const& { DynMat r(*this, _arena); r += x; return r; }
+    DynMat operator+(const DynMat& x) && { *this += x; return std::move(*this); }
+    DynMat& operator+=(const DynMat& x) { return axpby(1, x, 1); }
+    
+    // Scalar add
+    DynMat operator+(const T& x) const& { DynMat r(*this, _arena); r += x; return r; }
+    DynMat operator+(const T& x) && { *this += x; return std::move(*this); }
+    DynMat& operator+=(const T& x) {
+        for (T& v : *this) v += x;
+        return *this;
+    }
+    
+    // Element-wise subtract: *this - x, like Mat
+    DynMat operator-(const DynMat& x) const& { DynMat r(*this, _arena); r -= x; return r; }
+    DynMat operator-(const DynMat& x) && { *this -= x; return std::move(*this); }
+    DynMat& operator-=(const DynMat& x) { return axpby(-1, x, 1); }
+    
+    // Scalar subtract
+    DynMat operator-(const T& x) const& { DynMat r(*this, _arena); r -= x; return r; }
+    DynMat operator-(const T& x) && { *this -= x; return std::move(*this); }
+    DynMat& operator-=(const T& x) {
+        for (T& v : *this) v -= x;
+        return *this;
+    }
+    
+    T& operator[](size_t i) {
+        assert(i < count());
+        return _vals[i];
+    }
+    
+    const T& operator[](size_t i) const {
+        assert(i < count());
+        return _vals[i];
+    }
+    
+    T& at(size_t y, size_t x) {
+        assert(y < _h);
+        assert(x < _w);
+        return _vals[x*_h+y]; // `vals` is in column-major format
+    }
+    
+    const T& at(size_t y, size_t x) const {
+        assert(y < _h);
+        assert(x < _w);
+        return _vals[x*_h+y]; // `vals` is in column-major format
+    }
+    
+    T* col(size_t x) {
+        assert(x < _w);
+        return &_vals[x*_h];
+    }
+    
+    const T* col(size_t x) const {
+        assert(x < _w);
+        return &_vals[x*_h];
+    }
+    
+    T sum() const {
+        T r{};
+        for (const T& x : *this) r += x;
+        return r;
+    }
+    
+    std::string str(int precision=6) const {
+        std::stringstream ss;
+        ss.precision(precision);
+        ss << "[ ";
+        for (size_t y=0; y<_h; y++) {
+            for (size_t x=0; x<_w; x++) {
+                ss << at(y,x);
+                if (x != _w-1) ss << " ";
+            }
+            if (y != _h-1) ss << " ;" << "\n";
+        }
+        ss << " ]";
+        return ss.str();
+    }
+    
+    void print(int precision=6) const {
+        std::cout << str(precision) << "\n";
+    }
+    
+    friend auto operator<<(std::ostream& s, DynMat const& x) -> std::ostream& {
+        return s << x.str();
+    }
+    
+    // Iteration
+    T* begin()              { return _vals;             }
+    const T* begin() const  { return _vals;             }
+    T* end()                { return _vals+count();     }
+    const T* end() const    { return _vals+count();     }
+    
+private:
+    struct _Uninit {};
+    
+    // Uninitialized h x w matrix
+    DynMat(_Uninit, size_t h, size_t w, MatArena* arena) : _h(h), _w(w), _arena(arena) {
+        const size_t len = count()*sizeof(T);
+        if (!len) return;
+        if (_arena) _vals = (T*)_arena->alloc(len);
+        if (!_vals) {
+            _vals = (T*)::operator new(len, std::align_val_t(Align));
+            _heap = true;
+        }
+    }
+    
+    static void _CheckDims(size_t ah, size_t aw, size_t bh, size_t bw) {
+        if (ah!=bh || aw!=bw) throw std::runtime_error("matrix dimensions mismatch");
+    }
+    
+    void _swap(DynMat& x) {
+        std::swap(_vals, x._vals);
+        std::swap(_h, x._h);
+        std::swap(_w, x._w);
+        std::swap(_arena, x._arena);
+        std::swap(_heap, x._heap);
+    }
+    
+    T* _vals = nullptr;
+    size_t _h = 0;
+    size_t _w = 0;
+    MatArena* _arena = nullptr;
+    bool _heap = false; // Whether we own `_vals` (allocated from the heap)
+};
+
+} // namespace Toastbox
@@ -4,6 +4,7 @@
 namespace std = metal;
 #else
 #include <algorithm>
+#include <vector>
 #endif
 
 #ifdef __METAL_VERSION__
@@ -51,34 +52,49 @@ public:
         int32_t bottom  = 0;
     };
     
+    // CellInstance: per-instance data for drawing a cell (see
+    // Renderer::gridInstances())
+    struct CellInstance {
+        Rect rect;
+        int32_t index = 0;
+    };
+    
+    // Setters only invalidate the computed values that depend on what
+    // changed: the column values (columnCount) depend on the horizontal
+    // geometry, and the row values (everything else) depend on the column
+    // values, the vertical geometry, and elementCount.
+    
     CONSTANT BorderSize& borderSize() CONSTANT { return _borderSize; }
     void setBorderSize(CONSTANT BorderSize& x) {
+        if (x.left!=_borderSize.left || x.right!=_borderSize.right) _invalidateColumns();
+        if (x.top!=_borderSize.top || x.bottom!=_borderSize.bottom) _invalidateRows();
         _borderSize = x;
-        _computed.valid = false;
     }
     
     CONSTANT Size& cellSize() CONSTANT { return _cellSize; }
     void setCellSize(CONSTANT Size& x) {
+        if (x.x != _cellSize.x) _invalidateColumns();
+        if (x.y != _cellSize.y) _invalidateRows();
         _cellSize = x;
-        _computed.valid = false;
     }
     
     CONSTANT Size& cellSpacing() CONSTANT { return _cellSpacing; }
     void setCellSpacing(CONSTANT Size& x) {
+        if (x.x != _cellSpacing.x) _invalidateColumns();
+        if (x.y != _cellSpacing.y) _invalidateRows();
         _cellSpacing = x;
-        _computed.valid = false;
     }
     
     int32_t containerWidth() CONSTANT { return _containerWidth; }
     void setContainerWidth(int32_t x) {
+        if (x != _containerWidth) _invalidateColumns();
         _containerWidth = x;
-        _computed.valid = false;
     }
     
     int32_t elementCount() CONSTANT { return _elementCount; }
     void setElementCount(int32_t x) {
+        if (x != _elementCount) _invalidateRows();
         _elementCount = x;
-        _computed.valid = false;
     }
     
     int32_t columnCount()     CONSTANT_IF_METAL { recompute(); return _computed.columnCount; }
@@ -88,12 +104,12 @@ public:
     
     void recompute() CONSTANT_IF_METAL {
 #ifdef __METAL_VERSION__
-        assert(_computed.valid);
+        assert(_computed.columnsValid && _computed.rowsValid);
 #else
-        if (_computed.valid) return;
+        if (_computed.columnsValid && _computed.rowsValid) return;
         
         // Compute .columnCount
-        {
+        if (!_computed.columnsValid) {
             const int32_t usableWidth = std::max((int32_t)0, _containerWidth-_borderSize.left-_borderSize.right);
             _computed.columnCount = std::max((int32_t)1, usableWidth / (_cellSize.x + _cellSpacing.x));
             
@@ -104,6 +120,8 @@ public:
             if ((minUsedWidth + _cellSize.x + _cellSpacing.x) <= usableWidth) {
                 _computed.columnCount++;
             }
+            
+            _computed.columnsValid = true;
         }
         
         // Compute .rowCount
@@ -126,7 +144,7 @@ public:
             }
         }
         
-        _computed.valid = true;
+        _computed.rowsValid = true;
 #endif
     }
     
@@ -214,6 +232,51 @@ public:
         return IndexRange{start, end-start+1};
     }
     
+#ifndef __METAL_VERSION__
+    // indexRangeForRect(): equivalent to indexRangeForIndexRect(indexRectForRect(rect))
+    IndexRange indexRangeForRect(Rect rect) {
+        const IndexRect indexRect = indexRectForRect(rect);
+        return indexRangeForIndexRect(indexRect);
+    }
+    
+    // rectsForIndexRange(): writes the rects of the cells in `range` to `rects`
+    // (which must have room for range.count rects). Equivalent to calling
+    // rectForCellIndex() for each cell, but steps from cell to cell instead
+    // of dividing for each.
+    void rectsForIndexRange(IndexRange range, Rect* rects) {
+        if (range.count <= 0) return;
+        recompute();
+        
+        const int32_t stepX = _cellSize.x + _cellSpacing.x;
+        const int32_t stepY = _cellSize.y + _cellSpacing.y;
+        const int32_t x0 = _borderSize.left + _computed.extraBorderX;
+        const Rect first = rectForCellIndex(range.start);
+        
+        int32_t xIndex = range.start % _computed.columnCount;
+        Point p = first.point;
+        for (int32_t i=0; i<range.count; i++) {
+            rects[i] = Rect{ .point = p, .size = _cellSize };
+            if (++xIndex == _computed.columnCount) {
+                xIndex = 0;
+                p.x = x0;
+                p.y += stepY;
+            } else {
+                p.x += stepX;
+            }
+        }
+    }
+    
+    // visibleCells(): returns the range of cells that intersect `rect` (eg a
+    // scroll view's visible rect), and stores their rects in `rects`. Reusing
+    // `rects` across calls avoids reallocating it.
+    IndexRange visibleCells(Rect rect, std::vector<Rect>& rects) {
+        const IndexRange range = indexRangeForRect(rect);
+        rects.resize(range.count);
+        rectsForIndexRange(range, rects.data());
+        return range;
+    }
+#endif
+    
 private:
     template <typename T>
     static bool _InRange(T x, T lo, T hi) {
@@ -225,6 +288,17 @@ private:
         return x>=lo && x<hi;
     }
     
+    // The row values depend on the column values, so invalidating the columns
+    // invalidates the rows too
+    void _invalidateColumns() {
+        _computed.columnsValid = false;
+        _computed.rowsValid = false;
+    }
+    
+    void _invalidateRows() {
+        _computed.rowsValid = false;
+    }
+    
     static int32_t _DivFloor(int32_t num, int32_t denom) {
         if (num >= 0) {
             return num/denom;
@@ -241,7 +315,8 @@ private:
     
     // Computed properties
     struct {
-        bool valid = false;
+        bool columnsValid = false;
+        bool rowsValid = false;
         int32_t columnCount     = 0;
         int32_t rowCount        = 0;
         int32_t containerHeight = 0;
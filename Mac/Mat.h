@@ -2,9 +2,139 @@
 #import <Accelerate/Accelerate.h>
 #import <type_traits>
 #import <iostream>
+#import <atomic>
+#import <mutex>
+#import <vector>
+#import <memory>
 
 namespace Toastbox {
 
+// FFTSetupCache: a process-wide cache of vDSP FFT setups (by log2 size),
+// plus a per-thread scratch buffer, used by Mat::fft()/ifft(). Setups are
+// created on first use and live for the life of the process; they're
+// read-only once created, so they're used concurrently from any thread.
+template<typename Float>
+class FFTSetupCache {
+public:
+    using Setup = std::conditional_t<std::is_same_v<Float,float>, ::FFTSetup, ::FFTSetupD>;
+    
+    static Setup Get(size_t log2n) {
+        assert(log2n < _SetupCount);
+        std::atomic<Setup>& setup = _Setups()[log2n];
+        Setup s = setup.load(std::memory_order_acquire);
+        if (s) return s;
+        
+        auto lock = std::unique_lock(_Lock());
+        s = setup.load(std::memory_order_relaxed);
+        if (s) return s;
+        
+        if constexpr (std::is_same_v<Float,float>) {
+            s = vDSP_create_fftsetup(log2n, kFFTRadix2);
+        } else {
+            s = vDSP_create_fftsetupD(log2n, kFFTRadix2);
+        }
+        if (!s) throw std::runtime_error("vDSP_create_fftsetup failed");
+        setup.store(s, std::memory_order_release);
+        return s;
+    }
+    
+    // Scratch(): returns this thread's scratch buffer, with room for at
+    // least `len` elements. The buffer is reused by subsequent calls.
+    static Float* Scratch(size_t len) {
+        thread_local std::vector<Float> scratch;
+        if (scratch.size() < len) scratch.resize(len);
+        return scratch.data();
+    }
+    
+private:
+    static constexpr size_t _SetupCount = 32;
+    
+    static std::atomic<Setup>* _Setups() {
+        static std::atomic<Setup> setups[_SetupCount] = {};
+        return setups;
+    }
+    
+    static std::mutex& _Lock() {
+        static std::mutex lock;
+        return lock;
+    }
+};
+
+// MatKernel: the BLAS/vDSP kernels behind Mat's (and DynMat's) arithmetic,
+// operating on column-major arrays
+template<typename T>
+struct MatKernel {
+    // Gemm(): r = alpha*(a*b) + beta*r, where `a` is h x k and `b` is k x w
+    static void Gemm(size_t h, size_t w, size_t k, T alpha, const T* a, const T* b, T beta, T* r) {
+        if constexpr (std::is_same_v<T, float>) {
+            cblas_sgemm(CblasColMajor, CblasNoTrans, CblasNoTrans,
+                (int)h, (int)w, (int)k, alpha, a, (int)h, b, (int)k, beta, r, (int)h);
+        } else if constexpr (std::is_same_v<T, double>) {
+            cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans,
+                (int)h, (int)w, (int)k, alpha, a, (int)h, b, (int)k, beta, r, (int)h);
+        } else {
+            static_assert(_AlwaysFalse<T>);
+        }
+    }
+    
+    // Axpby(): y = a*x + b*y
+    static void Axpby(size_t n, T a, const T* x, T b, T* y) {
+        if constexpr (std::is_same_v<T, float>) {
+            catlas_saxpby((int)n, a, x, 1, b, y, 1);
+        } else if constexpr (std::is_same_v<T, double>) {
+            catlas_daxpby((int)n, a, x, 1, b, y, 1);
+        } else if constexpr (std::is_same_v<T, std::complex<float>>) {
+            catlas_caxpby((int)n, &a, x, 1, &b, y, 1);
+        } else if constexpr (std::is_same_v<T, std::complex<double>>) {
+            catlas_zaxpby((int)n, &a, x, 1, &b, y, 1);
+        } else {
+            static_assert(_AlwaysFalse<T>);
+        }
+    }
+    
+    // Scale(): x *= a
+    static void Scale(size_t n, T a, T* x) {
+        if constexpr (std::is_same_v<T, float>) {
+            cblas_sscal((int)n, a, x, 1);
+        } else if constexpr (std::is_same_v<T, double>) {
+            cblas_dscal((int)n, a, x, 1);
+        } else if constexpr (std::is_same_v<T, std::complex<float>>) {
+            cblas_cscal((int)n, &a, x, 1);
+        } else if constexpr (std::is_same_v<T, std::complex<double>>) {
+            cblas_zscal((int)n, &a, x, 1);
+        } else {
+            static_assert(_AlwaysFalse<T>);
+        }
+    }
+    
+    // ElmMul(): y *= x, element-wise
+    static void ElmMul(size_t n, const T* x, T* y) {
+        // There's no BLAS function to do element-wise vector multiplication, so use vDSP
+        if constexpr (std::is_same_v<T, float>) {
+            vDSP_vmul(y, 1, x, 1, y, 1, n);
+        } else if constexpr (std::is_same_v<T, double>) {
+            vDSP_vmulD(y, 1, x, 1, y, 1, n);
+        } else {
+            for (size_t i=0; i<n; i++) y[i] *= x[i];
+        }
+    }
+    
+    // ElmDiv(): y /= x, element-wise
+    static void ElmDiv(size_t n, const T* x, T* y) {
+        // There's no BLAS function to do element-wise vector division, so use vDSP.
+        // Note that vDSP_vdiv() divides its second argument by its first.
+        if constexpr (std::is_same_v<T, float>) {
+            vDSP_vdiv(x, 1, y, 1, y, 1, n);
+        } else if constexpr (std::is_same_v<T, double>) {
+            vDSP_vdivD(x, 1, y, 1, y, 1, n);
+        } else {
+            for (size_t i=0; i<n; i++) y[i] /= x[i];
+        }
+    }
+    
+    template<class...> static constexpr std::false_type _AlwaysFalse;
+};
+
 template<typename T, size_t H, size_t W>
 class Mat {
 public:
@@ -83,6 +213,11 @@ public:
     Mat<T,H,W> inv() const {
         static_assert(H==W, "not a square matrix");
         
+        // Small matrices: closed-form inverse, avoiding LAPACK's overhead
+        if constexpr (_Small && H<=4) {
+            return _InvSmall(*this);
+        }
+        
         Mat<T,H,H> r = *this;
         __CLPK_integer m = H;
         __CLPK_integer err = 0;
@@ -111,208 +246,201 @@ public:
     // Matrix multiply
     template<size_t N>
     Mat<T,H,N> operator*(const Mat<T,W,N>& b) const {
-        const auto& a = *this;
         Mat<T,H,N> r;
-        if constexpr (std::is_same_v<T, float>)
-            cblas_sgemm(
-                CblasColMajor, CblasNoTrans, CblasNoTrans,
-                (int)a.Rows, (int)b.Cols, (int)a.Cols,
-                1, // alpha
-                a._vals(), (int)a.Rows,
-                b._vals(), (int)b.Rows,
-                0, // beta
-                r._vals(), (int)r.Rows
-            );
-        else if constexpr (std::is_same_v<T, double>)
-            cblas_dgemm(
-                CblasColMajor, CblasNoTrans, CblasNoTrans,
-                (int)a.Rows, (int)b.Cols, (int)a.Cols,
-                1, // alpha
-                a._vals(), (int)a.Rows,
-                b._vals(), (int)b.Rows,
-                0, // beta
-                r._vals(), (int)r.Rows
-            );
-        else
-            static_assert(_AlwaysFalse<T>);
+        r.gemm(*this, b);
+        return r;
+    }
+    
+    // gemm(): fused matrix multiply-add, evaluated in place:
+    //   *this = alpha*(a*b) + beta*(*this)
+    // Like BLAS, if beta==0, our existing contents are ignored (so they can
+    // be uninitialized).
+    template<size_t K>
+    Mat<T,H,W>& gemm(const Mat<T,H,K>& a, const Mat<T,K,W>& b, T alpha=1, T beta=0) {
+        Mat<T,H,W>& r = *this;
+        assert((const void*)&r!=(const void*)&a && (const void*)&r!=(const void*)&b);
+        // Small matrices: multiply directly, since BLAS' per-call overhead
+        // dwarfs the arithmetic. The loops have constant bounds, so they're
+        // fully unrolled and vectorized.
+        if constexpr (_Small && K<=_SmallDimMax) {
+            for (size_t x=0; x<W; x++) {
+                for (size_t y=0; y<H; y++) {
+                    T s = 0;
+                    for (size_t i=0; i<K; i++) s += a.at(y,i)*b.at(i,x);
+                    r.at(y,x) = alpha*s + (beta==0 ? T(0) : beta*r.at(y,x));
+                }
+            }
+        } else {
+            MatKernel<T>::Gemm(H, W, K, alpha, a._vals(), b._vals(), beta, r._vals());
+        }
+        return r;
+    }
+    
+    // axpby(): fused scale-add, evaluated in place:
+    //   *this = a*x + b*(*this)
+    Mat<T,H,W>& axpby(T a, const Mat<T,H,W>& x, T b) {
+        Mat<T,H,W>& r = *this;
+        if constexpr (_Small) {
+            for (size_t i=0; i<Count; i++) r._vals()[i] = a*x._vals()[i] + b*r._vals()[i];
+        } else {
+            MatKernel<T>::Axpby(Count, a, x._vals(), b, r._vals());
+        }
         return r;
     }
     
     // Element-wise multiply
-    Mat<T,H,W> elmMul(const Mat<T,H,W>& x) const {
+    Mat<T,H,W> elmMul(const Mat<T,H,W>& x) const& {
         Mat<T,H,W> r = *this;
-        // There's apparently no BLAS function to do element-wise vector multiplication
-        for (size_t i=0; i<Count; i++) {
-            r._vals()[i] *= x._vals()[i];
-        }
+        r.elmMulEq(x);
         return r;
     }
     
+    // Rvalue overloads (of elmMul() and the arithmetic operators) operate in
+    // place on the temporary instead of copying it, so a chained expression
+    // like `(A*x + b) / c` reuses one temporary rather than creating one per
+    // operation
+    Mat<T,H,W> elmMul(const Mat<T,H,W>& x) && {
+        elmMulEq(x);
+        return std::move(*this);
+    }
+    
     // Element-wise multiply-assign
     Mat<T,H,W>& elmMulEq(const Mat<T,H,W>& x) {
         Mat<T,H,W>& r = *this;
-        // There's apparently no BLAS function to do element-wise vector multiplication
-        for (size_t i=0; i<Count; i++) {
-            r._vals()[i] *= x._vals()[i];
+        if constexpr (_Small) {
+            for (size_t i=0; i<Count; i++) r._vals()[i] *= x._vals()[i];
+        } else {
+            MatKernel<T>::ElmMul(Count, x._vals(), r._vals());
         }
         return r;
     }
     
     // Scalar multiply
-    Mat<T,H,W> operator*(const T& x) const {
+    Mat<T,H,W> operator*(const T& x) const& {
         Mat<T,H,W> r = *this;
-        if constexpr (std::is_same_v<T, float>)
-            cblas_sscal(Count, x, r._vals(), 1);
-        else if constexpr (std::is_same_v<T, double>)
-            cblas_dscal(Count, x, r._vals(), 1);
-        else
-            static_assert(_AlwaysFalse<T>);
+        r *= x;
         return r;
     }
     
+    Mat<T,H,W> operator*(const T& x) && {
+        *this *= x;
+        return std::move(*this);
+    }
+    
+    // Scalar multiply-assign
+    Mat<T,H,W>& operator*=(const T& x) {
+        MatKernel<T>::Scale(Count, x, _vals());
+        return *this;
+    }
+    
     // Element-wise divide
-    Mat<T,H,W> operator/(const Mat<T,H,W>& x) const {
+    Mat<T,H,W> operator/(const Mat<T,H,W>& x) const& {
         Mat<T,H,W> r = *this;
-        // There's apparently no BLAS function to do element-wise vector division
-        for (size_t i=0; i<Count; i++) {
-            r._vals()[i] /= x._vals()[i];
-        }
+        r /= x;
         return r;
     }
     
+    Mat<T,H,W> operator/(const Mat<T,H,W>& x) && {
+        *this /= x;
+        return std::move(*this);
+    }
+    
     // Element-wise divide-assign
-    Mat<T,H,W> operator/=(const Mat<T,H,W>& x) {
+    Mat<T,H,W>& operator/=(const Mat<T,H,W>& x) {
         Mat<T,H,W>& r = *this;
-        // There's apparently no BLAS function to do element-wise vector division
-        for (size_t i=0; i<Count; i++) {
-            r._vals()[i] /= x._vals()[i];
+        if constexpr (_Small) {
+            for (size_t i=0; i<Count; i++) r._vals()[i] /= x._vals()[i];
+        } else {
+            MatKernel<T>::ElmDiv(Count, x._vals(), r._vals());
         }
         return r;
     }
     
     // Scalar divide
-    Mat<T,H,W> operator/(const T& x) const {
+    Mat<T,H,W> operator/(const T& x) const& {
         Mat<T,H,W> r = *this;
-        if constexpr (std::is_same_v<T, float>) {
-            cblas_sscal(Count, T(1)/x, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, double>) {
-            cblas_dscal(Count, T(1)/x, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, std::complex<float>>) {
-            const std::complex<float> k(T(1)/x);
-            cblas_cscal(Count, &k, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, std::complex<double>>) {
-            const std::complex<double> k(T(1)/x);
-            cblas_zscal(Count, &k, r._vals(), 1);
-        } else {
-            static_assert(_AlwaysFalse<T>);
-        }
+        r /= x;
         return r;
     }
     
+    Mat<T,H,W> operator/(const T& x) && {
+        *this /= x;
+        return std::move(*this);
+    }
+    
     // Scalar divide-assign
     Mat<T,H,W>& operator/=(const T& x) {
-        Mat<T,H,W>& r = *this;
-        if constexpr (std::is_same_v<T, float>) {
-            cblas_sscal(Count, T(1)/x, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, double>) {
-            cblas_dscal(Count, T(1)/x, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, std::complex<float>>) {
-            const std::complex<float> k(T(1)/x);
-            cblas_cscal(Count, &k, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, std::complex<double>>) {
-            const std::complex<double> k(T(1)/x);
-            cblas_zscal(Count, &k, r._vals(), 1);
-        } else {
-            static_assert(_AlwaysFalse<T>);
-        }
-        return r;
+        MatKernel<T>::Scale(Count, T(1)/x, _vals());
+        return *this;
     }
     
     // Element-wise add
-    Mat<T,H,W> operator+(const Mat<T,H,W>& x) const {
+    Mat<T,H,W> operator+(const Mat<T,H,W>& x) const& {
         Mat<T,H,W> r = *this;
-        if constexpr (std::is_same_v<T, float>) {
-            catlas_saxpby(Count, 1, x._vals(), 1, 1, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, double>) {
-            catlas_daxpby(Count, 1, x._vals(), 1, 1, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, std::complex<float>>) {
-            const std::complex<float> one(1);
-            catlas_caxpby(Count, &one, x._vals(), 1, &one, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, std::complex<double>>) {
-            const std::complex<double> one(1);
-            catlas_zaxpby(Count, &one, x._vals(), 1, &one, r._vals(), 1);
-        } else {
-            static_assert(_AlwaysFalse<T>);
-        }
+        r += x;
         return r;
     }
     
+    Mat<T,H,W> operator+(const Mat<T,H,W>& x) && {
+        *this += x;
+        return std::move(*this);
+    }
+    
     // Element-wise add-assign
     Mat<T,H,W>& operator+=(const Mat<T,H,W>& x) {
-        Mat<T,H,W>& r = *this;
-        if constexpr (std::is_same_v<T, float>) {
-            catlas_saxpby(Count, 1, x._vals(), 1, 1, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, double>) {
-            catlas_daxpby(Count, 1, x._vals(), 1, 1, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, std::complex<float>>) {
-            const std::complex<float> one(1);
-            catlas_caxpby(Count, &one, x._vals(), 1, &one, r._vals(), 1);
-        } else if constexpr (std::is_same_v<T, std::complex<double>>) {
-            const std::complex<double> one(1);
-            catlas_zaxpby(Count, &one, x._vals(), 1, &one, r._vals(), 1);
-        } else {
-            static_assert(_AlwaysFalse<T>);
-        }
-        return r;
+        return axpby(1, x, 1);
     }
     
     // Scalar add
-    Mat<T,H,W> operator+(const T& x) const {
+    Mat<T,H,W> operator+(const T& x) const& {
         Mat<T,H,W> r = *this;
-        for (size_t i=0; i<Count; i++) r._vals()[i] += x;
+        r += x;
         return r;
     }
     
+    Mat<T,H,W> operator+(const T& x) && {
+        *this += x;
+        return std::move(*this);
+    }
+    
     // Scalar add-assign
-    Mat<T,H,W> operator+=(const T& x) {
+    Mat<T,H,W>& operator+=(const T& x) {
         Mat<T,H,W>& r = *this;
         for (size_t i=0; i<Count; i++) r._vals()[i] += x;
         return r;
     }
     
-    // Element-wise subtract
-    Mat<T,H,W> operator-(const Mat<T,H,W>& x) const {
+    // Element-wise subtract: returns *this - x
+    Mat<T,H,W> operator-(const Mat<T,H,W>& x) const& {
         Mat<T,H,W> r = *this;
-        if constexpr (std::is_same_v<T, float>)
-            catlas_saxpby(Count, 1, x._vals(), 1, -1, r._vals(), 1);
-        else if constexpr (std::is_same_v<T, double>)
-            catlas_daxpby(Count, 1, x._vals(), 1, -1, r._vals(), 1);
-        else
-            static_assert(_AlwaysFalse<T>);
+        r -= x;
         return r;
     }
     
-    // Element-wise subtract-assign
+    Mat<T,H,W> operator-(const Mat<T,H,W>& x) && {
+        *this -= x;
+        return std::move(*this);
+    }
+    
+    // Element-wise subtract-assign: *this = *this - x
     Mat<T,H,W>& operator-=(const Mat<T,H,W>& x) {
-        Mat<T,H,W>& r = *this;
-        if constexpr (std::is_same_v<T, float>)
-            catlas_saxpby(Count, 1, x._vals(), 1, -1, r._vals(), 1);
-        else if constexpr (std::is_same_v<T, double>)
-            catlas_daxpby(Count, 1, x._vals(), 1, -1, r._vals(), 1);
-        else
-            static_assert(_AlwaysFalse<T>);
-        return r;
+        return axpby(-1, x, 1);
     }
     
     // Scalar subtract
-    Mat<T,H,W> operator-(const T& x) const {
+    Mat<T,H,W> operator-(const T& x) const& {
         Mat<T,H,W> r = *this;
-        for (size_t i=0; i<Count; i++) r._vals()[i] -= x;
+        r -= x;
         return r;
     }
     
+    Mat<T,H,W> operator-(const T& x) && {
+        *this -= x;
+        return std::move(*this);
+    }
+    
     // Scalar subtract-assign
-    Mat<T,H,W> operator-=(const T& x) {
+    Mat<T,H,W>& operator-=(const T& x) {
         Mat<T,H,W>& r = *this;
         for (size_t i=0; i<Count; i++) r._vals()[i] -= x;
         return r;
@@ -399,6 +527,12 @@ public:
     Mat<T,W,N> solve(const Mat<T,H,N>& bconst) const {
         static_assert(H>=W, "matrix size must have H >= W");
         
+        // Small square matrices: use the closed-form inverse, avoiding LAPACK's
+        // overhead (and its workspace query)
+        if constexpr (_Small && H==W && H<=4 && N<=_SmallDimMax) {
+            return inv() * bconst;
+        }
+        
         __CLPK_integer h = H;
         __CLPK_integer w = W;
         __CLPK_integer nrhs = N;
@@ -587,73 +721,84 @@ private:
     
     static constexpr bool _DimsPowerOf2 = _IsPowerOf2(H) && _IsPowerOf2(W);
     
-//    // FFT (Real -> Complex)
-//    template<
-//    int Dir, // kFFTDirection_Forward or kFFTDirection_Inverse
-//    typename _T = T,
-//    typename std::enable_if_t<_DimsPowerOf2, int> = 0,
-//    typename std::enable_if_t<std::is_same_v<_T,float>||std::is_same_v<_T,double>, int> = 0
-//    >
-//    Mat<std::complex<T>,H,W> _fft() {
-//        using Float = T;
-//        constexpr size_t len = (H*(W/2));
-//        Mat<std::complex<Float>,H,W> r;
-//        FFTSetup<Float> s;
-//        
-//        auto outr = std::make_unique<Float[]>(len);
-//        auto outi = std::make_unique<Float[]>(len);
-//        
-//        // Separate the real/imaginary parts into `inr/ini`
-//        if constexpr (std::is_same_v<Float, float>) {
-//            vDSP_ctoz((const DSPComplex*)vals, 2, (DSPSplitComplex[]){outr.get(),outi.get()}, 1, len);
-//        } else if constexpr (std::is_same_v<Float, double>) {
-//            vDSP_ctozD((const DSPDoubleComplex*)vals, 2, (DSPDoubleSplitComplex[]){outr.get(),outi.get()}, 1, len);
-//        } else {
-//            static_assert(_AlwaysFalse<Float>);
-//        }
-//        
-//        // Perform 2D FFT
-//        if constexpr (std::is_same_v<Float, float>) {
-//            vDSP_fft2d_zrip(s,
-//                (DSPSplitComplex[]){outr.get(),outi.get()}, 1, 0,   // Output
-//                _Log2(W), _Log2(H),                                 // Dimensions
-//                Dir
-//            );
-//        } else if constexpr (std::is_same_v<Float, double>) {
-//            vDSP_fft2d_zripD(s,
-//                (DSPDoubleSplitComplex[]){outr.get(),outi.get()}, 1, 0, // Output
-//                _Log2(W), _Log2(H),                                     // Dimensions
-//                Dir
-//            );
-//        } else {
-//            static_assert(_AlwaysFalse<Float>);
-//        }
-//        
-//        for (size_t i=0; i<len; i++) {
-//            printf("%f %f\n", outr[i]/2, outi[i]/2);
-//        }
-//        exit(0);
-//        
-//        // Join the real/imaginary parts into `r._vals()`
-//        if constexpr (std::is_same_v<Float, float>) {
-//            vDSP_ztoc((DSPSplitComplex[]){outr.get(),outi.get()}, 1, (DSPComplex*)r._vals(), 2, len);
-//        } else if constexpr (std::is_same_v<Float, double>) {
-//            vDSP_ztocD((DSPDoubleSplitComplex[]){outr.get(),outi.get()}, 1, (DSPDoubleComplex*)r._vals(), 2, len);
-//        } else {
-//            static_assert(_AlwaysFalse<Float>);
-//        }
-//        
-//        if constexpr (Dir == kFFTDirection_Forward) {
-//            // Normalize based on the length
-//            r /= std::complex<Float>(2);
-//        
-//        } else if constexpr (Dir == kFFTDirection_Inverse) {
-//            // Normalize based on the length
-//            r /= std::complex<Float>(len);
-//        }
-//        
-//        return r;
-//    }
+    // _Small: whether we're small enough that calling into BLAS/LAPACK/vDSP
+    // costs more than doing the arithmetic ourselves
+    static constexpr size_t _SmallDimMax = 4;
+    static constexpr bool _Small = (H<=_SmallDimMax && W<=_SmallDimMax) &&
+        (std::is_same_v<T,float> || std::is_same_v<T,double>);
+    
+    // _InvSmall(): closed-form (adjugate) inverse of a 1x1 - 4x4 matrix
+    static Mat _InvSmall(const Mat& m) {
+        auto a = [&] (size_t y, size_t x) { return m.at(y,x); };
+        Mat r;
+        if constexpr (H == 1) {
+            const T det = a(0,0);
+            if (det == 0) throw std::runtime_error("matrix is singular");
+            r.at(0,0) = T(1)/det;
+        
+        } else if constexpr (H == 2) {
+            const T det = a(0,0)*a(1,1) - a(0,1)*a(1,0);
+            if (det == 0) throw std::runtime_error("matrix is singular");
+            const T k = T(1)/det;
+            r.at(0,0) =  a(1,1)*k; r.at(0,1) = -a(0,1)*k;
+            r.at(1,0) = -a(1,0)*k; r.at(1,1) =  a(0,0)*k;
+        
+        } else if constexpr (H == 3) {
+            const T c00 = a(1,1)*a(2,2) - a(1,2)*a(2,1);
+            const T c01 = a(1,2)*a(2,0) - a(1,0)*a(2,2);
+            const T c02 = a(1,0)*a(2,1) - a(1,1)*a(2,0);
+            const T det = a(0,0)*c00 + a(0,1)*c01 + a(0,2)*c02;
+            if (det == 0) throw std::runtime_error("matrix is singular");
+            const T k = T(1)/det;
+            r.at(0,0) = c00*k;
+            r.at(0,1) = (a(0,2)*a(2,1) - a(0,1)*a(2,2))*k;
+            r.at(0,2) = (a(0,1)*a(1,2) - a(0,2)*a(1,1))*k;
+            r.at(1,0) = c01*k;
+            r.at(1,1) = (a(0,0)*a(2,2) - a(0,2)*a(2,0))*k;
+            r.at(1,2) = (a(0,2)*a(1,0) - a(0,0)*a(1,2))*k;
+            r.at(2,0) = c02*k;
+            r.at(2,1) = (a(0,1)*a(2,0) - a(0,0)*a(2,1))*k;
+            r.at(2,2) = (a(0,0)*a(1,1) - a(0,1)*a(1,0))*k;
+        
+        } else if constexpr (H == 4) {
+            // 2x2 sub-determinants of the top two rows (s*) and bottom two rows (c*)
+            const T s0 = a(0,0)*a(1,1) - a(1,0)*a(0,1);
+            const T s1 = a(0,0)*a(1,2) - a(1,0)*a(0,2);
+            const T s2 = a(0,0)*a(1,3) - a(1,0)*a(0,3);
+            const T s3 = a(0,1)*a(1,2) - a(1,1)*a(0,2);
+            const T s4 = a(0,1)*a(1,3) - a(1,1)*a(0,3);
+            const T s5 = a(0,2)*a(1,3) - a(1,2)*a(0,3);
+            const T c5 = a(2,2)*a(3,3) - a(3,2)*a(2,3);
+            const T c4 = a(2,1)*a(3,3) - a(3,1)*a(2,3);
+            const T c3 = a(2,1)*a(3,2) - a(3,1)*a(2,2);
+            const T c2 = a(2,0)*a(3,3) - a(3,0)*a(2,3);
+            const T c1 = a(2,0)*a(3,2) - a(3,0)*a(2,2);
+            const T c0 = a(2,0)*a(3,1) - a(3,0)*a(2,1);
+            const T det = s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+            if (det == 0) throw std::runtime_error("matrix is singular");
+            const T k = T(1)/det;
+            r.at(0,0) = ( a(1,1)*c5 - a(1,2)*c4 + a(1,3)*c3)*k;
+            r.at(0,1) = (-a(0,1)*c5 + a(0,2)*c4 - a(0,3)*c3)*k;
+            r.at(0,2) = ( a(3,1)*s5 - a(3,2)*s4 + a(3,3)*s3)*k;
+            r.at(0,3) = (-a(2,1)*s5 + a(2,2)*s4 - a(2,3)*s3)*k;
+            r.at(1,0) = (-a(1,0)*c5 + a(1,2)*c2 - a(1,3)*c1)*k;
+            r.at(1,1) = ( a(0,0)*c5 - a(0,2)*c2 + a(0,3)*c1)*k;
+            r.at(1,2) = (-a(3,0)*s5 + a(3,2)*s2 - a(3,3)*s1)*k;
+            r.at(1,3) = ( a(2,0)*s5 - a(2,2)*s2 + a(2,3)*s1)*k;
+            r.at(2,0) = ( a(1,0)*c4 - a(1,1)*c2 + a(1,3)*c0)*k;
+            r.at(2,1) = (-a(0,0)*c4 + a(0,1)*c2 - a(0,3)*c0)*k;
+            r.at(2,2) = ( a(3,0)*s4 - a(3,1)*s2 + a(3,3)*s0)*k;
+            r.at(2,3) = (-a(2,0)*s4 + a(2,1)*s2 - a(2,3)*s0)*k;
+            r.at(3,0) = (-a(1,0)*c3 + a(1,1)*c1 - a(1,2)*c0)*k;
+            r.at(3,1) = ( a(0,0)*c3 - a(0,1)*c1 + a(0,2)*c0)*k;
+            r.at(3,2) = (-a(3,0)*s3 + a(3,1)*s1 - a(3,2)*s0)*k;
+            r.at(3,3) = ( a(2,0)*s3 - a(2,1)*s1 + a(2,2)*s0)*k;
+        
+        } else {
+            static_assert(_AlwaysFalse<T>);
+        }
+        return r;
+    }
     
     // FFT
     template<
@@ -663,56 +808,53 @@ private:
     >
     Mat<std::complex<Float>,H,W> _fft() const {
         constexpr size_t len = Count;
+        constexpr bool Real = std::is_same_v<T, float> || std::is_same_v<T, double>;
         Mat<std::complex<Float>,H,W> r;
-        FFTSetup<Float> s;
         
-        auto outr = std::make_unique<Float[]>(len);
-        auto outi = std::make_unique<Float[]>(len);
+        // Real input: use the faster real->complex implementation
+        if constexpr (Real && H>=2) {
+            _fftReal(r);
+            // The inverse DFT of real data is the conjugate of its forward DFT, scaled
+            if constexpr (Dir == kFFTDirection_Inverse) {
+                for (std::complex<Float>& x : r) x = std::conj(x) / (Float)len;
+            }
+            return r;
+        }
+        
+        const auto s = FFTSetupCache<Float>::Get(_Log2(std::max(H,W)));
+        Float* outr = FFTSetupCache<Float>::Scratch(2*len);
+        Float* outi = outr+len;
         
         // Separate the real/imaginary parts into `outr/outi`
-        if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
-            // We only have real values, so only copy those, and leave `outi` zero'd
-            std::copy(_vals(), _vals()+Count, outr.get());
+        if constexpr (Real) {
+            // We only have real values, so only copy those, and zero `outi`
+            std::copy(_vals(), _vals()+Count, outr);
+            std::fill(outi, outi+len, 0);
         } else if constexpr (std::is_same_v<T, std::complex<float>>) {
-            vDSP_ctoz((const DSPComplex*)_vals(), 2, (DSPSplitComplex[]){outr.get(),outi.get()}, 1, len);
+            const DSPSplitComplex out = {outr, outi};
+            vDSP_ctoz((const DSPComplex*)_vals(), 2, &out, 1, len);
         } else if constexpr (std::is_same_v<T, std::complex<double>>) {
-            vDSP_ctozD((const DSPDoubleComplex*)_vals(), 2, (DSPDoubleSplitComplex[]){outr.get(),outi.get()}, 1, len);
+            const DSPDoubleSplitComplex out = {outr, outi};
+            vDSP_ctozD((const DSPDoubleComplex*)_vals(), 2, &out, 1, len);
         } else {
             static_assert(_AlwaysFalse<Float>);
         }
         
         // Perform 2D FFT
-        // We're using the complex->complex FFT implementation (vDSP_fft2d_zip / vDSP_fft2d_zipD)
-        // instead of the real->complex one (vDSP_fft2d_zrip / vDSP_fft2d_zripD), even though
-        // the latter would be faster when the input data only contains real numbers.
-        // This is because the real->complex version uses some strange output packing format
-        // that I haven't been able to decipher and translate to the same format that MATLAB
-        // uses. See "Data Packing for Real FFTs":
-        //   https://developer.apple.com/library/archive/documentation/Performance/Conceptual/vDSP_Programming_Guide/UsingFourierTransforms/UsingFourierTransforms.html
+        // vDSP treats the data as row-major, so our columns (which are
+        // contiguous) are its rows
         if constexpr (std::is_same_v<Float, float>) {
-            vDSP_fft2d_zip(s,
-                (DSPSplitComplex[]){outr.get(),outi.get()}, 1, 0,   // Output
-                _Log2(W), _Log2(H),                                 // Dimensions
-                Dir
-            );
+            const DSPSplitComplex out = {outr, outi};
+            vDSP_fft2d_zip(s, &out, 1, 0, _Log2(H), _Log2(W), Dir);
         } else if constexpr (std::is_same_v<Float, double>) {
-            vDSP_fft2d_zipD(s,
-                (DSPDoubleSplitComplex[]){outr.get(),outi.get()}, 1, 0, // Output
-                _Log2(W), _Log2(H),                                     // Dimensions
-                Dir
-            );
+            const DSPDoubleSplitComplex out = {outr, outi};
+            vDSP_fft2d_zipD(s, &out, 1, 0, _Log2(H), _Log2(W), Dir);
         } else {
             static_assert(_AlwaysFalse<Float>);
         }
         
         // Join the real/imaginary parts into `r._vals()`
-        if constexpr (std::is_same_v<Float, float>) {
-            vDSP_ztoc((DSPSplitComplex[]){outr.get(),outi.get()}, 1, (DSPComplex*)r._vals(), 2, len);
-        } else if constexpr (std::is_same_v<Float, double>) {
-            vDSP_ztocD((DSPDoubleSplitComplex[]){outr.get(),outi.get()}, 1, (DSPDoubleComplex*)r._vals(), 2, len);
-        } else {
-            static_assert(_AlwaysFalse<Float>);
-        }
+        _join(r, outr, outi);
         
         // Scale result
         if constexpr (Dir == kFFTDirection_Inverse) {
@@ -722,6 +864,92 @@ private:
         return r;
     }
     
+    // _fftReal(): forward FFT of real data, in the same (MATLAB-compatible)
+    // layout as the complex FFT.
+    //
+    // Rather than vDSP_fft2d_zrip(), whose 2D output packing is hard to
+    // unpack, this uses the well-defined 1D packing of vDSP_fftm_zrip():
+    //   1. Real FFT of each column (H/2+1 unique outputs each)
+    //   2. Complex FFT of rows [0,H/2] only
+    //   3. Rows (H/2,H) from the Hermitian symmetry of real data's DFT:
+    //      X(y,x) = conj(X((H-y)%H, (W-x)%W))
+    // which is about half the work of the complex FFT.
+    void _fftReal(Mat<std::complex<Float>,H,W>& r) const {
+        constexpr size_t len = Count;
+        constexpr size_t H2 = H/2;
+        const auto s = FFTSetupCache<Float>::Get(_Log2(std::max(H,W)));
+        // `packed` holds the packed columns (len/2 complex values); `full`
+        // holds the unpacked columns (len complex values)
+        Float* scratch = FFTSetupCache<Float>::Scratch(3*len);
+        Float* packedr = scratch;
+        Float* packedi = packedr+len/2;
+        Float* fullr = packedi+len/2;
+        Float* fulli = fullr+len;
+        
+        // Real FFT of each column. vDSP_fftm_zrip() requires the even/odd
+        // elements as the real/imaginary parts; H is even, so each column's
+        // pairs are contiguous. The output of each column is packed as:
+        //   [0]: (2*X(0), 2*X(H/2)), [k]: 2*X(k)
+        if constexpr (std::is_same_v<Float, float>) {
+            const DSPSplitComplex packed = {packedr, packedi};
+            vDSP_ctoz((const DSPComplex*)_vals(), 2, &packed, 1, len/2);
+            vDSP_fftm_zrip(s, &packed, 1, H2, _Log2(H), W, kFFTDirection_Forward);
+        } else {
+            const DSPDoubleSplitComplex packed = {packedr, packedi};
+            vDSP_ctozD((const DSPDoubleComplex*)_vals(), 2, &packed, 1, len/2);
+            vDSP_fftm_zripD(s, &packed, 1, H2, _Log2(H), W, kFFTDirection_Forward);
+        }
+        
+        // Unpack rows [0,H/2] of each column, undoing vDSP's factor of 2
+        for (size_t x=0; x<W; x++) {
+            const Float* pr = packedr + x*H2;
+            const Float* pi = packedi + x*H2;
+            Float* fr = fullr + x*H;
+            Float* fi = fulli + x*H;
+            fr[0] = pr[0]/2;
+            fi[0] = 0;
+            fr[H2] = pi[0]/2;
+            fi[H2] = 0;
+            for (size_t y=1; y<H2; y++) {
+                fr[y] = pr[y]/2;
+                fi[y] = pi[y]/2;
+            }
+        }
+        
+        // Complex FFT of rows [0,H/2]
+        if constexpr (W > 1) {
+            if constexpr (std::is_same_v<Float, float>) {
+                const DSPSplitComplex full = {fullr, fulli};
+                vDSP_fftm_zip(s, &full, H, 1, _Log2(W), H2+1, kFFTDirection_Forward);
+            } else {
+                const DSPDoubleSplitComplex full = {fullr, fulli};
+                vDSP_fftm_zipD(s, &full, H, 1, _Log2(W), H2+1, kFFTDirection_Forward);
+            }
+        }
+        
+        // Fill the remaining rows from the Hermitian symmetry
+        for (size_t x=0; x<W; x++) {
+            const size_t xsym = (W-x)%W;
+            for (size_t y=H2+1; y<H; y++) {
+                fullr[x*H+y] =  fullr[xsym*H+(H-y)];
+                fulli[x*H+y] = -fulli[xsym*H+(H-y)];
+            }
+        }
+        
+        _join(r, fullr, fulli);
+    }
+    
+    // _join(): join split real/imaginary parts into `r`
+    static void _join(Mat<std::complex<Float>,H,W>& r, Float* re, Float* im) {
+        if constexpr (std::is_same_v<Float, float>) {
+            const DSPSplitComplex split = {re, im};
+            vDSP_ztoc(&split, 1, (DSPComplex*)r._vals(), 2, Count);
+        } else {
+            const DSPDoubleSplitComplex split = {re, im};
+            vDSP_ztocD(&split, 1, (DSPDoubleComplex*)r._vals(), 2, Count);
+        }
+    }
+    
 public:
     static constexpr size_t Height = H;
     static constexpr size_t Width = W;
@@ -731,48 +959,6 @@ public:
     using ValueType = T;
     
 private:
-    template<typename Float>
-    class FFTSetup {
-    public:
-        FFTSetup() {
-            if constexpr (std::is_same_v<Float,float>) {
-                _s = vDSP_create_fftsetup(_Log2(std::max(H,W)), kFFTRadix2);
-            } else if constexpr (std::is_same_v<Float, double>) {
-                _s = vDSP_create_fftsetupD(_Log2(std::max(H,W)), kFFTRadix2);
-            } else {
-                static_assert(_AlwaysFalse<Float>);
-            }
-            assert(_s);
-        }
-        
-        // Copy constructor: illegal
-        FFTSetup(const FFTSetup& x) = delete;
-        // Move constructor: illegal
-        FFTSetup(FFTSetup&& x) = delete;
-        
-        ~FFTSetup() {
-            if constexpr (std::is_same_v<Float,float>)
-                vDSP_destroy_fftsetup((::FFTSetup)_s);
-            else if constexpr (std::is_same_v<Float,double>)
-                vDSP_destroy_fftsetupD((::FFTSetupD)_s);
-            else
-                static_assert(_AlwaysFalse<Float>);
-        }
-        
-        template<
-        typename _Float = Float,
-        typename std::enable_if_t<std::is_same_v<_Float,float>, int> = 0>
-        operator ::FFTSetup() { return (::FFTSetup)_s; }
-        
-        template<
-        typename _Float = Float,
-        typename std::enable_if_t<std::is_same_v<_Float,double>, int> = 0>
-        operator ::FFTSetupD() { return (::FFTSetupD)_s; }
-    
-    private:
-        void* _s = nullptr;
-    };
-    
     template<class...> static constexpr std::false_type _AlwaysFalse;
     
     template<typename Iter>
@@ -1,17 +1,24 @@
 #import <Foundation/Foundation.h>
 #import <QuartzCore/QuartzCore.h>
 #import <Metal/Metal.h>
-#import <map>
-#import <unordered_map>
+#import <deque>
 #import <queue>
 #import <string>
 #import <list>
+#import <vector>
+#import <bit>
 #import <set>
 #import <mutex>
 #import <functional>
+#import <future>
+#import <span>
 #import <filesystem>
 #import <assert.h>
+#import <unistd.h>
 #import "MetalUtil.h"
+#import "../LRU.h"
+#import "../HashInts.h"
+#import "../FlatMap.h"
 
 namespace Toastbox {
 
@@ -24,22 +31,24 @@ class Renderer {
 private:
     template<typename... T_Args>
     struct _VertexShader {
-        std::string_view fn;
+        uint32_t fnId = 0; // Interned function name; see _fnId()
         std::tuple<T_Args...> args;
     };
     
     template<typename... T_Args>
     struct _FragmentShader {
-        std::string_view fn;
+        uint32_t fnId = 0; // Interned function name; see _fnId()
         std::tuple<T_Args...> args;
     };
     
     template<typename... T_Args>
     struct _ComputeKernel {
-        std::string_view fn;
+        uint32_t fnId = 0; // Interned function name; see _fnId()
         std::tuple<T_Args...> args;
     };
     
+    struct _BufPool;
+    
 public:
     template<typename T>
     class Resource {
@@ -59,18 +68,20 @@ public:
         }
         
         ~Resource() {
-            if (_state.renderer) _state.renderer->_recycle(_state.resource, _state.deferRecycle);
+            if (_state.renderer) _state.renderer->_recycle(_state.resource, _state.pool, _state.deferRecycle);
         }
         
         operator T() const { return _state.resource; }
         
     private:
-        Resource(Renderer& renderer, T resource, bool deferRecycle=false) : _state{&renderer, resource} {}
+        Resource(Renderer& renderer, T resource, bool deferRecycle=false, uint16_t pool=0) :
+        _state{&renderer, resource, deferRecycle, pool} {}
         
         struct {
             Renderer* renderer = nullptr;
             T resource = nil;
             bool deferRecycle = false;
+            uint16_t pool = 0; // The pool that the resource is recycled into
         } _state;
         
         friend class Renderer;
@@ -79,11 +90,69 @@ public:
     using Txt = Resource<id<MTLTexture>>;
     using Buf = Resource<id<MTLBuffer>>;
     
+    // Readback: a texture's samples, read back into a shared buffer by
+    // textureReadAsync(). The samples are tightly packed, and are accessed
+    // in place (eg by TIFF::pushImage(), with rowStride=width*samplesPerPixel)
+    // rather than being copied out. The buffer returns to the Renderer's
+    // buffer pool when the Readback is destroyed, which may happen after the
+    // Renderer is destroyed.
+    class Readback {
+    public:
+        // Copy/move: illegal; Readbacks are shared via ReadbackRef
+        Readback(const Readback& x) = delete;
+        Readback& operator=(const Readback& x) = delete;
+        
+        ~Readback() {
+            auto lock = std::unique_lock(_bufPool->lock);
+            _bufPool->put(_buf, _pool);
+        }
+        
+        const void* data() const { return [_buf contents]; }
+        size_t len() const { return bytesPerRow*height; }
+        
+        template<typename T>
+        std::span<const T> samples() const {
+            assert(sizeof(T) == bytesPerSample);
+            return { (const T*)data(), width*height*samplesPerPixel };
+        }
+        
+        const MTLPixelFormat fmt = MTLPixelFormatInvalid;
+        const size_t width = 0;
+        const size_t height = 0;
+        const size_t samplesPerPixel = 0;
+        const size_t bytesPerSample = 0;
+        const size_t bytesPerRow = 0;
+        
+    private:
+        Readback(std::shared_ptr<_BufPool> bufPool, id<MTLBuffer> buf, uint16_t pool,
+            MTLPixelFormat fmt, size_t width, size_t height, size_t samplesPerPixel, size_t bytesPerSample) :
+        fmt(fmt), width(width), height(height), samplesPerPixel(samplesPerPixel),
+        bytesPerSample(bytesPerSample), bytesPerRow(width*samplesPerPixel*bytesPerSample),
+        _bufPool(std::move(bufPool)), _buf(buf), _pool(pool) {}
+        
+        std::shared_ptr<_BufPool> _bufPool;
+        id<MTLBuffer> _buf = nil;
+        uint16_t _pool = 0;
+        
+        friend class Renderer;
+    };
+    
+    using ReadbackRef = std::shared_ptr<const Readback>;
+    using ReadbackCallback = std::function<void(ReadbackRef)>;
+    
     enum class BlendType {
         None,
         Over,
     };
     
+    // RenderPipeline: a render pipeline to precompile via pipelinesPrecompile()
+    struct RenderPipeline {
+        std::string_view vertName = _DefaultVertexShader;
+        std::string_view fragName = _DefaultFragmentShader;
+        MTLPixelFormat fmt = MTLPixelFormatInvalid;
+        BlendType blendType = BlendType::None;
+    };
+    
     static id /* CGColorSpaceRef */ LinearGrayColorSpace() {
         static id /* CGColorSpaceRef */ cs = CFBridgingRelease(CGColorSpaceCreateWithName(kCGColorSpaceLinearGray));
         return cs;
@@ -99,17 +168,42 @@ public:
         return cs;
     }
     
-    Renderer() :
+    static constexpr size_t DefaultFramesInFlight = 3;
+    
+    // BufSlice: a region of a buffer, which can be passed as a shader argument
+    // like a Buf/id<MTLBuffer>
+    struct BufSlice {
+        id<MTLBuffer> buf = nil;
+        size_t off = 0;
+        size_t len = 0;
+        
+        void* contents() const { return (uint8_t*)[buf contents] + off; }
+    };
+    
+    Renderer(size_t framesInFlight=DefaultFramesInFlight) :
     dev(MTLCreateSystemDefaultDevice()),
     _lib([dev newDefaultLibrary]),
     _commandQueue([dev newCommandQueue]),
-    _recycleBufs(std::make_shared<_RecycleBufs>()) {}
+    _recycleTxts(_TxtPoolDefaultBudget),
+    _bufPool(std::make_shared<_BufPool>()),
+    _frames{
+        .count = framesInFlight,
+        .sem = dispatch_semaphore_create(framesInFlight),
+    } {
+        assert(framesInFlight);
+    }
     
     ~Renderer() {
+        // Wait for the frames in flight to complete. This also restores the
+        // semaphore to its initial value, which libdispatch requires before
+        // it's released.
+        for (size_t i=0; i<_frames.count; i++) dispatch_semaphore_wait(_frames.sem, DISPATCH_TIME_FOREVER);
+        for (size_t i=0; i<_frames.count; i++) dispatch_semaphore_signal(_frames.sem);
+        
         // When the renderer is destroyed, make sure that there are no resources that were waiting to be recycled.
         // If there are, we likely have a memory leak and our -addCompletedHandler: was never called.
-        auto lock = std::unique_lock(_recycleBufs->lock);
-        assert(!_recycleBufs->pending);
+        auto lock = std::unique_lock(_bufPool->lock);
+        assert(!_bufPool->pending);
     }
     
     static size_t SamplesPerPixel(MTLPixelFormat fmt) {
@@ -161,10 +255,14 @@ public:
         [enc endEncoding];
     }
     
+    // VertexShader()/FragmentShader()/ComputeKernel(): the function name is
+    // interned here, once per shader object, so draws and dispatches look up
+    // pipeline states by integer key. Reusing a shader object across draws
+    // (eg in a loop) skips even that lookup.
     template<typename... T_Args>
     _VertexShader<T_Args...> VertexShader(std::string_view fn, T_Args&&... args) {
         return _VertexShader<T_Args...>{
-            .fn = fn,
+            .fnId = _fnId(fn),
             .args = std::forward_as_tuple(args...),
         };
     }
@@ -172,7 +270,7 @@ public:
     template<typename... T_Args>
     _FragmentShader<T_Args...> FragmentShader(std::string_view fn, T_Args&&... args) {
         return _FragmentShader<T_Args...>{
-            .fn = fn,
+            .fnId = _fnId(fn),
             .args = std::forward_as_tuple(args...),
         };
     }
@@ -180,11 +278,222 @@ public:
     template<typename... T_Args>
     _ComputeKernel<T_Args...> ComputeKernel(std::string_view fn, T_Args&&... args) {
         return _ComputeKernel<T_Args...>{
-            .fn = fn,
+            .fnId = _fnId(fn),
             .args = std::forward_as_tuple(args...),
         };
     }
     
+    // RenderPass: encodes any number of draws to a target texture into a
+    // single render command encoder, rather than one encoder per draw like
+    // render(). Encoding ends when the RenderPass is destroyed (or via end()).
+    // The pipeline state is only rebound when it changes between draws.
+    class RenderPass {
+    public:
+        // Default constructor
+        RenderPass() {}
+        
+        // Copy: deleted
+        RenderPass(const RenderPass& x) = delete;
+        RenderPass& operator=(const RenderPass& x) = delete;
+        // Move: allowed
+        RenderPass(RenderPass&& x) { swap(x); }
+        RenderPass& operator=(RenderPass&& x) { swap(x); return *this; }
+        
+        void swap(RenderPass& x) {
+            std::swap(_state, x._state);
+        }
+        
+        ~RenderPass() { end(); }
+        
+        void end() {
+            if (!_state.enc) return;
+            [_state.enc endEncoding];
+            _state = {};
+        }
+        
+        id<MTLRenderCommandEncoder> encoder() const { return _state.enc; }
+        
+        template<typename... T_VertArgs, typename... T_FragArgs>
+        void draw(
+            MTLPrimitiveType primitiveType,
+            size_t vertexCount,
+            size_t instanceCount,
+            const _VertexShader<T_VertArgs...>& vert,
+            const _FragmentShader<T_FragArgs...>& frag,
+            size_t baseInstance=0
+        ) {
+            _bind(vert, frag);
+            [_state.enc drawPrimitives:primitiveType
+                vertexStart:0
+                vertexCount:vertexCount
+                instanceCount:instanceCount
+                baseInstance:baseInstance];
+        }
+        
+        // drawBatch(): issues one draw per element of `args`, where draw i
+        // gets args[i] as buffer argument `argsIdx` of both shaders. The
+        // elements are packed into a single buffer, so that only the buffer
+        // offset changes between draws, instead of rebinding every argument.
+        template<typename T_Arg, typename... T_VertArgs, typename... T_FragArgs>
+        void drawBatch(
+            MTLPrimitiveType primitiveType,
+            size_t vertexCount,
+            std::span<const T_Arg> args,
+            size_t argsIdx,
+            const _VertexShader<T_VertArgs...>& vert,
+            const _FragmentShader<T_FragArgs...>& frag
+        ) {
+            static_assert(std::is_trivially_copyable_v<T_Arg>);
+            if (args.empty()) return;
+            _bind(vert, frag);
+            
+            // Offsets of constant-address-space arguments must be 256-byte
+            // aligned on macOS
+            constexpr size_t Align = 256;
+            const size_t stride = (sizeof(T_Arg)+Align-1) & ~(Align-1);
+            // deferRecycle=true, since the buffer is in use until the command
+            // buffer completes
+            const Buf buf = _state.renderer->_bufferCreate(stride*args.size(), MTLStorageModeShared, true);
+            if (!(id<MTLBuffer>)buf) throw std::runtime_error("failed to create batch buffer");
+            uint8_t* contents = (uint8_t*)[buf contents];
+            for (size_t i=0; i<args.size(); i++) {
+                memcpy(contents + i*stride, &args[i], sizeof(T_Arg));
+            }
+            
+            id<MTLRenderCommandEncoder> enc = _state.enc;
+            for (size_t i=0; i<args.size(); i++) {
+                if (!i) {
+                    [enc setVertexBuffer:buf offset:0 atIndex:argsIdx];
+                    [enc setFragmentBuffer:buf offset:0 atIndex:argsIdx];
+                } else {
+                    [enc setVertexBufferOffset:i*stride atIndex:argsIdx];
+                    [enc setFragmentBufferOffset:i*stride atIndex:argsIdx];
+                }
+                [enc drawPrimitives:primitiveType vertexStart:0 vertexCount:vertexCount];
+            }
+        }
+        
+        // drawIndirect(): draws with the arguments (a
+        // MTLDrawPrimitivesIndirectArguments) stored in `indirect` by the GPU,
+        // eg by Renderer::gridDrawArgs()
+        template<typename... T_VertArgs, typename... T_FragArgs>
+        void drawIndirect(
+            MTLPrimitiveType primitiveType,
+            id<MTLBuffer> indirect,
+            size_t indirectOff,
+            const _VertexShader<T_VertArgs...>& vert,
+            const _FragmentShader<T_FragArgs...>& frag
+        ) {
+            _bind(vert, frag);
+            [_state.enc drawPrimitives:primitiveType indirectBuffer:indirect indirectBufferOffset:indirectOff];
+        }
+        
+    private:
+        RenderPass(Renderer& renderer, id<MTLRenderCommandEncoder> enc, MTLPixelFormat fmt, BlendType blendType) :
+        _state{&renderer, enc, fmt, blendType} {}
+        
+        template<typename... T_VertArgs, typename... T_FragArgs>
+        void _bind(const _VertexShader<T_VertArgs...>& vert, const _FragmentShader<T_FragArgs...>& frag) {
+            assert(_state.enc);
+            Renderer& r = *_state.renderer;
+            id<MTLRenderPipelineState> ps = r._renderPipelineState(vert.fnId, frag.fnId, _state.fmt, _state.blendType);
+            if (ps != _state.ps) {
+                [_state.enc setRenderPipelineState:ps];
+                _state.ps = ps;
+            }
+            
+            id<MTLRenderCommandEncoder> enc = _state.enc;
+            std::apply([&] (const auto&... args) {
+                r._SetBufferArgs(_ShaderType::Vertex, enc, 0, args...);
+            }, vert.args);
+            
+            std::apply([&] (const auto&... args) {
+                r._SetBufferArgs(_ShaderType::Fragment, enc, 0, args...);
+            }, frag.args);
+        }
+        
+        struct {
+            Renderer* renderer = nullptr;
+            id<MTLRenderCommandEncoder> enc = nil;
+            MTLPixelFormat fmt = MTLPixelFormatInvalid;
+            BlendType blendType = BlendType::None;
+            id<MTLRenderPipelineState> ps = nil;
+        } _state;
+        
+        friend class Renderer;
+    };
+    
+    // renderPass(): starts a RenderPass to a target texture
+    RenderPass renderPass(id<MTLTexture> txt, BlendType blendType=BlendType::None) {
+        assert(txt);
+        
+        MTLRenderPassDescriptor* desc = [MTLRenderPassDescriptor new];
+        [[desc colorAttachments][0] setTexture:txt];
+        [[desc colorAttachments][0] setClearColor:{0,0,0,1}];
+        [[desc colorAttachments][0] setLoadAction:MTLLoadActionLoad];
+        [[desc colorAttachments][0] setStoreAction:MTLStoreActionStore];
+        id<MTLRenderCommandEncoder> enc = [cmdBuf() renderCommandEncoderWithDescriptor:desc];
+        
+//        [enc setTriangleFillMode:MTLTriangleFillModeLines];
+        
+        [enc setFrontFacingWinding:MTLWindingCounterClockwise];
+        [enc setCullMode:MTLCullModeNone];
+        return RenderPass(*this, enc, [txt pixelFormat], blendType);
+    }
+    
+    // gridDrawArgs(): computes on the GPU the arguments for drawing the cells of
+    // `grid` that intersect `visible`, as a MTLDrawPrimitivesIndirectArguments
+    // for RenderPass::drawIndirect(). There's one instance per visible cell,
+    // and the instance id is the cell's index. (The visible cells are a
+    // contiguous range of indexes, so they need a single draw.)
+    //
+    // T_Grid: Toastbox::Grid; a template parameter so that we don't depend on
+    // Grid.h unless this is used
+    template<typename T_Grid>
+    Buf gridDrawArgs(T_Grid grid, typename T_Grid::Rect visible, size_t vertexCount) {
+        grid.recompute(); // Metal can't recompute the grid
+        const uint32_t vertexCount32 = (uint32_t)vertexCount;
+        Buf args = _bufferCreate(sizeof(MTLDrawPrimitivesIndirectArguments), MTLStorageModePrivate, false);
+        if (!(id<MTLBuffer>)args) throw std::runtime_error("failed to create indirect buffer");
+        compute(1, 1, MTLSize{1,1,1},
+            ComputeKernel(
+                _ShaderNamespace "GridDrawArgs",
+                // Buffer args
+                grid,
+                visible,
+                vertexCount32,
+                args
+            )
+        );
+        return args;
+    }
+    
+    // gridInstances(): computes on the GPU a T_Grid::CellInstance (the cell's
+    // rect and index) for each cell of `grid` that intersects `visible`, for
+    // drawing the cells as instances. `range` is set to the visible cells
+    // (whose count is the instance count), and if it's empty, the returned
+    // buffer is null.
+    //
+    // T_Grid: Toastbox::Grid (see gridDrawArgs())
+    template<typename T_Grid>
+    Buf gridInstances(T_Grid grid, typename T_Grid::Rect visible, typename T_Grid::IndexRange& range) {
+        range = grid.indexRangeForRect(visible); // Also recomputes the grid, which Metal can't
+        if (range.count <= 0) return {};
+        Buf instances = _bufferCreate(range.count*sizeof(typename T_Grid::CellInstance), MTLStorageModePrivate, false);
+        if (!(id<MTLBuffer>)instances) throw std::runtime_error("failed to create instance buffer");
+        // 1D dispatch (see compute())
+        compute(range.count, 1,
+            ComputeKernel(
+                _ShaderNamespace "GridInstances",
+                // Buffer args
+                grid,
+                range,
+                instances
+            )
+        );
+        return instances;
+    }
+    
     // Render pass to a target texture
     template<typename... T_FragArgs>
     void render(
@@ -246,35 +555,8 @@ public:
         const _VertexShader<T_VertArgs...>& vert,
         const _FragmentShader<T_FragArgs...>& frag
     ) {
-        assert(txt);
-        
-        MTLRenderPassDescriptor* desc = [MTLRenderPassDescriptor new];
-        [[desc colorAttachments][0] setTexture:txt];
-        [[desc colorAttachments][0] setClearColor:{0,0,0,1}];
-        [[desc colorAttachments][0] setLoadAction:MTLLoadActionLoad];
-        [[desc colorAttachments][0] setStoreAction:MTLStoreActionStore];
-        id<MTLRenderCommandEncoder> enc = [cmdBuf() renderCommandEncoderWithDescriptor:desc];
-        
-//        [enc setTriangleFillMode:MTLTriangleFillModeLines];
-        
-        [enc setRenderPipelineState:_renderPipelineState(vert.fn, frag.fn, [txt pixelFormat], blendType)];
-        [enc setFrontFacingWinding:MTLWindingCounterClockwise];
-        [enc setCullMode:MTLCullModeNone];
-        
-        std::apply([=] (const auto&... args) {
-            _SetBufferArgs(_ShaderType::Vertex, enc, 0, args...);
-        }, vert.args);
-        
-        std::apply([=] (const auto&... args) {
-            _SetBufferArgs(_ShaderType::Fragment, enc, 0, args...);
-        }, frag.args);
-        
-        [enc drawPrimitives:primitiveType
-            vertexStart:0
-            vertexCount:vertexCount
-            instanceCount:instanceCount];
-        
-        [enc endEncoding];
+        RenderPass pass = renderPass(txt, blendType);
+        pass.draw(primitiveType, vertexCount, instanceCount, vert, frag);
     }
     
     // Compute pass with compute kernel
@@ -283,24 +565,186 @@ public:
         size_t width,
         size_t height,
         const _ComputeKernel<T_Args...>& kernel
+    ) {
+        compute(width, height, MTLSize{}, kernel);
+    }
+    
+    // Compute pass with compute kernel, with a fixed threadgroup size (for
+    // kernels that use threadgroup memory sized for it). If threadgroupSize
+    // is zero, it's derived from the pipeline state; it's 1D (height 1) if
+    // `height` is 1, so that 1D dispatches don't run duplicate threads.
+    template<typename... T_Args>
+    void compute(
+        size_t width,
+        size_t height,
+        MTLSize threadgroupSize,
+        const _ComputeKernel<T_Args...>& kernel
     ) {
         id<MTLComputeCommandEncoder> enc = [cmdBuf() computeCommandEncoder];
-        id<MTLComputePipelineState> ps = _computePipelineState(kernel.fn);
+        id<MTLComputePipelineState> ps = _computePipelineState(kernel.fnId);
         [enc setComputePipelineState:ps];
         
         std::apply([=] (const auto&... args) {
             _SetBufferArgs(enc, 0, args...);
         }, kernel.args);
         
-        const NSUInteger w = [ps threadExecutionWidth];
-        const NSUInteger h = [ps maxTotalThreadsPerThreadgroup] / w;
-        const MTLSize threadgroupSize = {w, h, 1};
+        if (!threadgroupSize.width) {
+            if (height == 1) {
+                threadgroupSize = {[ps maxTotalThreadsPerThreadgroup], 1, 1};
+            } else {
+                const NSUInteger w = [ps threadExecutionWidth];
+                const NSUInteger h = [ps maxTotalThreadsPerThreadgroup] / w;
+                threadgroupSize = {w, h, 1};
+            }
+        }
+        assert(threadgroupSize.width*threadgroupSize.height <= [ps maxTotalThreadsPerThreadgroup]);
+        const NSUInteger w = threadgroupSize.width;
+        const NSUInteger h = threadgroupSize.height;
         const MTLSize threadgroupCount = {((NSUInteger)width+w-1)/w, ((NSUInteger)height+h-1)/h, 1};
         
         [enc dispatchThreadgroups:threadgroupCount threadsPerThreadgroup:threadgroupSize];
         [enc endEncoding];
     }
     
+    // colorTransform(): applies a ColorSpace::Transform (see Color.h) to `src`,
+    // writing the result to `dst`, in a single pass. The transform's type is a
+    // template parameter so that we don't depend on Color.h (and Accelerate).
+    template<typename T_Transform>
+    void colorTransform(id<MTLTexture> src, id<MTLTexture> dst, const T_Transform& t) {
+        simd::float3x3 m;
+        for (int x=0; x<3; x++) {
+            for (int y=0; y<3; y++) {
+                m.columns[x][y] = (float)t.m.at(y,x);
+            }
+        }
+        const uint32_t gammaIn32 = (uint32_t)t.gammaIn;
+        const uint32_t gammaOut32 = (uint32_t)t.gammaOut;
+        
+        if (_ComputeWritable(dst)) {
+            compute([dst width], [dst height],
+                ComputeKernel(
+                    _ShaderNamespace "ColorTransformKernel",
+                    // Buffer args
+                    m,
+                    gammaIn32,
+                    gammaOut32,
+                    // Texture args
+                    src,
+                    dst
+                )
+            );
+            return;
+        }
+        
+        render(dst, BlendType::None,
+            FragmentShader(
+                _ShaderNamespace "ColorTransform",
+                // Buffer args
+                m,
+                gammaIn32,
+                gammaOut32,
+                // Texture args
+                src
+            )
+        );
+    }
+    
+    // pipelinesPrecompile(): compiles the given pipelines in parallel, so that
+    // their first use doesn't stall on compilation. Pipelines that were already
+    // compiled are skipped, and pipelines that fail to compile are ignored
+    // (and fail on first use instead).
+    void pipelinesPrecompile(std::span<const RenderPipeline> renders, std::span<const std::string_view> computes={}) {
+        struct Results {
+            std::mutex lock;
+            std::vector<std::pair<RenderPipelineStateKey,id<MTLRenderPipelineState>>> renders;
+            std::vector<std::pair<uint32_t,id<MTLComputePipelineState>>> computes;
+            bool archived = false; // Whether any pipeline was added to the archive
+        };
+        
+        // Each pipeline is added to the archive (if any) and compiled in the
+        // same parallel block. Adding to the archive compiles the pipeline, so
+        // it's added first, and the pipeline state is then loaded from the
+        // archive instead of being compiled a second time.
+        auto results = std::make_shared<Results>();
+        dispatch_group_t group = dispatch_group_create();
+        dispatch_queue_t queue = dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+        id<MTLDevice> d = dev;
+        id<MTLBinaryArchive> archive = _archive.archive;
+        
+        for (const RenderPipeline& x : renders) {
+            const RenderPipelineStateKey key = {
+                .vert = _fnId(x.vertName),
+                .frag = _fnId(x.fragName),
+                .fmt = x.fmt,
+                .blendType = x.blendType,
+            };
+            if (_renderPipelineStates.find(key) != _renderPipelineStates.end()) continue;
+            
+            MTLRenderPipelineDescriptor* desc = _renderPipelineDescriptor(key);
+            dispatch_group_async(group, queue, ^{
+                const bool archived = _ArchiveAdd(archive, desc);
+                id<MTLRenderPipelineState> ps = [d newRenderPipelineStateWithDescriptor:desc error:nil];
+                auto lock = std::unique_lock(results->lock);
+                results->archived |= archived;
+                if (ps) results->renders.push_back({key, ps});
+            });
+        }
+        
+        for (std::string_view x : computes) {
+            const uint32_t fnId = _fnId(x);
+            if (_computePipelineStates.find(fnId) != _computePipelineStates.end()) continue;
+            
+            MTLComputePipelineDescriptor* desc = _computePipelineDescriptor(fnId);
+            dispatch_group_async(group, queue, ^{
+                const bool archived = _ArchiveAdd(archive, desc);
+                id<MTLComputePipelineState> ps = [d newComputePipelineStateWithDescriptor:desc
+                    options:MTLPipelineOptionNone reflection:nil error:nil];
+                auto lock = std::unique_lock(results->lock);
+                results->archived |= archived;
+                if (ps) results->computes.push_back({fnId, ps});
+            });
+        }
+        
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        for (const auto& [key, ps] : results->renders) _renderPipelineStates.emplace(key, ps);
+        for (const auto& [fnId, ps] : results->computes) _computePipelineStates.emplace(fnId, ps);
+        if (results->archived) _archive.dirty = true;
+    }
+    
+    // pipelineArchiveOpen(): use the MTLBinaryArchive at `path` to cache
+    // compiled pipelines across launches. Pipelines compiled from now on are
+    // loaded from the archive if it has them, and are otherwise added to it.
+    // An unreadable archive (eg from a different OS version or GPU) is
+    // replaced. pipelineArchiveWrite() writes the archive back.
+    void pipelineArchiveOpen(const std::filesystem::path& path) {
+        MTLBinaryArchiveDescriptor* desc = [MTLBinaryArchiveDescriptor new];
+        id<MTLBinaryArchive> archive = nil;
+        if (std::filesystem::exists(path)) {
+            [desc setUrl:[NSURL fileURLWithPath:@(path.c_str())]];
+            archive = [dev newBinaryArchiveWithDescriptor:desc error:nil];
+            [desc setUrl:nil];
+        }
+        if (!archive) archive = [dev newBinaryArchiveWithDescriptor:desc error:nil];
+        if (!archive) throw std::runtime_error("newBinaryArchiveWithDescriptor returned nil");
+        _archive = {
+            .archive = archive,
+            .path = path,
+        };
+    }
+    
+    // pipelineArchiveWrite(): writes the archive atomically (to a temporary
+    // file, then renamed), if it has pipelines that the file doesn't
+    void pipelineArchiveWrite() {
+        if (!_archive.archive || !_archive.dirty) return;
+        const std::filesystem::path tmpPath = auto{_archive.path} += ".tmp";
+        NSError* err = nil;
+        if (![_archive.archive serializeToURL:[NSURL fileURLWithPath:@(tmpPath.c_str())] error:&err]) {
+            throw std::runtime_error(std::string("serializeToURL failed: ") + [[err localizedDescription] UTF8String]);
+        }
+        std::filesystem::rename(tmpPath, _archive.path);
+        _archive.dirty = false;
+    }
+    
     void copy(id<MTLTexture> src, id<MTLBuffer> dst) {
         const size_t w = [src width];
         const size_t h = [src height];
@@ -395,26 +839,82 @@ public:
         size_t width, size_t height,
         MTLTextureUsage usage=(MTLTextureUsageRenderTarget|MTLTextureUsageShaderRead)
     ) {
-        // Check if we already have a texture matching the given criteria
-        TxtKey key(fmt, width, height, usage);
-        TxtQueue& txts = _recycleTxts[key];
         // Check if we have a cached texture that matches our criteria
-        if (!txts.empty()) {
+        const TxtKey key(fmt, width, height, usage);
+        auto it = _recycleTxts.find(key);
+        if (it != _recycleTxts.end()) {
+            TxtQueue& txts = it->val;
+            assert(!txts.empty());
             Txt txt = Txt(*this, txts.front());
             txts.pop();
+            // Update the class' cost, or remove it if it's empty
+            const size_t cost = it->cost - [(id<MTLTexture>)txt allocatedSize];
+            if (txts.empty()) _recycleTxts.erase(it);
+            else _recycleTxts.set(key, std::move(txts), cost);
             return txt;
-        } else {
-            // We don't have a cached texture matching the criteria, so create a new one
-            MTLTextureDescriptor* desc = [MTLTextureDescriptor new];
-            [desc setTextureType:MTLTextureType2D];
-            [desc setWidth:width];
-            [desc setHeight:height];
-            [desc setPixelFormat:fmt];
-            [desc setUsage:usage];
-            id<MTLTexture> txt = [dev newTextureWithDescriptor:desc];
-            if (!txt) return {};
-            return Txt(*this, txt);
         }
+        
+        // We don't have a cached texture matching the criteria, so create a new one
+        id<MTLTexture> txt = [dev newTextureWithDescriptor:_TextureDescriptor(fmt, width, height, usage)];
+        if (!txt) return {};
+        return Txt(*this, txt);
+    }
+    
+    // textureCreateTransient(): creates a texture for temporary use, ie one
+    // whose contents aren't needed once its Txt is destroyed. If a transient
+    // heap is configured (transientHeapSetLen()), the texture is suballocated
+    // from it, and its memory becomes aliasable when its Txt is destroyed, so
+    // temporaries that don't overlap in time share memory. Transient textures
+    // are private, so they can't be read by the CPU. If there's no heap, or
+    // it's full, this is equivalent to textureCreate().
+    Txt textureCreateTransient(
+        MTLPixelFormat fmt,
+        size_t width, size_t height,
+        MTLTextureUsage usage=(MTLTextureUsageRenderTarget|MTLTextureUsageShaderRead)
+    ) {
+        if (_transientHeap) {
+            MTLTextureDescriptor* desc = _TextureDescriptor(fmt, width, height, usage);
+            [desc setStorageMode:MTLStorageModePrivate];
+            id<MTLTexture> txt = [_transientHeap newTextureWithDescriptor:desc];
+            if (txt) return Txt(*this, txt, false, _TxtPoolTransient);
+        }
+        return textureCreate(fmt, width, height, usage);
+    }
+    
+    // transientHeapSetLen(): sets the size of the heap that textureCreateTransient()
+    // suballocates from; 0 disables the heap. Existing transient textures keep
+    // the previous heap alive until they're destroyed.
+    void transientHeapSetLen(size_t len) {
+        if (!len) {
+            _transientHeap = nil;
+            return;
+        }
+        
+        MTLHeapDescriptor* desc = [MTLHeapDescriptor new];
+        [desc setSize:len];
+        [desc setStorageMode:MTLStorageModePrivate];
+        // Tracked: Metal orders GPU accesses to aliased memory, so a texture's
+        // memory can be made aliasable as soon as the CPU is done with it
+        [desc setHazardTrackingMode:MTLHazardTrackingModeTracked];
+        _transientHeap = [dev newHeapWithDescriptor:desc];
+        if (!_transientHeap) throw std::runtime_error("newHeapWithDescriptor returned nil");
+    }
+    
+    // texturePoolSetBudget(): sets the maximum number of bytes of recycled
+    // textures that are kept for reuse. When the budget is exceeded, the
+    // least-recently used texture classes (format/size/usage) are released.
+    // The budget is a hard limit: a texture larger than the budget isn't
+    // recycled at all.
+    void texturePoolSetBudget(size_t budget) {
+        _recycleTxts.budget(budget);
+        // LRUCost never evicts its front entry, so release it if it alone
+        // exceeds the new budget
+        if (_recycleTxts.cost() > budget) _recycleTxts.erase(_recycleTxts.begin());
+    }
+    
+    // texturePoolTrim(): releases every recycled texture
+    void texturePoolTrim() {
+        _recycleTxts.clear();
     }
     
     Txt textureCreate(id<MTLTexture> txt) {
@@ -454,6 +954,23 @@ public:
         return _bufferCreate([buf length], [buf storageMode], false);
     }
     
+    // bufferPoolSetCap(): sets the maximum number of bytes of idle buffers that
+    // are kept for reuse; buffers recycled beyond the cap are released
+    void bufferPoolSetCap(size_t cap) {
+        auto lock = std::unique_lock(_bufPool->lock);
+        _bufPool->idleCap = cap;
+        _bufPool->trim();
+    }
+    
+    // bufferPoolTrim(): releases every idle buffer
+    void bufferPoolTrim() {
+        auto lock = std::unique_lock(_bufPool->lock);
+        const size_t cap = _bufPool->idleCap;
+        _bufPool->idleCap = 0;
+        _bufPool->trim();
+        _bufPool->idleCap = cap;
+    }
+    
     // Write samples (from a raw pointer) to a texture
     template<typename T>
     void textureWrite(
@@ -471,6 +988,38 @@ public:
         textureWrite(txt, buf, samplesPerPixel, bytesPerSample, maxValue);
     }
     
+    // Write samples (from a raw pointer) to a texture, without copying them if
+    // possible. If `samples` is page-aligned, it's wrapped in a MTLBuffer
+    // directly, in which case the samples must remain valid and unmodified
+    // until the current command buffer completes. Otherwise the samples are
+    // copied, like textureWrite().
+    template<typename T>
+    void textureWriteNoCopy(
+        id<MTLTexture> txt,
+        const T* samples,
+        size_t samplesPerPixel,
+        size_t bytesPerSample=sizeof(T),
+        uintmax_t maxValue=std::numeric_limits<T>::max()
+    ) {
+        const size_t w = [txt width];
+        const size_t h = [txt height];
+        const size_t len = w*h*samplesPerPixel*sizeof(T);
+        const size_t pageLen = getpagesize();
+        if ((uintptr_t)samples % pageLen) {
+            textureWrite(txt, samples, samplesPerPixel, bytesPerSample, maxValue);
+            return;
+        }
+        
+        // The length must be page-aligned too. Rounding it up only extends
+        // into the page holding the samples' last byte, so it stays within
+        // mapped memory. The command buffer retains the buffer, so it lives
+        // until the GPU's done with it.
+        id<MTLBuffer> buf = [dev newBufferWithBytesNoCopy:(void*)samples length:(len+pageLen-1)&~(pageLen-1)
+            options:MTLResourceStorageModeShared deallocator:nil];
+        if (!buf) throw std::runtime_error("newBufferWithBytesNoCopy returned nil");
+        textureWrite(txt, buf, samplesPerPixel, bytesPerSample, maxValue);
+    }
+    
     // Write samples (from a MTLBuffer) to a texture
     void textureWrite(
         id<MTLTexture> txt,
@@ -500,6 +1049,30 @@ public:
         const uint32_t h32 = (uint32_t)h;
         const uint32_t inSamplesPerPixel32 = (uint32_t)inSamplesPerPixel;
         const uint32_t maxValue32 = (uint32_t)maxValue;
+        
+        // Use the compute kernels if `txt` is writable from them, to avoid
+        // the overhead of a render pass
+        if (_ComputeWritable(txt) && inSamplesPerPixel<=_LoadTileSamplesPerPixelMax) {
+            const char* kernelName = (inBytesPerSample==1 ?
+                _ShaderNamespace "LoadFromU8Kernel" : _ShaderNamespace "LoadFromU16Kernel");
+            const uint32_t outSamplesPerPixel32 = (uint32_t)outSamplesPerPixel;
+            compute(w, h, _LoadTile,
+                ComputeKernel(
+                    kernelName,
+                    // Buffer args
+                    w32,
+                    h32,
+                    inSamplesPerPixel32,
+                    maxValue32,
+                    outSamplesPerPixel32,
+                    buf,
+                    // Texture args
+                    txt
+                )
+            );
+            return;
+        }
+        
         // Load pixel data into `txt`
         render(txt, BlendType::None,
             FragmentShader(
@@ -549,6 +1122,49 @@ public:
         [txt getBytes:samples bytesPerRow:bytesPerRow fromRegion:region mipmapLevel:0];
     }
     
+    // textureReadAsync(): encodes a blit of `txt` into a pooled shared buffer
+    // on the current command buffer, so that the texture is read back without
+    // stalling the CPU on the GPU. Unlike textureRead(), the texture doesn't
+    // need to be sync()'d first. The returned future is fulfilled (or the
+    // callback is called, on a Metal completion thread) once the command
+    // buffer completes, so the caller must commit() it.
+    std::shared_future<ReadbackRef> textureReadAsync(id<MTLTexture> txt) {
+        auto promise = std::make_shared<std::promise<ReadbackRef>>();
+        std::shared_future<ReadbackRef> future = promise->get_future().share();
+        textureReadAsync(txt, [=] (ReadbackRef rb) {
+            if (rb) promise->set_value(std::move(rb));
+            else    promise->set_exception(std::make_exception_ptr(std::runtime_error("command buffer failed")));
+        });
+        return future;
+    }
+    
+    // textureReadAsync(): calls `cb` with the Readback, or with nullptr if the
+    // command buffer failed
+    void textureReadAsync(id<MTLTexture> txt, ReadbackCallback cb) {
+        assert(txt);
+        const MTLPixelFormat fmt = [txt pixelFormat];
+        const size_t w = [txt width];
+        const size_t h = [txt height];
+        const size_t samplesPerPixel = SamplesPerPixel(fmt);
+        const size_t bytesPerSample = BytesPerSample(fmt);
+        const size_t bytesPerRow = w*samplesPerPixel*bytesPerSample;
+        
+        uint16_t pool = 0;
+        id<MTLBuffer> buf = _bufferTake(bytesPerRow*h, MTLStorageModeShared, pool);
+        if (!buf) throw std::runtime_error("failed to create readback buffer");
+        auto rb = std::shared_ptr<const Readback>(new Readback(_bufPool, buf, pool,
+            fmt, w, h, samplesPerPixel, bytesPerSample));
+        
+        id<MTLBlitCommandEncoder> blit = [cmdBuf() blitCommandEncoder];
+        [blit copyFromTexture:txt sourceSlice:0 sourceLevel:0 sourceOrigin:{0,0,0} sourceSize:{w,h,1}
+            toBuffer:buf destinationOffset:0 destinationBytesPerRow:bytesPerRow destinationBytesPerImage:bytesPerRow*h];
+        [blit endEncoding];
+        
+        [cmdBuf() addCompletedHandler:^(id<MTLCommandBuffer> cmdBuf) {
+            cb([cmdBuf error] ? nullptr : rb);
+        }];
+    }
+    
     void bufferClear(id<MTLBuffer> buf) {
         const size_t len = [buf length];
         memset([buf contents], 0, len);
@@ -564,7 +1180,6 @@ public:
         const MTLPixelFormat fmt = [txt pixelFormat];
         const size_t samplesPerPixel = SamplesPerPixel(fmt);
         const size_t bytesPerSample = BytesPerSample(fmt);
-        const size_t sampleCount = samplesPerPixel*w*h;
         const size_t bytesPerRow = samplesPerPixel*bytesPerSample*w;
         uint32_t opts = 0;
         
@@ -615,33 +1230,23 @@ public:
         // Prevent the sRGB gamma from being doubly-applied
         assert(!(srgbGammaApplied && srgbGammaApply));
         
+        Txt tmp;
         if (srgbGammaApply || premulAlpha) {
-            Txt tmp = textureCreate(fmt, w, h);
-            copy(txt, tmp);
-            
-            if (srgbGammaApply) {
-                render(tmp, BlendType::None,
-                    FragmentShader(
-                        _ShaderNamespace "SRGBGamma",
-                        // Texture args
-                        tmp
-                    )
-                );
-                srgbGammaApplied = true;
-            }
-            
-            if (premulAlpha) {
-                render(tmp, BlendType::None,
-                    FragmentShader(
-                        _ShaderNamespace "PremulAlpha",
-                        // Texture args
-                        tmp
-                    )
-                );
-            }
-            
-            sync(tmp);
-            commitAndWait();
+            // Apply both in a single pass, from `txt` into `tmp`
+            tmp = textureCreate(fmt, w, h);
+            const uint32_t srgbGamma32 = srgbGammaApply;
+            const uint32_t premulAlpha32 = premulAlpha;
+            render(tmp, BlendType::None,
+                FragmentShader(
+                    _ShaderNamespace "SRGBGammaPremulAlpha",
+                    // Buffer args
+                    srgbGamma32,
+                    premulAlpha32,
+                    // Texture args
+                    txt
+                )
+            );
+            if (srgbGammaApply) srgbGammaApplied = true;
             txt = tmp;
         }
         
@@ -659,23 +1264,29 @@ public:
             throw std::runtime_error("invalid texture format");
         }
         
-        id ctx = CFBridgingRelease(CGBitmapContextCreate(nullptr, w, h, bytesPerSample*8,
-            bytesPerRow, (CGColorSpaceRef)colorSpace, opts));
-        
-        if (!ctx) throw std::runtime_error("CGBitmapContextCreate returned nil");
+        // Read the texture back, and wrap the Readback's buffer in the CGImage
+        // directly, rather than copying it into a bitmap context. The
+        // CGDataProvider owns a ReadbackRef, which it releases when the image
+        // is destroyed.
+        std::shared_future<ReadbackRef> future = textureReadAsync(txt);
+        commitAndWait();
+        ReadbackRef* rb = new ReadbackRef(future.get());
+        assert((*rb)->len() == bytesPerRow*h);
+        id provider = CFBridgingRelease(CGDataProviderCreateWithData(rb, (*rb)->data(), (*rb)->len(),
+            [] (void* info, const void*, size_t) { delete (ReadbackRef*)info; }));
+        if (!provider) {
+            delete rb;
+            throw std::runtime_error("CGDataProviderCreateWithData returned nil");
+        }
         
-        void* data = CGBitmapContextGetData((CGContextRef)ctx);
-        if (bytesPerSample == 1)        textureRead(txt, (uint8_t*)data, sampleCount);
-        else if (bytesPerSample == 2)   textureRead(txt, (uint16_t*)data, sampleCount);
-        else if (bytesPerSample == 4)   textureRead(txt, (uint32_t*)data, sampleCount);
-        else                            throw std::runtime_error("invalid bytesPerSample");
-        return CFBridgingRelease(CGBitmapContextCreateImage((CGContextRef)ctx));
+        id img = CFBridgingRelease(CGImageCreate(w, h, bytesPerSample*8, samplesPerPixel*bytesPerSample*8,
+            bytesPerRow, (CGColorSpaceRef)colorSpace, opts, (CGDataProviderRef)provider,
+            nullptr, false, kCGRenderingIntentDefault));
+        if (!img) throw std::runtime_error("CGImageCreate returned nil");
+        return img;
     }
     
     void debugTextureWrite(id<MTLTexture> txt, const std::filesystem::path& p) {
-        sync(txt);
-        commitAndWait();
-        
         id img = imageCreate(txt);
         assert(img);
         NSURL* outputURL = [NSURL fileURLWithPath:@(p.c_str())];
@@ -697,22 +1308,23 @@ public:
     
     // _prepareDeferredRecycle(): arrange for resources to be recycled after the MTLCommandBuffer is completed
     void _prepareDeferredRecycle() {
-        __block std::list<id<MTLBuffer>> pending;
+        __block std::vector<_BufPool::Entry> pending;
         {
-            auto lock = std::unique_lock(_recycleBufs->lock);
+            auto lock = std::unique_lock(_bufPool->lock);
             
             // Nothing to do if there are no pending buffers
-            if (_recycleBufs->defer.empty()) return;
+            if (_bufPool->defer.empty()) return;
             
-            _recycleBufs->pending++;
-            pending = std::move(_recycleBufs->defer);
+            _bufPool->pending++;
+            pending = std::move(_bufPool->defer);
+            _bufPool->defer = {};
         }
         
-        std::shared_ptr<_RecycleBufs> bufs = _recycleBufs;
+        std::shared_ptr<_BufPool> pool = _bufPool;
         [_cmdBuf addCompletedHandler:^(id<MTLCommandBuffer>) {
-            auto lock = std::unique_lock(bufs->lock);
-            bufs->bufs.splice(bufs->bufs.end(), pending);
-            bufs->pending--;
+            auto lock = std::unique_lock(pool->lock);
+            for (const _BufPool::Entry& e : pending) pool->put(e.buf, e.pool);
+            pool->pending--;
         }];
     }
     
@@ -731,8 +1343,83 @@ public:
         _cmdBuf = nil;
     }
     
+    // frameBegin()/frameEnd(): pipeline command submission across frames, so
+    // that the CPU can encode frame N+1 while the GPU executes frame N.
+    // frameBegin() blocks until fewer than `framesInFlight` (supplied to our
+    // constructor) frames are executing. frameEnd() commits the frame's
+    // command buffer without waiting, and returns a future that's fulfilled
+    // when the GPU completes the frame (or holds an exception if the command
+    // buffer failed).
+    void frameBegin() {
+        assert(!_frames.active);
+        dispatch_semaphore_wait(_frames.sem, DISPATCH_TIME_FOREVER);
+        _frames.active = true;
+        _frames.idx = (_frames.idx+1) % _frames.count;
+        _frames.uniformOff = 0;
+    }
+    
+    std::shared_future<void> frameEnd() {
+        assert(_frames.active);
+        _frames.active = false;
+        
+        auto promise = std::make_shared<std::promise<void>>();
+        std::shared_future<void> future = promise->get_future().share();
+        dispatch_semaphore_t sem = _frames.sem;
+        [cmdBuf() addCompletedHandler:^(id<MTLCommandBuffer> cmdBuf) {
+            NSError* err = [cmdBuf error];
+            if (err) {
+                promise->set_exception(std::make_exception_ptr(
+                    std::runtime_error([[err localizedDescription] UTF8String])));
+            } else {
+                promise->set_value();
+            }
+            dispatch_semaphore_signal(sem);
+        }];
+        commit();
+        return future;
+    }
+    
+    // uniformCreate(): copies `x` into a slice of the current frame's region of
+    // a ring buffer, for use as a shader argument during this frame. The
+    // frame's region is reused once frameBegin() cycles back to it, at which
+    // point the GPU is done with it. Outside of a frame, or if the frame's
+    // region is full, the slice comes from a new buffer instead.
+    template<typename T>
+    BufSlice uniformCreate(const T& x) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        return uniformCreate(&x, sizeof(x));
+    }
+    
+    BufSlice uniformCreate(const void* data, size_t len) {
+        // Metal requires buffer offsets of constant-address-space arguments to
+        // be 256-byte aligned on macOS
+        constexpr size_t Align = 256;
+        const size_t alignedLen = (len+Align-1) & ~(Align-1);
+        if (_frames.active && alignedLen<=_UniformRegionLen-_frames.uniformOff) {
+            if (!_frames.uniforms) {
+                _frames.uniforms = [dev newBufferWithLength:_UniformRegionLen*_frames.count
+                    options:MTLResourceStorageModeShared|MTLResourceCPUCacheModeWriteCombined];
+                if (!_frames.uniforms) throw std::runtime_error("newBufferWithLength returned nil");
+            }
+            const BufSlice slice = {
+                .buf = _frames.uniforms,
+                .off = _frames.idx*_UniformRegionLen + _frames.uniformOff,
+                .len = len,
+            };
+            memcpy(slice.contents(), data, len);
+            _frames.uniformOff += alignedLen;
+            return slice;
+        }
+        
+        // The Buf is destroyed when we return, but it's recycled with
+        // deferRecycle=true, so its contents stay intact until the current
+        // command buffer completes
+        const Buf buf = bufferCreate(data, len);
+        return BufSlice{ .buf = buf, .off = 0, .len = len };
+    }
+    
     id<MTLDevice> dev = nil;
-
+    
 private:
     enum class _ShaderType {
         Vertex,
@@ -757,6 +1444,12 @@ private:
                 case _ShaderType::Fragment: [enc setFragmentBuffer:t offset:0 atIndex:idx]; break;
                 default:                    abort();
                 }
+            } else if constexpr (std::is_same<U,BufSlice>::value) {
+                switch (type) {
+                case _ShaderType::Vertex:   [enc setVertexBuffer:t.buf offset:t.off atIndex:idx]; break;
+                case _ShaderType::Fragment: [enc setFragmentBuffer:t.buf offset:t.off atIndex:idx]; break;
+                default:                    abort();
+                }
             } else {
                 switch (type) {
                 case _ShaderType::Vertex:   [enc setVertexBytes:&t length:sizeof(t) atIndex:idx]; break;
@@ -812,6 +1505,8 @@ private:
                 [enc setBuffer:(id<MTLBuffer>)t offset:0 atIndex:idx];
             } else if constexpr (std::is_same<U,id<MTLBuffer>>::value) {
                 [enc setBuffer:t offset:0 atIndex:idx];
+            } else if constexpr (std::is_same<U,BufSlice>::value) {
+                [enc setBuffer:t.buf offset:t.off atIndex:idx];
             } else {
                 [enc setBytes:&t length:sizeof(t) atIndex:idx];
             }
@@ -847,114 +1542,208 @@ private:
     
     
     
+    // _LoadTile: must match LoadTile/LoadTileSamplesPerPixelMax in Renderer.metal
+    static constexpr MTLSize _LoadTile = {16, 16, 1};
+    static constexpr size_t _LoadTileSamplesPerPixelMax = 4;
+    
+    // _ComputeWritable(): whether `txt` can be written by a compute kernel.
+    // sRGB textures aren't writable from shaders on every GPU.
+    static bool _ComputeWritable(id<MTLTexture> txt) {
+        return ([txt usage] & MTLTextureUsageShaderWrite) &&
+            [txt pixelFormat]!=MTLPixelFormatRGBA8Unorm_sRGB;
+    }
+    
     Buf _bufferCreate(size_t len, MTLStorageMode storageMode, bool deferRecycle) {
-        // Return an existing buffer if its length is between len and 2*len,
-        // and its options match `opts`
-        auto lock = std::unique_lock(_recycleBufs->lock);
-        for (auto it=_recycleBufs->bufs.begin(); it!=_recycleBufs->bufs.end(); it++) {
-            id<MTLBuffer> buf = *it;
-            const size_t bufLen = [buf length];
-            const MTLStorageMode bufStorageMode = [buf storageMode];
-            if (bufLen>=len && bufLen<=2*len && bufStorageMode==storageMode) {
-                Buf b(*this, buf, deferRecycle);
-                _recycleBufs->bufs.erase(it);
-                return b;
-            }
-        }
-        
-        id<MTLBuffer> buf = [dev newBufferWithLength:len options:(storageMode<<MTLResourceStorageModeShift)];
+        uint16_t pool = 0;
+        id<MTLBuffer> buf = _bufferTake(len, storageMode, pool);
         if (!buf) return {};
-        return Buf(*this, buf, deferRecycle);
+        return Buf(*this, buf, deferRecycle, pool);
     }
     
-    void _recycle(id<MTLTexture> txt, bool deferRecycle) {
+    // _bufferTake(): returns a buffer from the pool (or a new one), and the
+    // pool that it must be returned to
+    id<MTLBuffer> _bufferTake(size_t len, MTLStorageMode storageMode, uint16_t& pool) {
+        // Allocations are rounded up to their size class, so that any buffer in
+        // the class' bucket can satisfy the request
+        const size_t cls = _BufPool::Class(len);
+        pool = _BufPool::Pool(storageMode, cls);
+        {
+            auto lock = std::unique_lock(_bufPool->lock);
+            id<MTLBuffer> buf = _bufPool->take(pool);
+            if (buf) return buf;
+        }
+        return [dev newBufferWithLength:_BufPool::ClassLen(cls) options:(storageMode<<MTLResourceStorageModeShift)];
+    }
+    
+    void _recycle(id<MTLTexture> txt, uint16_t pool, bool deferRecycle) {
         assert(!deferRecycle); // We only defer recycling of buffers
-        _recycleTxts[txt].push(txt);
+        // Transient textures aren't recycled; their memory is returned to the heap
+        if (pool == _TxtPoolTransient) {
+            [txt makeAliasable];
+            return;
+        }
+        
+        // LRUCost never evicts the entry being set, so keep each class within
+        // the budget ourselves: release the class' oldest textures to make
+        // room, or release `txt` itself if it exceeds the budget alone
+        const TxtKey key(txt);
+        const size_t cost = [txt allocatedSize];
+        const size_t budget = _recycleTxts.budget();
+        if (cost > budget) return;
+        auto it = _recycleTxts.find(key);
+        if (it != _recycleTxts.end()) {
+            TxtQueue& txts = it->val;
+            size_t classCost = it->cost;
+            while (!txts.empty() && classCost+cost>budget) {
+                classCost -= [txts.front() allocatedSize];
+                txts.pop();
+            }
+            txts.push(txt);
+            _recycleTxts.set(key, std::move(txts), classCost+cost);
+        } else {
+            TxtQueue txts;
+            txts.push(txt);
+            _recycleTxts.set(key, std::move(txts), cost);
+        }
+    }
+    
+    static MTLTextureDescriptor* _TextureDescriptor(MTLPixelFormat fmt, size_t width, size_t height, MTLTextureUsage usage) {
+        MTLTextureDescriptor* desc = [MTLTextureDescriptor new];
+        [desc setTextureType:MTLTextureType2D];
+        [desc setWidth:width];
+        [desc setHeight:height];
+        [desc setPixelFormat:fmt];
+        [desc setUsage:usage];
+        return desc;
     }
     
-    void _recycle(id<MTLBuffer> buf, bool deferRecycle) {
-        auto lock = std::unique_lock(_recycleBufs->lock);
+    void _recycle(id<MTLBuffer> buf, uint16_t pool, bool deferRecycle) {
+        auto lock = std::unique_lock(_bufPool->lock);
         if (deferRecycle) {
-            _recycleBufs->defer.push_back(buf);
+            _bufPool->defer.push_back({buf, pool});
         } else {
-            _recycleBufs->bufs.push_back(buf);
+            _bufPool->put(buf, pool);
         }
     }
     
-    id<MTLRenderPipelineState> _renderPipelineState(std::string_view vertName, std::string_view fragName, MTLPixelFormat fmt, BlendType blendType) {
-        RenderPipelineStateKey key(vertName, fragName, fmt, blendType);
-        auto find = _renderPipelineStates.find(key);
-        if (find != _renderPipelineStates.end()) return find->second;
+    struct RenderPipelineStateKey {
+        uint32_t vert = 0; // Interned function name; see _fnId()
+        uint32_t frag = 0; // Interned function name; see _fnId()
+        MTLPixelFormat fmt = MTLPixelFormatInvalid;
+        BlendType blendType = BlendType::None;
         
-        id<MTLFunction> vertShader = Toastbox::MetalUtil::MTLFunctionWithName(_lib, vertName);
+        bool operator==(const RenderPipelineStateKey& x) const = default;
+        
+        struct Hash {
+            size_t operator()(const RenderPipelineStateKey& x) const {
+                return Toastbox::HashInts(x.vert, x.frag, x.fmt, x.blendType);
+            }
+        };
+    };
+    
+    // _fnId(): interns a shader function name, so that pipeline states can be
+    // looked up by integer keys. Lookups don't allocate.
+    uint32_t _fnId(std::string_view name) {
+        auto find = _fnIds.find(name);
+        if (find != _fnIds.end()) return find->second;
+        const uint32_t id = (uint32_t)_fnNames.size();
+        _fnNames.emplace_back(name);
+        _fnIds.emplace(_fnNames.back(), id);
+        return id;
+    }
+    
+    // _fnName(): the name for an interned function id; NUL-terminated
+    std::string_view _fnName(uint32_t id) const {
+        return _fnNames.at(id);
+    }
+    
+    MTLRenderPipelineDescriptor* _renderPipelineDescriptor(const RenderPipelineStateKey& key) {
+        id<MTLFunction> vertShader = Toastbox::MetalUtil::MTLFunctionWithName(_lib, _fnName(key.vert));
         assert(vertShader);
-        id<MTLFunction> fragShader = Toastbox::MetalUtil::MTLFunctionWithName(_lib, fragName);
+        id<MTLFunction> fragShader = Toastbox::MetalUtil::MTLFunctionWithName(_lib, _fnName(key.frag));
         assert(fragShader);
         
         MTLRenderPipelineDescriptor* desc = [MTLRenderPipelineDescriptor new];
         [desc setVertexFunction:vertShader];
         [desc setFragmentFunction:fragShader];
-        [[desc colorAttachments][0] setPixelFormat:fmt];
+        [[desc colorAttachments][0] setPixelFormat:key.fmt];
         
-        if (blendType == BlendType::Over) {
+        if (key.blendType == BlendType::Over) {
             [[desc colorAttachments][0] setBlendingEnabled:true];
             [[desc colorAttachments][0] setAlphaBlendOperation:MTLBlendOperationAdd];
             [[desc colorAttachments][0] setSourceAlphaBlendFactor:MTLBlendFactorSourceAlpha];
             [[desc colorAttachments][0] setDestinationAlphaBlendFactor:MTLBlendFactorOneMinusSourceAlpha];
-
+            
             [[desc colorAttachments][0] setRgbBlendOperation:MTLBlendOperationAdd];
             [[desc colorAttachments][0] setSourceRGBBlendFactor:MTLBlendFactorSourceAlpha];
             [[desc colorAttachments][0] setDestinationRGBBlendFactor:MTLBlendFactorOneMinusSourceAlpha];
         }
         
+        if (_archive.archive) [desc setBinaryArchives:@[_archive.archive]];
+        return desc;
+    }
+    
+    MTLComputePipelineDescriptor* _computePipelineDescriptor(uint32_t fnId) {
+        id<MTLFunction> fn = Toastbox::MetalUtil::MTLFunctionWithName(_lib, _fnName(fnId));
+        assert(fn);
+        
+        MTLComputePipelineDescriptor* desc = [MTLComputePipelineDescriptor new];
+        [desc setComputeFunction:fn];
+        if (_archive.archive) [desc setBinaryArchives:@[_archive.archive]];
+        return desc;
+    }
+    
+    // _ArchiveAdd(): adds a pipeline to `archive` (if non-nil), so that future
+    // launches don't need to compile it. Returns whether it was added.
+    // MTLBinaryArchive is thread-safe, so this may be called concurrently.
+    static bool _ArchiveAdd(id<MTLBinaryArchive> archive, MTLRenderPipelineDescriptor* desc) {
+        return archive && [archive addRenderPipelineFunctionsWithDescriptor:desc error:nil];
+    }
+    
+    static bool _ArchiveAdd(id<MTLBinaryArchive> archive, MTLComputePipelineDescriptor* desc) {
+        return archive && [archive addComputePipelineFunctionsWithDescriptor:desc error:nil];
+    }
+    
+    // _archiveAdd(): adds a pipeline to our archive, before its pipeline
+    // state is created from `desc`. Adding compiles the pipeline, and the
+    // pipeline state is then loaded from the archive rather than compiled
+    // again.
+    template<typename T_Desc>
+    void _archiveAdd(T_Desc* desc) {
+        if (_ArchiveAdd(_archive.archive, desc)) _archive.dirty = true;
+    }
+    
+    id<MTLRenderPipelineState> _renderPipelineState(uint32_t vert, uint32_t frag, MTLPixelFormat fmt, BlendType blendType) {
+        const RenderPipelineStateKey key = {
+            .vert = vert,
+            .frag = frag,
+            .fmt = fmt,
+            .blendType = blendType,
+        };
+        auto find = _renderPipelineStates.find(key);
+        if (find != _renderPipelineStates.end()) return find->second;
+        
+        MTLRenderPipelineDescriptor* desc = _renderPipelineDescriptor(key);
+        _archiveAdd(desc);
         id<MTLRenderPipelineState> ps = [dev newRenderPipelineStateWithDescriptor:desc error:nil];
         if (!ps) return nil;
-        _renderPipelineStates.insert(find, {key, ps});
+        _renderPipelineStates.emplace(key, ps);
         return ps;
     }
     
-    id<MTLComputePipelineState> _computePipelineState(std::string_view fnName) {
-        auto find = _computePipelineStates.find(fnName);
+    id<MTLComputePipelineState> _computePipelineState(uint32_t fnId) {
+        auto find = _computePipelineStates.find(fnId);
         if (find != _computePipelineStates.end()) return find->second;
         
-        id<MTLFunction> fn = Toastbox::MetalUtil::MTLFunctionWithName(_lib, fnName);
-        assert(fn);
-        
-        id<MTLComputePipelineState> ps = [dev newComputePipelineStateWithFunction:fn error:nil];
+        MTLComputePipelineDescriptor* desc = _computePipelineDescriptor(fnId);
+        _archiveAdd(desc);
+        id<MTLComputePipelineState> ps = [dev newComputePipelineStateWithDescriptor:desc
+            options:MTLPipelineOptionNone reflection:nil error:nil];
         if (!ps) return nil;
-        
-        _computePipelineStates.insert(find, {std::string(fnName), ps});
+        _computePipelineStates.emplace(fnId, ps);
         return ps;
     }
     
-    class RenderPipelineStateKey {
-    public:
-        RenderPipelineStateKey(std::string_view vertName, std::string_view fragName, MTLPixelFormat fmt, BlendType blendType) :
-        _vertName(vertName), _fragName(fragName), _fmt(fmt), _blendType(blendType) {}
-        
-        bool operator==(const RenderPipelineStateKey& x) const {
-            if (_vertName != x._vertName)   return false;
-            if (_fragName != x._fragName)   return false;
-            if (_fmt != x._fmt)             return false;
-            if (_blendType != x._blendType) return false;
-            return true;
-        }
-        
-        bool operator<(const RenderPipelineStateKey& x) const {
-            if (_vertName != x._vertName)   return _vertName < x._vertName;
-            if (_fragName != x._fragName)   return _fragName < x._fragName;
-            if (_fmt != x._fmt)             return _fmt < x._fmt;
-            if (_blendType != x._blendType) return _blendType < x._blendType;
-            return false;
-        }
-    
-    private:
-        std::string _vertName;
-        std::string _fragName;
-        MTLPixelFormat _fmt = MTLPixelFormatInvalid;
-        BlendType _blendType = BlendType::None;
-    };
-    
     class TxtKey {
     public:
         TxtKey(id<MTLTexture> txt) :
@@ -979,13 +1768,13 @@ private:
             return false;
         }
         
-//        size_t hash() const {
-//            return Toastbox::HashInts(_fmt, _width, _height, _usage);
-//        }
-//        
-//        struct Hash {
-//            size_t operator()(const TxtKey& x) const { return x.hash(); }
-//        };
+        size_t hash() const {
+            return Toastbox::HashInts(_fmt, _width, _height, _usage);
+        }
+        
+        struct Hash {
+            size_t operator()(const TxtKey& x) const { return x.hash(); }
+        };
     
     private:
         MTLPixelFormat _fmt = MTLPixelFormatInvalid;
@@ -996,22 +1785,112 @@ private:
     
     using TxtQueue = std::queue<id<MTLTexture>>;
     
-    struct _RecycleBufs {
+    // _TxtPoolTransient: the Txt pool of textures from _transientHeap
+    static constexpr uint16_t _TxtPoolTransient = 1;
+    static constexpr size_t _TxtPoolDefaultBudget = (size_t)512<<20;
+    
+    // _BufPool: recycled buffers, bucketed by storage mode and power-of-two size
+    // class. Every buffer in a bucket has exactly its class' length, so reuse is
+    // a pop from the bucket's free list, without querying each buffer's
+    // length/storage mode. Idle buffers beyond `idleCap` bytes are released.
+    struct _BufPool {
+        static constexpr size_t StorageModeCount = 4; // MTLStorageMode{Shared,Managed,Private,Memoryless}
+        static constexpr size_t ClassMin = 12; // log2 of the smallest class (4 KiB: a page)
+        static constexpr size_t ClassCount = 48-ClassMin; // Largest class: 128 TiB
+        static constexpr size_t DefaultIdleCap = (size_t)256<<20;
+        
+        struct Entry {
+            id<MTLBuffer> buf = nil;
+            uint16_t pool = 0;
+        };
+        
+        static size_t Class(size_t len) {
+            const size_t cls = std::max(ClassMin, (size_t)std::bit_width(len ? len-1 : 0));
+            if (cls-ClassMin >= ClassCount) throw std::runtime_error("buffer too large");
+            return cls;
+        }
+        
+        static size_t ClassLen(size_t cls) { return (size_t)1<<cls; }
+        
+        static uint16_t Pool(MTLStorageMode storageMode, size_t cls) {
+            assert((size_t)storageMode < StorageModeCount);
+            return (uint16_t)((size_t)storageMode*ClassCount + (cls-ClassMin));
+        }
+        
+        static size_t PoolLen(uint16_t pool) { return ClassLen(ClassMin + pool%ClassCount); }
+        
+        // take()/put()/trim(): require `lock`
+        id<MTLBuffer> take(uint16_t pool) {
+            std::vector<id<MTLBuffer>>& bucket = buckets[pool];
+            if (bucket.empty()) return nil;
+            id<MTLBuffer> buf = bucket.back();
+            bucket.pop_back();
+            idleLen -= PoolLen(pool);
+            return buf;
+        }
+        
+        void put(id<MTLBuffer> buf, uint16_t pool) {
+            const size_t len = PoolLen(pool);
+            // Release the buffer instead if keeping it would exceed our cap
+            if (idleLen+len > idleCap) return;
+            buckets[pool].push_back(buf);
+            idleLen += len;
+        }
+        
+        // trim(): release idle buffers until we're within our cap, largest first
+        void trim() {
+            for (size_t cls=ClassMin+ClassCount; cls>ClassMin && idleLen>idleCap; cls--) {
+                for (size_t mode=0; mode<StorageModeCount && idleLen>idleCap; mode++) {
+                    const uint16_t pool = Pool((MTLStorageMode)mode, cls-1);
+                    std::vector<id<MTLBuffer>>& bucket = buckets[pool];
+                    while (!bucket.empty() && idleLen>idleCap) {
+                        bucket.pop_back();
+                        idleLen -= PoolLen(pool);
+                    }
+                }
+            }
+        }
+        
         std::mutex lock; // Protects this struct
-        std::list<id<MTLBuffer>> bufs;
-        std::list<id<MTLBuffer>> defer;
+        std::vector<id<MTLBuffer>> buckets[StorageModeCount*ClassCount];
+        std::vector<Entry> defer;
+        size_t idleLen = 0;
+        size_t idleCap = DefaultIdleCap;
         uint32_t pending = 0;
     };
     
     id <MTLLibrary> _lib = nil;
     id <MTLCommandQueue> _commandQueue = nil;
-    std::map<RenderPipelineStateKey,id<MTLRenderPipelineState>> _renderPipelineStates;
-    std::map<std::string,id<MTLComputePipelineState>,std::less<>> _computePipelineStates;
-    std::map<TxtKey,TxtQueue> _recycleTxts;
-    std::shared_ptr<_RecycleBufs> _recycleBufs;
+    FlatMap<RenderPipelineStateKey,id<MTLRenderPipelineState>,RenderPipelineStateKey::Hash> _renderPipelineStates;
+    FlatMap<uint32_t,id<MTLComputePipelineState>> _computePipelineStates;
+    // _fnNames/_fnIds: interned function names. _fnNames is a deque so that
+    // its strings (which _fnIds' keys reference) never move.
+    std::deque<std::string> _fnNames;
+    FlatMap<std::string_view,uint32_t> _fnIds;
+    struct {
+        id<MTLBinaryArchive> archive = nil;
+        std::filesystem::path path;
+        bool dirty = false; // Whether `archive` has pipelines that `path` doesn't
+    } _archive;
+    // _recycleTxts: recycled textures, grouped by class (TxtKey), whose cost is
+    // the class' total allocated size
+    LRUCost<TxtKey,TxtQueue,void,TxtKey::Hash> _recycleTxts;
+    id<MTLHeap> _transientHeap = nil;
+    std::shared_ptr<_BufPool> _bufPool;
     
     id<MTLCommandBuffer> _cmdBuf = nil;
     
+    // _UniformRegionLen: the size of each frame's region of _frames.uniforms
+    static constexpr size_t _UniformRegionLen = (size_t)1<<20;
+    struct {
+        size_t count = 0;
+        dispatch_semaphore_t sem = nil;
+        bool active = false;
+        size_t idx = 0;
+        id<MTLBuffer> uniforms = nil;
+        size_t uniformOff = 0;
+    } _frames;
+    
     template<class...> static constexpr std::false_type _AlwaysFalse;
     
     friend class Resource<id<MTLTexture>>;
@@ -1,5 +1,6 @@
 #import <metal_stdlib>
 #import "MetalUtil.h"
+#import "Grid.h"
 using namespace metal;
 using namespace Toastbox::MetalUtil;
 
@@ -76,6 +77,77 @@ fragment float4 LoadFloat4FromU16(
     return LoadFloat4(w, h, samplesPerPixel, maxValue, data, int2(in.pos.xy));
 }
 
+// LoadTile: the threadgroup size of the Load*Kernel kernels
+constant uint2 LoadTile = uint2(16,16);
+constant uint32_t LoadTileSamplesPerPixelMax = 4;
+
+// LoadTiled(): compute-kernel equivalent of LoadFloat()/LoadFloat4(), for
+// textures that are writable from compute kernels. Each threadgroup first
+// copies its tile's rows into threadgroup memory, with adjacent threads
+// reading adjacent samples (rather than each thread reading its own
+// pixel's samples, which are `samplesPerPixel` apart), and then each thread
+// converts its pixel from threadgroup memory.
+template<typename T>
+void LoadTiled(
+    uint32_t w, uint32_t h, uint32_t samplesPerPixel, uint32_t maxValue, uint32_t outSamplesPerPixel,
+    device const T* data, texture2d<float, access::write> txt,
+    threadgroup T* tile, uint2 tg, uint2 tpos
+) {
+    const uint32_t rowLen = LoadTile.x*LoadTileSamplesPerPixelMax;
+    const uint2 origin = tg*LoadTile;
+    const uint2 pos = origin+tpos;
+    const uint32_t y = origin.y + tpos.y;
+    if (y<h && origin.x<w) {
+        const uint32_t count = min(LoadTile.x, w-origin.x)*samplesPerPixel;
+        device const T* src = data + samplesPerPixel*(w*y + origin.x);
+        threadgroup T* dst = tile + tpos.y*rowLen;
+        for (uint32_t i=tpos.x; i<count; i+=LoadTile.x) {
+            dst[i] = src[i];
+        }
+    }
+    
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    if (pos.x>=w || pos.y>=h) return;
+    
+    threadgroup const T* s = tile + tpos.y*rowLen + tpos.x*samplesPerPixel;
+    const uint32_t n = min(samplesPerPixel, (outSamplesPerPixel==1 ? (uint32_t)1 : (uint32_t)3));
+    float4 c = float4(0,0,0,1);
+    for (uint32_t i=0; i<n; i++) {
+        c[i] = (float)s[i] / maxValue;
+    }
+    txt.write(c, pos);
+}
+
+kernel void LoadFromU8Kernel(
+    constant uint32_t& w [[buffer(0)]],
+    constant uint32_t& h [[buffer(1)]],
+    constant uint32_t& samplesPerPixel [[buffer(2)]],
+    constant uint32_t& maxValue [[buffer(3)]],
+    constant uint32_t& outSamplesPerPixel [[buffer(4)]],
+    device const uint8_t* data [[buffer(5)]],
+    texture2d<float, access::write> txt [[texture(0)]],
+    uint2 tg [[threadgroup_position_in_grid]],
+    uint2 tpos [[thread_position_in_threadgroup]]
+) {
+    threadgroup uint8_t tile[LoadTile.y*LoadTile.x*LoadTileSamplesPerPixelMax];
+    LoadTiled(w, h, samplesPerPixel, maxValue, outSamplesPerPixel, data, txt, tile, tg, tpos);
+}
+
+kernel void LoadFromU16Kernel(
+    constant uint32_t& w [[buffer(0)]],
+    constant uint32_t& h [[buffer(1)]],
+    constant uint32_t& samplesPerPixel [[buffer(2)]],
+    constant uint32_t& maxValue [[buffer(3)]],
+    constant uint32_t& outSamplesPerPixel [[buffer(4)]],
+    device const uint16_t* data [[buffer(5)]],
+    texture2d<float, access::write> txt [[texture(0)]],
+    uint2 tg [[threadgroup_position_in_grid]],
+    uint2 tpos [[thread_position_in_threadgroup]]
+) {
+    threadgroup uint16_t tile[LoadTile.y*LoadTile.x*LoadTileSamplesPerPixelMax];
+    LoadTiled(w, h, samplesPerPixel, maxValue, outSamplesPerPixel, data, txt, tile, tg, tpos);
+}
+
 float SRGBGammaForward(float x) {
     // From http://www.brucelindbloom.com/index.html?Eqn_RGB_XYZ_Matrix.html
     if (x <= 0.0031308) return 12.92*x;
@@ -110,6 +182,125 @@ fragment float4 PremulAlpha(
     return float4(s.rgb*s.a, s.a);
 }
 
+// SRGBGammaPremulAlpha: SRGBGamma and/or PremulAlpha in a single pass,
+// reading from a separate source texture (so no copy is needed first).
+// Like SRGBGamma, applying the gamma outputs opaque pixels.
+fragment float4 SRGBGammaPremulAlpha(
+    constant uint32_t& srgbGamma [[buffer(0)]],
+    constant uint32_t& premulAlpha [[buffer(1)]],
+    texture2d<float> txt [[texture(0)]],
+    VertexOutput in [[stage_in]]
+) {
+    float4 s = Sample::RGBA(txt, int2(in.pos.xy));
+    if (srgbGamma) {
+        s = float4(
+            SRGBGammaForward(s.r),
+            SRGBGammaForward(s.g),
+            SRGBGammaForward(s.b),
+            1
+        );
+    }
+    if (premulAlpha) {
+        s = float4(s.rgb*s.a, s.a);
+    }
+    return s;
+}
+
+// ColorTransformApply(): applies a ColorSpace::Transform (see Color.h), where
+// `gammaIn`/`gammaOut` are ColorSpace::Gamma values (0: none, 1: sRGB)
+float3 ColorTransformApply(float3x3 m, uint32_t gammaIn, uint32_t gammaOut, float3 c) {
+    if (gammaIn) {
+        c = float3(SRGBGammaReverse(c.r), SRGBGammaReverse(c.g), SRGBGammaReverse(c.b));
+    }
+    c = m*c;
+    if (gammaOut) {
+        c = float3(SRGBGammaForward(c.r), SRGBGammaForward(c.g), SRGBGammaForward(c.b));
+    }
+    return c;
+}
+
+fragment float4 ColorTransform(
+    constant float3x3& m [[buffer(0)]],
+    constant uint32_t& gammaIn [[buffer(1)]],
+    constant uint32_t& gammaOut [[buffer(2)]],
+    texture2d<float> txt [[texture(0)]],
+    VertexOutput in [[stage_in]]
+) {
+    const float4 s = Sample::RGBA(txt, int2(in.pos.xy));
+    return float4(ColorTransformApply(m, gammaIn, gammaOut, s.rgb), s.a);
+}
+
+// ColorTransformKernel: compute-kernel equivalent of ColorTransform, for
+// destination textures that are writable from compute kernels
+kernel void ColorTransformKernel(
+    constant float3x3& m [[buffer(0)]],
+    constant uint32_t& gammaIn [[buffer(1)]],
+    constant uint32_t& gammaOut [[buffer(2)]],
+    texture2d<float, access::read> src [[texture(0)]],
+    texture2d<float, access::write> dst [[texture(1)]],
+    uint2 pos [[thread_position_in_grid]]
+) {
+    if (pos.x>=dst.get_width() || pos.y>=dst.get_height()) return;
+    const float4 s = src.read(pos);
+    dst.write(float4(ColorTransformApply(m, gammaIn, gammaOut, s.rgb), s.a), pos);
+}
+
+// DrawPrimitivesIndirectArguments: MTLDrawPrimitivesIndirectArguments
+struct DrawPrimitivesIndirectArguments {
+    uint32_t vertexCount;
+    uint32_t instanceCount;
+    uint32_t vertexStart;
+    uint32_t baseInstance;
+};
+
+// GridDrawArgs: the draw arguments for the cells of `grid` that intersect
+// `visible`; one instance per cell, whose instance id is the cell index
+kernel void GridDrawArgs(
+    constant Grid& grid [[buffer(0)]],
+    constant Grid::Rect& visible [[buffer(1)]],
+    constant uint32_t& vertexCount [[buffer(2)]],
+    device DrawPrimitivesIndirectArguments& args [[buffer(3)]],
+    uint2 pos [[thread_position_in_grid]]
+) {
+    if (pos.x || pos.y) return;
+    
+    // Equivalent to Grid::indexRangeForIndexRect(), which can't be used
+    // here since it takes a constant-address-space IndexRect
+    const Grid::IndexRect r = grid.indexRectForRect(visible);
+    const int32_t elementCount = grid.elementCount();
+    const int32_t columnCount = grid.columnCount();
+    int32_t start = 0;
+    int32_t count = 0;
+    if (elementCount && r.x.count && r.y.count) {
+        start = clamp(r.y.start*columnCount + r.x.start, 0, elementCount-1);
+        const int32_t end = clamp((r.y.start+r.y.count-1)*columnCount + (r.x.start+r.x.count-1), 0, elementCount-1);
+        if (end >= start) count = end-start+1;
+        else start = 0;
+    }
+    
+    args = {
+        .vertexCount = vertexCount,
+        .instanceCount = (uint32_t)count,
+        .vertexStart = 0,
+        .baseInstance = (uint32_t)start,
+    };
+}
+
+// GridInstances: the Grid::CellInstance for each cell in `range`
+kernel void GridInstances(
+    constant Grid& grid [[buffer(0)]],
+    constant Grid::IndexRange& range [[buffer(1)]],
+    device Grid::CellInstance* instances [[buffer(2)]],
+    uint pos [[thread_position_in_grid]]
+) {
+    if (pos >= (uint32_t)range.count) return;
+    const int32_t idx = range.start + (int32_t)pos;
+    instances[pos] = {
+        .rect = grid.rectForCellIndex(idx),
+        .index = idx,
+    };
+}
+
 fragment float Copy1To1(
     texture2d<float> txt [[texture(0)]],
     VertexOutput in [[stage_in]]
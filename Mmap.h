@@ -8,6 +8,8 @@
 #include <cstring>
 #include <filesystem>
 #include <optional>
+#include <type_traits>
+#include <algorithm>
 #include <unistd.h>
 #include "RuntimeError.h"
 #include "FileDescriptor.h"
@@ -29,23 +31,72 @@ public:
         return PageFloor(x+PageSize()-1);
     }
     
+    // Advice: expected access pattern, for advise()
+    enum class Advice {
+        Normal,
+        Sequential,
+        Random,
+        WillNeed,
+        // DontNeed: the region won't be accessed soon, so its pages can be
+        // reclaimed. On Linux this is madvise(MADV_DONTNEED), which unmaps
+        // the pages immediately (they're refaulted from the file on the next
+        // access), since glibc's POSIX_MADV_DONTNEED is a no-op. Elsewhere
+        // it's POSIX_MADV_DONTNEED.
+        DontNeed,
+    };
+    
+    struct Options {
+        // populate: prefault the mapping up front (MAP_POPULATE on Linux;
+        // other platforms fall back to Advice::WillNeed)
+        bool populate = false;
+        // hugePages: request transparent huge pages for the mapping, where
+        // the platform supports them (MADV_HUGEPAGE on Linux; ignored elsewhere)
+        bool hugePages = false;
+        // growable: `cap` is only reserved as address space (PROT_NONE), and
+        // file-backed pages are committed as len() grows. The file is grown
+        // geometrically (so ftruncate() calls are amortized), and is trimmed
+        // to len() when the Mmap is destroyed. data() remains stable.
+        bool growable = false;
+        // trackDirty: sync()/syncAsync() only flush the range marked via
+        // markDirty() since the last sync, instead of the entire mapping
+        bool trackDirty = false;
+    };
+    
     Mmap() {}
     
     Mmap(FileDescriptor&& fd, std::optional<size_t> cap=std::nullopt, int oflags=O_RDONLY) {
-        _init(std::move(fd), cap, oflags);
+        _init(std::move(fd), cap, oflags, {});
+    }
+    
+    Mmap(FileDescriptor&& fd, std::optional<size_t> cap, int oflags, const Options& opts) {
+        _init(std::move(fd), cap, oflags, opts);
     }
     
     Mmap(const std::filesystem::path& path, std::optional<size_t> cap=std::nullopt, int oflags=O_RDONLY) {
         int fd = open(path.c_str(), oflags);
         if (fd < 0) throw RuntimeError("open failed: %s", strerror(errno));
-        _init(fd, cap, oflags);
+        _init(fd, cap, oflags, {});
+    }
+    
+    Mmap(const std::filesystem::path& path, std::optional<size_t> cap, int oflags, const Options& opts) {
+        int fd = open(path.c_str(), oflags);
+        if (fd < 0) throw RuntimeError("open failed: %s", strerror(errno));
+        _init(fd, cap, oflags, opts);
     }
     
     template<typename... T_Args>
+    requires (!std::is_same_v<std::remove_cvref_t<T_Args>, Options> && ...)
     Mmap(const std::filesystem::path& path, std::optional<size_t> cap, int oflags, T_Args&&... args) {
         int fd = open(path.c_str(), oflags, args...);
         if (fd < 0) throw RuntimeError("open failed: %s", strerror(errno));
-        _init(fd, cap, oflags);
+        _init(fd, cap, oflags, {});
+    }
+    
+    template<typename... T_Args>
+    Mmap(const std::filesystem::path& path, std::optional<size_t> cap, int oflags, const Options& opts, T_Args&&... args) {
+        int fd = open(path.c_str(), oflags, args...);
+        if (fd < 0) throw RuntimeError("open failed: %s", strerror(errno));
+        _init(fd, cap, oflags, opts);
     }
     
     // Copy: deleted
@@ -57,6 +108,10 @@ public:
     
     ~Mmap() {
         if (_state.data) {
+            // Growable: trim the file to its logical length, since it's grown geometrically
+            if (_state.opts.growable && _state.fileLen!=_state.len) {
+                ftruncate(_state.fd, _state.len);
+            }
             munmap((void*)_state.data, _state.cap);
         }
     }
@@ -65,11 +120,50 @@ public:
         std::swap(_state, x._state);
     }
     
-    void sync() const {
-        if (!_state.data) throw RuntimeError("invalid state");
-        if (!_state.len) return; // Short-circuit if there's nothing to sync
-        int ir = msync(_state.data, _state.len, MS_SYNC);
-        if (ir) throw RuntimeError("msync failed: %s", strerror(errno));
+    // sync(): synchronously flush the mapping (or only the dirty range, if
+    // Options::trackDirty is set) to the file
+    void sync() const { _sync(MS_SYNC); }
+    // sync(off,len): synchronously flush the range [off,off+len)
+    void sync(size_t off, size_t len) const { _sync(off, len, MS_SYNC); }
+    
+    // syncAsync(): like sync(), but only schedules the writeback and returns immediately
+    void syncAsync() const { _sync(MS_ASYNC); }
+    void syncAsync(size_t off, size_t len) const { _sync(off, len, MS_ASYNC); }
+    
+    // markDirty(): record that [off,off+len) was written, for Options::trackDirty
+    void markDirty(size_t off, size_t len) {
+        data(off, len); // Check bounds
+        if (!len) return;
+        if (_state.dirtyBegin == _state.dirtyEnd) {
+            _state.dirtyBegin = off;
+            _state.dirtyEnd = off+len;
+        } else {
+            _state.dirtyBegin = std::min(_state.dirtyBegin, off);
+            _state.dirtyEnd = std::max(_state.dirtyEnd, off+len);
+        }
+    }
+    
+    // advise(): tell the kernel how the region [off,off+len) will be accessed.
+    // The region is expanded to page boundaries.
+    void advise(size_t off, size_t len, Advice advice) const {
+        data(off, len); // Check bounds
+        if (!len) return;
+        const size_t begin = PageFloor(off);
+        const size_t end = PageCeil(off+len);
+#if __linux__
+        if (advice == Advice::DontNeed) {
+            int ir = madvise(_state.data+begin, end-begin, MADV_DONTNEED);
+            if (ir) throw RuntimeError("madvise failed: %s", strerror(errno));
+            return;
+        }
+#endif
+        int ir = posix_madvise(_state.data+begin, end-begin, _PosixAdvice(advice));
+        if (ir) throw RuntimeError("posix_madvise failed: %s", strerror(ir));
+    }
+    
+    // prefetch(): asynchronously read the region [off,off+len) into memory
+    void prefetch(size_t off, size_t len) const {
+        advise(off, len, Advice::WillNeed);
     }
     
     uint8_t* data(size_t off=0, size_t len=0) {
@@ -97,6 +191,10 @@ public:
     void len(size_t l) {
         assert(l <= _state.cap);
         if (l == _state.len) return; // Short-circuit if nothing changed
+        if (_state.opts.growable) {
+            _lenGrowable(l);
+            return;
+        }
         
         const size_t lenPrev = _state.len;
         _state.len = l;
@@ -110,14 +208,18 @@ public:
             const size_t begin = PageFloor(lenPrev);
             const size_t end   = PageCeil(_state.len);
             void* data = mmap(_state.data+begin, end-begin, _MmapProtection(_state.oflags),
-                _MmapFlags(_state.oflags)|MAP_FIXED, _state.fd, begin);
+                _MmapFlags(_state.oflags, _state.opts)|MAP_FIXED, _state.fd, begin);
             if (data == MAP_FAILED) throw RuntimeError("mmap failed: %s", strerror(errno));
+            _applyOptions(begin, end-begin);
         }
     }
     
     size_t cap() const { return _state.cap; }
     
 private:
+    // Minimum amount that we grow the file by, in growable mode
+    static constexpr size_t _GrowableMin = 1<<20;
+    
     static constexpr int _MmapProtection(int oflags) {
         switch (oflags & O_ACCMODE) {
         case O_RDONLY:  return PROT_READ;
@@ -127,26 +229,118 @@ private:
         }
     }
     
-    static constexpr int _MmapFlags(int oflags) {
+    static constexpr int _MmapFlags(int oflags, const Options& opts) {
+        int flags = 0;
         switch (oflags & O_ACCMODE) {
-        case O_RDONLY:  return MAP_PRIVATE;
+        case O_RDONLY:  flags = MAP_PRIVATE; break;
         case O_WRONLY:
-        case O_RDWR:    return MAP_SHARED;
+        case O_RDWR:    flags = MAP_SHARED; break;
         default:        abort();
         }
+#ifdef MAP_POPULATE
+        if (opts.populate) flags |= MAP_POPULATE;
+#endif
+        return flags;
     }
     
-    void _init(FileDescriptor&& fd, std::optional<size_t> cap, int oflags) {
+    static constexpr int _PosixAdvice(Advice advice) {
+        switch (advice) {
+        case Advice::Normal:        return POSIX_MADV_NORMAL;
+        case Advice::Sequential:    return POSIX_MADV_SEQUENTIAL;
+        case Advice::Random:        return POSIX_MADV_RANDOM;
+        case Advice::WillNeed:      return POSIX_MADV_WILLNEED;
+        case Advice::DontNeed:      return POSIX_MADV_DONTNEED;
+        default:                    abort();
+        }
+    }
+    
+    // _applyOptions(): apply the options that can't be expressed via mmap() flags
+    // to the newly-mapped region [off,off+len)
+    void _applyOptions(size_t off, size_t len) {
+        if (!len) return;
+#ifdef MADV_HUGEPAGE
+        // Best effort: huge pages aren't supported for every kind of file
+        if (_state.opts.hugePages) madvise(_state.data+off, len, MADV_HUGEPAGE);
+#endif
+#ifndef MAP_POPULATE
+        if (_state.opts.populate) posix_madvise(_state.data+off, len, POSIX_MADV_WILLNEED);
+#endif
+    }
+    
+    void _sync(int flags) const {
+        if (!_state.data) throw RuntimeError("invalid state");
+        if (!_state.opts.trackDirty) {
+            _sync(0, _state.len, flags);
+            return;
+        }
+        // Only flush the dirty range, clamped to our current length
+        // (in case the file was contracted since the range was marked)
+        const size_t begin = std::min(_state.dirtyBegin, _state.len);
+        const size_t end = std::min(_state.dirtyEnd, _state.len);
+        _sync(begin, end-begin, flags);
+        _state.dirtyBegin = 0;
+        _state.dirtyEnd = 0;
+    }
+    
+    void _sync(size_t off, size_t len, int flags) const {
+        if (!_state.data) throw RuntimeError("invalid state");
+        data(off, len); // Check bounds
+        if (!len) return; // Short-circuit if there's nothing to sync
+        const size_t begin = PageFloor(off);
+        const size_t end = PageCeil(off+len);
+        int ir = msync(_state.data+begin, end-begin, flags);
+        if (ir) throw RuntimeError("msync failed: %s", strerror(errno));
+    }
+    
+    // _commit(): map the file's pages [begin,end) into our reservation
+    void _commit(size_t begin, size_t end) {
+        if (begin == end) return;
+        void* data = mmap(_state.data+begin, end-begin, _MmapProtection(_state.oflags),
+            _MmapFlags(_state.oflags, _state.opts)|MAP_FIXED, _state.fd, begin);
+        if (data == MAP_FAILED) throw RuntimeError("mmap failed: %s", strerror(errno));
+        _applyOptions(begin, end-begin);
+    }
+    
+    void _lenGrowable(size_t l) {
+        // Grow the file geometrically if it's too small
+        if (l > _state.fileLen) {
+            const size_t fileLenPrev = _state.fileLen;
+            const size_t fileLen = std::min(_state.cap, PageCeil(std::max({l, 2*fileLenPrev, _GrowableMin})));
+            const int ir = ftruncate(_state.fd, fileLen);
+            if (ir) throw Toastbox::RuntimeError("ftruncate failed: %s", strerror(errno));
+            _state.fileLen = fileLen;
+            _commit(PageFloor(fileLenPrev), PageCeil(fileLen));
+        }
+        _state.len = l;
+    }
+    
+    void _init(FileDescriptor&& fd, std::optional<size_t> cap, int oflags, const Options& opts) {
         assert(!cap || *cap==PageCeil(*cap));
         
         _state.fd = std::move(fd);
         _state.oflags = oflags;
+        _state.opts = opts;
         
         // Determine file size
         struct stat st;
         int ir = fstat(_state.fd, &st);
         if (ir) throw RuntimeError("fstat failed: %s", strerror(errno));
         const size_t fileLen = st.st_size;
+        _state.fileLen = fileLen;
+        
+        // Growable: reserve `cap` bytes of address space, and only map the existing
+        // file pages. Subsequent pages are mapped as needed by len(x).
+        if (opts.growable) {
+            if (!cap) throw RuntimeError("growable mapping requires a capacity");
+            if (fileLen > *cap) throw RuntimeError("file is larger than capacity");
+            _state.len = fileLen;
+            _state.cap = *cap;
+            void* data = mmap(nullptr, _state.cap, PROT_NONE, MAP_PRIVATE|MAP_ANON, -1, 0);
+            if (data == MAP_FAILED) throw RuntimeError("mmap failed: %s", strerror(errno));
+            _state.data = (uint8_t*)data;
+            _commit(0, PageCeil(fileLen));
+            return;
+        }
         
         // No capacity specified: len=file length, cap=ceiled file length
         if (!cap) {
@@ -159,17 +353,24 @@ private:
             _state.cap = *cap;
         }
         
-        void* data = mmap(nullptr, _state.cap, _MmapProtection(_state.oflags), _MmapFlags(_state.oflags), _state.fd, 0);
+        void* data = mmap(nullptr, _state.cap, _MmapProtection(_state.oflags), _MmapFlags(_state.oflags, _state.opts), _state.fd, 0);
         if (data == MAP_FAILED) throw RuntimeError("mmap failed: %s", strerror(errno));
         _state.data = (uint8_t*)data;
+        _applyOptions(0, PageCeil(_state.len));
     }
     
     struct {
         FileDescriptor fd;
         int oflags = 0;
+        Options opts;
         uint8_t* data = nullptr;
         size_t len = 0;
         size_t cap = 0;
+        size_t fileLen = 0; // Only used in growable mode
+        // [dirtyBegin,dirtyEnd): range that needs to be flushed, if opts.trackDirty
+        // Mutable so that sync() can remain const
+        mutable size_t dirtyBegin = 0;
+        mutable size_t dirtyEnd = 0;
     } _state = {};
 };
 
@@ -1,32 +1,64 @@
 #pragma once
 #include <cinttypes>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
 #include <limits>
 #include <charconv>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <type_traits>
+#include <vector>
 #include "RuntimeError.h"
 
 namespace Toastbox {
 
+// Parsing functions come in three flavors:
+//   - IntForStr()/FloatForStr(): throw on failure
+//   - IntForStrTry()/FloatForStrTry(): return a std::errc (std::errc() on
+//     success, std::errc::invalid_argument or std::errc::result_out_of_range
+//     on failure), and leave the output untouched on failure
+//   - IntForStrOpt()/FloatForStrOpt(): return a std::optional
+// None of them allocate (except to format a thrown error).
+
 template<typename T>
-static T IntForStr(std::string_view s, uint8_t base=10) {
+static std::errc IntForStrTry(T& x, std::string_view s, uint8_t base=10) {
     constexpr bool T_Signed = std::numeric_limits<T>::is_signed;
     using T_IntType = typename std::conditional<T_Signed, intmax_t, uintmax_t>::type;
     T_IntType i = 0;
     
     auto r = std::from_chars(s.data(), s.data()+s.size(), i, base);
-    if (r.ec != std::errc()) throw RuntimeError("invalid integer: %s", std::string(s).c_str());
+    if (r.ec != std::errc()) return r.ec;
     
     if constexpr (T_Signed) {
         if (i>std::numeric_limits<T>::max() || i<std::numeric_limits<T>::min()) {
-            throw RuntimeError("integer out of range: %jd", (intmax_t)i);
+            return std::errc::result_out_of_range;
         }
     } else {
         if (i>std::numeric_limits<T>::max()) {
-            throw RuntimeError("integer out of range: %ju", (intmax_t)i);
+            return std::errc::result_out_of_range;
         }
     }
     
-    return (T)i;
+    x = (T)i;
+    return std::errc();
+}
+
+template<typename T>
+static std::optional<T> IntForStrOpt(std::string_view s, uint8_t base=10) {
+    T x;
+    if (IntForStrTry(x, s, base) != std::errc()) return std::nullopt;
+    return x;
+}
+
+template<typename T>
+static T IntForStr(std::string_view s, uint8_t base=10) {
+    T x;
+    const std::errc ec = IntForStrTry(x, s, base);
+    if (ec == std::errc::result_out_of_range) throw RuntimeError("integer out of range: %s", std::string(s).c_str());
+    if (ec != std::errc()) throw RuntimeError("invalid integer: %s", std::string(s).c_str());
+    return x;
 }
 
 template<typename T>
@@ -34,13 +66,70 @@ static void IntForStr(T& i, std::string_view s, uint8_t base=10) {
     i = IntForStr<T>(s, base);
 }
 
+// _FloatFromChars(): std::from_chars() for floats, where the standard library
+// supports it. Otherwise, falls back to strtof()/strtod()/strtold(), via a
+// stack copy of the string (since they require a null terminator).
+template<typename T>
+static std::from_chars_result _FloatFromChars(const char* begin, const char* end, T& x) {
+#if __cpp_lib_to_chars >= 201611L
+    return std::from_chars(begin, end, x);
+#else
+    constexpr size_t BufCap = 128;
+    const size_t len = end-begin;
+    char buf[BufCap];
+    std::string str;
+    const char* s = buf;
+    if (len < BufCap) {
+        memcpy(buf, begin, len);
+        buf[len] = 0;
+    } else {
+        str = std::string(begin, len);
+        s = str.c_str();
+    }
+    
+    char* send = nullptr;
+    errno = 0;
+    T y;
+    if constexpr (std::is_same_v<T, float>)         y = strtof(s, &send);
+    else if constexpr (std::is_same_v<T, double>)   y = strtod(s, &send);
+    else                                            y = strtold(s, &send);
+    
+    if (send == s) return { begin, std::errc::invalid_argument };
+    const char* ptr = begin + (send-s);
+    if (errno == ERANGE) return { ptr, std::errc::result_out_of_range };
+    x = y;
+    return { ptr, std::errc() };
+#endif
+}
+
+// FloatForStrTry(): like std::stod() (which FloatForStr() used to call), leading
+// whitespace and a leading '+' are accepted, although std::from_chars()
+// rejects them
+template<typename T>
+static std::errc FloatForStrTry(T& x, std::string_view s) {
+    static_assert(std::is_floating_point_v<T>);
+    const char* begin = s.data();
+    const char* end = s.data()+s.size();
+    while (begin!=end && (*begin==' ' || (*begin>='\t' && *begin<='\r'))) begin++;
+    // Only skip a '+' that precedes the number itself, so that eg "+-1" is still invalid
+    if (end-begin>=2 && begin[0]=='+' && begin[1]!='-' && begin[1]!='+') begin++;
+    return _FloatFromChars(begin, end, x).ec;
+}
+
+template<typename T>
+static std::optional<T> FloatForStrOpt(std::string_view s) {
+    T x;
+    if (FloatForStrTry(x, s) != std::errc()) return std::nullopt;
+    return x;
+}
+
 template<typename T>
 static T FloatForStr(std::string_view s) {
-    return std::stod(std::string(s));
-//    T y;
-//    auto r = std::from_chars(s.data(), s.data()+s.size(), y);
-//    if (r.ec != std::errc()) throw RuntimeError("invalid float: %s", std::string(s).c_str());
-//    return y;
+    T x;
+    const std::errc ec = FloatForStrTry(x, s);
+    if (ec == std::errc::result_out_of_range) throw RuntimeError("float out of range: %s", std::string(s).c_str());
+    if (ec != std::errc()) throw RuntimeError("invalid float: %s", std::string(s).c_str());
+    return x;
 }
 
 template<typename T>
@@ -48,4 +137,115 @@ static void FloatForStr(T& i, std::string_view s) {
     i = FloatForStr<T>(s);
 }
 
+// _SWAR*: parse decimal digits 8 at a time, using SIMD-within-a-register
+// arithmetic on a little-endian uint64_t (portable across arm64/x86_64)
+static inline uint64_t _SWARLoad(const char* p) {
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static inline bool _SWARIsEightDigits(uint64_t x) {
+    // Every byte must be in '0'...'9': its high nibble must be 3, both before
+    // and after adding 6 (which carries into the high nibble for > '9')
+    return ((x & 0xF0F0F0F0F0F0F0F0) == 0x3030303030303030) &&
+        (((x + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) == 0x3030303030303030);
+}
+
+static inline uint32_t _SWAREightDigits(uint64_t x) {
+    x -= 0x3030303030303030;
+    x = (x * 10) + (x >> 8); // Pairs of digits
+    x = (((x & 0x000000FF000000FF) * (100 + (1000000ULL << 32))) +
+        (((x >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32)))) >> 32;
+    return (uint32_t)x;
+}
+
+// _IntFromChars(): base-10 std::from_chars(), with an 8-digits-at-a-time
+// fast path. Numbers with too many digits to accumulate without overflow
+// use std::from_chars().
+template<typename T>
+static std::from_chars_result _IntFromChars(const char* begin, const char* end, T& x) {
+    constexpr bool T_Signed = std::numeric_limits<T>::is_signed;
+    constexpr ptrdiff_t DigitsMax = 18; // uint64_t can't overflow with <= 18 digits
+    const char* p = begin;
+    bool neg = false;
+    if (T_Signed && p!=end && *p=='-') {
+        neg = true;
+        p++;
+    }
+    
+    const char* digits = p;
+    uint64_t acc = 0;
+    while (end-p>=8 && (p-digits)+8<=DigitsMax) {
+        const uint64_t v = _SWARLoad(p);
+        if (!_SWARIsEightDigits(v)) break;
+        acc = acc*100000000 + _SWAREightDigits(v);
+        p += 8;
+    }
+    while (p!=end && *p>='0' && *p<='9' && p-digits<DigitsMax) {
+        acc = acc*10 + (*p-'0');
+        p++;
+    }
+    
+    if (p == digits) return { begin, std::errc::invalid_argument };
+    // Too many digits for the fast path
+    if (p!=end && *p>='0' && *p<='9') return std::from_chars(begin, end, x);
+    
+    if constexpr (T_Signed) {
+        using U = std::make_unsigned_t<T>;
+        const uint64_t max = (uint64_t)std::numeric_limits<T>::max() + (neg ? 1 : 0);
+        if (acc > max) return { p, std::errc::result_out_of_range };
+        x = (T)(neg ? (U)(0-(U)acc) : (U)acc);
+    } else {
+        if (acc > (uint64_t)std::numeric_limits<T>::max()) return { p, std::errc::result_out_of_range };
+        x = (T)acc;
+    }
+    return { p, std::errc() };
+}
+
+// NumsForStrTry(): parses the numbers in `s` into `nums` (appending to it),
+// for bulk-parsing eg a memory-mapped text file. Numbers are separated by
+// any combination of whitespace and `delim`. On failure, returns the error,
+// and sets `errOff` (if non-null) to the offset of the offending number.
+template<typename T>
+static std::errc NumsForStrTry(std::vector<T>& nums, std::string_view s, char delim=',', size_t* errOff=nullptr) {
+    static_assert(std::is_arithmetic_v<T>);
+    auto sep = [&] (char c) {
+        return c==delim || c==' ' || c=='\t' || c=='\n' || c=='\r';
+    };
+    
+    const char* begin = s.data();
+    const char* end = begin+s.size();
+    const char* p = begin;
+    for (;;) {
+        while (p!=end && sep(*p)) p++;
+        if (p == end) break;
+        
+        T x;
+        std::from_chars_result r;
+        if constexpr (std::is_floating_point_v<T>) r = _FloatFromChars(p, end, x);
+        else r = _IntFromChars(p, end, x);
+        
+        // The number must be followed by a separator (or the end)
+        if (r.ec==std::errc() && r.ptr!=end && !sep(*r.ptr)) r.ec = std::errc::invalid_argument;
+        if (r.ec != std::errc()) {
+            if (errOff) *errOff = p-begin;
+            return r.ec;
+        }
+        
+        nums.push_back(x);
+        p = r.ptr;
+    }
+    return std::errc();
+}
+
+template<typename T>
+static std::vector<T> NumsForStr(std::string_view s, char delim=',') {
+    std::vector<T> nums;
+    size_t off = 0;
+    const std::errc ec = NumsForStrTry(nums, s, delim, &off);
+    if (ec != std::errc()) throw RuntimeError("invalid number at offset %zu", off);
+    return nums;
+}
+
 } // namespace Toastbox
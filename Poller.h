@@ -0,0 +1,173 @@
+#pragma once
+#include <unistd.h>
+#include <errno.h>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <system_error>
+#include "FileDescriptor.h"
+
+#if __APPLE__
+#include <sys/event.h>
+#elif __linux__
+#include <sys/epoll.h>
+#endif
+
+namespace Toastbox {
+
+// Poller: an fd readiness multiplexer backed by epoll (Linux) or kqueue (macOS)
+//
+// Unlike Select(), fds are registered once via add() and stay registered until
+// remove(), so each wait() only costs O(ready fds) rather than O(registered fds),
+// and there's no FD_SETSIZE limit.
+
+class Poller {
+public:
+    using Events = uint8_t;
+    static constexpr Events Read  = 1<<0;
+    static constexpr Events Write = 1<<1;
+    
+    struct Ready {
+        int fd = -1;
+        Events events = 0;
+    };
+    
+    Poller() {
+#if __APPLE__
+        int fd = kqueue();
+        if (fd < 0) throw std::system_error(errno, std::generic_category());
+#elif __linux__
+        int fd = epoll_create1(EPOLL_CLOEXEC);
+        if (fd < 0) throw std::system_error(errno, std::generic_category());
+#endif
+        _fd = fd;
+    }
+    
+    // add(): begin monitoring `fd` for `events`
+    void add(int fd, Events events) {
+#if __APPLE__
+        _kevent(fd, events, EV_ADD);
+#elif __linux__
+        _epollCtl(EPOLL_CTL_ADD, fd, events);
+#endif
+    }
+    
+    // modify(): change the events that `fd` is monitored for
+    void modify(int fd, Events events) {
+#if __APPLE__
+        _kevent(fd, events, EV_ADD);
+#elif __linux__
+        _epollCtl(EPOLL_CTL_MOD, fd, events);
+#endif
+    }
+    
+    // remove(): stop monitoring `fd`
+    void remove(int fd) {
+#if __APPLE__
+        struct kevent ev[2];
+        EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+        EV_SET(&ev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+        int ir = kevent(_fd, ev, 2, nullptr, 0, nullptr);
+        if (ir < 0) throw std::system_error(errno, std::generic_category());
+#elif __linux__
+        int ir = epoll_ctl(_fd, EPOLL_CTL_DEL, fd, nullptr);
+        if (ir < 0) throw std::system_error(errno, std::generic_category());
+#endif
+    }
+    
+    // wait(): wait until at least one registered fd is ready, or the deadline passes.
+    // Stores up to `cap` ready fds into `ready`, and returns the number stored (0 on
+    // timeout). Hangups/errors are reported as the fd being ready, so that the
+    // subsequent read()/write() reports the condition.
+    //
+    // On macOS, an fd that's both readable and writable may be reported as two
+    // separate entries.
+    size_t wait(Ready* ready, size_t cap,
+    std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point()) {
+        using namespace std::chrono;
+        constexpr size_t EventCap = 64;
+        const int count = (int)std::min(cap, EventCap);
+        if (!count) return 0;
+        
+        int ir = 0;
+#if __APPLE__
+        struct kevent evs[EventCap];
+        do {
+            struct timespec timeout;
+            struct timespec* timeoutp = nullptr;
+            if (deadline.time_since_epoch().count()) {
+                const auto rem = std::max(steady_clock::duration::zero(), deadline-steady_clock::now());
+                const auto sec = duration_cast<seconds>(rem);
+                const auto nsec = duration_cast<nanoseconds>(rem-sec);
+                timeout = {
+                    .tv_sec = (time_t)sec.count(),
+                    .tv_nsec = (long)nsec.count(),
+                };
+                timeoutp = &timeout;
+            }
+            ir = kevent(_fd, nullptr, 0, evs, count, timeoutp);
+        } while (ir==-1 && errno==EINTR);
+        if (ir < 0) throw std::system_error(errno, std::generic_category());
+        
+        for (int i=0; i<ir; i++) {
+            ready[i] = {
+                .fd = (int)evs[i].ident,
+                .events = (evs[i].filter==EVFILT_READ ? Read : Write),
+            };
+        }
+#elif __linux__
+        struct epoll_event evs[EventCap];
+        do {
+            int timeout = -1;
+            if (deadline.time_since_epoch().count()) {
+                const auto rem = ceil<milliseconds>(deadline-steady_clock::now());
+                timeout = (int)std::max((milliseconds::rep)0, rem.count());
+            }
+            ir = epoll_wait(_fd, evs, count, timeout);
+        } while (ir==-1 && errno==EINTR);
+        if (ir < 0) throw std::system_error(errno, std::generic_category());
+        
+        for (int i=0; i<ir; i++) {
+            const uint32_t e = evs[i].events;
+            ready[i] = {
+                .fd = evs[i].data.fd,
+                .events = (Events)(
+                    ((e & (EPOLLIN|EPOLLHUP|EPOLLERR)) ? Read : 0) |
+                    ((e & (EPOLLOUT|EPOLLERR))         ? Write : 0)
+                ),
+            };
+        }
+#endif
+        return ir;
+    }
+    
+    size_t wait(Ready* ready, size_t cap, std::chrono::milliseconds timeout) {
+        return wait(ready, cap, std::chrono::steady_clock::now()+timeout);
+    }
+    
+private:
+#if __APPLE__
+    void _kevent(int fd, Events events, uint16_t flags) {
+        // Register both filters, and enable/disable each according to `events`,
+        // so that modify() doesn't need to know which filters were registered
+        struct kevent ev[2];
+        EV_SET(&ev[0], fd, EVFILT_READ, flags|((events & Read) ? EV_ENABLE : EV_DISABLE), 0, 0, nullptr);
+        EV_SET(&ev[1], fd, EVFILT_WRITE, flags|((events & Write) ? EV_ENABLE : EV_DISABLE), 0, 0, nullptr);
+        int ir = kevent(_fd, ev, 2, nullptr, 0, nullptr);
+        if (ir < 0) throw std::system_error(errno, std::generic_category());
+    }
+#elif __linux__
+    void _epollCtl(int op, int fd, Events events) {
+        struct epoll_event ev = {
+            .events = ((events & Read) ? (uint32_t)EPOLLIN : 0u) | ((events & Write) ? (uint32_t)EPOLLOUT : 0u),
+            .data = { .fd = fd },
+        };
+        int ir = epoll_ctl(_fd, op, fd, &ev);
+        if (ir < 0) throw std::system_error(errno, std::generic_category());
+    }
+#endif
+    
+    FileDescriptor _fd;
+};
+
+} // namespace Toastbox
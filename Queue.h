@@ -4,6 +4,30 @@
 
 namespace Toastbox {
 
+// QueueSlots:
+//   QueueSlots is the fixed array of `T_Count` slots underlying Queue and
+//   SignalQueueMPMC, and the mapping from their positions to slots.
+//   
+//   Idx() maps a free-running position to its slot index: when T_Count is a
+//   power of 2 (Pow2) that's a mask, otherwise a modulo. Callers that wrap
+//   their positions at T_Count themselves (like Queue does when !Pow2) can
+//   index with them directly instead.
+
+template<typename T_Slot, size_t T_Count>
+struct QueueSlots {
+    static constexpr bool Pow2 = T_Count && !(T_Count & (T_Count-1));
+    
+    static constexpr size_t Idx(size_t pos) {
+        if constexpr (Pow2) return pos & (T_Count-1);
+        else                return pos % T_Count;
+    }
+    
+    T_Slot& operator[](size_t idx) { return slots[idx]; }
+    const T_Slot& operator[](size_t idx) const { return slots[idx]; }
+    
+    T_Slot slots[T_Count];
+};
+
 // Queue:
 //   Queue is a statically-sized queue that manages `T_Count` items
 //   to facilitate producer-consumer schemes.
@@ -20,47 +44,70 @@ template<typename T_Item, size_t T_Count, bool T_FullReset=false, auto T_Assert=
 class Queue {
 public:
     // Read
-    bool rok() const { return _w!=_r || _full; }
+    bool rok() const {
+        if constexpr (_Pow2) return _w != _r;
+        else                 return _w!=_r || _full;
+    }
     
     T_Item& rget() {
         _Assert(rok());
-        return _items[_r];
+        return _items[_idx(_r)];
     }
     
     void rpop() {
         _Assert(rok());
         _r++;
-        if (_r == T_Count) _r = 0;
-        _full = false;
+        if constexpr (!_Pow2) {
+            if (_r == T_Count) _r = 0;
+            _full = false;
+        }
     }
     
     // Write
-    bool wok() const { return !_full; }
+    bool wok() const {
+        if constexpr (_Pow2) return _w-_r < T_Count;
+        else                 return !_full;
+    }
     
     T_Item& wget() {
         _Assert(wok());
-        return _items[_w];
+        return _items[_idx(_w)];
     }
     
     void wpush() {
         _Assert(wok());
         _w++;
-        if (_w == T_Count) _w = 0;
-        if (_w == _r) _full = true;
+        if constexpr (!_Pow2) {
+            if (_w == T_Count) _w = 0;
+            if (_w == _r) _full = true;
+        }
     }
     
     // Reset
     void reset() {
-        _w = 0;
+        _w = _WReset;
         _r = 0;
-        _full = T_FullReset;
+        _full = _FullReset;
     }
     
 private:
-    T_Item _items[T_Count];
-    size_t _w = 0;
+    using _Slots = QueueSlots<T_Item,T_Count>;
+    
+    // When T_Count is a power of 2, _w/_r are free-running counters that are
+    // masked to get the item index, so the full/empty checks don't need _full.
+    static constexpr bool _Pow2 = _Slots::Pow2;
+    static constexpr size_t _WReset = (_Pow2 && T_FullReset) ? T_Count : 0;
+    static constexpr bool _FullReset = !_Pow2 && T_FullReset;
+    
+    static constexpr size_t _idx(size_t x) {
+        if constexpr (_Pow2) return _Slots::Idx(x);
+        else                 return x;
+    }
+    
+    _Slots _items;
+    size_t _w = _WReset;
     size_t _r = 0;
-    bool _full = T_FullReset;
+    bool _full = _FullReset;
     
     static void _Assert(bool c) {
         if constexpr (!std::is_same_v<decltype(T_Assert), std::nullptr_t>) {
@@ -1,7 +1,26 @@
 #pragma once
-#include <sys/select.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <chrono>
+#include <system_error>
 #include "RuntimeError.h"
 
+#if __APPLE__
+#include <sys/types.h>
+#include <sys/socket.h>
+#elif __linux__
+#include <sys/sendfile.h>
+#endif
+
 namespace Toastbox {
 
 // Read()/Write(): simple wrappers around the read()/write() syscalls
@@ -13,72 +32,84 @@ struct ReadWriteTimeout : std::exception {
     }
 };
 
-inline int _FDMax(const int* fds, size_t fdsLen) {
-    int r = -1;
-    for (size_t i=0; i<fdsLen; i++) r = std::max(r, fds[i]);
-    return r;
+// FdMode: whether an fd has O_NONBLOCK set, which determines how Read()/Write()
+// honor a deadline. Defaults to FdMode::Blocking (wait for readiness before
+// each syscall), which works for any fd. Callers with a non-blocking fd can
+// pass FdMode::NonBlocking to skip the wait, or FdMode::Unknown to have it
+// determined via an extra fcntl() per call (when a deadline is specified).
+enum class FdMode : uint8_t {
+    Unknown,
+    Blocking,
+    NonBlocking,
+};
+
+// _PollTimeout(): converts a deadline to a poll() timeout (in milliseconds),
+// rounding up so that we don't spin when <1ms remains
+inline int _PollTimeout(std::chrono::steady_clock::time_point deadline) {
+    using namespace std::chrono;
+    if (!deadline.time_since_epoch().count()) return -1;
+    const auto rem = ceil<milliseconds>(deadline-steady_clock::now());
+    return (int)std::clamp(rem.count(), (milliseconds::rep)0, (milliseconds::rep)std::numeric_limits<int>::max());
+}
+
+// _Poll(): poll() wrapper that handles EINTR by recomputing the remaining timeout
+inline int _Poll(struct pollfd* pfds, size_t pfdsLen, std::chrono::steady_clock::time_point deadline) {
+    int ir = 0;
+    do ir = poll(pfds, (nfds_t)pfdsLen, _PollTimeout(deadline));
+    while (ir==-1 && errno==EINTR);
+    if (ir < 0) throw std::system_error(errno, std::generic_category());
+    return ir;
 }
 
-inline fd_set _FDSet(const int* fds, size_t fdsLen) {
-    fd_set r;
-    FD_ZERO(&r);
-    for (size_t i=0; i<fdsLen; i++) FD_SET(fds[i], &r);
-    return r;
+// _Wait(): wait for a single fd to become readable (T_Write=false) or writable
+// (T_Write=true). Returns false on timeout.
+template<bool T_Write>
+inline bool _Wait(int fd, std::chrono::steady_clock::time_point deadline) {
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = (T_Write ? POLLOUT : POLLIN),
+        .revents = 0,
+    };
+    return _Poll(&pfd, 1, deadline) > 0;
 }
 
+// Select(): wait until any of `rfds` are readable or any of `wfds` are writable.
+// On return, the fds that aren't ready are set to -1.
+// Implemented with poll(), so it isn't limited to FD_SETSIZE. For monitoring many
+// fds repeatedly, use Poller instead.
 inline bool Select(int* rfds, size_t rfdsLen, int* wfds, size_t wfdsLen,
 std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point()) {
     
-    using namespace std::chrono;
-    
-    // Determine fdMax (the largest supplied fd)
-    const int fdMax = std::max(_FDMax(rfds, rfdsLen), _FDMax(wfds, wfdsLen));
-    const fd_set rfdconst = _FDSet(rfds, rfdsLen);
-    const fd_set wfdconst = _FDSet(wfds, wfdsLen);
+    // Use a stack buffer for the common case of a few fds
+    constexpr size_t StackCap = 16;
+    struct pollfd pfdsStack[StackCap];
+    std::vector<struct pollfd> pfdsHeap;
+    const size_t pfdsLen = rfdsLen+wfdsLen;
+    struct pollfd* pfds = pfdsStack;
+    if (pfdsLen > StackCap) {
+        pfdsHeap.resize(pfdsLen);
+        pfds = pfdsHeap.data();
+    }
     
-    fd_set rfd;
-    fd_set wfd;
-    int ir = 0;
-    do {
-        // Prepare our timeout if a deadline was specified
-        struct timeval timeout;
-        struct timeval* timeoutp = nullptr;
-        if (deadline.time_since_epoch().count()) {
-            auto rem = deadline-steady_clock::now();
-            auto sec = duration_cast<seconds>(rem);
-            auto usec = duration_cast<microseconds>(rem-sec);
-            
-            timeout = {
-                .tv_sec = std::max(0, (int)sec.count()),
-                .tv_usec = std::max(0, (int)usec.count()),
-            };
-            timeoutp = &timeout;
-        }
-        
-        rfd = rfdconst;
-        wfd = wfdconst;
-        ir = select(fdMax+1, &rfd, &wfd, nullptr, timeoutp);
+    for (size_t i=0; i<rfdsLen; i++) pfds[i]         = { .fd=rfds[i], .events=POLLIN,  .revents=0 };
+    for (size_t i=0; i<wfdsLen; i++) pfds[rfdsLen+i] = { .fd=wfds[i], .events=POLLOUT, .revents=0 };
     
-    } while (ir==-1 && errno==EINTR);
-    if (ir < 0) throw std::system_error(errno, std::generic_category());
+    const int ir = _Poll(pfds, pfdsLen, deadline);
     if (ir == 0) return false; // Timeout
     
     // Clear the fds in rfds that aren't ready for reading
     for (size_t i=0; i<rfdsLen; i++) {
-        const int fd = rfds[i];
-        if (!FD_ISSET(fd, &rfd)) rfds[i] = -1;
+        if (!(pfds[i].revents & (POLLIN|POLLHUP|POLLERR))) rfds[i] = -1;
     }
     
     // Clear the fds in wfds that aren't ready for writing
     for (size_t i=0; i<wfdsLen; i++) {
-        const int fd = wfds[i];
-        if (!FD_ISSET(fd, &wfd)) wfds[i] = -1;
+        if (!(pfds[rfdsLen+i].revents & (POLLOUT|POLLHUP|POLLERR))) wfds[i] = -1;
     }
     
     return true;
 }
 
-
 //template<bool T_Write>
 //inline bool _Select(int fd, const std::chrono::steady_clock::time_point& deadline) {
 //    using namespace std::chrono;
@@ -104,56 +135,302 @@ std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_p
 //    return true;
 //}
 
-inline size_t Read(int fd, void* data, size_t len, std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point()) {
-    uint8_t* d = (uint8_t*)data;
+// _NonBlocking(): whether `fd` has O_NONBLOCK set, according to `mode` if it's
+// known, otherwise via fcntl()
+inline bool _NonBlocking(int fd, FdMode mode=FdMode::Unknown) {
+    if (mode != FdMode::Unknown) return mode == FdMode::NonBlocking;
+    const int fl = fcntl(fd, F_GETFL);
+    if (fl < 0) throw std::system_error(errno, std::generic_category());
+    return fl & O_NONBLOCK;
+}
+
+// _ReadWrite(): implementation of Read()/Write()
+//
+// If a deadline is specified and `fd` is non-blocking, we try the syscall first
+// and only wait for readiness upon EAGAIN. If `fd` is blocking, we have to wait
+// for readiness before each syscall, otherwise the syscall could block beyond
+// the deadline. So with a deadline, the common case (data/space available)
+// costs one syscall for FdMode::NonBlocking, and two (poll+syscall) for
+// FdMode::Blocking. FdMode::Unknown adds an fcntl() to determine which.
+// Without a deadline, the common case is always one syscall.
+template<bool T_Write>
+inline size_t _ReadWrite(int fd, uint8_t* d, size_t len, std::chrono::steady_clock::time_point deadline, FdMode mode) {
+    const bool hasDeadline = deadline.time_since_epoch().count();
+    const bool nonBlocking = hasDeadline && _NonBlocking(fd, mode);
     size_t off = 0;
     
     while (off < len) {
-        if (deadline.time_since_epoch().count()) {
-            int fdCopy = fd;
-            bool br = Select(&fdCopy, 1, nullptr, 0, deadline);
-            if (!br) return off;
+        if (hasDeadline && !nonBlocking) {
+            if (!_Wait<T_Write>(fd, deadline)) return off;
         }
         
         ssize_t sr = 0;
-        do sr = read(fd, d+off, len-off);
-        while (sr==-1 && errno==EINTR);
+        if constexpr (!T_Write) {
+            do sr = read(fd, d+off, len-off);
+            while (sr==-1 && errno==EINTR);
+        } else {
+            do sr = write(fd, d+off, len-off);
+            while (sr==-1 && errno==EINTR);
+        }
+        
+        if (sr<0 && nonBlocking && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+            if (!_Wait<T_Write>(fd, deadline)) return off;
+            continue;
+        }
+        
+        if (sr < 0) throw std::system_error(errno, std::generic_category());
+        if (!T_Write && !sr) return off; // EOF
+        off += sr;
+    }
+    return off;
+}
+
+// Read()/Write(): returns the number of bytes transferred, which is only less
+// than `len` upon timeout (or EOF, for Read())
+inline size_t Read(int fd, void* data, size_t len, std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point(), FdMode mode=FdMode::Blocking) {
+    return _ReadWrite<false>(fd, (uint8_t*)data, len, deadline, mode);
+}
+
+inline size_t Write(int fd, const void* data, size_t len, std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point(), FdMode mode=FdMode::Blocking) {
+    return _ReadWrite<true>(fd, (uint8_t*)data, len, deadline, mode);
+}
+
+// _ReadWriteV(): implementation of ReadV()/WriteV()
+//
+// Same waiting strategy as _ReadWrite(). Partial transfers are resumed from the
+// iovec where the previous syscall stopped, so the caller's iovecs are copied
+// first (onto the stack, for the common case of a few iovecs) since we need to
+// modify them.
+template<bool T_Write>
+inline size_t _ReadWriteV(int fd, const struct iovec* iovs, size_t iovsLen, std::chrono::steady_clock::time_point deadline, FdMode mode) {
+    constexpr size_t StackCap = 16;
+    struct iovec iovStack[StackCap];
+    std::vector<struct iovec> iovHeap;
+    struct iovec* iov = iovStack;
+    if (iovsLen > StackCap) {
+        iovHeap.resize(iovsLen);
+        iov = iovHeap.data();
+    }
+    std::copy(iovs, iovs+iovsLen, iov);
+    
+    // advance(): skip past `len` bytes, dropping the iovecs that are complete
+    // (including empty ones)
+    size_t iovLen = iovsLen;
+    const auto advance = [&] (size_t len) {
+        while (iovLen && len>=iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            iovLen--;
+        }
+        if (len) {
+            iov->iov_base = (uint8_t*)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    };
+    
+    const bool hasDeadline = deadline.time_since_epoch().count();
+    const bool nonBlocking = hasDeadline && _NonBlocking(fd, mode);
+    size_t off = 0;
+    
+    advance(0);
+    while (iovLen) {
+        if (hasDeadline && !nonBlocking) {
+            if (!_Wait<T_Write>(fd, deadline)) return off;
+        }
+        
+        const int count = (int)std::min(iovLen, (size_t)IOV_MAX);
+        ssize_t sr = 0;
+        if constexpr (!T_Write) {
+            do sr = readv(fd, iov, count);
+            while (sr==-1 && errno==EINTR);
+        } else {
+            do sr = writev(fd, iov, count);
+            while (sr==-1 && errno==EINTR);
+        }
+        
+        if (sr<0 && nonBlocking && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+            if (!_Wait<T_Write>(fd, deadline)) return off;
+            continue;
+        }
+        
         if (sr < 0) throw std::system_error(errno, std::generic_category());
+        if (!T_Write && !sr) return off; // EOF
         off += sr;
+        advance(sr);
     }
     return off;
 }
 
-inline size_t Write(int fd, const void* data, size_t len, std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point()) {
-    const uint8_t* d = (const uint8_t*)data;
+// ReadV()/WriteV(): scatter/gather variants of Read()/Write(), with the same
+// EINTR/deadline handling. Returns the number of bytes transferred, which is
+// only less than the total length of `iov` upon timeout (or EOF, for ReadV()).
+inline size_t ReadV(int fd, const struct iovec* iov, size_t iovLen, std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point(), FdMode mode=FdMode::Blocking) {
+    return _ReadWriteV<false>(fd, iov, iovLen, deadline, mode);
+}
+
+inline size_t WriteV(int fd, const struct iovec* iov, size_t iovLen, std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point(), FdMode mode=FdMode::Blocking) {
+    return _ReadWriteV<true>(fd, iov, iovLen, deadline, mode);
+}
+
+// _CopyUnsupported(): whether `err` (from sendfile()/splice()/copy_file_range())
+// indicates that the syscall doesn't support this pair of fds, in which case we
+// fall back to the next strategy
+inline bool _CopyUnsupported(int err) {
+    return err==EINVAL || err==ENOSYS || err==EXDEV || err==EBADF ||
+           err==EOPNOTSUPP || err==ENOTSUP || err==ENOTSOCK;
+}
+
+// _Copy(): repeatedly calls `fn(n)` until `len` bytes have been copied from
+// `srcFd` to `dstFd`, EOF, or the deadline passes. `fn` is a syscall wrapper
+// that copies up to `n` bytes and returns the number copied, or -1 and sets
+// errno.
+//
+// Returns std::nullopt if `fn` doesn't support the pair of fds, so the caller
+// can try the next strategy.
+template<typename T_Fn>
+inline std::optional<size_t> _Copy(int dstFd, int srcFd, size_t len, std::chrono::steady_clock::time_point deadline, T_Fn fn) {
+    const bool hasDeadline = deadline.time_since_epoch().count();
+    const bool srcWait = hasDeadline && !_NonBlocking(srcFd);
+    const bool dstWait = hasDeadline && !_NonBlocking(dstFd);
     size_t off = 0;
     
     while (off < len) {
-        if (deadline.time_since_epoch().count()) {
-            int fdCopy = fd;
-            bool br = Select(nullptr, 0, &fdCopy, 1, deadline);
-            if (!br) return off;
+        if (srcWait && !_Wait<false>(srcFd, deadline)) return off;
+        if (dstWait && !_Wait<true>(dstFd, deadline)) return off;
+        
+        ssize_t sr = 0;
+        do sr = fn(len-off);
+        while (sr==-1 && errno==EINTR);
+        
+        if (sr<0 && hasDeadline && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+            // We don't know which side would have blocked, so wait for both
+            if (!_Wait<false>(srcFd, deadline)) return off;
+            if (!_Wait<true>(dstFd, deadline)) return off;
+            continue;
         }
         
+        if (sr < 0) {
+            if (!off && _CopyUnsupported(errno)) return std::nullopt;
+            throw std::system_error(errno, std::generic_category());
+        }
+        if (!sr) return off; // EOF
+        off += sr;
+    }
+    return off;
+}
+
+// _CopyBuffered(): the fallback for SendFile()/Splice(), which copies through a
+// userspace buffer. If `srcOff` is non-null, reads via pread() from `*srcOff`
+// and advances it; otherwise reads from `srcFd`'s file offset.
+inline size_t _CopyBuffered(int dstFd, int srcFd, off_t* srcOff, size_t len, std::chrono::steady_clock::time_point deadline) {
+    constexpr size_t BufCap = 1<<16;
+    const auto buf = std::make_unique<uint8_t[]>(std::min(len, BufCap));
+    const bool hasDeadline = deadline.time_since_epoch().count();
+    // Determine `dstFd`'s mode once, rather than in every Write()
+    const FdMode dstMode = (!hasDeadline ? FdMode::Unknown :
+        (_NonBlocking(dstFd) ? FdMode::NonBlocking : FdMode::Blocking));
+    size_t off = 0;
+    
+    while (off < len) {
+        if (hasDeadline && !_Wait<false>(srcFd, deadline)) return off;
+        
+        const size_t chunk = std::min(len-off, BufCap);
         ssize_t sr = 0;
-        do sr = write(fd, d+off, len-off);
+        do sr = (srcOff ? pread(srcFd, buf.get(), chunk, *srcOff) : read(srcFd, buf.get(), chunk));
         while (sr==-1 && errno==EINTR);
+        
+        if (sr<0 && hasDeadline && (errno==EAGAIN || errno==EWOULDBLOCK)) continue;
         if (sr < 0) throw std::system_error(errno, std::generic_category());
-        off += sr;
+        if (!sr) return off; // EOF
+        if (srcOff) *srcOff += sr;
+        
+        const size_t wr = Write(dstFd, buf.get(), sr, deadline, dstMode);
+        off += wr;
+        if (wr < (size_t)sr) return off; // Timeout
     }
     return off;
 }
 
+// SendFile(): copies `len` bytes from `srcFd` (a regular file) starting at
+// `srcOff`, to `dstFd` at its current file offset, without crossing into
+// userspace when possible. `srcFd`'s file offset isn't modified.
+//
+// On Linux, uses copy_file_range() (file-to-file, which can share extents on
+// filesystems that support it), then sendfile() (file-to-anything, eg sockets).
+// On macOS, uses sendfile() (file-to-socket). Otherwise falls back to copying
+// through a userspace buffer.
+//
+// Returns the number of bytes copied, which is only less than `len` upon EOF
+// or timeout.
+inline size_t SendFile(int dstFd, int srcFd, off_t srcOff, size_t len, std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point()) {
+    off_t off = srcOff;
+#if __APPLE__
+    std::optional<size_t> r = _Copy(dstFd, srcFd, len, deadline, [&] (size_t n) -> ssize_t {
+        // sendfile() reports the bytes sent via `l`, even when it fails with EAGAIN/EINTR
+        off_t l = (off_t)n;
+        const int ir = sendfile(srcFd, dstFd, off, &l, nullptr, 0);
+        off += l;
+        if (l) return l;
+        return ir;
+    });
+    if (r) return *r;
+#elif __linux__
+    std::optional<size_t> r = _Copy(dstFd, srcFd, len, deadline, [&] (size_t n) {
+        return copy_file_range(srcFd, &off, dstFd, nullptr, n, 0);
+    });
+    if (r) return *r;
+    
+    r = _Copy(dstFd, srcFd, len, deadline, [&] (size_t n) {
+        return sendfile(dstFd, srcFd, &off, n);
+    });
+    if (r) return *r;
+#endif
+    return _CopyBuffered(dstFd, srcFd, &off, len, deadline);
+}
+
+// Splice(): copies `len` bytes from `srcFd` at its current file offset, to
+// `dstFd` at its current file offset. Unlike SendFile(), `srcFd` can be a pipe
+// or socket.
+//
+// On Linux, uses splice() (if either fd is a pipe), then sendfile() (if `srcFd`
+// is a regular file). Otherwise falls back to copying through a userspace
+// buffer, which is always the case on macOS since it lacks splice().
+//
+// Returns the number of bytes copied, which is only less than `len` upon EOF
+// or timeout.
+inline size_t Splice(int dstFd, int srcFd, size_t len, std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point()) {
+#if __linux__
+    std::optional<size_t> r = _Copy(dstFd, srcFd, len, deadline, [&] (size_t n) {
+        return splice(srcFd, nullptr, dstFd, nullptr, n, SPLICE_F_MOVE);
+    });
+    if (r) return *r;
+    
+    r = _Copy(dstFd, srcFd, len, deadline, [&] (size_t n) {
+        return sendfile(dstFd, srcFd, nullptr, n);
+    });
+    if (r) return *r;
+#endif
+    return _CopyBuffered(dstFd, srcFd, nullptr, len, deadline);
+}
+
 inline bool Select(int* rfds, size_t rfdsLen, int* wfds, size_t wfdsLen, std::chrono::milliseconds timeout) {
     return Select(rfds, rfdsLen, wfds, wfdsLen, std::chrono::steady_clock::now()+timeout);
 }
 
-inline void Read(int fd, void* data, size_t len, std::chrono::milliseconds timeout) {
-    Read(fd, data, len, std::chrono::steady_clock::now()+timeout);
+inline void Read(int fd, void* data, size_t len, std::chrono::milliseconds timeout, FdMode mode=FdMode::Blocking) {
+    Read(fd, data, len, std::chrono::steady_clock::now()+timeout, mode);
+}
+
+inline void Write(int fd, const void* data, size_t len, std::chrono::milliseconds timeout, FdMode mode=FdMode::Blocking) {
+    Write(fd, data, len, std::chrono::steady_clock::now()+timeout, mode);
+}
+
+inline size_t ReadV(int fd, const struct iovec* iov, size_t iovLen, std::chrono::milliseconds timeout, FdMode mode=FdMode::Blocking) {
+    return ReadV(fd, iov, iovLen, std::chrono::steady_clock::now()+timeout, mode);
 }
 
-inline void Write(int fd, const void* data, size_t len, std::chrono::milliseconds timeout) {
-    Write(fd, data, len, std::chrono::steady_clock::now()+timeout);
+inline size_t WriteV(int fd, const struct iovec* iov, size_t iovLen, std::chrono::milliseconds timeout, FdMode mode=FdMode::Blocking) {
+    return WriteV(fd, iov, iovLen, std::chrono::steady_clock::now()+timeout, mode);
 }
 
 } // namespace Toastbox
@@ -2,6 +2,8 @@
 #include <cstdlib>
 #include <algorithm>
 #include <cassert>
+#include <atomic>
+#include <span>
 
 namespace Toastbox {
 
@@ -10,6 +12,7 @@ class RingBuffer {
 public:
     
     size_t len() const {
+        if constexpr (_Pow2) return _woff-_roff;
         if (_woff > _roff)      return _woff-_roff;
         else if (_woff < _roff) return (Cap-_roff) + _woff;
         else if (_full)         return Cap;
@@ -23,6 +26,16 @@ public:
     void read(T* data, size_t len) {
         assert(len <= this->len());
         
+        if constexpr (_Pow2) {
+            // Read segment 1 (_roff to end) and segment 2 (0 to _woff)
+            const size_t idx = _roff & _Mask;
+            const size_t len1 = std::min(len, Cap-idx);
+            std::copy(_buf+idx, _buf+idx+len1, data);
+            std::copy(_buf, _buf+(len-len1), data+len1);
+            _roff += len;
+            return;
+        }
+        
         // Read segment 1 (_roff to end)
         size_t rem = len;
         const size_t len1 = std::min(rem, Cap-_roff);
@@ -66,7 +79,9 @@ public:
             
             // Update _roff according to the amount of data being overwritten
             const size_t avail = space();
-            if (len > avail) {
+            if constexpr (_Pow2) {
+                if (len > avail) _roff += len-avail;
+            } else if (len > avail) {
                 const size_t overflow = len-avail;
                 if (overflow < Cap-_roff) {
                     _roff += overflow;
@@ -76,6 +91,16 @@ public:
             }
         }
         
+        if constexpr (_Pow2) {
+            // Write segment 1 (_woff to end) and segment 2 (0 to _roff)
+            const size_t idx = _woff & _Mask;
+            const size_t len1 = std::min(len, Cap-idx);
+            std::copy(data, data+len1, _buf+idx);
+            std::copy(data+len1, data+len, _buf);
+            _woff += len;
+            return;
+        }
+        
         // Write segment 1 (_woff to end)
         size_t rem = len;
         const size_t len1 = std::min(rem, Cap-_woff);
@@ -103,10 +128,133 @@ public:
     void writeOver(T t)                         { write<true>(&t, 1);       }
     
 private:
+    // When Cap is a power of 2, _roff/_woff are free-running counters that are
+    // masked to get the buffer index. Unsigned overflow keeps `_woff-_roff`
+    // correct, so len() is branchless and _full is unused.
+    static constexpr bool _Pow2 = Cap && !(Cap & (Cap-1));
+    static constexpr size_t _Mask = Cap-1;
+    
     size_t _roff = 0;
     size_t _woff = 0;
     bool _full = false;
     T _buf[Cap];
 };
 
+// RingBufferSPSC:
+//   RingBufferSPSC is a lock-free ring buffer that can be shared between
+//   exactly one producer thread and exactly one consumer thread.
+//   
+//   The read/write offsets are free-running counters (they're never reset
+//   to 0), so the buffer is full when `_w-_r == Cap` and we don't need a
+//   separate `_full` flag. Each counter is only ever stored by one side, so
+//   plain acquire/release loads/stores suffice.
+//   
+//   In addition to the copying read()/write() API, the producer can obtain
+//   the free region of the buffer via writeReserve() (up to 2 contiguous
+//   spans), fill it directly (eg by handing the spans to USBDevice::read()),
+//   and then publish the data via writeCommit(). Similarly the consumer can
+//   access the readable region via readPeek() and release it via
+//   readConsume().
+
+template<typename T, size_t Cap>
+class RingBufferSPSC {
+public:
+    static_assert(Cap > 0);
+    
+    struct Spans {
+        std::span<T> a;
+        std::span<T> b;
+        size_t len() const { return a.size()+b.size(); }
+    };
+    
+    // len(): number of elements available for reading
+    // Only meaningful as a snapshot when called from the producer or consumer
+    size_t len() const {
+        return _w.load(std::memory_order_acquire) - _r.load(std::memory_order_acquire);
+    }
+    
+    // space(): number of elements available for writing
+    size_t space() const {
+        return Cap-len();
+    }
+    
+    // Producer
+    
+    // writeReserve(): returns up to `n` elements of free space, as up to 2 contiguous
+    // spans. The data isn't visible to the consumer until writeCommit() is called.
+    Spans writeReserve(size_t n=Cap) {
+        const size_t w = _w.load(std::memory_order_relaxed);
+        const size_t r = _r.load(std::memory_order_acquire);
+        return _spans(w, std::min(n, Cap-(w-r)));
+    }
+    
+    // writeCommit(): publishes `n` elements previously obtained via writeReserve()
+    void writeCommit(size_t n) {
+        const size_t w = _w.load(std::memory_order_relaxed);
+        assert(n <= Cap-(w-_r.load(std::memory_order_acquire)));
+        _w.store(w+n, std::memory_order_release);
+    }
+    
+    void write(const T* data, size_t len) {
+        const Spans s = writeReserve(len);
+        assert(s.len() == len);
+        std::copy(data, data+s.a.size(), s.a.data());
+        std::copy(data+s.a.size(), data+len, s.b.data());
+        writeCommit(len);
+    }
+    
+    void write(T t) { write(&t, 1); }
+    
+    // Consumer
+    
+    // readPeek(): returns up to `n` readable elements, as up to 2 contiguous spans.
+    // The elements remain in the buffer until readConsume() is called.
+    Spans readPeek(size_t n=Cap) {
+        const size_t r = _r.load(std::memory_order_relaxed);
+        const size_t w = _w.load(std::memory_order_acquire);
+        return _spans(r, std::min(n, w-r));
+    }
+    
+    // readConsume(): releases `n` elements previously obtained via readPeek()
+    void readConsume(size_t n) {
+        const size_t r = _r.load(std::memory_order_relaxed);
+        assert(n <= _w.load(std::memory_order_acquire)-r);
+        _r.store(r+n, std::memory_order_release);
+    }
+    
+    void read(T* data, size_t len) {
+        const Spans s = readPeek(len);
+        assert(s.len() == len);
+        std::copy(s.a.begin(), s.a.end(), data);
+        std::copy(s.b.begin(), s.b.end(), data+s.a.size());
+        readConsume(len);
+    }
+    
+    T read() {
+        T t;
+        read(&t, 1);
+        return t;
+    }
+    
+private:
+    // 128 bytes covers the cache line size on both x86 (64) and Apple silicon (128)
+    static constexpr size_t _CacheLineSize = 128;
+    
+    Spans _spans(size_t off, size_t len) {
+        const size_t idx = off % Cap;
+        const size_t len1 = std::min(len, Cap-idx);
+        return Spans{
+            .a = std::span<T>(_buf+idx, len1),
+            .b = std::span<T>(_buf, len-len1),
+        };
+    }
+    
+    // _w: written by the producer only
+    // _r: written by the consumer only
+    // Each lives on its own cache line to prevent false sharing between the two threads.
+    alignas(_CacheLineSize) std::atomic<size_t> _w = 0;
+    alignas(_CacheLineSize) std::atomic<size_t> _r = 0;
+    alignas(_CacheLineSize) T _buf[Cap];
+};
+
 } // namespace Toastbox
@@ -0,0 +1,162 @@
+#pragma once
+#include <mutex>
+#include <shared_mutex>
+#include <optional>
+#include <iterator>
+#include "LRU.h"
+#include "Atomic.h"
+
+namespace Toastbox {
+
+// ShardedLRU:
+//   ShardedLRU is a thread-safe LRU cache that partitions keys across
+//   `T_ShardCount` independently-locked LRUFlat shards, so that threads
+//   accessing different keys rarely contend.
+//
+//   Each shard holds up to `T_Cap/T_ShardCount` entries, and evicts down
+//   to its low-water mark (20% below its capacity) when it fills up, just
+//   like LRU::evict().
+//
+//   If `T_Approx==false`, find() promotes the entry to the front of its
+//   shard's recency list, which requires the shard's exclusive lock.
+//
+//   If `T_Approx==true`, find() only takes the shard's shared lock, and
+//   marks the entry as referenced (a CLOCK bit) instead of reordering the
+//   list. When a shard needs to evict, referenced entries at the tail get
+//   a second chance: they're moved to the front and their bit is cleared,
+//   instead of being evicted. Recency order is therefore approximate, but
+//   concurrent hits never serialize.
+//
+//   Values are returned by copy, since the entry could be evicted by
+//   another thread as soon as the shard's lock is released.
+
+template<
+typename T_Key,
+typename T_Val,
+size_t T_Cap,
+size_t T_ShardCount=16,
+bool T_Approx=false,
+typename T_Hash=LRUHash<T_Key>
+>
+class ShardedLRU {
+public:
+    static_assert(T_ShardCount && !(T_ShardCount & (T_ShardCount-1)), "T_ShardCount must be a power of 2");
+    static_assert(T_Cap/T_ShardCount >= 2, "each shard needs room for at least 2 entries");
+    
+    std::optional<T_Val> find(const T_Key& key) {
+        _Shard& s = _shard(key);
+        if constexpr (T_Approx) {
+            auto lock = std::shared_lock(s.lock);
+            const auto it = s.lru.peek(key);
+            if (it == s.lru.end()) return std::nullopt;
+            it->val.ref.store(true, std::memory_order_relaxed);
+            return it->val.val;
+        } else {
+            auto lock = std::unique_lock(s.lock);
+            const auto it = s.lru.find(key);
+            if (it == s.lru.end()) return std::nullopt;
+            return it->val.val;
+        }
+    }
+    
+    void set(const T_Key& key, T_Val val) {
+        _Shard& s = _shard(key);
+        auto lock = std::unique_lock(s.lock);
+        if constexpr (T_Approx) {
+            // Evict using the CLOCK bits before LRUFlat::operator[] would evict
+            // strictly by recency
+            if (s.lru.size()+1>=_ShardCap && s.lru.peek(key)==s.lru.end()) {
+                _evict(s);
+            }
+        }
+        _Entry& e = s.lru[key];
+        e.val = std::move(val);
+        e.ref.store(false, std::memory_order_relaxed);
+    }
+    
+    bool erase(const T_Key& key) {
+        _Shard& s = _shard(key);
+        auto lock = std::unique_lock(s.lock);
+        const auto it = s.lru.peek(key);
+        if (it == s.lru.end()) return false;
+        s.lru.erase(it);
+        return true;
+    }
+    
+    void evict() {
+        for (_Shard& s : _shards) {
+            auto lock = std::unique_lock(s.lock);
+            _evict(s);
+        }
+    }
+    
+    void clear() {
+        for (_Shard& s : _shards) {
+            auto lock = std::unique_lock(s.lock);
+            s.lru.clear();
+        }
+    }
+    
+    // size(): the total number of entries. Only a snapshot, since the
+    // shards are locked one at a time.
+    size_t size() {
+        size_t r = 0;
+        for (_Shard& s : _shards) {
+            auto lock = std::unique_lock(s.lock);
+            r += s.lru.size();
+        }
+        return r;
+    }
+    
+private:
+    // 128 bytes covers the cache line size on both x86 (64) and Apple silicon (128)
+    static constexpr size_t _CacheLineSize = 128;
+    static constexpr size_t _ShardCap = T_Cap/T_ShardCount;
+    
+    struct _Entry {
+        T_Val val = {};
+        // ref: CLOCK bit, set by find() while only holding the shared lock
+        mutable Atomic<bool> ref = false;
+    };
+    
+    using _LRU = LRUFlat<T_Key,_Entry,_ShardCap,T_Hash>;
+    using _Lock = std::conditional_t<T_Approx, std::shared_mutex, std::mutex>;
+    
+    struct alignas(_CacheLineSize) _Shard {
+        _Lock lock;
+        _LRU lru;
+    };
+    
+    _Shard& _shard(const T_Key& key) {
+        // Use the high bits of the hash to pick the shard, since LRUFlat uses
+        // the low bits to pick the hash table bucket
+        constexpr size_t Shift = (sizeof(size_t)*8)/2;
+        return _shards[(T_Hash{}(key) >> Shift) & (T_ShardCount-1)];
+    }
+    
+    // _evict(): evict until we get to the shard's low-water mark.
+    // Requires the shard's exclusive lock.
+    static void _evict(_Shard& s) {
+        if constexpr (!T_Approx) {
+            s.lru.evict();
+        } else {
+            constexpr size_t LowWater = (_ShardCap*4)/5;
+            // Give each entry at most one second chance per call, so we're
+            // guaranteed to terminate even if every entry is referenced
+            size_t chances = s.lru.size();
+            while (s.lru.size() > LowWater) {
+                const auto it = std::prev(s.lru.end());
+                if (chances && it->val.ref.exchange(false, std::memory_order_relaxed)) {
+                    s.lru.find(it->key); // Move to front
+                    chances--;
+                    continue;
+                }
+                s.lru.erase(it);
+            }
+        }
+    }
+    
+    _Shard _shards[T_ShardCount];
+};
+
+} // namespace Toastbox
@@ -1,40 +1,66 @@
 #pragma once
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <cassert>
+#include "Defer.h"
 
 namespace Toastbox {
 
+// Signal:
+//   Signal pairs a mutex with condition variables, and supports stopping
+//   (causing waiters to throw Signal::Stop).
+//
+//   Signal has `CondCount` independent condition variables, selected via the
+//   `T_Idx` template argument (default 0). This allows waiters for different
+//   conditions (eg 'not empty' and 'not full') to be woken independently.
+//
+//   Signal tracks the number of waiters on each condition variable, so that
+//   signalOne()/signalAll() are no-ops if nobody is waiting. The state that
+//   waiters are waiting on must be modified with the lock held, but
+//   signalOne()/signalAll() can be called after the lock is released.
+
 class Signal {
 public:
     struct Stop : std::exception {};
     
-    template<typename T_Cond>
+    static constexpr size_t CondCount = 2;
+    
+    template<size_t T_Idx=0, typename T_Cond>
     void wait(std::unique_lock<std::mutex>& lock, T_Cond cond) {
-        _cv.wait(lock, [&] {
+        static_assert(T_Idx < CondCount);
+        _Cond& c = _conds[T_Idx];
+        c.waiters.fetch_add(1, std::memory_order_relaxed);
+        Defer( c.waiters.fetch_sub(1, std::memory_order_relaxed) );
+        c.cv.wait(lock, [&] {
             if (_stop) throw Stop();
             return cond();
         });
     }
     
-    template<typename T_Duration, typename T_Cond>
+    template<size_t T_Idx=0, typename T_Duration, typename T_Cond>
     void wait_for(std::unique_lock<std::mutex>& lock, T_Duration dur, T_Cond cond) {
-        _cv.wait_for(lock, dur, [&] {
+        static_assert(T_Idx < CondCount);
+        _Cond& c = _conds[T_Idx];
+        c.waiters.fetch_add(1, std::memory_order_relaxed);
+        Defer( c.waiters.fetch_sub(1, std::memory_order_relaxed) );
+        c.cv.wait_for(lock, dur, [&] {
             if (_stop) throw Stop();
             return cond();
         });
     }
     
-    template<typename T_Cond>
+    template<size_t T_Idx=0, typename T_Cond>
     auto wait(T_Cond cond) {
         auto l = std::unique_lock(_lock);
-        wait(l, cond);
+        wait<T_Idx>(l, cond);
         return l;
     }
     
-    template<typename T_Duration, typename T_Cond>
+    template<size_t T_Idx=0, typename T_Duration, typename T_Cond>
     auto wait_for(T_Duration dur, T_Cond cond) {
         auto l = std::unique_lock(_lock);
-        wait_for(l, dur, cond);
+        wait_for<T_Idx>(l, dur, cond);
         return l;
     }
     
@@ -44,13 +70,24 @@ public:
         return l;
     }
     
-    void signalOne() { _cv.notify_one(); }
-    void signalAll() { _cv.notify_all(); }
+    template<size_t T_Idx=0>
+    void signalOne() {
+        static_assert(T_Idx < CondCount);
+        _Cond& c = _conds[T_Idx];
+        if (c.waiters.load(std::memory_order_relaxed)) c.cv.notify_one();
+    }
+    
+    template<size_t T_Idx=0>
+    void signalAll() {
+        static_assert(T_Idx < CondCount);
+        _Cond& c = _conds[T_Idx];
+        if (c.waiters.load(std::memory_order_relaxed)) c.cv.notify_all();
+    }
     
     void stop(const std::unique_lock<std::mutex>& lock, bool x=true) {
         assert((bool)lock);
         _stop = x;
-        _cv.notify_all();
+        for (_Cond& c : _conds) c.cv.notify_all();
     }
     
     void stop(bool x=true) {
@@ -58,8 +95,17 @@ public:
     }
     
 private:
+    struct _Cond {
+        std::condition_variable cv;
+        // waiters: only modified with _lock held, but read without it by signalOne()/signalAll().
+        // A waiter registers itself (under the lock) before checking its condition, so a
+        // signaller that modified the state under the lock either observes the waiter, or
+        // the waiter observes the new state.
+        std::atomic<size_t> waiters = 0;
+    };
+    
     std::mutex _lock;
-    std::condition_variable _cv;
+    _Cond _conds[CondCount];
     bool _stop = false;
 };
 
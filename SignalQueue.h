@@ -1,4 +1,5 @@
 #pragma once
+#include <optional>
 #include "Signal.h"
 #include "Queue.h"
 #include "Assert.h"
@@ -14,20 +15,80 @@ struct SignalQueue : Queue<T_Item,T_Count,T_FullReset,T_Assert> {
     T_Item pop() {
         T_Item t;
         {
-            auto lock = _signal.wait([&] { return _Super::rok(); });
-            t = std::move(_Super::rget());
-            _Super::rpop();
+            auto lock = _signal.wait<_CondNotEmpty>([&] { return _Super::rok(); });
+            t = _pop();
         }
+        _signal.signalOne<_CondNotFull>();
         return t;
     }
     
+    // tryPop(): pops an item if one is available, otherwise returns immediately
+    std::optional<T_Item> tryPop() {
+        std::optional<T_Item> t;
+        {
+            auto lock = _signal.lock();
+            if (!_Super::rok()) return std::nullopt;
+            t = _pop();
+        }
+        _signal.signalOne<_CondNotFull>();
+        return t;
+    }
+    
+    // popFor(): pops an item, waiting up to `dur` for one to become available
+    template<typename T_Duration>
+    std::optional<T_Item> popFor(T_Duration dur) {
+        std::optional<T_Item> t;
+        {
+            auto lock = _signal.wait_for<_CondNotEmpty>(dur, [&] { return _Super::rok(); });
+            if (!_Super::rok()) return std::nullopt;
+            t = _pop();
+        }
+        _signal.signalOne<_CondNotFull>();
+        return t;
+    }
+    
+    // popN(): waits for at least one item, then pops up to `len` items into
+    // `dst` under a single lock acquisition. Pass `len>=T_Count` to drain
+    // every available item. Returns the number of items popped.
+    size_t popN(T_Item* dst, size_t len) {
+        if (!len) return 0;
+        size_t i = 0;
+        {
+            auto lock = _signal.wait<_CondNotEmpty>([&] { return _Super::rok(); });
+            for (; i<len && _Super::rok(); i++) {
+                dst[i] = _pop();
+            }
+        }
+        if (i == 1) _signal.signalOne<_CondNotFull>();
+        else        _signal.signalAll<_CondNotFull>();
+        return i;
+    }
+    
     void push(T_Item&& t) {
         {
-            auto lock = _signal.wait([&] { return _Super::wok(); });
+            auto lock = _signal.wait<_CondNotFull>([&] { return _Super::wok(); });
             _Super::wget() = std::move(t);
             _Super::wpush();
         }
-        _signal.signalAll();
+        _signal.signalOne<_CondNotEmpty>();
+    }
+    
+    // pushN(): waits for space for at least one item, then pushes up to `len`
+    // items from `src` under a single lock acquisition, and signals waiters
+    // once. Returns the number of items pushed.
+    size_t pushN(T_Item* src, size_t len) {
+        if (!len) return 0;
+        size_t i = 0;
+        {
+            auto lock = _signal.wait<_CondNotFull>([&] { return _Super::wok(); });
+            for (; i<len && _Super::wok(); i++) {
+                _Super::wget() = std::move(src[i]);
+                _Super::wpush();
+            }
+        }
+        if (i == 1) _signal.signalOne<_CondNotEmpty>();
+        else        _signal.signalAll<_CondNotEmpty>();
+        return i;
     }
     
     void stop() {
@@ -43,6 +104,20 @@ struct SignalQueue : Queue<T_Item,T_Count,T_FullReset,T_Assert> {
 //    }
     
     using _Super = Queue<T_Item,T_Count,T_FullReset,T_Assert>;
+    
+    // Consumers wait on _CondNotEmpty and producers wait on _CondNotFull, so
+    // that a push only wakes a consumer, and a pop only wakes a producer (and
+    // only if one is blocked).
+    static constexpr size_t _CondNotEmpty = 0;
+    static constexpr size_t _CondNotFull  = 1;
+    
+    // _pop(): requires _signal's lock to be held and rok()==true
+    T_Item _pop() {
+        T_Item t = std::move(_Super::rget());
+        _Super::rpop();
+        return t;
+    }
+    
     Signal _signal;
 };
 
@@ -0,0 +1,188 @@
+#pragma once
+#include <atomic>
+#include <optional>
+#include "Signal.h"
+#include "Queue.h"
+
+namespace Toastbox {
+
+// SignalQueueMPMC:
+//   SignalQueueMPMC is a bounded multi-producer/multi-consumer queue of
+//   `T_Count` items, with the same push()/pop()/stop() interface as
+//   SignalQueue, but that doesn't use a mutex.
+//
+//   Each slot carries a sequence number that tells producers/consumers
+//   whether the slot is ready to be written or read (Dmitry Vyukov's
+//   bounded MPMC queue). Producers/consumers claim slots by CAS'ing the
+//   free-running _w/_r counters, so in the uncontended case push/pop only
+//   cost a few atomic operations.
+//
+//   Threads that need to block (pop() on an empty queue, push() on a full
+//   queue) park via std::atomic::wait() on an epoch counter. The other side
+//   only bumps the epoch and calls notify_one() when it observes a
+//   registered waiter, so an item never wakes more than one thread.
+//
+//   stop() wakes all blocked threads, and subsequent push()/pop() calls
+//   throw Signal::Stop, matching Signal's semantics.
+
+template<typename T_Item, size_t T_Count>
+class SignalQueueMPMC {
+public:
+    using Stop = Signal::Stop;
+    
+    static_assert(T_Count > 0);
+    
+    SignalQueueMPMC() {
+        for (size_t i=0; i<T_Count; i++) {
+            _slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    
+    // Copy/move: illegal
+    SignalQueueMPMC(const SignalQueueMPMC& x) = delete;
+    SignalQueueMPMC& operator=(const SignalQueueMPMC& x) = delete;
+    
+    T_Item pop() {
+        T_Item t;
+        _wait(_pushEpoch, _popWaiters, [&] { return _pop(t); });
+        _notify(_popEpoch, _pushWaiters);
+        return t;
+    }
+    
+    void push(T_Item&& t) {
+        _wait(_popEpoch, _pushWaiters, [&] { return _push(t); });
+        _notify(_pushEpoch, _popWaiters);
+    }
+    
+    std::optional<T_Item> tryPop() {
+        _checkStop();
+        std::optional<T_Item> t(std::in_place);
+        if (!_pop(*t)) return std::nullopt;
+        _notify(_popEpoch, _pushWaiters);
+        return t;
+    }
+    
+    bool tryPush(T_Item&& t) {
+        _checkStop();
+        if (!_push(t)) return false;
+        _notify(_pushEpoch, _popWaiters);
+        return true;
+    }
+    
+    void stop(bool x=true) {
+        _stop.store(x, std::memory_order_seq_cst);
+        if (x) {
+            _pushEpoch.fetch_add(1, std::memory_order_seq_cst);
+            _popEpoch.fetch_add(1, std::memory_order_seq_cst);
+            _pushEpoch.notify_all();
+            _popEpoch.notify_all();
+        }
+    }
+    
+private:
+    // 128 bytes covers the cache line size on both x86 (64) and Apple silicon (128)
+    static constexpr size_t _CacheLineSize = 128;
+    
+    struct _Slot {
+        std::atomic<size_t> seq;
+        T_Item item;
+    };
+    
+    // _slots: Queue's slot storage, with each slot carrying its sequence number
+    using _Slots = QueueSlots<_Slot,T_Count>;
+    
+    void _checkStop() const {
+        if (_stop.load(std::memory_order_relaxed)) throw Stop();
+    }
+    
+    // _push(): moves `t` into the queue and returns true, or returns false if
+    // the queue is full (in which case `t` is untouched)
+    bool _push(T_Item& t) {
+        size_t pos = _w.load(std::memory_order_relaxed);
+        for (;;) {
+            _Slot& slot = _slots[_Slots::Idx(pos)];
+            const size_t seq = slot.seq.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            // Slot is writable: try to claim it
+            if (diff == 0) {
+                if (_w.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) {
+                    slot.item = std::move(t);
+                    slot.seq.store(pos+1, std::memory_order_release);
+                    return true;
+                }
+            // Slot still holds an item from the previous lap: we're full
+            } else if (diff < 0) {
+                return false;
+            // Another producer claimed the slot: reload and retry
+            } else {
+                pos = _w.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    // _pop(): moves the next item into `t` and returns true, or returns false
+    // if the queue is empty
+    bool _pop(T_Item& t) {
+        size_t pos = _r.load(std::memory_order_relaxed);
+        for (;;) {
+            _Slot& slot = _slots[_Slots::Idx(pos)];
+            const size_t seq = slot.seq.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)(pos+1);
+            // Slot is readable: try to claim it
+            if (diff == 0) {
+                if (_r.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) {
+                    t = std::move(slot.item);
+                    slot.seq.store(pos+T_Count, std::memory_order_release);
+                    return true;
+                }
+            // Slot hasn't been written yet: we're empty
+            } else if (diff < 0) {
+                return false;
+            // Another consumer claimed the slot: reload and retry
+            } else {
+                pos = _r.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    // _wait(): calls `fn` until it returns true, parking on `epoch` between attempts
+    template<typename T_Fn>
+    void _wait(std::atomic<uint32_t>& epoch, std::atomic<uint32_t>& waiters, T_Fn fn) {
+        _checkStop();
+        if (fn()) return;
+        for (;;) {
+            // Register as a waiter before re-checking, so that the other side
+            // either observes us in _notify(), or we observe its update in fn().
+            waiters.fetch_add(1, std::memory_order_seq_cst);
+            const uint32_t e = epoch.load(std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const bool stop = _stop.load(std::memory_order_relaxed);
+            const bool ok = !stop && fn();
+            if (!stop && !ok) epoch.wait(e, std::memory_order_acquire);
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+            if (stop) throw Stop();
+            if (ok) return;
+            _checkStop();
+        }
+    }
+    
+    // _notify(): wakes a single waiter, only if there's a waiter registered
+    void _notify(std::atomic<uint32_t>& epoch, std::atomic<uint32_t>& waiters) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed)) {
+            epoch.fetch_add(1, std::memory_order_seq_cst);
+            epoch.notify_one();
+        }
+    }
+    
+    alignas(_CacheLineSize) std::atomic<size_t> _w = 0;
+    alignas(_CacheLineSize) std::atomic<size_t> _r = 0;
+    alignas(_CacheLineSize) std::atomic<uint32_t> _pushEpoch = 0;
+    std::atomic<uint32_t> _popWaiters = 0;
+    alignas(_CacheLineSize) std::atomic<uint32_t> _popEpoch = 0;
+    std::atomic<uint32_t> _pushWaiters = 0;
+    alignas(_CacheLineSize) std::atomic<bool> _stop = false;
+    alignas(_CacheLineSize) _Slots _slots;
+};
+
+} // namespace Toastbox
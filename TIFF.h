@@ -1,11 +1,55 @@
 #include <vector>
 #include <limits>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <tuple>
 #include <utility>
 #include <optional>
 #include <fstream>
+#include <filesystem>
+#include <system_error>
+#include <exception>
+#include <algorithm>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include "BufferedFD.h"
+#include "RuntimeError.h"
+
+// ToastboxTIFFDeflate: define to 1 (before including TIFF.h) to enable
+// Compression::Deflate, which requires linking zlib
+#ifndef ToastboxTIFFDeflate
+#define ToastboxTIFFDeflate 0
+#endif
+
+#if ToastboxTIFFDeflate
+#include <zlib.h>
+#endif
 
 namespace Toastbox {
 
+// TIFF: a TIFF/DNG builder
+//
+// By default, the file is accumulated in memory and written by write(path).
+//
+// If constructed with a path, TIFF instead streams to a temporary file as data
+// is pushed, so large pixel data isn't copied (pushes at least as large as the
+// write buffer go straight from the caller's buffer to the fd), and set()
+// patches already-written Val<T> offsets in place. write() then renames the
+// temporary file into place, so the file still appears atomically. If write()
+// isn't called, the temporary file is removed.
+//
+// pushImage() pushes pixel data as strips or tiles, optionally compressed
+// (Deflate, with the horizontal differencing predictor; see
+// ToastboxTIFFDeflate), encoding the strips/tiles in parallel.
+//
+// TIFF is movable. It's copyable too, but only in the default (in-memory)
+// mode, since a streaming TIFF owns its temporary file.
 struct TIFF {
     static constexpr uint16_t Byte      = 1;
     static constexpr uint16_t ASCII     = 2;
@@ -58,12 +102,114 @@ struct TIFF {
         size_t off = 0;
     };
     
+    enum class Compression : uint16_t {
+        None    = 1,
+#if ToastboxTIFFDeflate
+        Deflate = 8, // Adobe Deflate
+#endif
+    };
+    
+    struct ImageOptions {
+        // tileWidth/tileLength: if non-zero, the image is tiled rather than
+        // stored as strips. Must be multiples of 16.
+        uint32_t tileWidth = 0;
+        uint32_t tileLength = 0;
+        // rowsPerStrip: if zero, strips are ~256 KB
+        uint32_t rowsPerStrip = 0;
+        Compression compression = Compression::None;
+        // predictor: apply horizontal differencing before compressing
+        bool predictor = false;
+        // level: the zlib compression level; -1 is Z_DEFAULT_COMPRESSION
+        int level = -1;
+        // threads: if zero, std::thread::hardware_concurrency()
+        size_t threads = 0;
+    };
+    
+    // Image: the values for the image's IFD tags, returned by pushImage()
+    struct Image {
+        bool tiled = false;
+        uint32_t tileWidth = 0;     // TileWidth (322)
+        uint32_t tileLength = 0;    // TileLength (323)
+        uint32_t rowsPerStrip = 0;  // RowsPerStrip (278)
+        uint16_t compression = 0;   // Compression (259)
+        uint16_t predictor = 0;     // Predictor (317)
+        // count: the number of strips/tiles, ie the count for the
+        // StripOffsets/StripByteCounts (273/279) or TileOffsets/TileByteCounts
+        // (324/325) tags
+        uint32_t count = 0;
+        // offsets/byteCounts: the values for those tags; either the value
+        // itself (if count==1), or the offset of the array
+        uint32_t offsets = 0;
+        uint32_t byteCounts = 0;
+    };
+    
+    // Default constructor: buffer the file in memory
+    TIFF() {}
+    
+    // Constructor: stream the file to `filePath`
+    TIFF(const std::filesystem::path& filePath, size_t bufCap=BufferedWriter::DefaultCap) {
+        const std::filesystem::path tmpFilePath = _TmpFilePath(filePath);
+        const int fd = open(tmpFilePath.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+        if (fd < 0) throw std::system_error(errno, std::generic_category());
+        _stream = _Stream{
+            .filePath = filePath,
+            .tmpFile = _TmpFile(tmpFilePath),
+            .writer = BufferedWriter(FileDescriptor(fd), bufCap),
+        };
+    }
+    
+    // Copy: only legal in the default (in-memory) mode, since a streaming
+    // TIFF's temporary file can't be shared
+    TIFF(const TIFF& x) : _data(x._data), _tag(x._tag) {
+        assert(!x._stream);
+    }
+    
+    TIFF& operator=(const TIFF& x) {
+        assert(!x._stream);
+        _data = x._data;
+        _tag = x._tag;
+        _stream = std::nullopt;
+        return *this;
+    }
+    
+    // Move: the temporary file (if any) moves with `_stream`
+    TIFF(TIFF&& x) = default;
+    TIFF& operator=(TIFF&& x) = default;
+    
     // Base implementation; other push() variants must funnel through here
     void push(const void* data, size_t len) {
-        _data.insert(_data.end(), (const uint8_t*)data, (const uint8_t*)data+len);
+        if (_stream) {
+            _stream->writer.write(data, len);
+            _stream->off += len;
+        } else {
+            _data.insert(_data.end(), (const uint8_t*)data, (const uint8_t*)data+len);
+        }
         _tag = std::nullopt;
     }
     
+    // push(len, fn): pushes `len` bytes produced by `fn(uint8_t* dst, size_t off, size_t len)`,
+    // which is called with successive chunks. Allows large data to be generated
+    // directly into the output (eg a texture readback) without an intermediate
+    // buffer for the whole image.
+    template<typename T_Fn>
+    void push(size_t len, T_Fn fn) {
+        if (_stream) {
+            constexpr size_t ChunkCap = 1<<20;
+            const auto chunk = std::make_unique<uint8_t[]>(std::min(len, ChunkCap));
+            for (size_t off=0; off<len;) {
+                const size_t l = std::min(len-off, ChunkCap);
+                fn(chunk.get(), off, l);
+                push(chunk.get(), l);
+                off += l;
+            }
+        } else {
+            const size_t off = _data.size();
+            _data.resize(off+len);
+            fn(_data.data()+off, 0, len);
+            _tag = std::nullopt;
+        }
+    }
+    
     template<typename T>
     void push(T t={}) {
         push((uint8_t*)&t, sizeof(t));
@@ -71,7 +217,7 @@ struct TIFF {
     
     template<typename T>
     void push(Val<T>& val) {
-        val.off = _data.size();
+        val.off = off();
         push((T)0);
     }
     
@@ -114,18 +260,212 @@ struct TIFF {
         }
     }
     
+    // pushImage(): pushes the image's strips/tiles, encoded in parallel but
+    // pushed in order, followed by the offset/byte-count arrays (if there are
+    // multiple strips/tiles). Returns the values for the image's IFD tags.
+    //
+    // `rowStride` is the distance between rows, in samples.
+    template<typename T_Sample>
+    Image pushImage(const T_Sample* pixels, uint32_t width, uint32_t height,
+    uint32_t samplesPerPixel, size_t rowStride, const ImageOptions& opts) {
+        static_assert(std::is_same_v<T_Sample,uint8_t> || std::is_same_v<T_Sample,uint16_t>);
+        assert(width && height && samplesPerPixel);
+        
+        Image img = {
+            .tiled = opts.tileWidth && opts.tileLength,
+            .compression = (uint16_t)opts.compression,
+            .predictor = (uint16_t)(opts.predictor ? 2 : 1),
+        };
+        
+        size_t across = 1;
+        if (img.tiled) {
+            assert(!(opts.tileWidth%16) && !(opts.tileLength%16));
+            img.tileWidth = opts.tileWidth;
+            img.tileLength = opts.tileLength;
+            across = (width+img.tileWidth-1) / img.tileWidth;
+            const size_t down = (height+img.tileLength-1) / img.tileLength;
+            img.count = (uint32_t)(across*down);
+        } else {
+            constexpr size_t StripLen = 256*1024;
+            const size_t rowLen = (size_t)width*samplesPerPixel*sizeof(T_Sample);
+            img.rowsPerStrip = opts.rowsPerStrip;
+            if (!img.rowsPerStrip) img.rowsPerStrip = (uint32_t)std::clamp(StripLen/rowLen, (size_t)1, (size_t)height);
+            img.count = (height+img.rowsPerStrip-1) / img.rowsPerStrip;
+        }
+        
+        // encode(): encodes strip/tile `idx` into `out`
+        const auto encode = [&] (size_t idx, std::vector<uint8_t>& out, std::vector<T_Sample>& raw) {
+            uint32_t x = 0, y = 0, cols = width, rows = 0, rowsValid = 0;
+            if (img.tiled) {
+                x = (uint32_t)(idx%across) * img.tileWidth;
+                y = (uint32_t)(idx/across) * img.tileLength;
+                cols = img.tileWidth;
+                rows = img.tileLength;
+                rowsValid = std::min(rows, height-y);
+            } else {
+                y = (uint32_t)idx * img.rowsPerStrip;
+                rows = std::min(img.rowsPerStrip, height-y);
+                rowsValid = rows;
+            }
+            
+            // Gather the rows, zero-padding tiles that extend past the image
+            const uint32_t colsValid = std::min(cols, width-x);
+            const size_t rowSamples = (size_t)cols*samplesPerPixel;
+            raw.assign(rowSamples*rows, 0);
+            for (uint32_t r=0; r<rowsValid; r++) {
+                const T_Sample* src = pixels + (y+r)*rowStride + (size_t)x*samplesPerPixel;
+                std::copy(src, src+(size_t)colsValid*samplesPerPixel, raw.data()+r*rowSamples);
+            }
+            
+            // Horizontal differencing: each sample becomes the difference from the
+            // same sample of the previous pixel
+            if (opts.predictor) {
+                for (uint32_t r=0; r<rows; r++) {
+                    T_Sample* row = raw.data() + r*rowSamples;
+                    for (size_t i=rowSamples-1; i>=samplesPerPixel; i--) {
+                        row[i] -= row[i-samplesPerPixel];
+                    }
+                }
+            }
+            
+            const uint8_t* rawData = (const uint8_t*)raw.data();
+            const size_t rawLen = raw.size()*sizeof(T_Sample);
+#if ToastboxTIFFDeflate
+            if (opts.compression == Compression::Deflate) {
+                uLongf len = compressBound((uLong)rawLen);
+                out.resize(len);
+                const int ir = compress2(out.data(), &len, rawData, (uLong)rawLen, opts.level);
+                if (ir != Z_OK) throw RuntimeError("compress2 failed: %d", ir);
+                out.resize(len);
+                return;
+            }
+#endif
+            out.assign(rawData, rawData+rawLen);
+        };
+        
+        // Encode on `threadCount` threads, while this thread pushes the encoded
+        // strips/tiles in order. Encoding only runs up to `Window` strips/tiles
+        // ahead of pushing, to bound memory usage.
+        const size_t threadCount = std::min((size_t)img.count,
+            (opts.threads ? opts.threads : std::max(1u, std::thread::hardware_concurrency())));
+        const size_t Window = threadCount*4;
+        
+        struct Slot {
+            std::vector<uint8_t> data;
+            bool ready = false;
+        };
+        
+        std::mutex lock;
+        std::condition_variable readyCond;
+        std::condition_variable pushedCond;
+        std::vector<Slot> slots(Window);
+        size_t next = 0;
+        size_t pushed = 0;
+        std::exception_ptr err;
+        
+        const auto worker = [&] {
+            std::vector<T_Sample> raw;
+            for (;;) {
+                size_t idx = 0;
+                {
+                    auto l = std::unique_lock(lock);
+                    pushedCond.wait(l, [&] { return next>=img.count || next<pushed+Window; });
+                    if (next >= img.count) return;
+                    idx = next++;
+                }
+                
+                Slot& slot = slots[idx%Window];
+                std::exception_ptr e;
+                try {
+                    encode(idx, slot.data, raw);
+                } catch (...) {
+                    e = std::current_exception();
+                }
+                
+                {
+                    auto l = std::unique_lock(lock);
+                    if (e && !err) err = e;
+                    slot.ready = true;
+                }
+                readyCond.notify_all();
+            }
+        };
+        
+        std::vector<std::thread> threads;
+        // join(): stops the workers (if we're bailing early due to an error) and joins them
+        const auto join = [&] {
+            {
+                auto l = std::unique_lock(lock);
+                next = img.count;
+            }
+            pushedCond.notify_all();
+            for (std::thread& t : threads) t.join();
+        };
+        
+        std::vector<uint32_t> offsets(img.count);
+        std::vector<uint32_t> byteCounts(img.count);
+        try {
+            for (size_t i=0; i<threadCount; i++) {
+                threads.emplace_back(worker);
+            }
+            
+            for (size_t i=0; i<img.count; i++) {
+                Slot& slot = slots[i%Window];
+                {
+                    auto l = std::unique_lock(lock);
+                    readyCond.wait(l, [&] { return slot.ready; });
+                    if (err) std::rethrow_exception(err);
+                }
+                
+                offsets[i] = off();
+                byteCounts[i] = (uint32_t)slot.data.size();
+                push(slot.data.data(), slot.data.size());
+                
+                {
+                    auto l = std::unique_lock(lock);
+                    slot.ready = false;
+                    pushed++;
+                }
+                pushedCond.notify_all();
+            }
+        } catch (...) {
+            join();
+            throw;
+        }
+        join();
+        
+        if (img.count == 1) {
+            img.offsets = offsets[0];
+            img.byteCounts = byteCounts[0];
+        } else {
+            img.offsets = off();
+            push(offsets.begin(), offsets.end());
+            img.byteCounts = off();
+            push(byteCounts.begin(), byteCounts.end());
+        }
+        return img;
+    }
+    
     template<typename T>
     void set(Val<T> val, T t) {
-        memcpy(_data.data()+val.off, &t, sizeof(t));
+        if (_stream) {
+            // The value may still be buffered, so flush before patching the file
+            _stream->writer.flush();
+            _Pwrite(_stream->writer.fd(), &t, sizeof(t), val.off);
+        } else {
+            memcpy(_data.data()+val.off, &t, sizeof(t));
+        }
     }
     
     uint32_t off() {
+        if (_stream) return (uint32_t)_stream->off;
         return (uint32_t)_data.size();
     }
     
     void write(const std::filesystem::path& filePath) {
+        assert(!_stream);
         // Write the file atomically (write to a temp file, then rename)
-        const std::filesystem::path tmpFilePath = auto{filePath} += ".tmp";
+        const std::filesystem::path tmpFilePath = _TmpFilePath(filePath);
         std::ofstream f;
         f.exceptions(std::ofstream::failbit | std::ofstream::badbit);
         f.open(tmpFilePath);
@@ -133,8 +473,64 @@ struct TIFF {
         std::filesystem::rename(tmpFilePath, filePath);
     }
     
+    // write(): streaming mode only; flushes and renames the temporary file into place
+    void write() {
+        assert(_stream);
+        _stream->writer.flush();
+        _stream->writer.fd().reset();
+        std::filesystem::rename(_stream->tmpFile.path, _stream->filePath);
+        _stream->tmpFile.release();
+        _stream = std::nullopt;
+    }
+    
+    static std::filesystem::path _TmpFilePath(const std::filesystem::path& filePath) {
+        return std::filesystem::path(filePath) += ".tmp";
+    }
+    
+    static void _Pwrite(int fd, const void* data, size_t len, off_t off) {
+        const uint8_t* d = (const uint8_t*)data;
+        while (len) {
+            ssize_t sr = 0;
+            do sr = pwrite(fd, d, len, off);
+            while (sr==-1 && errno==EINTR);
+            if (sr < 0) throw std::system_error(errno, std::generic_category());
+            d += sr;
+            len -= sr;
+            off += sr;
+        }
+    }
+    
+    // _TmpFile: owns the temporary file, removing it upon destruction unless
+    // released (ie write() renamed it into place). Move-only, so that moving
+    // a TIFF moves the ownership.
+    struct _TmpFile {
+        _TmpFile(std::filesystem::path p) : path(std::move(p)) {}
+        _TmpFile(const _TmpFile& x) = delete;
+        _TmpFile& operator=(const _TmpFile& x) = delete;
+        _TmpFile(_TmpFile&& x) { swap(x); }
+        _TmpFile& operator=(_TmpFile&& x) { swap(x); return *this; }
+        ~_TmpFile() {
+            if (path.empty()) return;
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+        }
+        
+        void swap(_TmpFile& x) { std::swap(path, x.path); }
+        void release() { path.clear(); }
+        
+        std::filesystem::path path;
+    };
+    
+    struct _Stream {
+        std::filesystem::path filePath;
+        _TmpFile tmpFile;
+        BufferedWriter writer;
+        size_t off = 0;
+    };
+    
     std::vector<uint8_t> _data;
     std::optional<uint16_t> _tag;
+    std::optional<_Stream> _stream;
 };
 
 } // namespace Toastbox
@@ -0,0 +1,88 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <future>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Test.h"
+#include "../AsyncIO.h"
+
+namespace Test {
+
+using namespace std::chrono_literals;
+
+// _Flood(): keeps far more ops in flight than the CQ holds, while the
+// completion thread is stalled in a callback, so that submission hits a full
+// CQ (EBUSY/EAGAIN) while the completion thread still has to reap. Fails
+// (instead of hanging the test run) if the ops don't all complete in time.
+static void _Flood() {
+    constexpr size_t Entries = 8; // The CQ holds Entries*4
+    constexpr size_t Ops = 4096;
+    
+    const Toastbox::FileDescriptor fd(open("/dev/zero", O_RDONLY));
+    TestAssert((int)fd >= 0);
+    
+    Toastbox::AsyncIO io(Entries);
+    std::atomic<size_t> done = 0;
+    std::atomic<size_t> bad = 0;
+    std::promise<void> gate;
+    std::shared_future<void> gateFuture = gate.get_future().share();
+    std::promise<void> finished;
+    std::vector<uint8_t> bufs(Ops);
+    
+    for (size_t i=0; i<Ops; i++) {
+        io.read(fd, &bufs[i], 1, 0, [&, i] (const Toastbox::AsyncIO::Result& x) {
+            // Stall the completion thread on the first completion, until
+            // everything has been queued
+            if (!i) gateFuture.wait();
+            if (x.error || x.len!=1) bad++;
+            if (++done == Ops) finished.set_value();
+        });
+        // Submit in small batches, so the SQ keeps draining into a backed-up CQ
+        if (i % Entries == Entries-1) io.submit();
+    }
+    
+    // Open the gate from another thread, since the submissions above may
+    // themselves be waiting on the completion thread
+    std::thread opener([&] {
+        std::this_thread::sleep_for(100ms);
+        gate.set_value();
+    });
+    io.submit();
+    opener.join();
+    
+    TestAssert(finished.get_future().wait_for(30s) == std::future_status::ready);
+    TestAssert(!bad);
+}
+
+// _Basic(): a few reads complete with the expected results, via callbacks
+// and futures
+static void _Basic() {
+    int fds[2];
+    TestAssert(!pipe(fds));
+    const Toastbox::FileDescriptor r(fds[0]), w(fds[1]);
+    Toastbox::AsyncIO io;
+    
+    uint8_t buf[4] = {};
+    std::future<size_t> f = io.read(r, buf, sizeof(buf), -1);
+    io.submit();
+    TestAssert(::write(w, "abcd", 4) == 4);
+    TestAssert(f.get() == 4);
+    TestAssert(!memcmp(buf, "abcd", 4));
+    
+    // Deadline: nothing is written, so the read times out
+    std::future<size_t> t = io.read(r, buf, sizeof(buf), -1, std::chrono::steady_clock::now()+50ms);
+    io.submit();
+    bool timedOut = false;
+    try { t.get(); } catch (const Toastbox::ReadWriteTimeout&) { timedOut = true; }
+    TestAssert(timedOut);
+}
+
+void AsyncIO(Runner& r) {
+    r.run("AsyncIO/Basic", _Basic);
+    r.run("AsyncIO/Flood", _Flood);
+}
+
+} // namespace Test
@@ -0,0 +1,67 @@
+#import <vector>
+#import "Test.h"
+#import "../Mac/Mat.h"
+#import "../Mac/DynMat.h"
+
+namespace Test {
+
+// _Fill(): fills `a` with 3i+1 and `b` with i, so a-b is 2i+1 and b-a is
+// -(2i+1)
+template<typename T_Mat>
+static void _Fill(T_Mat& a, T_Mat& b) {
+    size_t i = 0;
+    for (auto& v : a) v = 3*(i++)+1;
+    i = 0;
+    for (auto& v : b) v = i++;
+}
+
+template<typename T_Mat>
+static void _CheckDiff(const T_Mat& d) {
+    size_t i = 0;
+    for (const auto& v : d) {
+        TestAssert(v == 2*(i++)+1);
+    }
+}
+
+// _Sub(): `a - b` and `a -= b` compute a-b (the baseline computed b-a).
+// N<=4 takes Mat's _Small path; larger N goes through MatKernel (BLAS).
+template<typename T, size_t N>
+static void _Sub() {
+    using T_Mat = Toastbox::Mat<T,N,N>;
+    T_Mat a, b;
+    _Fill(a, b);
+    
+    _CheckDiff(T_Mat(a - b));
+    _CheckDiff(T_Mat(T_Mat(a) - b)); // Rvalue overload
+    
+    T_Mat c = a;
+    c -= b;
+    _CheckDiff(c);
+}
+
+// _DynSub(): DynMat subtracts in the same order as Mat
+template<typename T>
+static void _DynSub() {
+    using T_Mat = Toastbox::DynMat<T>;
+    for (const size_t n : {3, 16}) {
+        T_Mat a(n, n), b(n, n);
+        _Fill(a, b);
+        
+        _CheckDiff(T_Mat(a - b));
+        
+        T_Mat c = a;
+        c -= b;
+        _CheckDiff(c);
+    }
+}
+
+void Mat(Runner& r) {
+    r.run("Mat/Sub/Small/float", _Sub<float,4>);
+    r.run("Mat/Sub/Small/double", _Sub<double,3>);
+    r.run("Mat/Sub/BLAS/float", _Sub<float,16>);
+    r.run("Mat/Sub/BLAS/double", _Sub<double,9>);
+    r.run("Mat/DynSub/float", _DynSub<float>);
+    r.run("Mat/DynSub/double", _DynSub<double>);
+}
+
+} // namespace Test
@@ -0,0 +1,60 @@
+#include <thread>
+#include <vector>
+#include "Test.h"
+#include "../Queue.h"
+#include "../SignalQueueMPMC.h"
+
+namespace Test {
+
+// _Queue(): items come out in order across many wraparounds, for both
+// power-of-2 (masked) and other (wrapped) counts
+template<size_t T_Count>
+static void _Queue() {
+    Toastbox::Queue<size_t,T_Count> q;
+    size_t w = 0, r = 0;
+    for (size_t lap=0; lap<100; lap++) {
+        while (q.wok()) { q.wget() = w++; q.wpush(); }
+        TestAssert(w-r == T_Count);
+        // Drain partially, so that the next lap starts mid-array
+        for (size_t i=0; i<T_Count/2+1; i++) {
+            TestAssert(q.rok());
+            TestAssert(q.rget() == r++);
+            q.rpop();
+        }
+    }
+}
+
+// _MPMC(): every pushed item is popped exactly once, with multiple producers
+// and consumers, for both power-of-2 and other counts
+template<size_t T_Count>
+static void _MPMC() {
+    constexpr size_t Threads = 4;
+    constexpr size_t Items = 20000; // Per producer
+    Toastbox::SignalQueueMPMC<size_t,T_Count> q;
+    std::vector<std::thread> threads;
+    std::vector<size_t> sums(Threads);
+    
+    for (size_t t=0; t<Threads; t++) {
+        threads.emplace_back([&] {
+            for (size_t i=1; i<=Items; i++) q.push(size_t(i));
+        });
+        threads.emplace_back([&, t] {
+            for (size_t i=0; i<Items; i++) sums[t] += q.pop();
+        });
+    }
+    for (std::thread& t : threads) t.join();
+    
+    size_t sum = 0;
+    for (size_t s : sums) sum += s;
+    TestAssert(sum == Threads*Items*(Items+1)/2);
+    TestAssert(!q.tryPop());
+}
+
+void Queue(Runner& r) {
+    r.run("Queue/Queue/4", _Queue<4>);
+    r.run("Queue/Queue/5", _Queue<5>);
+    r.run("Queue/MPMC/4", _MPMC<4>);
+    r.run("Queue/MPMC/5", _MPMC<5>);
+}
+
+} // namespace Test
@@ -0,0 +1,74 @@
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "Test.h"
+#include "../ReadWrite.h"
+#include "../FileDescriptor.h"
+
+namespace Test {
+
+using namespace std::chrono_literals;
+
+// _Pipe(): a pipe containing `data`, with the write end already closed, so that
+// reading past `data` hits EOF
+static Toastbox::FileDescriptor _Pipe(const char* data) {
+    int fds[2];
+    TestAssert(!pipe(fds));
+    const Toastbox::FileDescriptor w(fds[1]);
+    const size_t len = strlen(data);
+    TestAssert(::write(w, data, len) == (ssize_t)len);
+    return Toastbox::FileDescriptor(fds[0]);
+}
+
+// _EOF(): Read() and ReadV() both return a short count upon EOF, with and
+// without a deadline, instead of looping until the deadline (or forever)
+static void _EOF() {
+    const auto deadline = std::chrono::steady_clock::now()+10s;
+    for (const bool hasDeadline : {false, true}) {
+        const auto dl = (hasDeadline ? deadline : std::chrono::steady_clock::time_point());
+        uint8_t buf[8] = {};
+        
+        {
+            const Toastbox::FileDescriptor r = _Pipe("abc");
+            TestAssert(Toastbox::Read(r, buf, sizeof(buf), dl) == 3);
+            TestAssert(!memcmp(buf, "abc", 3));
+        }
+        
+        {
+            const Toastbox::FileDescriptor r = _Pipe("abc");
+            const struct iovec iov[] = {
+                { .iov_base = buf,   .iov_len = 2 },
+                { .iov_base = buf+2, .iov_len = sizeof(buf)-2 },
+            };
+            TestAssert(Toastbox::ReadV(r, iov, std::size(iov), dl) == 3);
+        }
+    }
+    
+    // Finishing well before the deadline shows that we returned upon EOF, not
+    // upon timeout
+    TestAssert(std::chrono::steady_clock::now() < deadline);
+}
+
+// _Timeout(): Read() returns a short count upon timeout, for each FdMode
+static void _Timeout() {
+    using Toastbox::FdMode;
+    for (const FdMode mode : {FdMode::Blocking, FdMode::NonBlocking, FdMode::Unknown}) {
+        int fds[2];
+        TestAssert(!pipe(fds));
+        const Toastbox::FileDescriptor r(fds[0]), w(fds[1]);
+        if (mode != FdMode::Blocking) TestAssert(!fcntl(r, F_SETFL, O_NONBLOCK));
+        TestAssert(::write(w, "ab", 2) == 2);
+        
+        uint8_t buf[4] = {};
+        TestAssert(Toastbox::Read(r, buf, sizeof(buf), std::chrono::steady_clock::now()+20ms, mode) == 2);
+    }
+}
+
+void ReadWrite(Runner& r) {
+    r.run("ReadWrite/EOF", _EOF);
+    r.run("ReadWrite/Timeout", _Timeout);
+}
+
+} // namespace Test
@@ -0,0 +1,60 @@
+#include <vector>
+#include <utility>
+#include <filesystem>
+#include "Test.h"
+#include "../TIFF.h"
+
+namespace Test {
+
+// _Move(): moving a streaming TIFF moves ownership of its temporary file:
+// destroying the moved-from TIFF doesn't remove it, and the moved-to TIFF
+// still writes it into place (or removes it, if write() isn't called)
+static void _Move() {
+    const std::filesystem::path path = std::filesystem::temp_directory_path() / "ToastboxTest.tiff";
+    const std::filesystem::path tmpPath = std::filesystem::path(path) += ".tmp";
+    std::filesystem::remove(path);
+    
+    {
+        Toastbox::TIFF b;
+        {
+            Toastbox::TIFF a(path);
+            a.push((uint32_t)0x12345678);
+            b = std::move(a);
+        }
+        TestAssert(std::filesystem::exists(tmpPath));
+        
+        Toastbox::TIFF c(std::move(b));
+        c.push((uint32_t)0x9abcdef0);
+        TestAssert(c.off() == 8);
+        c.write();
+    }
+    TestAssert(!std::filesystem::exists(tmpPath));
+    TestAssert(std::filesystem::file_size(path) == 8);
+    std::filesystem::remove(path);
+    
+    {
+        Toastbox::TIFF a(path);
+        Toastbox::TIFF b(std::move(a));
+    }
+    TestAssert(!std::filesystem::exists(tmpPath));
+    TestAssert(!std::filesystem::exists(path));
+}
+
+// _Copy(): in-memory TIFFs are copyable
+static void _Copy() {
+    Toastbox::TIFF a;
+    a.push((uint16_t)1);
+    Toastbox::TIFF b = a;
+    b.push((uint16_t)2);
+    TestAssert(a.off() == 2);
+    TestAssert(b.off() == 4);
+    a = b;
+    TestAssert(a._data == b._data);
+}
+
+void TIFF(Runner& r) {
+    r.run("TIFF/Move", _Move);
+    r.run("TIFF/Copy", _Copy);
+}
+
+} // namespace Test
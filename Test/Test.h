@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <exception>
+#include "../RuntimeError.h"
+
+// Test: a minimal test harness for Toastbox's primitives
+//
+// Each test is a function that throws (eg via TestAssert()) on failure.
+// Runner::run() runs a test if it matches the filter, and reports whether it
+// passed; main() exits non-zero if any test failed, so the tests can run
+// under ctest.
+namespace Test {
+
+// TestAssert(): throws if `x` is false, identifying the failed expression
+#define TestAssert(x) do {                                                      \
+    if (!(x)) throw Toastbox::RuntimeError("%s:%d: %s", __FILE__, __LINE__, #x);  \
+} while (0)
+
+class Runner {
+public:
+    Runner(std::string_view filter) : _filter(filter) {}
+    
+    bool enabled(std::string_view name) const {
+        return _filter.empty() || name.find(_filter) != std::string_view::npos;
+    }
+    
+    template<typename T_Fn>
+    void run(std::string_view name, T_Fn fn) {
+        if (!enabled(name)) return;
+        try {
+            fn();
+            printf("PASS  %.*s\n", (int)name.size(), name.data());
+        } catch (const std::exception& e) {
+            printf("FAIL  %.*s: %s\n", (int)name.size(), name.data(), e.what());
+            _failures++;
+        }
+        fflush(stdout);
+    }
+    
+    size_t failures() const { return _failures; }
+    
+private:
+    std::string _filter;
+    size_t _failures = 0;
+};
+
+void AsyncIO(Runner& r);
+void ReadWrite(Runner& r);
+void TIFF(Runner& r);
+void Queue(Runner& r);
+#if __APPLE__
+void Mat(Runner& r);
+#endif
+
+} // namespace Test
@@ -0,0 +1,21 @@
+#include <cstdio>
+#include "Test.h"
+
+// Usage: ToastboxTest [filter]
+//   filter: only run tests whose name contains `filter`
+int main(int argc, const char* argv[]) {
+    Test::Runner r(argc>1 ? argv[1] : "");
+    Test::AsyncIO(r);
+    Test::ReadWrite(r);
+    Test::TIFF(r);
+    Test::Queue(r);
+#if __APPLE__
+    Test::Mat(r);
+#endif
+    
+    if (r.failures()) {
+        printf("%zu test(s) failed\n", r.failures());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,184 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <sstream>
+#include <algorithm>
+
+// ToastboxTrace: define to 0 (before including Trace.h) to compile out
+// tracing entirely
+#ifndef ToastboxTrace
+#define ToastboxTrace 1
+#endif
+
+namespace Toastbox {
+
+// Trace:
+//   Low-overhead trace events for instrumenting hot paths, exportable as
+//   Chrome trace JSON (viewable in chrome://tracing or ui.perfetto.dev).
+//
+//   Each thread records into its own fixed-capacity ring buffer, so recording
+//   takes no locks: a Scope costs two clock reads and a handful of stores.
+//   When a thread's ring is full, its oldest events are overwritten.
+//
+//   Tracing starts disabled, so that instrumented production builds only pay
+//   a relaxed load per Scope; Enable() turns recording on. If
+//   ToastboxTrace=0, Scope/Instant are empty and cost nothing.
+//
+//   Event names must outlive the trace (eg string literals), since only the
+//   pointer is recorded. ChromeJSON() should be called while threads aren't
+//   recording; otherwise events that are overwritten during the export may
+//   be torn.
+struct Trace {
+    static constexpr bool Compiled = ToastboxTrace;
+    static constexpr size_t RingCap = 16384; // Events per thread
+    using Clock = std::chrono::steady_clock;
+    
+    struct Event {
+        const char* name = nullptr;
+        int64_t start = 0;  // Nanoseconds since the trace epoch
+        int64_t dur = -1;   // Nanoseconds, or -1 for an instant event
+    };
+    
+    static void Enable(bool x=true) { _State().enabled.store(x, std::memory_order_relaxed); }
+    static bool Enabled() { return Compiled && _State().enabled.load(std::memory_order_relaxed); }
+    
+    // Instant(): records an event without a duration
+    static void Instant(const char* name) {
+        if (!Enabled()) return;
+        _Record({ .name = name, .start = _Now(), .dur = -1 });
+    }
+    
+    // Scope: records an event spanning its lifetime
+    class Scope {
+    public:
+        Scope(const char* name) {
+            if (!Enabled()) return;
+            _name = name;
+            _start = _Now();
+        }
+        
+        // Copy/move: illegal
+        Scope(const Scope& x) = delete;
+        Scope& operator=(const Scope& x) = delete;
+        
+        ~Scope() {
+            if (!_name) return;
+            _Record({ .name = _name, .start = _start, .dur = _Now()-_start });
+        }
+    
+    private:
+        const char* _name = nullptr;
+        int64_t _start = 0;
+    };
+    
+    // Clear(): discards all recorded events, and the rings of threads that
+    // have exited. Like ChromeJSON(), only call while threads aren't recording.
+    static void Clear() {
+        _GlobalState& s = _State();
+        auto lock = std::unique_lock(s.lock);
+        std::erase_if(s.rings, [] (const std::shared_ptr<_Ring>& r) { return r.use_count() == 1; });
+        for (const auto& r : s.rings) r->count.store(0, std::memory_order_release);
+    }
+    
+    // WriteChromeJSON(): writes every thread's recorded events in the Chrome
+    // trace event format
+    static void WriteChromeJSON(std::ostream& out) {
+        _GlobalState& s = _State();
+        auto lock = std::unique_lock(s.lock);
+        out << "{\"traceEvents\":[";
+        bool first = true;
+        for (const auto& r : s.rings) {
+            const uint64_t count = r->count.load(std::memory_order_acquire);
+            const uint64_t n = std::min(count, (uint64_t)RingCap);
+            for (uint64_t i=count-n; i<count; i++) {
+                const Event& ev = r->events[i % RingCap];
+                if (!first) out << ",";
+                first = false;
+                out << "\n{\"name\":\"";
+                _WriteEscaped(out, ev.name);
+                out << "\",\"pid\":1,\"tid\":" << r->tid << ",\"ts\":" << _Micros(ev.start);
+                if (ev.dur >= 0) out << ",\"ph\":\"X\",\"dur\":" << _Micros(ev.dur);
+                else out << ",\"ph\":\"i\",\"s\":\"t\"";
+                out << "}";
+            }
+        }
+        out << "\n]}\n";
+    }
+    
+    static std::string ChromeJSON() {
+        std::stringstream ss;
+        WriteChromeJSON(ss);
+        return ss.str();
+    }
+    
+    struct _Ring {
+        uint32_t tid = 0;
+        std::atomic<uint64_t> count = 0; // Events ever recorded (the next event's index)
+        Event events[RingCap];
+    };
+    
+    struct _GlobalState {
+        std::atomic<bool> enabled = false;
+        const Clock::time_point epoch = Clock::now();
+        std::mutex lock;
+        std::vector<std::shared_ptr<_Ring>> rings; // Protected by `lock`
+        uint32_t tidNext = 1; // Protected by `lock`
+    };
+    
+    static _GlobalState& _State() {
+        static _GlobalState s;
+        return s;
+    }
+    
+    static int64_t _Now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now()-_State().epoch).count();
+    }
+    
+    // _ThreadRing(): the calling thread's ring, registered on first use. The
+    // registry also holds a reference, so the events outlive the thread.
+    static _Ring& _ThreadRing() {
+        thread_local std::shared_ptr<_Ring> ring = [] {
+            _GlobalState& s = _State();
+            auto r = std::make_shared<_Ring>();
+            auto lock = std::unique_lock(s.lock);
+            r->tid = s.tidNext++;
+            s.rings.push_back(r);
+            return r;
+        }();
+        return *ring;
+    }
+    
+    static void _Record(const Event& ev) {
+        _Ring& r = _ThreadRing();
+        // Only this thread writes `count`, besides Clear()
+        const uint64_t i = r.count.load(std::memory_order_relaxed);
+        r.events[i % RingCap] = ev;
+        r.count.store(i+1, std::memory_order_release);
+    }
+    
+    static std::string _Micros(int64_t ns) {
+        // Chrome trace timestamps are in (fractional) microseconds
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.3f", (double)ns/1000);
+        return buf;
+    }
+    
+    static void _WriteEscaped(std::ostream& out, const char* s) {
+        for (; s && *s; s++) {
+            const char c = *s;
+            if (c=='"' || c=='\\') out << '\\' << c;
+            else if ((unsigned char)c < 0x20) out << ' ';
+            else out << c;
+        }
+    }
+};
+
+} // namespace Toastbox
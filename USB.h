@@ -111,6 +111,7 @@ namespace EndpointAttributes {
     constexpr uint8_t TransferIsochronous               = 0x01;
     constexpr uint8_t TransferBulk                      = 0x02;
     constexpr uint8_t TransferInterrupt                 = 0x03;
+    constexpr uint8_t TransferMask                      = 0x03;
     
     namespace Isochronous {
         constexpr uint8_t SynchronizationNone           = 0x00;
@@ -0,0 +1,347 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <span>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "USBDevice.h"
+#include "USB.h"
+#include "RuntimeError.h"
+
+namespace Toastbox {
+
+// USBControlQueue:
+//   USBControlQueue keeps up to `depth` control transfers in flight on a
+//   device's default pipe, so that a sequence of control requests (eg
+//   reading/writing a device's register bank) costs one round-trip in total,
+//   rather than one round-trip per request like USBDevice::controlRequest().
+//
+//   Requests complete on USBDevice's event thread, but are always reported in
+//   the order they were pushed: each request's callback is called once it and
+//   every request before it have completed. The callback receives the
+//   request's status, and for IN requests, the data that was read. Callbacks
+//   must not block or throw.
+//
+//   push() blocks while `depth` requests are in flight, except when called
+//   from a callback: then it never blocks (since blocking the event thread
+//   would deadlock), and the request is submitted once the callback returns
+//   and a transfer is free. wait() blocks until every pushed request has
+//   completed, and throws if any of them failed; callbacks must not call it.
+//
+//   The USBDevice must outlive the USBControlQueue. Destroying the queue
+//   cancels the requests in flight, without calling their callbacks.
+//
+//   On macOS, the device is claimed (USBDevice::claim()), since async
+//   requests require the device to be open.
+
+class USBControlQueue {
+public:
+    using Milliseconds = USBDevice::Milliseconds;
+    static constexpr Milliseconds Forever = USBDevice::Forever;
+    static constexpr size_t MaxDepth = 64;
+    
+    enum class Status : uint8_t {
+        OK,
+        Error,
+        Stall,
+        Timeout,
+        Disconnected,
+    };
+    
+    using Callback = std::function<void(Status, std::span<const uint8_t>)>;
+    
+    USBControlQueue(USBDevice& dev, size_t depth=8, Milliseconds timeout=Forever) :
+    _dev(dev), _timeout(timeout) {
+        if (!depth || depth>MaxDepth) throw RuntimeError("invalid depth: %zu", depth);
+        _transfers = std::vector<_Transfer>(depth);
+        
+#if __APPLE__
+        _dev.claim();
+        CFRunLoopAddSource(USBDevice::_EventThread::RunLoop(), _dev.asyncEventSource(), kCFRunLoopDefaultMode);
+#elif __linux__
+        _dev._openIfNeeded();
+#endif
+        
+        for (_Transfer& t : _transfers) {
+            t.queue = this;
+#if __linux__
+            t.xfer = libusb_alloc_transfer(0);
+            if (!(libusb_transfer*)t.xfer) throw RuntimeError("libusb_alloc_transfer failed");
+#endif
+        }
+    }
+    
+    // Copy/move: illegal, since our transfers reference us
+    USBControlQueue(const USBControlQueue& x) = delete;
+    USBControlQueue& operator=(const USBControlQueue& x) = delete;
+    
+    ~USBControlQueue() {
+        _stop();
+    }
+    
+    // push(): queues a control request. The direction comes from
+    // req.bmRequestType, and the length from req.wLength. For OUT requests,
+    // `data` is copied, so it doesn't need to outlive the call.
+    void push(const USB::SetupRequest& req, const void* data=nullptr, Callback cb=nullptr) {
+        auto lock = std::unique_lock(_lock);
+        // From a callback (ie on the event thread), queue the request rather
+        // than waiting for a free transfer, which would deadlock, since only
+        // the event thread frees transfers. _complete() submits it once the
+        // callback returns (and so also reports submission failures, rather
+        // than throwing into the event thread).
+        if (std::this_thread::get_id() == _callbackThread) {
+            const bool in = (req.bmRequestType&USB::RequestType::DirectionMask) == USB::RequestType::DirectionIn;
+            _Pending& p = _pending.emplace_back(_Pending{ .req = req, .data = {}, .cb = std::move(cb) });
+            if (!in && req.wLength) {
+                assert(data);
+                p.data.assign((const uint8_t*)data, (const uint8_t*)data + req.wLength);
+            }
+            return;
+        }
+        
+        // Requests queued by callbacks go first, to keep push() order
+        _cv.wait(lock, [&] { return _count<_transfers.size() && _pending.empty(); });
+        _submit(_fill(req, data, std::move(cb)));
+        _count++;
+    }
+    
+    void vendorRequestOut(uint8_t req, uint16_t wValue, uint16_t wIndex, const void* data, size_t len, Callback cb=nullptr) {
+        push(USBDevice::VendorRequest(USB::RequestType::DirectionOut, req, wValue, wIndex, len), data, std::move(cb));
+    }
+    
+    void vendorRequestIn(uint8_t req, uint16_t wValue, uint16_t wIndex, size_t len, Callback cb) {
+        push(USBDevice::VendorRequest(USB::RequestType::DirectionIn, req, wValue, wIndex, len), nullptr, std::move(cb));
+    }
+    
+    // wait(): waits for every pushed request to complete. Throws if any
+    // request failed since the last wait().
+    void wait() {
+        auto lock = std::unique_lock(_lock);
+        _cv.wait(lock, [&] { return !_count && _pending.empty(); });
+        if (_err.status != Status::OK) {
+            const _Error err = _err;
+            _err = {};
+            throw RuntimeError("control request failed (bRequest: 0x%02x, status: %ju)",
+                err.bRequest, (uintmax_t)err.status);
+        }
+    }
+    
+    size_t depth() const { return _transfers.size(); }
+    
+private:
+    struct _Transfer {
+        USBControlQueue* queue = nullptr;
+        USB::SetupRequest req = {};
+        Callback cb;
+        Status status = Status::OK;
+        size_t len = 0;
+        bool done = false;
+        std::vector<uint8_t> buf;
+        uint8_t* data = nullptr; // Data stage, within `buf`
+#if __APPLE__
+        IOUSBDevRequestTO ioreq = {};
+#elif __linux__
+        Uniqued<libusb_transfer*, libusb_free_transfer> xfer;
+#endif
+    };
+    
+    struct _Error {
+        Status status = Status::OK;
+        uint8_t bRequest = 0;
+    };
+    
+    // _Pending: a request pushed by a callback, waiting to be submitted by
+    // _complete()
+    struct _Pending {
+        USB::SetupRequest req = {};
+        std::vector<uint8_t> data; // OUT data
+        Callback cb;
+    };
+    
+#if __APPLE__
+    static Status _StatusForIOReturn(IOReturn ior) {
+        switch (ior) {
+        case kIOReturnSuccess:          return Status::OK;
+        case kIOUSBPipeStalled:         return Status::Stall;
+        case kIOUSBTransactionTimeout:  return Status::Timeout;
+        case kIOReturnNoDevice:
+        case kIOReturnNotResponding:    return Status::Disconnected;
+        default:                        return Status::Error;
+        }
+    }
+    
+    static void _IOKitCallback(void* refcon, IOReturn ior, void* arg0) {
+        _Transfer& t = *(_Transfer*)refcon;
+        t.queue->_complete(t, _StatusForIOReturn(ior), (size_t)(uintptr_t)arg0);
+    }
+#elif __linux__
+    static Status _StatusForLibusbStatus(enum libusb_transfer_status status) {
+        switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED: return Status::OK;
+        case LIBUSB_TRANSFER_STALL:     return Status::Stall;
+        case LIBUSB_TRANSFER_TIMED_OUT: return Status::Timeout;
+        case LIBUSB_TRANSFER_NO_DEVICE: return Status::Disconnected;
+        default:                        return Status::Error;
+        }
+    }
+    
+    static void _LibusbCallback(libusb_transfer* xfer) {
+        _Transfer& t = *(_Transfer*)xfer->user_data;
+        t.queue->_complete(t, _StatusForLibusbStatus(xfer->status), (size_t)xfer->actual_length);
+    }
+#endif
+    
+    // _fill(): sets up the next free transfer (at the tail of the queue) for
+    // `req`. For OUT requests, `data` is copied. Requires _lock.
+    _Transfer& _fill(const USB::SetupRequest& req, const void* data, Callback cb) {
+        assert(_count < _transfers.size());
+        const bool in = (req.bmRequestType&USB::RequestType::DirectionMask) == USB::RequestType::DirectionIn;
+        _Transfer& t = _transfers[(_head+_count) % _transfers.size()];
+        t.req = req;
+        t.cb = std::move(cb);
+        t.status = Status::OK;
+        t.len = 0;
+        t.done = false;
+#if __APPLE__
+        t.buf.resize(req.wLength);
+        t.data = t.buf.data();
+#elif __linux__
+        // libusb control transfers are prefixed by the setup packet
+        t.buf.resize(LIBUSB_CONTROL_SETUP_SIZE + req.wLength);
+        libusb_fill_control_setup(t.buf.data(), req.bmRequestType, req.bRequest, req.wValue, req.wIndex, req.wLength);
+        t.data = t.buf.data() + LIBUSB_CONTROL_SETUP_SIZE;
+#endif
+        if (!in && req.wLength) {
+            assert(data);
+            memcpy(t.data, data, req.wLength);
+        }
+        return t;
+    }
+    
+    // _submit(): requires _lock
+    void _submit(_Transfer& t) {
+#if __APPLE__
+        // A completionTimeout of 0 means no timeout
+        t.ioreq = {
+            .bmRequestType      = t.req.bmRequestType,
+            .bRequest           = t.req.bRequest,
+            .wValue             = t.req.wValue,
+            .wIndex             = t.req.wIndex,
+            .wLength            = t.req.wLength,
+            .pData              = t.data,
+            .noDataTimeout      = (uint32_t)0,
+            .completionTimeout  = (_timeout==Forever ? (uint32_t)0 : (uint32_t)_timeout.count()),
+        };
+        IOReturn ior = _dev.iokitExec<&IOUSBDeviceInterface::DeviceRequestAsyncTO>(&t.ioreq, _IOKitCallback, &t);
+        USBDevice::_CheckErr(ior, "DeviceRequestAsyncTO failed");
+#elif __linux__
+        libusb_fill_control_transfer(t.xfer, _dev._handle, t.buf.data(), _LibusbCallback, &t,
+            USBDevice::_LibUSBTimeoutFromMs(_timeout));
+        int ir = libusb_submit_transfer(t.xfer);
+        USBDevice::_CheckErr(ir, "libusb_submit_transfer failed");
+#endif
+    }
+    
+    // _complete(): called on the event thread when a transfer completes
+    void _complete(_Transfer& t, Status status, size_t len) {
+        auto lock = std::unique_lock(_lock);
+        t.status = status;
+        t.len = len;
+        t.done = true;
+        
+        for (;;) {
+            // Report the completed transfers at the head of the queue, in
+            // order. Completions only occur on the event thread, so there's
+            // only ever one thread here, and the head transfer can't be reused
+            // by push() until we pop it.
+            while (_count) {
+                _Transfer& head = _transfers[_head];
+                if (!head.done) break;
+                if (head.status!=Status::OK && _err.status==Status::OK) {
+                    _err = { .status = head.status, .bRequest = head.req.bRequest };
+                }
+                
+                Callback cb = std::move(head.cb);
+                head.cb = nullptr;
+                if (cb && !_stopping) {
+                    // Let push() know that it's being called from a callback
+                    _callbackThread = std::this_thread::get_id();
+                    lock.unlock();
+                    cb(head.status, { head.data, head.len });
+                    lock.lock();
+                    _callbackThread = {};
+                }
+                
+                _head = (_head+1) % _transfers.size();
+                _count--;
+            }
+            
+            // Submit the requests that callbacks queued, now that there are
+            // free transfers. A request that fails to submit completes with
+            // Status::Error, so report it in order too.
+            bool failed = false;
+            while (!_pending.empty() && _count<_transfers.size() && !_stopping) {
+                _Pending p = std::move(_pending.front());
+                _pending.pop_front();
+                _Transfer& t = _fill(p.req, p.data.data(), std::move(p.cb));
+                _count++;
+                try {
+                    _submit(t);
+                } catch (const std::exception&) {
+                    t.status = Status::Error;
+                    t.done = true;
+                    failed = true;
+                }
+            }
+            if (!failed) break;
+        }
+        
+        // Notify while holding the lock, since _stop() destroys us as soon as
+        // it observes _count==0
+        _cv.notify_all();
+    }
+    
+    // _stop(): cancel the transfers in flight and wait for their completions
+    void _stop() {
+        auto lock = std::unique_lock(_lock);
+        _stopping = true;
+        _pending.clear();
+#if __APPLE__
+        if (_count) _dev.iokitExec<&IOUSBDeviceInterface::USBDeviceAbortPipeZero>();
+#elif __linux__
+        // Transfers that already completed return LIBUSB_ERROR_NOT_FOUND, which
+        // we don't care about
+        for (size_t i=0; i<_count; i++) {
+            _Transfer& t = _transfers[(_head+i) % _transfers.size()];
+            if (!t.done) libusb_cancel_transfer(t.xfer);
+        }
+#endif
+        _cv.wait(lock, [&] { return !_count; });
+    }
+    
+    // _events: declared first so that it's destroyed last, after every transfer
+    // has completed
+    USBDevice::_EventThread::Ref _events;
+    USBDevice& _dev;
+    const Milliseconds _timeout = Forever;
+    std::vector<_Transfer> _transfers;
+    
+    std::mutex _lock;
+    std::condition_variable _cv;
+    size_t _head = 0;
+    size_t _count = 0;
+    bool _stopping = false;
+    _Error _err;
+    // _pending: requests pushed by callbacks, waiting to be submitted
+    std::deque<_Pending> _pending;
+    // _callbackThread: the thread invoking a callback, if any (ie the event
+    // thread), so that push() can tell that it's being called from a callback
+    std::thread::id _callbackThread;
+};
+
+} // namespace Toastbox
@@ -12,13 +12,24 @@
 #include <vector>
 #include <set>
 #include <memory>
+#include <functional>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <span>
+#include <system_error>
 #include <cassert>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include "USB.h"
 #include "RefCounted.h"
 #include "Uniqued.h"
 #include "RuntimeError.h"
 #include "Defer.h"
+#include "USBStats.h"
 
 namespace Toastbox {
 
@@ -99,15 +110,7 @@ struct USBDevice {
         }
         
         size_t read(uint8_t pipeRef, void* buf, size_t len, Milliseconds timeout=Forever) {
-            uint32_t len32 = (uint32_t)len;
-            if (timeout == Forever) {
-                IOReturn ior = iokitExec<&IOUSBInterfaceInterface::ReadPipe>(pipeRef, buf, &len32);
-                _CheckErr(ior, "ReadPipe failed");
-            } else {
-                IOReturn ior = iokitExec<&IOUSBInterfaceInterface::ReadPipeTO>(pipeRef, buf, &len32, 0, (uint32_t)timeout.count());
-                _CheckErr(ior, "ReadPipeTO failed");
-            }
-            return len32;
+            return _IOKitRead(_iokitInterface, pipeRef, buf, len, timeout, nullptr);
         }
         
         template<typename T>
@@ -116,13 +119,7 @@ struct USBDevice {
         }
         
         void write(uint8_t pipeRef, const void* buf, size_t len, Milliseconds timeout=Forever) {
-            if (timeout == Forever) {
-                IOReturn ior = iokitExec<&IOUSBInterfaceInterface::WritePipe>(pipeRef, (void*)buf, (uint32_t)len);
-                _CheckErr(ior, "WritePipe failed");
-            } else {
-                IOReturn ior = iokitExec<&IOUSBInterfaceInterface::WritePipeTO>(pipeRef, (void*)buf, (uint32_t)len, 0, (uint32_t)timeout.count());
-                _CheckErr(ior, "WritePipeTO failed");
-            }
+            _IOKitWrite(_iokitInterface, pipeRef, buf, len, timeout, nullptr);
         }
         
         void reset(uint8_t pipeRef) {
@@ -130,6 +127,55 @@ struct USBDevice {
             _CheckErr(ior, "ResetPipe failed");
         }
         
+        // asyncEventSource(): the run loop source that delivers completions of
+        // async transfers (readAsync()). The source is owned by the interface.
+        CFRunLoopSourceRef asyncEventSource() {
+            CFRunLoopSourceRef source = (*_iokitInterface)->GetInterfaceAsyncEventSource(_iokitInterface);
+            if (source) return source;
+            IOReturn ior = iokitExec<&IOUSBInterfaceInterface::CreateInterfaceAsyncEventSource>(&source);
+            _CheckErr(ior, "CreateInterfaceAsyncEventSource failed");
+            return source;
+        }
+        
+        // readAsync(): start an async read; `cb` is called on the run loop that
+        // asyncEventSource() was added to, with `arg0` holding the length read
+        void readAsync(uint8_t pipeRef, void* buf, size_t len, IOAsyncCallback1 cb, void* refcon) {
+            IOReturn ior = iokitExec<&IOUSBInterfaceInterface::ReadPipeAsync>(pipeRef, buf, (uint32_t)len, cb, refcon);
+            _CheckErr(ior, "ReadPipeAsync failed");
+        }
+        
+        // abort(): abort all pending async transfers on `pipeRef`; their
+        // callbacks are called with kIOReturnAborted
+        void abort(uint8_t pipeRef) {
+            IOReturn ior = iokitExec<&IOUSBInterfaceInterface::AbortPipe>(pipeRef);
+            _CheckErr(ior, "AbortPipe failed");
+        }
+        
+        // readIsochAsync(): start an async isochronous read of `frameCount` frames,
+        // starting at bus frame `frame`. `cb` is called with `arg0` pointing to
+        // `frames`, which holds each frame's status and length.
+        void readIsochAsync(uint8_t pipeRef, void* buf, uint64_t frame, IOUSBIsocFrame* frames, size_t frameCount,
+        IOAsyncCallback1 cb, void* refcon) {
+            IOReturn ior = iokitExec<&IOUSBInterfaceInterface::ReadIsochPipeAsync>(pipeRef, buf, frame,
+                (uint32_t)frameCount, frames, cb, refcon);
+            _CheckErr(ior, "ReadIsochPipeAsync failed");
+        }
+        
+        uint64_t busFrameNumber() {
+            uint64_t frame = 0;
+            AbsoluteTime time;
+            IOReturn ior = iokitExec<&IOUSBInterfaceInterface::GetBusFrameNumber>(&frame, &time);
+            _CheckErr(ior, "GetBusFrameNumber failed");
+            return frame;
+        }
+        
+        IOUSBEndpointProperties pipeProperties(uint8_t pipeRef) {
+            IOUSBEndpointProperties props = { .bVersion = kUSBEndpointPropertiesVersion3 };
+            IOReturn ior = iokitExec<&IOUSBInterfaceInterface::GetPipePropertiesV3>(pipeRef, &props);
+            _CheckErr(ior, "GetPipePropertiesV3 failed");
+            return props;
+        }
+        
         _IOUSBInterfaceInterface _iokitInterface;
         bool _claimed = false;
     };
@@ -143,6 +189,156 @@ struct USBDevice {
     
 #endif
     
+    // _EventThread: a dedicated thread that services async USB events (ie
+    // transfer completions), so that completions don't depend on the client
+    // calling into us. On Linux the thread runs libusb's event handling, and on
+    // macOS it runs a CFRunLoop, to which async event sources are added.
+    //
+    // The thread is shared by all clients, and runs for as long as at least one
+    // _EventThread::Ref exists. If the last Ref is released on the event thread
+    // itself (eg by a completion callback), the thread can't join itself, so
+    // it's detached instead, and exits once the current callback returns.
+    struct _EventThread {
+        class Ref {
+        public:
+            Ref() : _valid(true) { _Acquire(); }
+            // Copy: illegal
+            Ref(const Ref& x) = delete;
+            Ref& operator=(const Ref& x) = delete;
+            // Move: allowed
+            Ref(Ref&& x) : _valid(x._valid) { x._valid = false; }
+            Ref& operator=(Ref&& x) {
+                if (_valid) _Release();
+                _valid = x._valid;
+                x._valid = false;
+                return *this;
+            }
+            ~Ref() { if (_valid) _Release(); }
+        private:
+            bool _valid = false;
+        };
+        
+#if __APPLE__
+        // RunLoop(): the event thread's run loop; only valid while a Ref exists
+        static CFRunLoopRef RunLoop() {
+            _EventThread& e = _Get();
+            auto lock = std::unique_lock(e._lock);
+            assert(e._refs);
+            return e._runLoop;
+        }
+#elif __linux__
+        // Post(): calls `fn` on the event thread, once the current (or next)
+        // libusb_handle_events() returns. libusb callbacks (eg hotplug
+        // callbacks) mustn't do I/O themselves, so they use Post() to do it
+        // outside of libusb's event handling. Only valid while a Ref exists.
+        static void Post(std::function<void()> fn) {
+            _EventThread& e = _Get();
+            {
+                auto lock = std::unique_lock(e._postedLock);
+                e._posted.push_back(std::move(fn));
+            }
+            libusb_interrupt_event_handler(_USBCtx());
+        }
+#endif
+        
+        static _EventThread& _Get() {
+            static _EventThread X;
+            return X;
+        }
+        
+        static void _Acquire() {
+            _EventThread& e = _Get();
+            auto lock = std::unique_lock(e._lock);
+            if (e._refs++) return;
+#if __APPLE__
+            // Wait for the thread to publish its run loop, so that RunLoop() is
+            // valid as soon as the Ref exists
+            e._runLoop = nullptr;
+            e._thread = std::thread([&e] { e._thread_(); });
+            e._cv.wait(lock, [&] { return e._runLoop; });
+#elif __linux__
+            e._thread = std::thread([&e, gen=e._gen.load()] { e._thread_(gen); });
+#endif
+        }
+        
+        static void _Release() {
+            _EventThread& e = _Get();
+            auto lock = std::unique_lock(e._lock);
+            assert(e._refs);
+            if (--e._refs) return;
+#if __APPLE__
+            // Signal our stop source rather than calling CFRunLoopStop() directly,
+            // since CFRunLoopStop() is lost if the run loop isn't running yet
+            CFRunLoopSourceSignal(e._stopSource);
+            CFRunLoopWakeUp(e._runLoop);
+#elif __linux__
+            // Bump the generation rather than setting a stop flag, so that if
+            // we detach the thread below and a new Ref starts a new thread
+            // before this one exits, this one still stops
+            e._gen++;
+            libusb_interrupt_event_handler(_USBCtx());
+#endif
+            if (std::this_thread::get_id() == e._thread.get_id()) e._thread.detach();
+            else e._thread.join();
+        }
+        
+#if __APPLE__
+        void _thread_() {
+            // The stop source also keeps the run loop alive while there are no
+            // other sources (CFRunLoopRun() returns immediately otherwise).
+            // It's a local, since a detached thread may still be exiting after
+            // a new thread has replaced `_stopSource`.
+            CFRunLoopSourceContext ctx = {
+                .perform = [] (void*) { CFRunLoopStop(CFRunLoopGetCurrent()); },
+            };
+            CFRunLoopSourceRef stopSource = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &ctx);
+            CFRunLoopAddSource(CFRunLoopGetCurrent(), stopSource, kCFRunLoopDefaultMode);
+            {
+                auto lock = std::unique_lock(_lock);
+                _stopSource = stopSource;
+                _runLoop = CFRunLoopGetCurrent();
+            }
+            _cv.notify_all();
+            
+            CFRunLoopRun();
+            
+            CFRunLoopSourceInvalidate(stopSource);
+            CFRelease(stopSource);
+        }
+#elif __linux__
+        void _thread_(uint64_t gen) {
+            std::vector<std::function<void()>> posted;
+            while (_gen == gen) {
+                int ir = libusb_handle_events(_USBCtx());
+                // Errors here are transient (eg LIBUSB_ERROR_INTERRUPTED), and
+                // we have nobody to report them to anyway
+                (void)ir;
+                
+                {
+                    auto lock = std::unique_lock(_postedLock);
+                    std::swap(posted, _posted);
+                }
+                for (const auto& fn : posted) fn();
+                posted.clear();
+            }
+        }
+#endif
+        
+        std::mutex _lock;
+        size_t _refs = 0;
+        std::thread _thread;
+#if __APPLE__
+        std::condition_variable _cv;
+        CFRunLoopRef _runLoop = nullptr;
+        CFRunLoopSourceRef _stopSource = nullptr;
+#elif __linux__
+        // _gen: the generation of the running thread, which runs until it changes
+        std::atomic<uint64_t> _gen = 0;
+        std::mutex _postedLock;
+        std::vector<std::function<void()>> _posted;
+#endif
+    };
+    
     // Copy: illegal
     USBDevice(const USBDevice& x) = delete;
     USBDevice& operator=(const USBDevice& x) = delete;
@@ -253,6 +449,7 @@ struct USBDevice {
                         .epAddr         = epAddr,
                         .ifaceIdx       = (uint8_t)(_interfaces.size()-1),
                         .pipeRef        = pipeRef,
+                        .type           = props.bTransferType,
                         .maxPacketSize  = props.wMaxPacketSize,
                     };
                 }
@@ -353,18 +550,28 @@ struct USBDevice {
         _claimed = true;
     }
     
-    template<typename... T_Args>
-    auto read(uint8_t epAddr, T_Args&&... args) {
+    template<typename T_Dst>
+    void read(uint8_t epAddr, T_Dst& dst, Milliseconds timeout=Forever) {
+        const size_t len = read(epAddr, (void*)&dst, sizeof(dst), timeout);
+        if (len != sizeof(dst)) throw RuntimeError("read() didn't read enough data (needed %ju bytes, got %ju bytes)",
+            (uintmax_t)sizeof(dst), (uintmax_t)len);
+    }
+    
+    size_t read(uint8_t epAddr, void* buf, size_t len, Milliseconds timeout=Forever) {
         const _EndpointInfo& epInfo = _epInfo(epAddr);
         _Interface& iface = _interfaces.at(epInfo.ifaceIdx);
-        return iface.read(epInfo.pipeRef, std::forward<T_Args>(args)...);
+        return _IOKitRead(iface._iokitInterface, epInfo.pipeRef, buf, len, timeout, _statsFor(epAddr));
     }
     
-    template<typename... T_Args>
-    void write(uint8_t epAddr, T_Args&&... args) {
+    template<typename T_Src>
+    void write(uint8_t epAddr, T_Src& src, Milliseconds timeout=Forever) {
+        write(epAddr, (void*)&src, sizeof(src), timeout);
+    }
+    
+    void write(uint8_t epAddr, const void* buf, size_t len, Milliseconds timeout=Forever) {
         const _EndpointInfo& epInfo = _epInfo(epAddr);
         _Interface& iface = _interfaces.at(epInfo.ifaceIdx);
-        iface.write(epInfo.pipeRef, std::forward<T_Args>(args)...);
+        _IOKitWrite(iface._iokitInterface, epInfo.pipeRef, buf, len, timeout, _statsFor(epAddr));
     }
     
     template<typename... T_Args>
@@ -374,38 +581,54 @@ struct USBDevice {
         iface.reset(epInfo.pipeRef, std::forward<T_Args>(args)...);
     }
     
-    template<typename T>
-    void vendorRequestOut(uint8_t req, const T& x, Milliseconds timeout=Forever) {
-        vendorRequestOut(req, (const void*)&x, sizeof(x), timeout);
-    }
-    
-    void vendorRequestOut(uint8_t req, const void* data, size_t len, Milliseconds timeout=Forever) {
+    // controlRequest(): performs a control transfer on the default pipe. The
+    // direction comes from req.bmRequestType, and the length from req.wLength.
+    // Returns the number of bytes transferred.
+    size_t controlRequest(const USB::SetupRequest& req, void* data, Milliseconds timeout=Forever) {
+        USBStats::Transfer stats(_statsFor(req.bmRequestType & USB::RequestType::DirectionMask));
         if (timeout == Forever) {
             IOUSBDevRequest usbReq = {
-                .bmRequestType      = USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBDevice),
-                .bRequest           = req,
-                .pData              = (void*)data,
-                .wLength            = (uint16_t)len,
+                .bmRequestType      = req.bmRequestType,
+                .bRequest           = req.bRequest,
+                .wValue             = req.wValue,
+                .wIndex             = req.wIndex,
+                .wLength            = req.wLength,
+                .pData              = data,
             };
             
             IOReturn ior = iokitExec<&IOUSBDeviceInterface::DeviceRequest>(&usbReq);
+            stats.done(_StatsResult(ior), req.wLength, usbReq.wLenDone);
             _CheckErr(ior, "DeviceRequest failed");
+            return usbReq.wLenDone;
         
         } else {
             IOUSBDevRequestTO usbReq = {
-                .bmRequestType      = USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBDevice),
-                .bRequest           = req,
-                .pData              = (void*)data,
-                .wLength            = (uint16_t)len,
+                .bmRequestType      = req.bmRequestType,
+                .bRequest           = req.bRequest,
+                .wValue             = req.wValue,
+                .wIndex             = req.wIndex,
+                .wLength            = req.wLength,
+                .pData              = data,
                 .noDataTimeout      = (uint32_t)0,
                 .completionTimeout  = (uint32_t)timeout.count()
             };
             
             IOReturn ior = iokitExec<&IOUSBDeviceInterface::DeviceRequestTO>(&usbReq);
+            stats.done(_StatsResult(ior), req.wLength, usbReq.wLenDone);
             _CheckErr(ior, "DeviceRequestTO failed");
+            return usbReq.wLenDone;
         }
     }
     
+    // asyncEventSource(): the device's async event source, for DeviceRequestAsync()
+    CFRunLoopSourceRef asyncEventSource() {
+        CFRunLoopSourceRef source = iokitExec<&IOUSBDeviceInterface::GetDeviceAsyncEventSource>();
+        if (source) return source;
+        IOReturn ior = iokitExec<&IOUSBDeviceInterface::CreateDeviceAsyncEventSource>(&source);
+        _CheckErr(ior, "CreateDeviceAsyncEventSource failed");
+        return source;
+    }
+    
     const SendRight& service() const { return _service; }
     
     void debugGetStatus() {
@@ -429,6 +652,7 @@ struct USBDevice {
         uint8_t epAddr = 0;
         uint8_t ifaceIdx = 0;
         uint8_t pipeRef = 0;
+        uint8_t type = 0; // USB::EndpointAttributes::Transfer*
         uint16_t maxPacketSize = 0;
     };
     
@@ -440,6 +664,46 @@ struct USBDevice {
         if (ior != kIOReturnSuccess) throw RuntimeError("%s: %s", errMsg, mach_error_string(ior));
     }
     
+    static USBStats::Result _StatsResult(IOReturn ior) {
+        switch (ior) {
+        case kIOReturnSuccess:          return USBStats::Result::OK;
+        case kIOUSBTransactionTimeout:  return USBStats::Result::Timeout;
+        case kIOUSBPipeStalled:         return USBStats::Result::Stall;
+        default:                        return USBStats::Result::Error;
+        }
+    }
+    
+    // _IOKitRead()/_IOKitWrite(): a synchronous transfer on an interface's pipe
+    static size_t _IOKitRead(IOUSBInterfaceInterface** iface, uint8_t pipeRef, void* buf, size_t len,
+    Milliseconds timeout, USBStats::Endpoint* statsEp) {
+        USBStats::Transfer stats(statsEp);
+        uint32_t len32 = (uint32_t)len;
+        if (timeout == Forever) {
+            IOReturn ior = (*iface)->ReadPipe(iface, pipeRef, buf, &len32);
+            stats.done(_StatsResult(ior), len, len32);
+            _CheckErr(ior, "ReadPipe failed");
+        } else {
+            IOReturn ior = (*iface)->ReadPipeTO(iface, pipeRef, buf, &len32, 0, (uint32_t)timeout.count());
+            stats.done(_StatsResult(ior), len, len32);
+            _CheckErr(ior, "ReadPipeTO failed");
+        }
+        return len32;
+    }
+    
+    static void _IOKitWrite(IOUSBInterfaceInterface** iface, uint8_t pipeRef, const void* buf, size_t len,
+    Milliseconds timeout, USBStats::Endpoint* statsEp) {
+        USBStats::Transfer stats(statsEp);
+        if (timeout == Forever) {
+            IOReturn ior = (*iface)->WritePipe(iface, pipeRef, (void*)buf, (uint32_t)len);
+            stats.done(_StatsResult(ior), len, (ior==kIOReturnSuccess ? len : 0));
+            _CheckErr(ior, "WritePipe failed");
+        } else {
+            IOReturn ior = (*iface)->WritePipeTO(iface, pipeRef, (void*)buf, (uint32_t)len, 0, (uint32_t)timeout.count());
+            stats.done(_StatsResult(ior), len, (ior==kIOReturnSuccess ? len : 0));
+            _CheckErr(ior, "WritePipeTO failed");
+        }
+    }
+    
     const _EndpointInfo& _epInfo(uint8_t epAddr) const {
         const _EndpointInfo& epInfo = _epInfos[_IdxForEndpointAddr(epAddr)];
         if (!epInfo.valid) throw RuntimeError("invalid endpoint address: 0x%02x", epAddr);
@@ -451,6 +715,7 @@ struct USBDevice {
     std::vector<_Interface> _interfaces;
     _EndpointInfo _epInfos[USB::Endpoint::MaxCount];
     bool _claimed = false;
+    std::unique_ptr<USBStats::Endpoint[]> _stats = _StatsCreate();
     
 #elif __linux__
     
@@ -475,6 +740,7 @@ struct USBDevice {
             struct libusb_config_descriptor* configDesc = nullptr;
             int ir = libusb_get_config_descriptor(_dev, 0, &configDesc);
             _CheckErr(ir, "libusb_get_config_descriptor failed");
+            Defer( libusb_free_config_descriptor(configDesc); );
             
             for (uint8_t ifaceIdx=0; ifaceIdx<configDesc->bNumInterfaces; ifaceIdx++) {
                 const struct libusb_interface& iface = configDesc->interface[ifaceIdx];
@@ -493,6 +759,7 @@ struct USBDevice {
                         .valid          = true,
                         .epAddr         = epAddr,
                         .ifaceIdx       = ifaceIdx,
+                        .type           = (uint8_t)(endpointDesc.bmAttributes & USB::EndpointAttributes::TransferMask),
                         .maxPacketSize  = endpointDesc.wMaxPacketSize,
                     };
                 }
@@ -531,6 +798,7 @@ struct USBDevice {
         struct libusb_config_descriptor* desc;
         int ir = libusb_get_config_descriptor(_dev, idx, &desc);
         _CheckErr(ir, "libusb_get_config_descriptor failed");
+        Defer( libusb_free_config_descriptor(desc); );
         return USB::ConfigurationDescriptor{
             .bLength                 = desc->bLength,
             .bDescriptorType         = desc->bDescriptorType,
@@ -562,11 +830,7 @@ struct USBDevice {
     
     size_t read(uint8_t epAddr, void* buf, size_t len, Milliseconds timeout=Forever) {
         _claimInterfaceForEndpointAddr(epAddr);
-        int xferLen = 0;
-        int ir = libusb_bulk_transfer(_handle, epAddr, (uint8_t*)buf, (int)len, &xferLen,
-            _LibUSBTimeoutFromMs(timeout));
-        _CheckErr(ir, "libusb_bulk_transfer failed");
-        return xferLen;
+        return _LibusbTransfer(_handle, _epInfo(epAddr).type, epAddr, buf, len, timeout, _statsFor(epAddr));
     }
     
     template<typename T_Src>
@@ -577,12 +841,9 @@ struct USBDevice {
     void write(uint8_t epAddr, const void* buf, size_t len, Milliseconds timeout=Forever) {
         _claimInterfaceForEndpointAddr(epAddr);
         
-        int xferLen = 0;
-        int ir = libusb_bulk_transfer(_handle, epAddr, (uint8_t*)buf, (int)len, &xferLen,
-            _LibUSBTimeoutFromMs(timeout));
-        _CheckErr(ir, "libusb_bulk_transfer failed");
-        if ((size_t)xferLen != len)
-            throw RuntimeError("libusb_bulk_transfer short write (tried: %zu, got: %zu)", len, (size_t)xferLen);
+        const size_t xferLen = _LibusbTransfer(_handle, _epInfo(epAddr).type, epAddr, (void*)buf, len, timeout, _statsFor(epAddr));
+        if (xferLen != len)
+            throw RuntimeError("short write (tried: %zu, got: %zu)", len, xferLen);
     }
     
     void reset(uint8_t epAddr) {
@@ -591,24 +852,17 @@ struct USBDevice {
         _CheckErr(ir, "libusb_clear_halt failed");
     }
     
-    template<typename T>
-    void vendorRequestOut(uint8_t req, const T& x, Milliseconds timeout=Forever) {
-        vendorRequestOut(req, (void*)&x, sizeof(x), timeout);
-    }
-    
-    void vendorRequestOut(uint8_t req, const void* data, size_t len, Milliseconds timeout=Forever) {
+    // controlRequest(): performs a control transfer on the default pipe. The
+    // direction comes from req.bmRequestType, and the length from req.wLength.
+    // Returns the number of bytes transferred.
+    size_t controlRequest(const USB::SetupRequest& req, void* data, Milliseconds timeout=Forever) {
         _openIfNeeded();
-        
-        const uint8_t bmRequestType =
-            USB::RequestType::DirectionOut      |
-            USB::RequestType::TypeVendor        |
-            USB::RequestType::RecipientDevice   ;
-        const uint8_t bRequest = req;
-        const uint8_t wValue = 0;
-        const uint8_t wIndex = 0;
-        int ir = libusb_control_transfer(_handle, bmRequestType, bRequest, wValue, wIndex,
-            (uint8_t*)data, len, _LibUSBTimeoutFromMs(timeout));
+        USBStats::Transfer stats(_statsFor(req.bmRequestType & USB::RequestType::DirectionMask));
+        int ir = libusb_control_transfer(_handle, req.bmRequestType, req.bRequest, req.wValue, req.wIndex,
+            (uint8_t*)data, req.wLength, _LibUSBTimeoutFromMs(timeout));
+        stats.done(_StatsResult(ir), req.wLength, (ir>0 ? ir : 0));
         _CheckErr(ir, "libusb_control_transfer failed");
+        return ir;
     }
     
     operator libusb_device*() const { return _dev; }
@@ -617,6 +871,7 @@ struct USBDevice {
         bool valid = false;
         uint8_t epAddr = 0;
         uint8_t ifaceIdx = 0;
+        uint8_t type = 0; // USB::EndpointAttributes::Transfer*
         uint16_t maxPacketSize = 0;
     };
     
@@ -644,6 +899,37 @@ struct USBDevice {
         if (ir < 0) throw RuntimeError("%s: %s", errMsg, libusb_error_name(ir));
     }
     
+    static USBStats::Result _StatsResult(int ir) {
+        if (ir >= 0) return USBStats::Result::OK;
+        switch (ir) {
+        case LIBUSB_ERROR_TIMEOUT:  return USBStats::Result::Timeout;
+        case LIBUSB_ERROR_PIPE:     return USBStats::Result::Stall;
+        default:                    return USBStats::Result::Error;
+        }
+    }
+    
+    // _LibusbTransfer(): a synchronous bulk or interrupt transfer, according to
+    // the endpoint's type. Isochronous endpoints require USBStream.
+    static size_t _LibusbTransfer(libusb_device_handle* handle, uint8_t type, uint8_t epAddr,
+    void* buf, size_t len, Milliseconds timeout, USBStats::Endpoint* statsEp) {
+        USBStats::Transfer stats(statsEp);
+        int xferLen = 0;
+        if (type == USB::EndpointAttributes::TransferInterrupt) {
+            int ir = libusb_interrupt_transfer(handle, epAddr, (uint8_t*)buf, (int)len, &xferLen,
+                _LibUSBTimeoutFromMs(timeout));
+            stats.done(_StatsResult(ir), len, xferLen);
+            _CheckErr(ir, "libusb_interrupt_transfer failed");
+        } else if (type == USB::EndpointAttributes::TransferBulk) {
+            int ir = libusb_bulk_transfer(handle, epAddr, (uint8_t*)buf, (int)len, &xferLen,
+                _LibUSBTimeoutFromMs(timeout));
+            stats.done(_StatsResult(ir), len, xferLen);
+            _CheckErr(ir, "libusb_bulk_transfer failed");
+        } else {
+            throw RuntimeError("endpoint 0x%02x doesn't support synchronous transfers", epAddr);
+        }
+        return xferLen;
+    }
+    
     void _openIfNeeded() {
         if (_handle.hasValue()) return;
         libusb_device_handle* handle = nullptr;
@@ -680,14 +966,349 @@ struct USBDevice {
     _LibusbHandle _handle = {};
     std::vector<_Interface> _interfaces = {};
     _EndpointInfo _epInfos[USB::Endpoint::MaxCount] = {};
+    std::unique_ptr<USBStats::Endpoint[]> _stats = _StatsCreate();
     
 #endif
     
+    template<typename T>
+    void vendorRequestOut(uint8_t req, const T& x, Milliseconds timeout=Forever) {
+        vendorRequestOut(req, (const void*)&x, sizeof(x), timeout);
+    }
+    
+    void vendorRequestOut(uint8_t req, const void* data, size_t len, Milliseconds timeout=Forever) {
+        vendorRequestOut(req, 0, 0, data, len, timeout);
+    }
+    
+    void vendorRequestOut(uint8_t req, uint16_t wValue, uint16_t wIndex,
+    const void* data, size_t len, Milliseconds timeout=Forever) {
+        const USB::SetupRequest setup = VendorRequest(USB::RequestType::DirectionOut, req, wValue, wIndex, len);
+        const size_t xferLen = controlRequest(setup, (void*)data, timeout);
+        if (xferLen != len) throw RuntimeError("short write (tried: %zu, got: %zu)", len, xferLen);
+    }
+    
+    template<typename T>
+    void vendorRequestIn(uint8_t req, T& x, Milliseconds timeout=Forever) {
+        const size_t len = vendorRequestIn(req, (void*)&x, sizeof(x), timeout);
+        if (len != sizeof(x)) throw RuntimeError("vendorRequestIn() didn't read enough data (needed %ju bytes, got %ju bytes)",
+            (uintmax_t)sizeof(x), (uintmax_t)len);
+    }
+    
+    size_t vendorRequestIn(uint8_t req, void* data, size_t len, Milliseconds timeout=Forever) {
+        return vendorRequestIn(req, 0, 0, data, len, timeout);
+    }
+    
+    size_t vendorRequestIn(uint8_t req, uint16_t wValue, uint16_t wIndex,
+    void* data, size_t len, Milliseconds timeout=Forever) {
+        const USB::SetupRequest setup = VendorRequest(USB::RequestType::DirectionIn, req, wValue, wIndex, len);
+        return controlRequest(setup, data, timeout);
+    }
+    
+    // VendorRequest(): the setup packet for a vendor request to the device
+    static USB::SetupRequest VendorRequest(uint8_t dir, uint8_t req, uint16_t wValue, uint16_t wIndex, size_t len) {
+        if (len > UINT16_MAX) throw RuntimeError("control request too large: %zu", len);
+        return USB::SetupRequest{
+            .bmRequestType  = (uint8_t)(dir | USB::RequestType::TypeVendor | USB::RequestType::RecipientDevice),
+            .bRequest       = req,
+            .wValue         = wValue,
+            .wIndex         = wIndex,
+            .wLength        = (uint16_t)len,
+        };
+    }
+    
+    // stats(): a snapshot of the transfer stats for endpoint `epAddr`, or an
+    // empty snapshot if stats are disabled (see USBStats.h). The stats for
+    // control requests are reported under 0x00 (OUT) and 0x80 (IN).
+    USBStats::Snapshot stats(uint8_t epAddr) const {
+        if constexpr (!USBStats::Enabled) return {};
+        else return _stats[_IdxForEndpointAddr(epAddr)].snapshot();
+    }
+    
+    void statsReset(uint8_t epAddr) {
+        if constexpr (USBStats::Enabled) _stats[_IdxForEndpointAddr(epAddr)].reset();
+    }
+    
+    static std::unique_ptr<USBStats::Endpoint[]> _StatsCreate() {
+        if constexpr (!USBStats::Enabled) return nullptr;
+        else return std::make_unique<USBStats::Endpoint[]>(USB::Endpoint::MaxCount);
+    }
+    
+    // _statsFor(): the stats for endpoint `epAddr`, or nullptr if stats are disabled
+    USBStats::Endpoint* _statsFor(uint8_t epAddr) const {
+        if constexpr (!USBStats::Enabled) return nullptr;
+        else return &_stats[_IdxForEndpointAddr(epAddr)];
+    }
+    
+    // Endpoint: a handle to an endpoint, whose interface, pipe and claim state
+    // are resolved once by endpoint(), so that each transfer is a single call
+    // into libusb/IOKit. Copyable; valid for the lifetime of the USBDevice.
+    class Endpoint {
+    public:
+        Endpoint() {}
+        
+        template<typename T_Dst>
+        void read(T_Dst& dst, Milliseconds timeout=Forever) {
+            const size_t len = read((void*)&dst, sizeof(dst), timeout);
+            if (len != sizeof(dst)) throw RuntimeError("read() didn't read enough data (needed %ju bytes, got %ju bytes)",
+                (uintmax_t)sizeof(dst), (uintmax_t)len);
+        }
+        
+        size_t read(void* buf, size_t len, Milliseconds timeout=Forever) {
+#if __APPLE__
+            return _IOKitRead(_iface, _pipeRef, buf, len, timeout, _stats);
+#elif __linux__
+            return _LibusbTransfer(_handle, _type, _epAddr, buf, len, timeout, _stats);
+#endif
+        }
+        
+        template<typename T_Src>
+        void write(T_Src& src, Milliseconds timeout=Forever) {
+            write((void*)&src, sizeof(src), timeout);
+        }
+        
+        void write(const void* buf, size_t len, Milliseconds timeout=Forever) {
+#if __APPLE__
+            _IOKitWrite(_iface, _pipeRef, buf, len, timeout, _stats);
+#elif __linux__
+            const size_t xferLen = _LibusbTransfer(_handle, _type, _epAddr, (void*)buf, len, timeout, _stats);
+            if (xferLen != len)
+                throw RuntimeError("short write (tried: %zu, got: %zu)", len, xferLen);
+#endif
+        }
+        
+        void reset() {
+#if __APPLE__
+            IOReturn ior = _iokitExec<&IOUSBInterfaceInterface::ResetPipe>(_pipeRef);
+            _CheckErr(ior, "ResetPipe failed");
+#elif __linux__
+            int ir = libusb_clear_halt(_handle, _epAddr);
+            _CheckErr(ir, "libusb_clear_halt failed");
+#endif
+        }
+        
+        explicit operator bool() const { return _epAddr; }
+        uint8_t epAddr() const { return _epAddr; }
+        uint8_t type() const { return _type; }
+        uint16_t maxPacketSize() const { return _maxPacketSize; }
+        USBStats::Snapshot stats() const { return (_stats ? _stats->snapshot() : USBStats::Snapshot{}); }
+    
+    private:
+#if __APPLE__
+        template<auto T_Fn, typename... T_Args>
+        IOReturn _iokitExec(T_Args&&... args) {
+            assert(_iface);
+            return ((*_iface)->*T_Fn)(_iface, std::forward<T_Args>(args)...);
+        }
+        
+        IOUSBInterfaceInterface** _iface = nullptr;
+        uint8_t _pipeRef = 0;
+#elif __linux__
+        libusb_device_handle* _handle = nullptr;
+#endif
+        uint8_t _epAddr = 0;
+        uint8_t _type = 0;
+        uint16_t _maxPacketSize = 0;
+        USBStats::Endpoint* _stats = nullptr;
+        friend struct USBDevice;
+    };
+    
+    // endpoint(): returns a handle to the endpoint `epAddr`, claiming its
+    // interface if it isn't claimed already
+    Endpoint endpoint(uint8_t epAddr) {
+        const _EndpointInfo& epInfo = _epInfo(epAddr);
+        Endpoint ep;
+#if __APPLE__
+        _Interface& iface = _interfaces.at(epInfo.ifaceIdx);
+        iface.claim();
+        ep._iface = iface._iokitInterface;
+        ep._pipeRef = epInfo.pipeRef;
+#elif __linux__
+        _claimInterfaceForEndpointAddr(epAddr);
+        ep._handle = _handle;
+#endif
+        ep._epAddr = epAddr;
+        ep._type = epInfo.type;
+        ep._maxPacketSize = epInfo.maxPacketSize;
+        ep._stats = _statsFor(epAddr);
+        return ep;
+    }
+    
+    // Memory: memory for transfer buffers, allocated by memAlloc()
+    class Memory {
+    public:
+        Memory() {}
+        // Copy: illegal
+        Memory(const Memory& x) = delete;
+        Memory& operator=(const Memory& x) = delete;
+        // Move: allowed
+        Memory(Memory&& x) { swap(x); }
+        Memory& operator=(Memory&& x) { swap(x); return *this; }
+        
+        ~Memory() {
+            if (!_data) return;
+#if __linux__
+            if (_handle) {
+                libusb_dev_mem_free(_handle, _data, _cap);
+                return;
+            }
+#endif
+            munmap(_data, _cap);
+        }
+        
+        uint8_t* data() const { return _data; }
+        size_t len() const { return _len; }
+        std::span<uint8_t> span() const { return { _data, _len }; }
+        
+        // dma(): whether the memory is mapped for DMA by the kernel; see memAlloc()
+        bool dma() const {
+#if __linux__
+            return _handle;
+#else
+            return false;
+#endif
+        }
+        
+        void swap(Memory& x) {
+            std::swap(_data, x._data);
+            std::swap(_len, x._len);
+            std::swap(_cap, x._cap);
+#if __linux__
+            std::swap(_handle, x._handle);
+#endif
+        }
+    
+    private:
+        uint8_t* _data = nullptr;
+        size_t _len = 0;
+        size_t _cap = 0;
+#if __linux__
+        libusb_device_handle* _handle = nullptr;
+#endif
+        friend struct USBDevice;
+    };
+    
+    // memAlloc(): allocate `len` bytes of memory for transfer buffers.
+    //
+    // On Linux, the memory comes from libusb_dev_mem_alloc() when the kernel
+    // supports it, which maps memory that usbfs can DMA into directly, instead
+    // of bouncing the data through a kernel buffer. Otherwise (and on macOS),
+    // the memory is page-aligned anonymous memory, which is locked into RAM if
+    // RLIMIT_MEMLOCK allows it.
+    //
+    // The Memory must be destroyed before the USBDevice.
+    Memory memAlloc(size_t len) {
+        const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        Memory mem;
+        mem._len = len;
+        mem._cap = std::max(pageSize, ((len+pageSize-1)/pageSize)*pageSize);
+        
+#if __linux__
+        _openIfNeeded();
+        mem._data = libusb_dev_mem_alloc(_handle, mem._cap);
+        if (mem._data) {
+            mem._handle = _handle;
+            return mem;
+        }
+#endif
+        
+        void* data = mmap(nullptr, mem._cap, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+        if (data == MAP_FAILED) throw std::system_error(errno, std::generic_category());
+        mem._data = (uint8_t*)data;
+        // Best effort: lock the memory so it doesn't get paged out mid-transfer
+        mlock(mem._data, mem._cap);
+        return mem;
+    }
+    
+    // BufferPool: fixed-size transfer buffers carved from a single memAlloc()
+    // allocation, so that transfers can read/write DMA-capable memory directly,
+    // without an allocation per transfer.
+    //
+    // Thread-safe. The BufferPool must outlive its Buffers.
+    class BufferPool {
+    public:
+        class Buffer {
+        public:
+            Buffer() {}
+            // Copy: illegal
+            Buffer(const Buffer& x) = delete;
+            Buffer& operator=(const Buffer& x) = delete;
+            // Move: allowed
+            Buffer(Buffer&& x) { swap(x); }
+            Buffer& operator=(Buffer&& x) { swap(x); return *this; }
+            ~Buffer() { if (_pool) _pool->_release(_data); }
+            
+            explicit operator bool() const { return _data; }
+            uint8_t* data() const { return _data; }
+            size_t len() const { return _len; }
+            std::span<uint8_t> span() const { return { _data, _len }; }
+            
+            void swap(Buffer& x) {
+                std::swap(_pool, x._pool);
+                std::swap(_data, x._data);
+                std::swap(_len, x._len);
+            }
+        
+        private:
+            Buffer(BufferPool* pool, uint8_t* data, size_t len) : _pool(pool), _data(data), _len(len) {}
+            BufferPool* _pool = nullptr;
+            uint8_t* _data = nullptr;
+            size_t _len = 0;
+            friend class BufferPool;
+        };
+        
+        // Constructor: `len` is rounded up to a multiple of the page size, so that
+        // each buffer is page-aligned
+        BufferPool(USBDevice& dev, size_t len, size_t count) {
+            const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+            _len = len;
+            _stride = std::max(pageSize, ((len+pageSize-1)/pageSize)*pageSize);
+            _mem = dev.memAlloc(_stride*count);
+            _free.reserve(count);
+            for (size_t i=0; i<count; i++) {
+                _free.push_back(_mem.data() + (count-i-1)*_stride);
+            }
+        }
+        
+        // Copy/move: illegal, since Buffers reference us
+        BufferPool(const BufferPool& x) = delete;
+        BufferPool& operator=(const BufferPool& x) = delete;
+        
+        // acquire(): returns an empty Buffer if every buffer is in use
+        Buffer acquire() {
+            auto lock = std::unique_lock(_lock);
+            if (_free.empty()) return {};
+            uint8_t* data = _free.back();
+            _free.pop_back();
+            return Buffer(this, data, _len);
+        }
+        
+        size_t len() const { return _len; }
+        bool dma() const { return _mem.dma(); }
+    
+    private:
+        void _release(uint8_t* data) {
+            auto lock = std::unique_lock(_lock);
+            _free.push_back(data);
+        }
+        
+        Memory _mem;
+        size_t _len = 0;
+        size_t _stride = 0;
+        std::mutex _lock;
+        std::vector<uint8_t*> _free;
+    };
+    
     uint16_t maxPacketSize(uint8_t epAddr) const {
         const _EndpointInfo& epInfo = _epInfo(epAddr);
         return epInfo.maxPacketSize;
     }
     
+    // endpointType(): the endpoint's transfer type (USB::EndpointAttributes::Transfer*),
+    // from its descriptor
+    uint8_t endpointType(uint8_t epAddr) const {
+        const _EndpointInfo& epInfo = _epInfo(epAddr);
+        return epInfo.type;
+    }
+    
     std::string manufacturer() {
         return stringDescriptor(deviceDescriptor().iManufacturer).asciiString();
     }
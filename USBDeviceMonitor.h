@@ -0,0 +1,314 @@
+#pragma once
+#include <cstdint>
+#include <cassert>
+#include <memory>
+#include <vector>
+#include <map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "USBDevice.h"
+#include "RuntimeError.h"
+
+namespace Toastbox {
+
+// USBDeviceMonitor:
+//   USBDeviceMonitor maintains a list of the connected USB devices, which is
+//   updated incrementally via hotplug notifications (libusb hotplug callbacks
+//   on Linux, IOServiceAddMatchingNotification() on macOS), rather than by
+//   re-enumerating the bus like USBDevice::DevicesGet().
+//
+//   Each device's USBDevice is created once, when the device arrives, so its
+//   interface/endpoint tables are only parsed once. devices() just copies the
+//   current list.
+//
+//   The optional callback is called when a device arrives or leaves. For the
+//   devices that are already connected, it's called from the constructor;
+//   otherwise it's called on USBDevice's event thread, so it shouldn't block.
+//   The callback may call devices(), and must not throw.
+//
+//   On Linux, libusb hotplug callbacks mustn't do I/O, so they only queue the
+//   event (holding a reference to the libusb_device). The USBDevice is created,
+//   and the callback called, after libusb_handle_events() returns (via
+//   _EventThread::Post()).
+
+class USBDeviceMonitor {
+public:
+    using DevicePtr = std::shared_ptr<USBDevice>;
+    
+    enum class Event : uint8_t {
+        Arrived,
+        Left,
+    };
+    
+    using Callback = std::function<void(Event, const DevicePtr&)>;
+    
+    USBDeviceMonitor(Callback cb=nullptr) : _cb(std::move(cb)) {
+#if __APPLE__
+        _port = IONotificationPortCreate(kIOMasterPortDefault);
+        if (!_port) throw RuntimeError("IONotificationPortCreate failed");
+        CFRunLoopAddSource(USBDevice::_EventThread::RunLoop(), IONotificationPortGetRunLoopSource(_port), kCFRunLoopDefaultMode);
+        
+        try {
+            // Each IOServiceAddMatchingNotification() call consumes a reference
+            // to the matching dictionary, so each needs its own
+            io_iterator_t iter = MACH_PORT_NULL;
+            kern_return_t kr = IOServiceAddMatchingNotification(_port, kIOFirstMatchNotification,
+                IOServiceMatching(kIOUSBDeviceClassName), _IOKitArrived, this, &iter);
+            if (kr != KERN_SUCCESS) throw RuntimeError("IOServiceAddMatchingNotification failed: 0x%x", kr);
+            _arrivedIter = SendRight(SendRight::NoRetain, iter);
+            
+            iter = MACH_PORT_NULL;
+            kr = IOServiceAddMatchingNotification(_port, kIOTerminatedNotification,
+                IOServiceMatching(kIOUSBDeviceClassName), _IOKitLeft, this, &iter);
+            if (kr != KERN_SUCCESS) throw RuntimeError("IOServiceAddMatchingNotification failed: 0x%x", kr);
+            _leftIter = SendRight(SendRight::NoRetain, iter);
+            
+            // Iterating arms the notifications, and the arrival iterator
+            // initially contains the devices that are already connected
+            _callbackEnter();
+            _iokitArrived();
+            _iokitLeft();
+            _callbackExit();
+        } catch (...) {
+            _stop();
+            throw;
+        }
+#elif __linux__
+        if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) throw RuntimeError("libusb doesn't support hotplug");
+        // LIBUSB_HOTPLUG_ENUMERATE: call our callback for the devices that are
+        // already connected, before libusb_hotplug_register_callback() returns
+        int ir = libusb_hotplug_register_callback(USBDevice::_USBCtx(),
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED|LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+            LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+            _LibusbCallback, this, &_handle);
+        USBDevice::_CheckErr(ir, "libusb_hotplug_register_callback failed");
+        _registered = true;
+        // Handle the already-connected devices now, so that they're in
+        // devices() (and the callback has been called) when we return
+        _libusbDrain();
+#endif
+    }
+    
+    // Copy/move: illegal, since the notifications reference us
+    USBDeviceMonitor(const USBDeviceMonitor& x) = delete;
+    USBDeviceMonitor& operator=(const USBDeviceMonitor& x) = delete;
+    
+    ~USBDeviceMonitor() {
+        _stop();
+    }
+    
+    // devices(): a snapshot of the connected devices
+    std::vector<DevicePtr> devices() {
+        auto lock = std::unique_lock(_lock);
+        std::vector<DevicePtr> r;
+        r.reserve(_devices.size());
+        for (const auto& [key, dev] : _devices) r.push_back(dev);
+        return r;
+    }
+    
+private:
+#if __APPLE__
+    using _Key = uint64_t; // Registry entry ID
+#elif __linux__
+    using _Key = libusb_device*;
+#endif
+    
+    void _arrived(_Key key, DevicePtr dev) {
+        {
+            auto lock = std::unique_lock(_lock);
+            if (_stopping) return;
+            _devices[key] = dev;
+        }
+        if (_cb) _cb(Event::Arrived, dev);
+    }
+    
+    void _left(_Key key) {
+        DevicePtr dev;
+        {
+            auto lock = std::unique_lock(_lock);
+            if (_stopping) return;
+            auto it = _devices.find(key);
+            if (it == _devices.end()) return;
+            dev = std::move(it->second);
+            _devices.erase(it);
+        }
+        if (_cb) _cb(Event::Left, dev);
+    }
+    
+    // _callbackEnter()/_callbackExit(): bracket our notification handlers, so
+    // that _stop() can wait for the handlers in progress to finish
+    void _callbackEnter() {
+        auto lock = std::unique_lock(_lock);
+        _callbacks++;
+    }
+    
+    void _callbackExit() {
+        // Notify while holding the lock, since _stop() destroys us as soon as
+        // it observes _callbacks==0
+        auto lock = std::unique_lock(_lock);
+        _callbacks--;
+        _cv.notify_all();
+    }
+    
+#if __APPLE__
+    static void _IOKitArrived(void* refcon, io_iterator_t) {
+        USBDeviceMonitor& self = *(USBDeviceMonitor*)refcon;
+        self._callbackEnter();
+        self._iokitArrived();
+        self._callbackExit();
+    }
+    
+    static void _IOKitLeft(void* refcon, io_iterator_t) {
+        USBDeviceMonitor& self = *(USBDeviceMonitor*)refcon;
+        self._callbackEnter();
+        self._iokitLeft();
+        self._callbackExit();
+    }
+    
+    static _Key _KeyForService(const SendRight& service) {
+        uint64_t id = 0;
+        kern_return_t kr = IORegistryEntryGetRegistryEntryID(service, &id);
+        if (kr != KERN_SUCCESS) throw RuntimeError("IORegistryEntryGetRegistryEntryID failed: 0x%x", kr);
+        return id;
+    }
+    
+    // _iokitArrived(): drains the arrival iterator, which re-arms the notification
+    void _iokitArrived() {
+        for (;;) {
+            SendRight service(SendRight::NoRetain, IOIteratorNext(_arrivedIter));
+            if (!service.valid()) break;
+            // Ignore devices that we fail to create a USBDevice for, like DevicesGet()
+            try {
+                _arrived(_KeyForService(service), std::make_shared<USBDevice>(service));
+            } catch (...) {}
+        }
+    }
+    
+    void _iokitLeft() {
+        for (;;) {
+            SendRight service(SendRight::NoRetain, IOIteratorNext(_leftIter));
+            if (!service.valid()) break;
+            try {
+                _left(_KeyForService(service));
+            } catch (...) {}
+        }
+    }
+#elif __linux__
+    // _LibusbCallback(): queues the event for _libusbDrain(), and posts a
+    // drain to the event thread if one isn't pending already
+    static int _LibusbCallback(libusb_context*, libusb_device* dev, libusb_hotplug_event event, void* ctx) {
+        USBDeviceMonitor& self = *(USBDeviceMonitor*)ctx;
+        bool post = false;
+        {
+            auto lock = std::unique_lock(self._lock);
+            if (self._stopping) return 0;
+            self._pending.push_back({ .event = event, .dev = libusb_ref_device(dev) });
+            post = !self._drainPosted;
+            self._drainPosted = true;
+            // The posted drain counts as a handler in progress, so that _stop()
+            // waits for it
+            if (post) self._callbacks++;
+        }
+        
+        if (post) {
+            USBDevice::_EventThread::Post([&self] {
+                {
+                    auto lock = std::unique_lock(self._lock);
+                    self._drainPosted = false;
+                }
+                self._libusbDrain();
+                self._callbackExit();
+            });
+        }
+        // Stay registered
+        return 0;
+    }
+    
+    // _libusbDrain(): handles the events queued by _LibusbCallback(), outside
+    // of libusb's event handling
+    void _libusbDrain() {
+        // Drains may run concurrently (from the constructor and the event
+        // thread), so serialize them to keep each device's events in order
+        auto drainLock = std::unique_lock(_drainLock);
+        for (;;) {
+            _Pending p;
+            {
+                auto lock = std::unique_lock(_lock);
+                if (_pending.empty()) return;
+                p = _pending.front();
+                _pending.erase(_pending.begin());
+            }
+            
+            if (p.event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+                // Ignore devices that we fail to create a USBDevice for, like DevicesGet()
+                try {
+                    _arrived(p.dev, std::make_shared<USBDevice>(p.dev));
+                } catch (...) {}
+            } else {
+                _left(p.dev);
+            }
+            libusb_unref_device(p.dev);
+        }
+    }
+#endif
+    
+    // _stop(): stop the notifications and wait for the handlers in progress
+    void _stop() {
+        {
+            auto lock = std::unique_lock(_lock);
+            _stopping = true;
+        }
+#if __APPLE__
+        if (_port) {
+            CFRunLoopRemoveSource(USBDevice::_EventThread::RunLoop(), IONotificationPortGetRunLoopSource(_port), kCFRunLoopDefaultMode);
+        }
+#elif __linux__
+        if (_registered) libusb_hotplug_deregister_callback(USBDevice::_USBCtx(), _handle);
+#endif
+        {
+            auto lock = std::unique_lock(_lock);
+            _cv.wait(lock, [&] { return !_callbacks; });
+        }
+#if __linux__
+        // Drop the events that were queued but never drained
+        for (const _Pending& p : _pending) libusb_unref_device(p.dev);
+        _pending.clear();
+#endif
+#if __APPLE__
+        _arrivedIter = {};
+        _leftIter = {};
+        if (_port) IONotificationPortDestroy(_port);
+        _port = nullptr;
+#endif
+    }
+    
+    // _events: declared first so that it's destroyed last
+    USBDevice::_EventThread::Ref _events;
+    const Callback _cb;
+#if __APPLE__
+    IONotificationPortRef _port = nullptr;
+    SendRight _arrivedIter;
+    SendRight _leftIter;
+#elif __linux__
+    struct _Pending {
+        libusb_hotplug_event event = {};
+        libusb_device* dev = nullptr; // Referenced via libusb_ref_device()
+    };
+    
+    libusb_hotplug_callback_handle _handle = {};
+    bool _registered = false;
+    std::mutex _drainLock;
+    // _pending/_drainPosted: protected by _lock
+    std::vector<_Pending> _pending;
+    bool _drainPosted = false;
+#endif
+    
+    std::mutex _lock;
+    std::condition_variable _cv;
+    size_t _callbacks = 0;
+    bool _stopping = false;
+    std::map<_Key,DevicePtr> _devices;
+};
+
+} // namespace Toastbox
@@ -0,0 +1,200 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <bit>
+#include <algorithm>
+
+// ToastboxUSBStats: define to 1 (before including USBDevice.h) to compile in
+// USB transfer instrumentation
+#ifndef ToastboxUSBStats
+#define ToastboxUSBStats 0
+#endif
+
+namespace Toastbox {
+
+// USBStats:
+//   Per-endpoint transfer instrumentation for USBDevice and USBStream: transfer
+//   and byte counts, short transfers, timeouts, stalls, errors, and a latency
+//   histogram. USBDevice::stats() returns a Snapshot of an endpoint's stats.
+//
+//   Instrumentation is only compiled in if ToastboxUSBStats=1. Otherwise
+//   Endpoint and Transfer are empty and their methods are no-ops, so
+//   instrumentation costs nothing, and stats() returns an empty Snapshot.
+//   When enabled, recording a transfer costs two clock reads and a handful of
+//   relaxed atomic increments.
+
+struct USBStats {
+    static constexpr bool Enabled = ToastboxUSBStats;
+    using Clock = std::chrono::steady_clock;
+    
+    // Latency histogram: bucket i counts the transfers whose latency is in
+    // [2^(i-1), 2^i) microseconds, and bucket 0 counts those under 1us. The
+    // last bucket also counts everything longer (>= ~8.4s).
+    static constexpr size_t LatencyBucketCount = 25;
+    
+    enum class Result : uint8_t {
+        OK,
+        Timeout,
+        Stall,
+        Error,
+    };
+    
+    struct Snapshot {
+        uint64_t transfers = 0;
+        uint64_t bytes = 0;
+        uint64_t shortTransfers = 0; // Successful, but fewer bytes than requested
+        uint64_t timeouts = 0;
+        uint64_t stalls = 0;
+        uint64_t errors = 0;
+        std::chrono::nanoseconds elapsed = {}; // Time since the stats were reset
+        std::chrono::nanoseconds latencyTotal = {};
+        std::chrono::nanoseconds latencyMax = {};
+        std::array<uint64_t, LatencyBucketCount> latencyHistogram = {};
+        
+        double bytesPerSecond() const {
+            if (elapsed <= std::chrono::nanoseconds::zero()) return 0;
+            return (double)bytes / std::chrono::duration<double>(elapsed).count();
+        }
+        
+        std::chrono::nanoseconds latencyMean() const {
+            if (!transfers) return {};
+            return latencyTotal / transfers;
+        }
+        
+        // latencyPercentile(): an upper bound on the `p`th percentile (0-1)
+        // latency, with the histogram's resolution
+        std::chrono::microseconds latencyPercentile(double p) const {
+            uint64_t total = 0;
+            for (uint64_t x : latencyHistogram) total += x;
+            if (!total) return {};
+            const uint64_t target = std::max((uint64_t)1, (uint64_t)(p*total + .5));
+            uint64_t count = 0;
+            for (size_t i=0; i<LatencyBucketCount; i++) {
+                count += latencyHistogram[i];
+                if (count >= target) return std::chrono::microseconds((uint64_t)1<<i);
+            }
+            return std::chrono::microseconds((uint64_t)1<<(LatencyBucketCount-1));
+        }
+    };
+    
+    static constexpr size_t LatencyBucket(std::chrono::nanoseconds latency) {
+        const uint64_t us = (uint64_t)std::max((int64_t)0, (int64_t)latency.count()) / 1000;
+        return std::min((size_t)std::bit_width(us), LatencyBucketCount-1);
+    }
+    
+    template<bool T_Enabled>
+    class _Endpoint;
+    
+    template<bool T_Enabled>
+    class _Transfer;
+    
+    using Endpoint = _Endpoint<Enabled>;
+    using Transfer = _Transfer<Enabled>;
+};
+
+template<>
+class USBStats::_Endpoint<true> {
+public:
+    _Endpoint() { reset(); }
+    
+    void record(Result result, size_t len, size_t actualLen, std::chrono::nanoseconds latency) {
+        constexpr auto Relaxed = std::memory_order_relaxed;
+        _transfers.fetch_add(1, Relaxed);
+        _bytes.fetch_add(actualLen, Relaxed);
+        switch (result) {
+        case Result::OK:        if (actualLen < len) _shortTransfers.fetch_add(1, Relaxed); break;
+        case Result::Timeout:   _timeouts.fetch_add(1, Relaxed); break;
+        case Result::Stall:     _stalls.fetch_add(1, Relaxed); break;
+        case Result::Error:     _errors.fetch_add(1, Relaxed); break;
+        }
+        
+        const int64_t ns = latency.count();
+        _latencyTotal.fetch_add(ns, Relaxed);
+        int64_t max = _latencyMax.load(Relaxed);
+        while (ns>max && !_latencyMax.compare_exchange_weak(max, ns, Relaxed));
+        _latencyHistogram[LatencyBucket(latency)].fetch_add(1, Relaxed);
+    }
+    
+    // snapshot(): the counters aren't read atomically as a whole, so a snapshot
+    // taken while transfers are completing may be off by a transfer
+    Snapshot snapshot() const {
+        constexpr auto Relaxed = std::memory_order_relaxed;
+        Snapshot s = {
+            .transfers          = _transfers.load(Relaxed),
+            .bytes              = _bytes.load(Relaxed),
+            .shortTransfers     = _shortTransfers.load(Relaxed),
+            .timeouts           = _timeouts.load(Relaxed),
+            .stalls             = _stalls.load(Relaxed),
+            .errors             = _errors.load(Relaxed),
+            .elapsed            = Clock::now() - Clock::time_point(Clock::duration(_start.load(Relaxed))),
+            .latencyTotal       = std::chrono::nanoseconds(_latencyTotal.load(Relaxed)),
+            .latencyMax         = std::chrono::nanoseconds(_latencyMax.load(Relaxed)),
+        };
+        for (size_t i=0; i<LatencyBucketCount; i++) {
+            s.latencyHistogram[i] = _latencyHistogram[i].load(Relaxed);
+        }
+        return s;
+    }
+    
+    void reset() {
+        constexpr auto Relaxed = std::memory_order_relaxed;
+        _transfers.store(0, Relaxed);
+        _bytes.store(0, Relaxed);
+        _shortTransfers.store(0, Relaxed);
+        _timeouts.store(0, Relaxed);
+        _stalls.store(0, Relaxed);
+        _errors.store(0, Relaxed);
+        _latencyTotal.store(0, Relaxed);
+        _latencyMax.store(0, Relaxed);
+        for (auto& x : _latencyHistogram) x.store(0, Relaxed);
+        _start.store(Clock::now().time_since_epoch().count(), Relaxed);
+    }
+    
+private:
+    std::atomic<uint64_t> _transfers;
+    std::atomic<uint64_t> _bytes;
+    std::atomic<uint64_t> _shortTransfers;
+    std::atomic<uint64_t> _timeouts;
+    std::atomic<uint64_t> _stalls;
+    std::atomic<uint64_t> _errors;
+    std::atomic<int64_t> _latencyTotal;
+    std::atomic<int64_t> _latencyMax;
+    std::array<std::atomic<uint64_t>, LatencyBucketCount> _latencyHistogram;
+    std::atomic<Clock::rep> _start;
+};
+
+template<>
+class USBStats::_Endpoint<false> {
+public:
+    void record(Result, size_t, size_t, std::chrono::nanoseconds) {}
+    Snapshot snapshot() const { return {}; }
+    void reset() {}
+};
+
+// Transfer: times a single transfer, and records its result in an Endpoint
+// (if non-null) via done()
+template<>
+class USBStats::_Transfer<true> {
+public:
+    _Transfer(Endpoint* ep) : _ep(ep), _start(_ep ? Clock::now() : Clock::time_point()) {}
+    
+    void done(Result result, size_t len, size_t actualLen) {
+        if (_ep) _ep->record(result, len, actualLen, Clock::now()-_start);
+    }
+    
+private:
+    Endpoint* _ep = nullptr;
+    Clock::time_point _start;
+};
+
+template<>
+class USBStats::_Transfer<false> {
+public:
+    _Transfer(Endpoint*) {}
+    void done(Result, size_t, size_t) {}
+};
+
+} // namespace Toastbox
@@ -0,0 +1,506 @@
+#pragma once
+#include <cstdint>
+#include <cassert>
+#include <memory>
+#include <vector>
+#include <span>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "USBDevice.h"
+#include "SignalQueueMPMC.h"
+#include "RuntimeError.h"
+
+namespace Toastbox {
+
+// USBStream:
+//   USBStream keeps `transferCount` IN transfers in flight on an endpoint,
+//   so that the bus doesn't go idle while the client processes data, as it
+//   does with USBDevice::read() (which performs one synchronous transfer at a
+//   time).
+//
+//   Bulk, interrupt and isochronous endpoints are supported, according to the
+//   endpoint's descriptor. Isochronous transfers batch `transferLen/packetLen`
+//   packets per transfer, and report each packet's length and status via
+//   Buffer::packets(); packet errors don't stop the stream, since they're
+//   expected on isochronous endpoints.
+//
+//   Transfers complete on USBDevice's event thread, and are delivered as
+//   Buffers, either to the callback supplied to the constructor (called on the
+//   event thread), or via a lock-free queue (pop()). A Buffer owns its transfer
+//   until the Buffer is destroyed, at which point the transfer is resubmitted.
+//   So all memory comes from a pool that's allocated up front, and if the
+//   client holds onto every Buffer, no more transfers are submitted until it
+//   releases one. The pool is allocated with USBDevice::memAlloc(), so on
+//   Linux the kernel can DMA into it directly.
+//
+//   readPeek()/readConsume() provide RingBufferSPSC-style access to the
+//   stream's data, for consumers that treat the stream as a byte stream
+//   rather than a sequence of transfers. Either way the data isn't copied.
+//
+//   If a transfer fails, the failing Buffer is delivered with a non-OK status
+//   and no more transfers are submitted. Once the stream has stopped, an empty
+//   Buffer is delivered (to the callback, or returned by pop()).
+//
+//   The USBDevice must outlive the USBStream, all Buffers must be destroyed
+//   before the USBStream is destroyed, and the USBStream must not be destroyed
+//   from its own callback.
+//
+//   On macOS, the interface must already be claimed (USBDevice::claim()).
+
+class USBStream {
+private:
+    struct _Transfer;
+    
+public:
+    static constexpr size_t MaxTransferCount = 64;
+    
+    enum class Status : uint8_t {
+        OK,
+        Error,
+        Stall,
+        Overflow,
+        Disconnected,
+    };
+    
+    // Packet: one packet of an isochronous transfer
+    struct Packet {
+        std::span<const uint8_t> data;
+        Status status = Status::OK;
+    };
+    
+    class Buffer {
+    public:
+        Buffer() {}
+        // Copy: illegal
+        Buffer(const Buffer& x) = delete;
+        Buffer& operator=(const Buffer& x) = delete;
+        // Move: allowed
+        Buffer(Buffer&& x) : _t(x._t) { x._t = nullptr; }
+        Buffer& operator=(Buffer&& x) {
+            _Transfer* t = _t;
+            _t = x._t;
+            x._t = t;
+            return *this;
+        }
+        
+        // Destructor: returns the transfer to the stream, which resubmits it
+        ~Buffer() {
+            if (_t) _t->stream->_recycle(*_t);
+        }
+        
+        explicit operator bool() const { return _t; }
+        
+        // data(): the data that the transfer read. For isochronous transfers,
+        // this spans the entire transfer buffer, and the packets' data is found
+        // via packets().
+        std::span<const uint8_t> data() const {
+            assert(_t);
+            return { _t->buf, _t->len };
+        }
+        
+        // packets(): the packets of an isochronous transfer; empty otherwise
+        std::span<const Packet> packets() const {
+            assert(_t);
+            return { _t->packets.get(), _t->stream->_packetCount };
+        }
+        
+        Status status() const {
+            assert(_t);
+            return _t->status;
+        }
+    
+    private:
+        Buffer(_Transfer* t) : _t(t) {}
+        _Transfer* _t = nullptr;
+        friend class USBStream;
+    };
+    
+    using Callback = std::function<void(Buffer&&)>;
+    
+    USBStream(USBDevice& dev, uint8_t epAddr, size_t transferLen, size_t transferCount, Callback cb=nullptr) :
+    _dev(dev), _epAddr(epAddr), _transferLen(transferLen), _cb(std::move(cb)), _stats(dev._statsFor(epAddr)) {
+        if (!(epAddr & USB::Endpoint::DirectionIn)) throw RuntimeError("not an IN endpoint: 0x%02x", epAddr);
+        if (!transferCount || transferCount>MaxTransferCount) throw RuntimeError("invalid transfer count: %zu", transferCount);
+        
+        const uint8_t type = dev.endpointType(epAddr);
+        const bool isoch = (type == USB::EndpointAttributes::TransferIsochronous);
+        if (type == USB::EndpointAttributes::TransferControl) throw RuntimeError("control endpoints aren't supported: 0x%02x", epAddr);
+        
+#if __APPLE__
+        const USBDevice::_EndpointInfo& epInfo = dev._epInfo(epAddr);
+        _iface = &dev._interfaces.at(epInfo.ifaceIdx);
+        _pipeRef = epInfo.pipeRef;
+        CFRunLoopAddSource(USBDevice::_EventThread::RunLoop(), _iface->asyncEventSource(), kCFRunLoopDefaultMode);
+#elif __linux__
+        dev._claimInterfaceForEndpointAddr(epAddr);
+#endif
+        
+        // Isochronous packets can be larger than wMaxPacketSize's low bits
+        // suggest (high-bandwidth endpoints send multiple packets per microframe)
+        size_t packetLen = dev.maxPacketSize(epAddr);
+        if (isoch) {
+#if __APPLE__
+            const IOUSBEndpointProperties props = _iface->pipeProperties(_pipeRef);
+            packetLen = (size_t)props.wMaxPacketSize * (props.bMult+1);
+#elif __linux__
+            int ir = libusb_get_max_iso_packet_size(dev, epAddr);
+            USBDevice::_CheckErr(ir, "libusb_get_max_iso_packet_size failed");
+            packetLen = ir;
+#endif
+        }
+        
+        // Transfers must be a multiple of the max packet size, otherwise the
+        // device could send more data than the transfer can hold (babble)
+        if (!packetLen || !transferLen || transferLen%packetLen) {
+            throw RuntimeError("transfer length (%zu) isn't a multiple of the max packet size (%zu)",
+                transferLen, packetLen);
+        }
+        
+        _packetLen = packetLen;
+        _packetCount = (isoch ? transferLen/packetLen : 0);
+        _mem = dev.memAlloc(transferLen*transferCount);
+        _transfers = std::vector<_Transfer>(transferCount);
+        
+        for (size_t i=0; i<transferCount; i++) {
+            _Transfer& t = _transfers[i];
+            t.stream = this;
+            t.buf = _mem.data() + i*transferLen;
+            if (_packetCount) t.packets = std::make_unique<Packet[]>(_packetCount);
+#if __APPLE__
+            if (_packetCount) {
+                t.frames = std::make_unique<IOUSBIsocFrame[]>(_packetCount);
+                for (size_t f=0; f<_packetCount; f++) {
+                    t.frames[f] = { .frReqCount = (uint16_t)packetLen };
+                }
+            }
+#elif __linux__
+            t.xfer = libusb_alloc_transfer((int)_packetCount);
+            if (!(libusb_transfer*)t.xfer) throw RuntimeError("libusb_alloc_transfer failed");
+            if (isoch) {
+                libusb_fill_iso_transfer(t.xfer, dev._handle, epAddr, t.buf, (int)transferLen, (int)_packetCount,
+                    _LibusbCallback, &t, 0);
+                libusb_set_iso_packet_lengths(t.xfer, (unsigned int)packetLen);
+            } else if (type == USB::EndpointAttributes::TransferInterrupt) {
+                libusb_fill_interrupt_transfer(t.xfer, dev._handle, epAddr, t.buf, (int)transferLen,
+                    _LibusbCallback, &t, 0);
+            } else {
+                libusb_fill_bulk_transfer(t.xfer, dev._handle, epAddr, t.buf, (int)transferLen,
+                    _LibusbCallback, &t, 0);
+            }
+#endif
+        }
+        
+        // Start the transfers
+        try {
+            auto lock = std::unique_lock(_lock);
+            for (_Transfer& t : _transfers) {
+                _submit(t);
+            }
+        } catch (...) {
+            _stop();
+            throw;
+        }
+    }
+    
+    // Copy/move: illegal, since transfers reference us
+    USBStream(const USBStream& x) = delete;
+    USBStream& operator=(const USBStream& x) = delete;
+    
+    ~USBStream() {
+        _stop();
+        _cur = {};
+    }
+    
+    // pop(): returns the next completed transfer, blocking until one is available.
+    // Returns an empty Buffer once the stream has stopped. Only valid if the
+    // stream wasn't created with a callback.
+    Buffer pop() {
+        assert(!_cb);
+        _Transfer* t = _queue.pop();
+        // Re-push the stop marker so that subsequent pop()s return immediately too
+        if (!t) _queue.push(nullptr);
+        return Buffer(t);
+    }
+    
+    // readPeek(): returns the unconsumed data of the oldest completed transfer,
+    // blocking until one is available. Returns an empty span once the stream
+    // has stopped, or if the transfer failed (see status()).
+    //
+    // Like pop(), only valid if the stream wasn't created with a callback.
+    // Only one thread may use readPeek()/readConsume(), and they can't be mixed
+    // with pop(). Not supported for isochronous endpoints, whose data isn't
+    // contiguous.
+    std::span<const uint8_t> readPeek() {
+        assert(!_packetCount);
+        while (!_cur || _curOff==_cur.data().size()) {
+            // Hold onto a failed transfer so that status() reports its status
+            if (_cur && _cur.status()!=Status::OK) return {};
+            // Moving the new Buffer into _cur recycles the previous one
+            _cur = pop();
+            _curOff = 0;
+            if (!_cur) return {};
+        }
+        return _cur.data().subspan(_curOff);
+    }
+    
+    // readConsume(): consumes `n` bytes previously returned by readPeek(). The
+    // transfer is resubmitted once all of its data is consumed.
+    void readConsume(size_t n) {
+        assert(_cur && n<=_cur.data().size()-_curOff);
+        _curOff += n;
+        if (_curOff == _cur.data().size()) _cur = {};
+    }
+    
+    // status(): when readPeek() returns an empty span, status() returns the
+    // failed transfer's status, or Status::Error if the stream stopped for
+    // another reason (eg a transfer couldn't be resubmitted)
+    Status status() const {
+        return (_cur ? _cur.status() : Status::Error);
+    }
+    
+    uint8_t epAddr() const { return _epAddr; }
+    size_t transferLen() const { return _transferLen; }
+    size_t transferCount() const { return _transfers.size(); }
+    size_t packetLen() const { return _packetLen; }
+    
+private:
+    struct _Transfer {
+        USBStream* stream = nullptr;
+        uint8_t* buf = nullptr;
+        size_t len = 0;
+        Status status = Status::OK;
+        std::unique_ptr<Packet[]> packets;
+        USBStats::Transfer stats = USBStats::Transfer(nullptr);
+#if __APPLE__
+        std::unique_ptr<IOUSBIsocFrame[]> frames;
+#elif __linux__
+        Uniqued<libusb_transfer*, libusb_free_transfer> xfer;
+#endif
+    };
+    
+#if __APPLE__
+    static Status _StatusForIOReturn(IOReturn ior) {
+        switch (ior) {
+        case kIOReturnSuccess:
+        // Underrun: a short packet, which isn't an error
+        case kIOReturnUnderrun:         return Status::OK;
+        case kIOUSBPipeStalled:         return Status::Stall;
+        case kIOReturnOverrun:          return Status::Overflow;
+        case kIOReturnNoDevice:
+        case kIOReturnNotResponding:    return Status::Disconnected;
+        default:                        return Status::Error;
+        }
+    }
+    
+    static void _IOKitCallback(void* refcon, IOReturn ior, void* arg0) {
+        _Transfer& t = *(_Transfer*)refcon;
+        t.stream->_complete(t, _StatusForIOReturn(ior), (size_t)(uintptr_t)arg0, ior==kIOReturnAborted);
+    }
+    
+    static void _IOKitIsochCallback(void* refcon, IOReturn ior, void*) {
+        _Transfer& t = *(_Transfer*)refcon;
+        USBStream& self = *t.stream;
+        for (size_t i=0; i<self._packetCount; i++) {
+            const IOUSBIsocFrame& frame = t.frames[i];
+            t.packets[i] = {
+                .data = { t.buf + i*self._packetLen, frame.frActCount },
+                .status = _StatusForIOReturn(frame.frStatus),
+            };
+        }
+        self._complete(t, _StatusForIOReturn(ior), self._transferLen, ior==kIOReturnAborted);
+    }
+#elif __linux__
+    static Status _StatusForLibusbStatus(enum libusb_transfer_status status) {
+        switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED: return Status::OK;
+        case LIBUSB_TRANSFER_STALL:     return Status::Stall;
+        case LIBUSB_TRANSFER_OVERFLOW:  return Status::Overflow;
+        case LIBUSB_TRANSFER_NO_DEVICE: return Status::Disconnected;
+        default:                        return Status::Error;
+        }
+    }
+    
+    static void _LibusbCallback(libusb_transfer* xfer) {
+        _Transfer& t = *(_Transfer*)xfer->user_data;
+        USBStream& self = *t.stream;
+        size_t len = (size_t)xfer->actual_length;
+        if (self._packetCount) {
+            for (size_t i=0; i<self._packetCount; i++) {
+                const libusb_iso_packet_descriptor& desc = xfer->iso_packet_desc[i];
+                t.packets[i] = {
+                    .data = { t.buf + i*self._packetLen, desc.actual_length },
+                    .status = _StatusForLibusbStatus(desc.status),
+                };
+            }
+            len = self._transferLen;
+        }
+        self._complete(t, _StatusForLibusbStatus(xfer->status), len, xfer->status==LIBUSB_TRANSFER_CANCELLED);
+    }
+#endif
+    
+    // _submit(): requires _lock
+    void _submit(_Transfer& t) {
+        t.stats = USBStats::Transfer(_stats);
+#if __APPLE__
+        if (_packetCount) {
+            // Schedule transfers back-to-back, but resync if we've fallen behind
+            // (eg because the client held onto its Buffers), since frames in the
+            // past fail with kIOReturnIsoTooOld
+            const uint64_t frame = _iface->busFrameNumber() + _IsochLatencyFrames;
+            if (_nextFrame < frame) _nextFrame = frame;
+            _iface->readIsochAsync(_pipeRef, t.buf, _nextFrame, t.frames.get(), _packetCount, _IOKitIsochCallback, &t);
+            _nextFrame += _packetCount;
+        } else {
+            _iface->readAsync(_pipeRef, t.buf, _transferLen, _IOKitCallback, &t);
+        }
+#elif __linux__
+        int ir = libusb_submit_transfer(t.xfer);
+        USBDevice::_CheckErr(ir, "libusb_submit_transfer failed");
+#endif
+        _submitted++;
+    }
+    
+    // _cancel(): cancel all transfers in flight; their completions are reported
+    // as cancelled
+    void _cancel() {
+#if __APPLE__
+        try {
+            _iface->abort(_pipeRef);
+        } catch (...) {}
+#elif __linux__
+        // Transfers that aren't in flight return LIBUSB_ERROR_NOT_FOUND, which
+        // we don't care about
+        for (_Transfer& t : _transfers) {
+            libusb_cancel_transfer(t.xfer);
+        }
+#endif
+    }
+    
+    static USBStats::Result _StatsResult(Status status) {
+        switch (status) {
+        case Status::OK:    return USBStats::Result::OK;
+        case Status::Stall: return USBStats::Result::Stall;
+        default:            return USBStats::Result::Error;
+        }
+    }
+    
+    // _complete(): called on the event thread when a transfer completes
+    void _complete(_Transfer& t, Status status, size_t len, bool cancelled) {
+        bool deliver = false;
+        bool fail = false;
+        bool stopped = false;
+        {
+            auto lock = std::unique_lock(_lock);
+            assert(_submitted);
+            _submitted--;
+            _completing++;
+            deliver = !_stopped && !cancelled;
+            fail = deliver && status!=Status::OK;
+            if (fail) _stopped = true;
+            stopped = _stopped && !_submitted && !_stopping;
+        }
+        
+        // Cancel the other transfers on failure, since they'll fail too
+        if (fail) _cancel();
+        
+        if (deliver) {
+            if constexpr (USBStats::Enabled) {
+                size_t actualLen = len;
+                if (_packetCount) {
+                    actualLen = 0;
+                    for (size_t i=0; i<_packetCount; i++) actualLen += t.packets[i].data.size();
+                }
+                t.stats.done(_StatsResult(status), _transferLen, actualLen);
+            }
+            t.len = len;
+            t.status = status;
+            _deliver(&t);
+        }
+        
+        if (stopped) _deliver(nullptr);
+        
+        // Notify while holding the lock, since _stop() destroys us as soon as
+        // it observes _completing==0
+        auto lock = std::unique_lock(_lock);
+        _completing--;
+        _cv.notify_all();
+    }
+    
+    // _recycle(): called when a Buffer is destroyed
+    void _recycle(_Transfer& t) {
+        auto lock = std::unique_lock(_lock);
+        if (_stopped) return;
+        try {
+            _submit(t);
+        } catch (...) {
+            _stopped = true;
+            if (_submitted) {
+                // The remaining transfers deliver the stop marker when they complete
+                lock.unlock();
+                _cancel();
+            } else {
+                lock.unlock();
+                _deliver(nullptr);
+            }
+        }
+    }
+    
+    void _deliver(_Transfer* t) {
+        if (_cb) {
+            _cb(Buffer(t));
+        } else {
+            // Never blocks: each transfer is queued at most once, plus the stop marker
+            _queue.push(std::move(t));
+        }
+    }
+    
+    // _stop(): stop submitting transfers, cancel the transfers in flight, and wait
+    // for their completions
+    void _stop() {
+        {
+            auto lock = std::unique_lock(_lock);
+            _stopped = true;
+            _stopping = true;
+        }
+        _cancel();
+        auto lock = std::unique_lock(_lock);
+        _cv.wait(lock, [&] { return !_submitted && !_completing; });
+    }
+    
+    // _events: declared first so that it's destroyed last, after every transfer
+    // has completed
+    USBDevice::_EventThread::Ref _events;
+    USBDevice& _dev;
+    const uint8_t _epAddr = 0;
+    const size_t _transferLen = 0;
+    const Callback _cb;
+    USBStats::Endpoint* const _stats = nullptr;
+    size_t _packetLen = 0;
+    size_t _packetCount = 0; // Isochronous endpoints only
+    USBDevice::Memory _mem;
+    std::vector<_Transfer> _transfers;
+#if __APPLE__
+    // The number of frames ahead of the current bus frame that isochronous
+    // transfers are scheduled, so that they reach the controller in time
+    static constexpr uint64_t _IsochLatencyFrames = 8;
+    USBDevice::_Interface* _iface = nullptr;
+    uint8_t _pipeRef = 0;
+    uint64_t _nextFrame = 0;
+#endif
+    
+    std::mutex _lock;
+    std::condition_variable _cv;
+    size_t _submitted = 0;
+    size_t _completing = 0;
+    bool _stopped = false;
+    bool _stopping = false;
+    
+    SignalQueueMPMC<_Transfer*, MaxTransferCount+1> _queue;
+    
+    // readPeek()/readConsume() state
+    Buffer _cur;
+    size_t _curOff = 0;
+};
+
+} // namespace Toastbox
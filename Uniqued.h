@@ -1,5 +1,6 @@
 #pragma once
 #include <optional>
+#include <cassert>
 
 template<typename T, auto FreeFn>
 class Uniqued {
@@ -0,0 +1,23 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/Test/AsyncIO.cpp" "CMakeFiles/ToastboxTest.dir/AsyncIO.cpp.o" "gcc" "CMakeFiles/ToastboxTest.dir/AsyncIO.cpp.o.d"
+  "/root/repo/Test/Queue.cpp" "CMakeFiles/ToastboxTest.dir/Queue.cpp.o" "gcc" "CMakeFiles/ToastboxTest.dir/Queue.cpp.o.d"
+  "/root/repo/Test/ReadWrite.cpp" "CMakeFiles/ToastboxTest.dir/ReadWrite.cpp.o" "gcc" "CMakeFiles/ToastboxTest.dir/ReadWrite.cpp.o.d"
+  "/root/repo/Test/TIFF.cpp" "CMakeFiles/ToastboxTest.dir/TIFF.cpp.o" "gcc" "CMakeFiles/ToastboxTest.dir/TIFF.cpp.o.d"
+  "/root/repo/Test/main.cpp" "CMakeFiles/ToastboxTest.dir/main.cpp.o" "gcc" "CMakeFiles/ToastboxTest.dir/main.cpp.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
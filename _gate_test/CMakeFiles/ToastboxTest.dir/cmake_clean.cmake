@@ -0,0 +1,19 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/ToastboxTest.dir/AsyncIO.cpp.o"
+  "CMakeFiles/ToastboxTest.dir/AsyncIO.cpp.o.d"
+  "CMakeFiles/ToastboxTest.dir/Queue.cpp.o"
+  "CMakeFiles/ToastboxTest.dir/Queue.cpp.o.d"
+  "CMakeFiles/ToastboxTest.dir/ReadWrite.cpp.o"
+  "CMakeFiles/ToastboxTest.dir/ReadWrite.cpp.o.d"
+  "CMakeFiles/ToastboxTest.dir/TIFF.cpp.o"
+  "CMakeFiles/ToastboxTest.dir/TIFF.cpp.o.d"
+  "CMakeFiles/ToastboxTest.dir/main.cpp.o"
+  "CMakeFiles/ToastboxTest.dir/main.cpp.o.d"
+  "ToastboxTest"
+  "ToastboxTest.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/ToastboxTest.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,8 @@
+# CMake generated Testfile for 
+# Source directory: /root/repo/Test
+# Build directory: /root/repo/_gate_test
+# 
+# This file includes the relevant testing commands required for 
+# testing this directory and lists subdirectories to be tested as well.
+add_test([=[ToastboxTest]=] "/root/repo/_gate_test/ToastboxTest")
+set_tests_properties([=[ToastboxTest]=] PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/Test/CMakeLists.txt;41;add_test;/root/repo/Test/CMakeLists.txt;0;")